@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AUDIOPROCESSOR_H
+#define CHIAKI_AUDIOPROCESSOR_H
+
+#include <chiaki/log.h>
+#include <chiaki/opusencoder.h>
+
+#include <QObject>
+#include <QIODevice>
+#include <QAudioDeviceInfo>
+
+#include <SDL.h>
+
+#if CHIAKI_GUI_ENABLE_SPEEX
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+class QAudioInput;
+class QAudioOutput;
+class AudioProcessor;
+
+/**
+ * Lock-free ring of samples for exactly one producer and one consumer thread.
+ * All memory is allocated in the constructor, Write() and Read() never allocate.
+ */
+template<typename T> class AudioRingBuffer
+{
+	private:
+		std::vector<T> buf;
+		size_t mask;
+		std::atomic<size_t> read_pos;
+		std::atomic<size_t> write_pos;
+
+	public:
+		explicit AudioRingBuffer(size_t capacity_min) : read_pos(0), write_pos(0)
+		{
+			size_t capacity = 1;
+			while(capacity < capacity_min)
+				capacity <<= 1;
+			buf.resize(capacity);
+			mask = capacity - 1;
+		}
+
+		size_t Capacity() const	{ return buf.size(); }
+
+		/**
+		 * Only call from the consumer thread.
+		 */
+		size_t Available() const	{ return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_relaxed); }
+
+		/**
+		 * Only call from the producer thread.
+		 */
+		size_t Free() const	{ return buf.size() - (write_pos.load(std::memory_order_relaxed) - read_pos.load(std::memory_order_acquire)); }
+
+		/**
+		 * Write all of data or nothing if there is not enough space.
+		 */
+		bool Write(const T *data, size_t count)
+		{
+			if(Free() < count)
+				return false;
+			size_t w = write_pos.load(std::memory_order_relaxed);
+			size_t start = w & mask;
+			size_t first = std::min(count, buf.size() - start);
+			memcpy(buf.data() + start, data, first * sizeof(T));
+			memcpy(buf.data(), data + first, (count - first) * sizeof(T));
+			write_pos.store(w + count, std::memory_order_release);
+			return true;
+		}
+
+		/**
+		 * Read exactly count elements or nothing if not enough are available.
+		 */
+		bool Read(T *data, size_t count)
+		{
+			if(Available() < count)
+				return false;
+			size_t r = read_pos.load(std::memory_order_relaxed);
+			size_t start = r & mask;
+			size_t first = std::min(count, buf.size() - start);
+			memcpy(data, buf.data() + start, first * sizeof(T));
+			memcpy(data + first, buf.data(), (count - first) * sizeof(T));
+			read_pos.store(r + count, std::memory_order_release);
+			return true;
+		}
+
+		void Skip(size_t count)
+		{
+			count = std::min(count, Available());
+			read_pos.store(read_pos.load(std::memory_order_relaxed) + count, std::memory_order_release);
+		}
+
+		/**
+		 * Drop all contents. Neither producer nor consumer may be active during this call.
+		 */
+		void Reset()
+		{
+			read_pos.store(0, std::memory_order_relaxed);
+			write_pos.store(0, std::memory_order_release);
+		}
+};
+
+/**
+ * Average interleaved stereo int16 frames into mono.
+ */
+void AudioStereoToMono(const int16_t *in, int16_t *out, size_t frames);
+
+/**
+ * Duplicate mono int16 samples into interleaved stereo frames.
+ */
+void AudioMonoToStereo(const int16_t *in, int16_t *out, size_t frames);
+
+/**
+ * Converts DualSense haptics from 3 kHz stereo to 48 kHz with 4 channels, where the haptics go to channels 3 and 4.
+ * Interpolation state is kept across calls, so consecutive packets join without discontinuities.
+ */
+class HapticsResampler
+{
+	private:
+		int16_t last_l;
+		int16_t last_r;
+
+	public:
+		static const size_t in_rate = 3000;
+		static const size_t out_rate = 48000;
+		static const size_t ratio = out_rate / in_rate;
+		static const size_t out_channels = 4;
+
+		HapticsResampler() : last_l(0), last_r(0) {}
+
+		/**
+		 * @param out must hold frames * ratio * out_channels samples
+		 */
+		void Process(const int16_t *in, size_t frames, int16_t *out);
+};
+
+struct AudioOutputStats
+{
+	bool active;
+	double jitter_buffer_ms; // smoothed fill of the jitter buffer
+	double device_buffer_ms; // size of the buffer of the audio device
+	double resample_ratio; // > 1 when playing back faster to reduce latency
+	uint64_t underruns;
+	uint64_t dropped_frames;
+};
+
+/**
+ * Source that the audio device pulls the played back audio from.
+ */
+class AudioOutputDevice : public QIODevice
+{
+	private:
+		AudioProcessor *processor;
+
+	protected:
+		qint64 readData(char *data, qint64 maxlen) override;
+		qint64 writeData(const char *data, qint64 len) override	{ (void)data; (void)len; return -1; }
+
+	public:
+		explicit AudioOutputDevice(AudioProcessor *processor);
+		bool isSequential() const override	{ return true; }
+};
+
+/**
+ * Runs the audio output, microphone, echo cancellation and DualSense haptics chain on its own thread,
+ * so none of them depends on the Qt main thread being responsive.
+ *
+ * Played back audio goes through a jitter buffer that is held at a constant target fill
+ * by resampling within +-0.5%, compensating for clock drift between console and audio device.
+ *
+ * The object must live in a dedicated QThread.
+ * PushAudio(), PushHaptics(), SetMuted(), SetHapticsOutput() and GetOutputStats() may be called from any thread,
+ * PushAudio() only from one thread at a time.
+ * StartMic(), StopMic(), StartOutput() and StopOutput() must be called from the processor's own thread.
+ */
+class AudioProcessor : public QObject
+{
+	Q_OBJECT
+
+	friend class AudioOutputDevice;
+
+	private:
+		ChiakiLog *log;
+		ChiakiOpusEncoder *opus_encoder;
+		unsigned int buffer_size;
+		size_t frame_size;
+
+		QAudioInput *audio_input;
+		QIODevice *audio_mic;
+		unsigned int mic_channels;
+		std::vector<int16_t> mic_frame;
+		size_t mic_frame_fill;
+		std::atomic<bool> muted;
+		std::atomic<bool> mic_active;
+
+#if CHIAKI_GUI_ENABLE_SPEEX
+		bool speech_processing_enabled;
+		SpeexEchoState *echo_state;
+		SpeexPreprocessState *preprocess_state;
+		AudioRingBuffer<int16_t> echo_ring;
+		std::vector<int16_t> echo_stereo;
+		std::vector<int16_t> echo_mono;
+		std::vector<int16_t> mic_clean;
+		std::vector<int16_t> mic_stereo;
+#endif
+
+		std::atomic<SDL_AudioDeviceID> haptics_output;
+		std::atomic<bool> haptics_pending;
+		AudioRingBuffer<int16_t> haptics_ring;
+		HapticsResampler haptics_resampler;
+		std::vector<int16_t> haptics_in;
+		std::vector<int16_t> haptics_out;
+
+		QAudioOutput *audio_output;
+		AudioOutputDevice *audio_output_device;
+		std::atomic<bool> output_active;
+		unsigned int output_channels;
+		unsigned int output_rate;
+		size_t output_target_frames;
+		size_t output_max_frames;
+		AudioRingBuffer<int16_t> output_ring;
+		std::vector<int16_t> output_scratch;
+		std::vector<int32_t> output_prev;
+		std::vector<int32_t> output_cur;
+		double output_frac;
+		double output_fill_avg;
+		double output_ratio_integral;
+		bool output_prebuffering;
+		std::atomic<uint64_t> output_underruns;
+		std::atomic<uint64_t> output_dropped_frames;
+		std::atomic<uint32_t> output_fill_avg_us;
+		std::atomic<uint32_t> output_device_buffer_us;
+		std::atomic<int32_t> output_ratio_ppm;
+
+		void ProcessMicFrame();
+		qint64 ReadOutput(char *data, qint64 maxlen);
+
+	private slots:
+		void ReadMic();
+		void ProcessHaptics();
+
+	public:
+		/**
+		 * @param frame_size samples per channel in each frame passed to the opus encoder
+		 */
+		AudioProcessor(ChiakiLog *log, ChiakiOpusEncoder *opus_encoder, unsigned int buffer_size, size_t frame_size,
+				bool speech_processing_enabled, int32_t noise_suppress_level, int32_t echo_suppress_level);
+		~AudioProcessor();
+
+		void StartMic(const QAudioDeviceInfo &device_info, unsigned int channels, unsigned int rate);
+		void StopMic();
+
+		/**
+		 * May only be called while no PushAudio() is in progress.
+		 */
+		bool StartOutput(const QAudioDeviceInfo &device_info, unsigned int channels, unsigned int rate);
+		void StopOutput();
+		AudioOutputStats GetOutputStats();
+
+		void SetMuted(bool muted)	{ this->muted = muted; }
+		void SetHapticsOutput(SDL_AudioDeviceID device)	{ haptics_output = device; }
+
+		/**
+		 * Queue decoded audio for playback. It is also the reference for echo cancellation.
+		 *
+		 * @param samples_count number of frames, each with the channel count passed to StartOutput()
+		 */
+		void PushAudio(const int16_t *buf, size_t samples_count);
+
+		/**
+		 * Feed raw 3 kHz stereo haptics audio as received from the console.
+		 */
+		void PushHaptics(const uint8_t *buf, size_t buf_size);
+};
+
+#endif // CHIAKI_AUDIOPROCESSOR_H
@@ -8,6 +8,8 @@
 
 #include <chiaki/ffmpegdecoder.h>
 
+#include "avopenglwidget.h"
+
 class StreamSession;
 class AVOpenGLWidget;
 class QSurface;
@@ -22,11 +24,20 @@ class AVOpenGLFrameUploader: public QObject
 		QOpenGLContext *context;
 		QSurface *surface;
 
+		bool gl_initialized;
+		bool immutable_textures;
+		AVOpenGLPixelBufferRing pbo_ring;
+
 	private slots:
 		void UpdateFrameFromDecoder();
 
 	public:
 		AVOpenGLFrameUploader(StreamSession *session, AVOpenGLWidget *widget, QOpenGLContext *context, QSurface *surface);
+
+		/**
+		 * Free all GL objects of the uploader. Must be called on the uploader's thread.
+		 */
+		void CleanupGL();
 };
 
 #endif // CHIAKI_AVOPENGLFRAMEUPLOADER_H
@@ -7,6 +7,7 @@
 #include "avwidget.h"
 
 #include <QOpenGLWidget>
+#include <QOpenGLExtraFunctions>
 #include <QMutex>
 
 extern "C"
@@ -15,6 +16,7 @@ extern "C"
 }
 
 #define MAX_PANES 3
+#define PBO_RING_SIZE 3
 
 class StreamSession;
 class AVOpenGLFrameUploader;
@@ -38,15 +40,62 @@ struct ConversionConfig
 	struct PlaneConfig plane_configs[MAX_PANES];
 };
 
+/**
+ * Pixel unpack buffers that frames are cycled through, so writing a frame never waits for the GPU
+ * to finish reading one of the previous ones.
+ * Buffers are persistently mapped if the context supports ARB_buffer_storage.
+ * Must only be used with its own context current.
+ */
+struct AVOpenGLPixelBufferRing
+{
+	typedef void (QOPENGLF_APIENTRYP BufferStorageFunc)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+	GLuint pbo[PBO_RING_SIZE];
+	GLsizeiptr size[PBO_RING_SIZE];
+	uint8_t *mapped[PBO_RING_SIZE];
+	GLsync fence[PBO_RING_SIZE];
+	unsigned int cur;
+	BufferStorageFunc buffer_storage;
+
+	void Init(QOpenGLContext *context);
+
+	/**
+	 * Free all buffers and fences.
+	 */
+	void Fini(QOpenGLExtraFunctions *f);
+
+	/**
+	 * Wait until the next buffer is not used by the GPU anymore, bind it to GL_PIXEL_UNPACK_BUFFER
+	 * and map it for writing at least required bytes.
+	 */
+	uint8_t *Acquire(QOpenGLExtraFunctions *f, GLsizeiptr required, ChiakiLog *log);
+
+	/**
+	 * Unmap the buffer from Acquire() if necessary. Upload from it before calling Commit().
+	 */
+	void Release(QOpenGLExtraFunctions *f);
+
+	/**
+	 * Fence all commands reading from the buffer from Acquire() and move on to the next one.
+	 */
+	void Commit(QOpenGLExtraFunctions *f);
+};
+
 struct AVOpenGLFrame
 {
-	GLuint pbo[MAX_PANES];
 	GLuint tex[MAX_PANES];
 	unsigned int width;
 	unsigned int height;
+	unsigned int tex_width;
+	unsigned int tex_height;
+	GLsync upload_fence; // signals when the textures contain the frame
+	GLsync render_fence; // signals when the last draw reading from the textures is done
 	ConversionConfig *conversion_config;
 
-	bool Update(AVFrame *frame, ChiakiLog *log);
+	bool Update(AVFrame *frame, AVOpenGLPixelBufferRing *pbo_ring, bool immutable_textures, ChiakiLog *log);
+
+	private:
+		void AllocateTextures(QOpenGLExtraFunctions *f, bool immutable);
 };
 
 class AVOpenGLWidget: public QOpenGLWidget, public IAVWidget
@@ -10,8 +10,11 @@
 
 #include <QWidget>
 #include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
 #include <QWindow>
 #include <QElapsedTimer>
+#include <atomic>
 #include <libplacebo/options.h>
 #include <libplacebo/vulkan.h>
 #include <libplacebo/renderer.h>
@@ -27,6 +30,13 @@ extern "C"
 class StreamSession;
 class AVPlaceboFrameUploader;
 
+struct AVPlaceboFrameStats
+{
+    uint64_t presented;
+    uint64_t dropped; // decoded, but never shown
+    uint64_t repeated; // display refreshes that showed the previous frame again because the next one was late
+    uint64_t late; // frames presented more than half a frame interval after their target time
+};
 
 class AVPlaceboWidget : public QWindow, public IAVWidget
 {
@@ -39,9 +49,21 @@ class AVPlaceboWidget : public QWindow, public IAVWidget
         QThread *frame_uploader_thread;
         QThread *render_thread;
         VkSurfaceKHR surface = VK_NULL_HANDLE;
-        AVFrame *queued_frame = nullptr;
         bool stream_started = false;
 
+        // presentation queue, all protected by frames_mutex
+        PlaceboPacing pacing;
+        QQueue<AVFrame *> frame_queue;
+        QWaitCondition frames_cond;
+        bool present_scheduled = false;
+        bool present_stop = false;
+
+        // only accessed on the render thread
+        QElapsedTimer pacing_timer;
+        qint64 stream_interval_us;
+        qint64 next_present_us = -1;
+        std::atomic<qint64> display_interval_us;
+
         pl_cache placebo_cache;
         pl_render_params render_params;
         pl_log placebo_log;
@@ -51,15 +73,29 @@ class AVPlaceboWidget : public QWindow, public IAVWidget
         pl_renderer placebo_renderer = nullptr;
         pl_tex placebo_tex[4] = {nullptr, nullptr, nullptr, nullptr};
 
-        qint64 num_frames_total = 0;
-        qint64 num_frames_dropped = 0;
+        std::atomic<uint64_t> num_frames_presented;
+        std::atomic<uint64_t> num_frames_dropped;
+        std::atomic<uint64_t> num_frames_repeated;
+        std::atomic<uint64_t> num_frames_late;
+
+        void PresentFrames();
+        void UpdatePacing(qint64 now_us, int queued);
+        void UpdateDisplayInterval();
 
     public:
-        explicit AVPlaceboWidget(StreamSession *session, ResolutionMode resolution_mode, PlaceboPreset preset);
+        /**
+         * @param stream_fps frame rate of the stream, used to derive when each frame should be presented
+         */
+        explicit AVPlaceboWidget(StreamSession *session, ResolutionMode resolution_mode, PlaceboPreset preset,
+                PlaceboPacing pacing, unsigned int stream_fps);
         ~AVPlaceboWidget() override;
 
+        /**
+         * Add a decoded frame to the presentation queue. May be called from any thread, takes ownership of frame.
+         */
         bool QueueFrame(AVFrame *frame);
-        void RenderFrame();
+        void RenderFrame(AVFrame *frame);
+        AVPlaceboFrameStats GetFrameStats() const;
         void RenderImage(const QImage &img);
         void RenderPlaceholderIcon();
         void CreateSwapchain();
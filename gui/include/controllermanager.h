@@ -95,6 +95,7 @@ class Controller : public QObject
 		ChiakiControllerState GetState();
 		void SetRumble(uint8_t left, uint8_t right);
 		void SetTriggerEffects(uint8_t type_left, const uint8_t *data_left, uint8_t type_right, const uint8_t *data_right);
+		void SetGyroBiasCalibration(bool enabled);
 		bool IsDualSense();
 #ifdef CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 		bool IsSteamDeck();
@@ -36,8 +36,7 @@ class DiscoveryManager : public QObject
 		bool service_active;
 		QList<DiscoveryHost> hosts;
 
-	private slots:
-		void DiscoveryServiceHosts(QList<DiscoveryHost> hosts);
+		void DiscoveryServiceHostEvent(ChiakiDiscoveryServiceHostEvent event, const DiscoveryHost &host);
 
 	public:
 		explicit DiscoveryManager(QObject *parent = nullptr);
@@ -19,6 +19,8 @@ class SessionLog
 	private:
 		StreamSession *session;
 		ChiakiLog log;
+		ChiakiLogAsync log_async;
+		bool log_async_active;
 		QFile *file;
 		QMutex file_mutex;
 
@@ -28,7 +30,10 @@ class SessionLog
 		SessionLog(StreamSession *session, uint32_t level_mask, const QString &filename);
 		~SessionLog();
 
-		ChiakiLog *GetChiakiLog()	{ return &log; }
+		/**
+		 * Log to be used by everything else. Backed by a drain thread, so no logging thread ever waits for console or file I/O.
+		 */
+		ChiakiLog *GetChiakiLog()	{ return log_async_active ? chiaki_log_async_get_log(&log_async) : &log; }
 };
 
 QString GetLogBaseDir();
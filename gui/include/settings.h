@@ -48,6 +48,11 @@ enum class PlaceboPreset {
 	Default,
 	HighQuality
 };
+
+enum class PlaceboPacing {
+	LowestLatency,
+	Smoothest
+};
 #endif
 
 class Settings : public QObject
@@ -86,6 +91,15 @@ class Settings : public QObject
 		bool GetVerticalDeckEnabled() const       { return settings.value("settings/gyro_inverted", false).toBool(); }
 		void SetVerticalDeckEnabled(bool enabled) { settings.setValue("settings/gyro_inverted", enabled); }
 
+		bool GetGyroBiasCalibration() const			{ return settings.value("settings/gyro_bias_calibration", false).toBool(); }
+		void SetGyroBiasCalibration(bool enabled)	{ settings.setValue("settings/gyro_bias_calibration", enabled); }
+
+		bool GetFastStartupEnabled() const			{ return settings.value("settings/fast_startup", true).toBool(); }
+		void SetFastStartupEnabled(bool enabled)	{ settings.setValue("settings/fast_startup", enabled); }
+
+		bool GetResumeEnabled() const			{ return settings.value("settings/enable_resume", true).toBool(); }
+		void SetResumeEnabled(bool enabled)		{ settings.setValue("settings/enable_resume", enabled); }
+
 		bool GetAutomaticConnect() const         { return settings.value("settings/automatic_connect", false).toBool(); }
 		void SetAutomaticConnect(bool autoconnect)    { settings.setValue("settings/automatic_connect", autoconnect); }
 
@@ -116,6 +130,9 @@ class Settings : public QObject
 #if CHIAKI_GUI_ENABLE_PLACEBO
 		PlaceboPreset GetPlaceboPreset() const;
 		void SetPlaceboPreset(PlaceboPreset preset);
+
+		PlaceboPacing GetPlaceboPacing() const;
+		void SetPlaceboPacing(PlaceboPacing pacing);
 #endif
 
 		unsigned int GetAudioBufferSizeDefault() const;
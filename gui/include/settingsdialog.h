@@ -28,7 +28,10 @@ class SettingsDialog : public QDialog
 		QCheckBox *dualsense_check_box;
 		QCheckBox *buttons_pos_check_box;
 		QCheckBox *vertical_sdeck_check_box;
+		QCheckBox *gyro_bias_calibration_check_box;
 		QCheckBox *automatic_connect_check_box;
+		QCheckBox *fast_startup_check_box;
+		QCheckBox *resume_check_box;
 
 		QComboBox *resolution_combo_box;
 		QComboBox *fps_combo_box;
@@ -42,6 +45,7 @@ class SettingsDialog : public QDialog
 		QComboBox *renderer_combo_box;
 #if CHIAKI_GUI_ENABLE_PLACEBO
 		QComboBox *placebo_preset_combo_box;
+		QComboBox *placebo_pacing_combo_box;
 
 		QFormLayout *renderer_settings_layout;
 #endif
@@ -63,7 +67,10 @@ class SettingsDialog : public QDialog
 		void DualSenseChanged();
 		void ButtonsPosChanged();
 		void DeckOrientationChanged();
+		void GyroBiasCalibrationChanged();
 		void AutomaticConnectChanged();
+		void FastStartupChanged();
+		void ResumeChanged();
 #if CHIAKI_GUI_ENABLE_SPEEX
 		void SpeechProcessingChanged();
 #endif
@@ -81,6 +88,7 @@ class SettingsDialog : public QDialog
 		void RendererSelected();
 #if CHIAKI_GUI_ENABLE_PLACEBO
 		void PlaceboPresetSelected();
+		void PlaceboPacingSelected();
 #endif
 
 		void UpdateRegisteredHosts();
@@ -25,22 +25,18 @@
 #include "sessionlog.h"
 #include "controllermanager.h"
 #include "settings.h"
+#include "audioprocessor.h"
 
 #include <QObject>
 #include <QImage>
 #include <QMouseEvent>
 #include <QTimer>
-#include <QQueue>
 #include <QElapsedTimer>
-#if CHIAKI_GUI_ENABLE_SPEEX
-#include <QQueue>
-#include <speex/speex_echo.h>
-#include <speex/speex_preprocess.h>
-#endif
+#include <QMutex>
+
+#include <atomic>
 
-class QAudioOutput;
-class QAudioInput;
-class QIODevice;
+class QThread;
 class QKeyEvent;
 class Settings;
 
@@ -50,14 +46,6 @@ class ChiakiException: public Exception
 		explicit ChiakiException(const QString &msg) : Exception(msg) {};
 };
 
-#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-typedef struct haptic_packet_t
-{
-   	int16_t haptic_packet[30];
-    uint64_t timestamp;
-} haptic_packet_t;
-#endif
-
 struct StreamSessionConnectInfo
 {
 	Settings *settings;
@@ -82,6 +70,9 @@ struct StreamSessionConnectInfo
 	bool enable_keyboard;
 	bool enable_dualsense;
 	bool buttons_by_pos;
+	bool fast_startup;
+	bool enable_resume;
+	bool gyro_bias_calibration;
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 	bool vertical_sdeck;
 # endif
@@ -103,13 +94,6 @@ struct StreamSessionConnectInfo
 			bool stretch);
 };
 
-struct MicBuf
-{
-	int16_t *buf;
-	uint32_t size_bytes;
-	uint32_t current_byte;
-};
-
 class StreamSession : public QObject
 {
 	friend class StreamSessionPrivate;
@@ -125,6 +109,7 @@ class StreamSession : public QObject
 		bool muted;
 		bool mic_connected;
 		bool allow_unmute;
+		bool gyro_bias_calibration;
 
 		QHash<int, Controller *> controllers;
 #if CHIAKI_GUI_ENABLE_SETSU
@@ -134,22 +119,23 @@ class StreamSession : public QObject
 		SetsuDevice *setsu_motion_device;
 		ChiakiOrientationTracker orient_tracker;
 		bool orient_dirty;
+		bool setsu_state_dirty;
+		ChiakiThread setsu_thread;
+		bool setsu_thread_running;
+		std::atomic<bool> setsu_thread_stop;
 #endif
 
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 		SDeck *sdeck;
 		ChiakiControllerState sdeck_state;
 		int haptics_sdeck;
-		QQueue<haptic_packet_t> sdeck_hapticl;
-		QQueue<haptic_packet_t> sdeck_hapticr;
-		int16_t * sdeck_haptics_senderl;
-		int16_t * sdeck_haptics_senderr;
-		int sdeck_queue_segment;
-		uint64_t sdeck_last_haptic;
-		bool sdeck_skipl, sdeck_skipr;
 		ChiakiOrientationTracker sdeck_orient_tracker;
 		bool sdeck_orient_dirty;
 		bool vertical_sdeck;
+		bool sdeck_state_dirty;
+		ChiakiThread sdeck_thread;
+		bool sdeck_thread_running;
+		std::atomic<bool> sdeck_thread_stop;
 #endif
 		float PS_TOUCHPAD_MAX_X, PS_TOUCHPAD_MAX_Y;
 		ChiakiControllerState keyboard_state;
@@ -157,6 +143,19 @@ class StreamSession : public QObject
 		QMap<int, uint8_t> touch_tracker;
 		int8_t mouse_touch_id;
 
+		/**
+		 * Input states as last published by the main thread and the input threads,
+		 * fused into the state sent to the console by PublishInputState()
+		 */
+		QMutex input_state_mutex;
+		ChiakiControllerState main_input_state;
+#if CHIAKI_GUI_ENABLE_SETSU
+		ChiakiControllerState setsu_input_state;
+#endif
+#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
+		ChiakiControllerState sdeck_input_state;
+#endif
+
 		ChiakiFfmpegDecoder *ffmpeg_decoder;
 		void TriggerFfmpegFrameAvailable();
 #if CHIAKI_LIB_ENABLE_PI_DECODER
@@ -166,41 +165,36 @@ class StreamSession : public QObject
 		QAudioDeviceInfo audio_out_device_info;
 		QAudioDeviceInfo audio_in_device_info;
 		unsigned int audio_buffer_size;
-		QAudioOutput *audio_output;
-		QAudioInput *audio_input;
-		QIODevice *audio_io;
-		QIODevice *audio_mic;
 #if CHIAKI_GUI_ENABLE_SPEEX
-		SpeexEchoState *echo_state;
-		SpeexPreprocessState *preprocess_state;
 		bool speech_processing_enabled;
-		uint8_t *echo_resampler_buf, *mic_resampler_buf;
-		QQueue<int16_t *> echo_to_cancel;
 #endif
+		QThread *audio_thread;
+		AudioProcessor *audio_processor;
 		SDL_AudioDeviceID haptics_output;
-		uint8_t *haptics_resampler_buf;
-		MicBuf mic_buf;
 		QMap<Qt::Key, int> key_map;
 
 		void PushAudioFrame(int16_t *buf, size_t samples_count);
 		void PushHapticsFrame(uint8_t *buf, size_t buf_size);
+		void PublishInputState(ChiakiControllerState *published, const ChiakiControllerState &state);
 #if CHIAKI_GUI_ENABLE_SETSU
 		void HandleSetsuEvent(SetsuEvent *event);
+		void StopSetsuThread();
+		void *SetsuThreadFunc();
 #endif
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 		void HandleSDeckEvent(SDeckEvent *event);
+		void StopSDeckThread();
+		void *SDeckThreadFunc();
 #endif
 
 	private slots:
 		void InitAudio(unsigned int channels, unsigned int rate);
 		void InitMic(unsigned int channels, unsigned int rate);
-		void ReadMic();
 		void InitHaptics();
 		void Event(ChiakiEvent *event);
 		void DisconnectHaptics();
 		void ConnectHaptics();
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-		void SdeckQueueHaptics(haptic_packet_t packetl, haptic_packet_t packetr);
 		void ConnectSdeckHaptics();
 #endif
 
@@ -219,6 +213,7 @@ class StreamSession : public QObject
 		ChiakiLog *GetChiakiLog()				{ return log.GetChiakiLog(); }
 		QList<Controller *> GetControllers()	{ return controllers.values(); }
 		ChiakiFfmpegDecoder *GetFfmpegDecoder()	{ return ffmpeg_decoder; }
+		AudioOutputStats GetAudioOutputStats()	{ return audio_processor->GetOutputStats(); }
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 		ChiakiPiDecoder *GetPiDecoder()	{ return pi_decoder; }
 #endif
@@ -230,9 +225,6 @@ class StreamSession : public QObject
 
 	signals:
 		void FfmpegFrameAvailable();
-#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-		void SdeckHapticPushed(haptic_packet_t packetl, haptic_packet_t packetr);
-#endif
 		void SessionQuit(ChiakiQuitReason reason, const QString &reason_str);
 		void LoginPINRequested(bool incorrect);
 
@@ -242,8 +234,5 @@ class StreamSession : public QObject
 };
 
 Q_DECLARE_METATYPE(ChiakiQuitReason)
-#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-Q_DECLARE_METATYPE(haptic_packet_t)
-#endif
 
 #endif // CHIAKI_STREAMSESSION_H
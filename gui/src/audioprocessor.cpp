@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <audioprocessor.h>
+
+#include <QAudioInput>
+#include <QAudioOutput>
+
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AUDIO_PROCESSOR_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_PROCESSOR_NEON 1
+#endif
+
+// frames of played back audio kept for echo cancellation
+#define ECHO_QUEUE_MAX 40
+// older echo than this is too far behind the mic to be cancelled, so it is skipped
+#define ECHO_DELAY_FRAMES_MAX 4
+// 0.5s of 3 kHz stereo
+#define HAPTICS_RING_SAMPLES 3000
+#define HAPTICS_CHUNK_FRAMES 30
+
+// ring of played back audio, 0.5s of 48 kHz stereo
+#define OUTPUT_RING_SAMPLES 48000
+// fill of the jitter buffer that is held by drift compensation
+#define OUTPUT_TARGET_MS 30
+// latency above this is cut immediately instead of slowly resampled away
+#define OUTPUT_MAX_MS 200
+#define OUTPUT_RATIO_MAX_DEVIATION 0.005
+// the ratio is controlled from the relative deviation of the fill from the target,
+// the integral part removes the remaining offset caused by a constant clock drift
+#define OUTPUT_RATIO_GAIN_P 0.005
+#define OUTPUT_RATIO_GAIN_I 0.00001
+// weight of each new fill measurement in the average, about 1-2s time constant with typical device periods
+#define OUTPUT_FILL_AVG_WEIGHT 0.01
+
+void AudioStereoToMono(const int16_t *in, int16_t *out, size_t frames)
+{
+	size_t i = 0;
+#if AUDIO_PROCESSOR_SSE2
+	for(; i + 8 <= frames; i += 8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(in + i * 2));
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + i * 2 + 8));
+		// sign extend left and right into 32 bit lanes, sum, halve and pack back
+		__m128i a_sum = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(a, 16));
+		__m128i b_sum = _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(b, 16), 16), _mm_srai_epi32(b, 16));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(_mm_srai_epi32(a_sum, 1), _mm_srai_epi32(b_sum, 1)));
+	}
+#elif AUDIO_PROCESSOR_NEON
+	for(; i + 8 <= frames; i += 8)
+	{
+		int16x8x2_t lr = vld2q_s16(in + i * 2);
+		vst1q_s16(out + i, vhaddq_s16(lr.val[0], lr.val[1]));
+	}
+#endif
+	for(; i < frames; i++)
+		out[i] = (int16_t)(((int32_t)in[i * 2] + (int32_t)in[i * 2 + 1]) >> 1);
+}
+
+void AudioMonoToStereo(const int16_t *in, int16_t *out, size_t frames)
+{
+	size_t i = 0;
+#if AUDIO_PROCESSOR_SSE2
+	for(; i + 8 <= frames; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i * 2), _mm_unpacklo_epi16(v, v));
+		_mm_storeu_si128((__m128i *)(out + i * 2 + 8), _mm_unpackhi_epi16(v, v));
+	}
+#elif AUDIO_PROCESSOR_NEON
+	for(; i + 8 <= frames; i += 8)
+	{
+		int16x8_t v = vld1q_s16(in + i);
+		int16x8x2_t lr = { { v, v } };
+		vst2q_s16(out + i * 2, lr);
+	}
+#endif
+	for(; i < frames; i++)
+	{
+		out[i * 2] = in[i];
+		out[i * 2 + 1] = in[i];
+	}
+}
+
+void HapticsResampler::Process(const int16_t *in, size_t frames, int16_t *out)
+{
+	for(size_t i = 0; i < frames; i++)
+	{
+		int32_t l = in[i * 2];
+		int32_t r = in[i * 2 + 1];
+		for(size_t j = 1; j <= ratio; j++)
+		{
+			out[0] = 0;
+			out[1] = 0;
+			out[2] = (int16_t)(last_l + (l - last_l) * (int32_t)j / (int32_t)ratio);
+			out[3] = (int16_t)(last_r + (r - last_r) * (int32_t)j / (int32_t)ratio);
+			out += out_channels;
+		}
+		last_l = (int16_t)l;
+		last_r = (int16_t)r;
+	}
+}
+
+AudioProcessor::AudioProcessor(ChiakiLog *log, ChiakiOpusEncoder *opus_encoder, unsigned int buffer_size, size_t frame_size,
+		bool speech_processing_enabled, int32_t noise_suppress_level, int32_t echo_suppress_level)
+	: log(log),
+	opus_encoder(opus_encoder),
+	buffer_size(buffer_size),
+	frame_size(frame_size),
+	audio_input(nullptr),
+	audio_mic(nullptr),
+	mic_channels(0),
+	mic_frame_fill(0),
+	muted(true),
+	mic_active(false),
+#if CHIAKI_GUI_ENABLE_SPEEX
+	echo_ring(ECHO_QUEUE_MAX * frame_size * 2),
+#endif
+	haptics_output(0),
+	haptics_pending(false),
+	haptics_ring(HAPTICS_RING_SAMPLES),
+	haptics_in(HAPTICS_CHUNK_FRAMES * 2),
+	haptics_out(HAPTICS_CHUNK_FRAMES * HapticsResampler::ratio * HapticsResampler::out_channels),
+	audio_output(nullptr),
+	audio_output_device(nullptr),
+	output_active(false),
+	output_channels(0),
+	output_rate(0),
+	output_target_frames(0),
+	output_max_frames(0),
+	output_ring(OUTPUT_RING_SAMPLES),
+	output_frac(0.0),
+	output_fill_avg(0.0),
+	output_ratio_integral(0.0),
+	output_prebuffering(true),
+	output_underruns(0),
+	output_dropped_frames(0),
+	output_fill_avg_us(0),
+	output_device_buffer_us(0),
+	output_ratio_ppm(0)
+{
+#if CHIAKI_GUI_ENABLE_SPEEX
+	this->speech_processing_enabled = speech_processing_enabled;
+	echo_state = nullptr;
+	preprocess_state = nullptr;
+	if(speech_processing_enabled)
+	{
+		echo_state = speex_echo_state_init(frame_size, frame_size * 10);
+		preprocess_state = speex_preprocess_state_init(frame_size, frame_size * 100);
+		noise_suppress_level = -1 * noise_suppress_level;
+		echo_suppress_level = -1 * echo_suppress_level;
+		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);
+		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_NOISE_SUPPRESS, &noise_suppress_level);
+		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_GET_NOISE_SUPPRESS, &noise_suppress_level);
+		CHIAKI_LOGI(log, "Noise suppress level is %i dB", noise_suppress_level);
+		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &echo_suppress_level);
+		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_GET_ECHO_SUPPRESS, &echo_suppress_level);
+		CHIAKI_LOGI(log, "Echo suppress level is %i dB", echo_suppress_level);
+		CHIAKI_LOGI(log, "Started microphone echo cancellation and noise suppression");
+
+		echo_stereo.resize(frame_size * 2);
+		echo_mono.resize(frame_size);
+		mic_clean.resize(frame_size);
+		mic_stereo.resize(frame_size * 2);
+	}
+#else
+	(void)speech_processing_enabled;
+	(void)noise_suppress_level;
+	(void)echo_suppress_level;
+#endif
+}
+
+AudioProcessor::~AudioProcessor()
+{
+	StopMic();
+	StopOutput();
+#if CHIAKI_GUI_ENABLE_SPEEX
+	if(preprocess_state)
+		speex_preprocess_state_destroy(preprocess_state);
+	if(echo_state)
+		speex_echo_state_destroy(echo_state);
+#endif
+}
+
+void AudioProcessor::StartMic(const QAudioDeviceInfo &device_info, unsigned int channels, unsigned int rate)
+{
+	StopMic();
+
+	mic_channels = channels;
+	mic_frame.assign(frame_size * channels, 0);
+	mic_frame_fill = 0;
+
+	QAudioFormat audio_format;
+	audio_format.setSampleRate(rate);
+	audio_format.setChannelCount(channels);
+	audio_format.setSampleSize(16);
+	audio_format.setCodec("audio/pcm");
+	audio_format.setSampleType(QAudioFormat::SignedInt);
+
+	if(!device_info.isFormatSupported(audio_format))
+	{
+		CHIAKI_LOGE(log, "Audio Format with %u channels @ %u Hz not supported by microphone %s",
+				channels, rate,
+				device_info.deviceName().toLocal8Bit().constData());
+		return;
+	}
+	audio_input = new QAudioInput(device_info, audio_format, this);
+	audio_input->setBufferSize(buffer_size);
+	audio_mic = audio_input->start();
+
+	CHIAKI_LOGI(log, "Microphone %s opened with %u channels @ %u Hz, buffer size %u",
+			device_info.deviceName().toLocal8Bit().constData(),
+			channels, rate, audio_input->bufferSize());
+	connect(audio_mic, &QIODevice::readyRead, this, &AudioProcessor::ReadMic);
+	mic_active = true;
+}
+
+void AudioProcessor::StopMic()
+{
+	mic_active = false;
+	if(!audio_input)
+		return;
+	audio_input->stop();
+	delete audio_input;
+	audio_input = nullptr;
+	audio_mic = nullptr;
+}
+
+void AudioProcessor::ReadMic()
+{
+	if(!audio_mic)
+		return;
+	size_t frame_bytes = mic_frame.size() * sizeof(int16_t);
+	while(true)
+	{
+		qint64 r = audio_mic->read((char *)mic_frame.data() + mic_frame_fill, frame_bytes - mic_frame_fill);
+		if(r <= 0)
+			break;
+		mic_frame_fill += r;
+		if(mic_frame_fill < frame_bytes)
+			continue;
+		mic_frame_fill = 0;
+		// Don't send mic data if muted
+		if(muted)
+			continue;
+		ProcessMicFrame();
+	}
+}
+
+void AudioProcessor::ProcessMicFrame()
+{
+#if CHIAKI_GUI_ENABLE_SPEEX
+	if(speech_processing_enabled && mic_channels == 1)
+	{
+		size_t echo_samples = frame_size * 2;
+		size_t echo_available = echo_ring.Available();
+		if(echo_available > ECHO_DELAY_FRAMES_MAX * echo_samples)
+			echo_ring.Skip(echo_available - ECHO_DELAY_FRAMES_MAX * echo_samples);
+		if(echo_ring.Read(echo_stereo.data(), echo_samples))
+		{
+			AudioStereoToMono(echo_stereo.data(), echo_mono.data(), frame_size);
+			speex_echo_cancellation(echo_state, mic_frame.data(), echo_mono.data(), mic_clean.data());
+		}
+		else
+			memcpy(mic_clean.data(), mic_frame.data(), frame_size * sizeof(int16_t));
+		speex_preprocess_run(preprocess_state, mic_clean.data());
+		// change samples to stereo after processing with SPEEX
+		AudioMonoToStereo(mic_clean.data(), mic_stereo.data(), frame_size);
+		chiaki_opus_encoder_frame(mic_stereo.data(), opus_encoder);
+		return;
+	}
+#endif
+	chiaki_opus_encoder_frame(mic_frame.data(), opus_encoder);
+}
+
+bool AudioProcessor::StartOutput(const QAudioDeviceInfo &device_info, unsigned int channels, unsigned int rate)
+{
+	StopOutput();
+
+	QAudioFormat audio_format;
+	audio_format.setSampleRate(rate);
+	audio_format.setChannelCount(channels);
+	audio_format.setSampleSize(16);
+	audio_format.setCodec("audio/pcm");
+	audio_format.setSampleType(QAudioFormat::SignedInt);
+
+	if(!channels || !device_info.isFormatSupported(audio_format))
+	{
+		CHIAKI_LOGE(log, "Audio Format with %u channels @ %u Hz not supported by Audio Device %s",
+				channels, rate,
+				device_info.deviceName().toLocal8Bit().constData());
+		return false;
+	}
+
+	output_channels = channels;
+	output_rate = rate;
+	output_target_frames = (size_t)rate * OUTPUT_TARGET_MS / 1000;
+	output_max_frames = std::min((size_t)rate * OUTPUT_MAX_MS / 1000, output_ring.Capacity() / channels);
+	output_ring.Reset();
+	output_prev.assign(channels, 0);
+	output_cur.assign(channels, 0);
+	output_frac = 0.0;
+	output_fill_avg = output_target_frames;
+	output_ratio_integral = 0.0;
+	output_prebuffering = true;
+
+	audio_output = new QAudioOutput(device_info, audio_format, this);
+	audio_output->setBufferSize(buffer_size);
+	audio_output_device = new AudioOutputDevice(this);
+	audio_output_device->open(QIODevice::ReadOnly);
+	audio_output->start(audio_output_device);
+
+	size_t frame_bytes = channels * sizeof(int16_t);
+	size_t device_frames = audio_output->bufferSize() / frame_bytes;
+	// enough for one full device buffer at the maximum ratio, so reading never allocates
+	output_scratch.resize((size_t)(device_frames * (1.0 + OUTPUT_RATIO_MAX_DEVIATION) + 2) * channels);
+	output_device_buffer_us = (uint32_t)((uint64_t)device_frames * 1000000 / rate);
+
+	CHIAKI_LOGI(log, "Audio Device %s opened with %u channels @ %u Hz, buffer size %u, jitter buffer target %u ms",
+			device_info.deviceName().toLocal8Bit().constData(),
+			channels, rate, audio_output->bufferSize(), (unsigned int)OUTPUT_TARGET_MS);
+	output_active = true;
+	return true;
+}
+
+void AudioProcessor::StopOutput()
+{
+	output_active = false;
+	if(!audio_output)
+		return;
+	audio_output->stop();
+	delete audio_output;
+	audio_output = nullptr;
+	delete audio_output_device;
+	audio_output_device = nullptr;
+}
+
+AudioOutputStats AudioProcessor::GetOutputStats()
+{
+	AudioOutputStats stats;
+	stats.active = output_active;
+	stats.jitter_buffer_ms = output_fill_avg_us / 1000.0;
+	stats.device_buffer_ms = output_device_buffer_us / 1000.0;
+	stats.resample_ratio = 1.0 + output_ratio_ppm / 1000000.0;
+	stats.underruns = output_underruns;
+	stats.dropped_frames = output_dropped_frames;
+	return stats;
+}
+
+void AudioProcessor::PushAudio(const int16_t *buf, size_t samples_count)
+{
+	if(!output_active)
+		return;
+	if(!output_ring.Write(buf, samples_count * output_channels))
+		output_dropped_frames += samples_count;
+
+#if CHIAKI_GUI_ENABLE_SPEEX
+	if(!speech_processing_enabled || output_channels != 2 || !mic_active || muted)
+		return;
+	// if the mic thread fell behind that much, the oldest echo is skipped on its side
+	echo_ring.Write(buf, samples_count * 2);
+#endif
+}
+
+AudioOutputDevice::AudioOutputDevice(AudioProcessor *processor)
+	: QIODevice(processor),
+	processor(processor)
+{
+}
+
+qint64 AudioOutputDevice::readData(char *data, qint64 maxlen)
+{
+	return processor->ReadOutput(data, maxlen);
+}
+
+qint64 AudioProcessor::ReadOutput(char *data, qint64 maxlen)
+{
+	size_t channels = output_channels;
+	size_t frame_bytes = channels * sizeof(int16_t);
+	if(!channels || maxlen < (qint64)frame_bytes)
+		return 0;
+	size_t frames = maxlen / frame_bytes;
+	int16_t *out = (int16_t *)data;
+
+	size_t available = output_ring.Available() / channels;
+	if(available > output_max_frames)
+	{
+		// far too much latency, e.g. after a stall of the device, cut it right away
+		size_t skip = available - output_target_frames;
+		output_ring.Skip(skip * channels);
+		output_dropped_frames += skip;
+		available = output_target_frames;
+		output_fill_avg = output_target_frames;
+	}
+	output_fill_avg += (available - output_fill_avg) * OUTPUT_FILL_AVG_WEIGHT;
+	output_fill_avg_us = (uint32_t)(output_fill_avg * 1000000.0 / output_rate);
+
+	if(output_prebuffering)
+	{
+		if(available < output_target_frames)
+		{
+			memset(data, 0, frames * frame_bytes);
+			return frames * frame_bytes;
+		}
+		output_prebuffering = false;
+	}
+
+	double deviation = (output_fill_avg - output_target_frames) / output_target_frames;
+	output_ratio_integral += deviation * OUTPUT_RATIO_GAIN_I;
+	output_ratio_integral = std::max(-OUTPUT_RATIO_MAX_DEVIATION, std::min(OUTPUT_RATIO_MAX_DEVIATION, output_ratio_integral));
+	double ratio = 1.0 + std::max(-OUTPUT_RATIO_MAX_DEVIATION, std::min(OUTPUT_RATIO_MAX_DEVIATION,
+				deviation * OUTPUT_RATIO_GAIN_P + output_ratio_integral));
+	output_ratio_ppm = (int32_t)std::lround((ratio - 1.0) * 1000000.0);
+
+	size_t needed = (size_t)(output_frac + frames * ratio);
+	if(needed > available)
+	{
+		output_underruns++;
+		output_prebuffering = true;
+		memset(data, 0, frames * frame_bytes);
+		return frames * frame_bytes;
+	}
+	if(needed * channels > output_scratch.size())
+		output_scratch.resize(needed * channels);
+	output_ring.Read(output_scratch.data(), needed * channels);
+
+	// linear interpolation between the previous and current input frame
+	const int16_t *in = output_scratch.data();
+	size_t in_index = 0;
+	double frac = output_frac;
+	for(size_t i = 0; i < frames; i++)
+	{
+		for(size_t c = 0; c < channels; c++)
+			out[i * channels + c] = (int16_t)(output_prev[c] + (output_cur[c] - output_prev[c]) * frac);
+		frac += ratio;
+		while(frac >= 1.0)
+		{
+			frac -= 1.0;
+			// rounding may ask for one frame more than was read, then the last one is held
+			if(in_index >= needed)
+				continue;
+			for(size_t c = 0; c < channels; c++)
+			{
+				output_prev[c] = output_cur[c];
+				output_cur[c] = in[in_index * channels + c];
+			}
+			in_index++;
+		}
+	}
+	output_frac = frac;
+	return frames * frame_bytes;
+}
+
+void AudioProcessor::PushHaptics(const uint8_t *buf, size_t buf_size)
+{
+	if(!haptics_output)
+		return;
+	size_t samples = buf_size / sizeof(int16_t);
+	if(samples > haptics_in.size())
+	{
+		CHIAKI_LOGE(log, "Haptic audio of incompatible size: %u", (unsigned int)buf_size);
+		return;
+	}
+	int16_t samples_buf[HAPTICS_CHUNK_FRAMES * 2];
+	memcpy(samples_buf, buf, samples * sizeof(int16_t));
+	if(!haptics_ring.Write(samples_buf, samples))
+		return;
+	// only one wakeup is in flight at any time, the processor drains everything that is queued
+	if(!haptics_pending.exchange(true))
+		QMetaObject::invokeMethod(this, &AudioProcessor::ProcessHaptics, Qt::QueuedConnection);
+}
+
+void AudioProcessor::ProcessHaptics()
+{
+	haptics_pending = false;
+	SDL_AudioDeviceID device = haptics_output;
+	while(true)
+	{
+		size_t frames = std::min(haptics_ring.Available() / 2, (size_t)HAPTICS_CHUNK_FRAMES);
+		if(!frames)
+			break;
+		haptics_ring.Read(haptics_in.data(), frames * 2);
+		if(!device)
+			continue;
+		haptics_resampler.Process(haptics_in.data(), frames, haptics_out.data());
+		Uint32 out_size = frames * HapticsResampler::ratio * HapticsResampler::out_channels * sizeof(int16_t);
+		if(SDL_QueueAudio(device, haptics_out.data(), out_size) < 0)
+		{
+			CHIAKI_LOGE(log, "Failed to submit haptics audio to device: %s", SDL_GetError());
+			return;
+		}
+	}
+}
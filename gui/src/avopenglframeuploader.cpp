@@ -12,7 +12,9 @@ AVOpenGLFrameUploader::AVOpenGLFrameUploader(StreamSession *session, AVOpenGLWid
 	session(session),
 	widget(widget),
 	context(context),
-	surface(surface)
+	surface(surface),
+	gl_initialized(false),
+	immutable_textures(false)
 {
 	connect(session, &StreamSession::FfmpegFrameAvailable, this, &AVOpenGLFrameUploader::UpdateFrameFromDecoder);
 }
@@ -29,13 +31,37 @@ void AVOpenGLFrameUploader::UpdateFrameFromDecoder()
 	if(QOpenGLContext::currentContext() != context)
 		context->makeCurrent(surface);
 
+	if(!gl_initialized)
+	{
+		pbo_ring.Init(context);
+		auto version = context->format().version();
+		immutable_textures = context->isOpenGLES()
+			? version >= qMakePair(3, 0)
+			: version >= qMakePair(4, 2) || context->hasExtension("GL_ARB_texture_storage");
+		CHIAKI_LOGI(session->GetChiakiLog(), "Frame uploader using %s pixel buffers and %s textures",
+				pbo_ring.buffer_storage ? "persistently mapped" : "mapped",
+				immutable_textures ? "immutable" : "mutable");
+		gl_initialized = true;
+	}
+
 	AVFrame *next_frame = chiaki_ffmpeg_decoder_pull_frame(decoder, /*hw_download*/ true);
 	if(!next_frame)
 		return;
 
-	bool success = widget->GetBackgroundFrame()->Update(next_frame, decoder->log);
+	bool success = widget->GetBackgroundFrame()->Update(next_frame, &pbo_ring, immutable_textures, decoder->log);
 	av_frame_free(&next_frame);
 
 	if(success)
 		widget->SwapFrames();
 }
+
+void AVOpenGLFrameUploader::CleanupGL()
+{
+	if(!gl_initialized)
+		return;
+	if(QOpenGLContext::currentContext() != context)
+		context->makeCurrent(surface);
+	pbo_ring.Fini(context->extraFunctions());
+	context->doneCurrent();
+	gl_initialized = false;
+}
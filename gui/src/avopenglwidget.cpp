@@ -15,6 +15,18 @@
 
 //#define DEBUG_OPENGL
 
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+// plane offsets inside a pixel buffer
+#define PBO_PLANE_ALIGN 64
+// the GPU is normally two frames past a buffer when it is reused, so this only triggers on a hang
+#define PBO_FENCE_TIMEOUT_NS 100000000
+
 static const char *shader_vert_glsl = R"glsl(
 #version 150 core
 
@@ -158,6 +170,10 @@ AVOpenGLWidget::~AVOpenGLWidget()
 {
 	if(frame_uploader_thread)
 	{
+		// the uploader's GL objects can only be freed with its context current, which lives on its thread
+		QMetaObject::invokeMethod(frame_uploader, [this]() {
+			frame_uploader->CleanupGL();
+		}, Qt::BlockingQueuedConnection);
 		frame_uploader_thread->quit();
 		frame_uploader_thread->wait();
 		delete frame_uploader_thread;
@@ -208,7 +224,135 @@ void AVOpenGLWidget::SwapFrames()
 	QMetaObject::invokeMethod(this, "update");
 }
 
-bool AVOpenGLFrame::Update(AVFrame *frame, ChiakiLog *log)
+void AVOpenGLPixelBufferRing::Init(QOpenGLContext *context)
+{
+	auto f = context->extraFunctions();
+	f->glGenBuffers(PBO_RING_SIZE, pbo);
+	for(int i=0; i<PBO_RING_SIZE; i++)
+	{
+		size[i] = 0;
+		mapped[i] = nullptr;
+		fence[i] = nullptr;
+	}
+	cur = 0;
+
+	buffer_storage = nullptr;
+	if(!context->isOpenGLES() && (context->format().version() >= qMakePair(4, 4) || context->hasExtension("GL_ARB_buffer_storage")))
+		buffer_storage = reinterpret_cast<BufferStorageFunc>(context->getProcAddress("glBufferStorage"));
+}
+
+uint8_t *AVOpenGLPixelBufferRing::Acquire(QOpenGLExtraFunctions *f, GLsizeiptr required, ChiakiLog *log)
+{
+	if(fence[cur])
+	{
+		GLenum r = f->glClientWaitSync(fence[cur], GL_SYNC_FLUSH_COMMANDS_BIT, PBO_FENCE_TIMEOUT_NS);
+		if(r == GL_TIMEOUT_EXPIRED || r == GL_WAIT_FAILED)
+			CHIAKI_LOGW(log, "AVOpenGLFrame timed out waiting for PBO to become available");
+		f->glDeleteSync(fence[cur]);
+		fence[cur] = nullptr;
+	}
+
+	f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[cur]);
+	if(size[cur] < required)
+	{
+		if(mapped[cur])
+		{
+			f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			mapped[cur] = nullptr;
+		}
+		// the buffer may have immutable storage from glBufferStorage, even if that has been given up since,
+		// so growing always requires a new buffer object
+		f->glDeleteBuffers(1, &pbo[cur]);
+		f->glGenBuffers(1, &pbo[cur]);
+		f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[cur]);
+		if(buffer_storage)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			buffer_storage(GL_PIXEL_UNPACK_BUFFER, required, nullptr, flags);
+			mapped[cur] = reinterpret_cast<uint8_t *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, required, flags));
+			if(!mapped[cur])
+			{
+				CHIAKI_LOGW(log, "AVOpenGLFrame failed to persistently map PBO, falling back to mapping every frame");
+				buffer_storage = nullptr;
+				f->glDeleteBuffers(1, &pbo[cur]);
+				f->glGenBuffers(1, &pbo[cur]);
+				f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[cur]);
+			}
+		}
+		if(!mapped[cur])
+			f->glBufferData(GL_PIXEL_UNPACK_BUFFER, required, nullptr, GL_STREAM_DRAW);
+		size[cur] = required;
+	}
+
+	if(mapped[cur])
+		return mapped[cur];
+	// the fence guarantees the GPU is done with this buffer, so there is no need to orphan or synchronize
+	return reinterpret_cast<uint8_t *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, required, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+}
+
+void AVOpenGLPixelBufferRing::Fini(QOpenGLExtraFunctions *f)
+{
+	for(int i=0; i<PBO_RING_SIZE; i++)
+	{
+		if(fence[i])
+		{
+			f->glDeleteSync(fence[i]);
+			fence[i] = nullptr;
+		}
+		if(mapped[i])
+		{
+			f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+			f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			mapped[i] = nullptr;
+		}
+		size[i] = 0;
+	}
+	f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	f->glDeleteBuffers(PBO_RING_SIZE, pbo);
+}
+
+void AVOpenGLPixelBufferRing::Release(QOpenGLExtraFunctions *f)
+{
+	if(!mapped[cur])
+		f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+}
+
+void AVOpenGLPixelBufferRing::Commit(QOpenGLExtraFunctions *f)
+{
+	fence[cur] = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	cur = (cur + 1) % PBO_RING_SIZE;
+}
+
+void AVOpenGLFrame::AllocateTextures(QOpenGLExtraFunctions *f, bool immutable)
+{
+	for(int i=0; i<conversion_config->planes; i++)
+	{
+		const PlaneConfig &plane = conversion_config->plane_configs[i];
+		int width = this->width / plane.width_divider;
+		int height = this->height / plane.height_divider;
+		if(immutable)
+		{
+			// immutable storage can not be resized, so replace the whole texture
+			f->glDeleteTextures(1, &tex[i]);
+			f->glGenTextures(1, &tex[i]);
+			f->glBindTexture(GL_TEXTURE_2D, tex[i]);
+			f->glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			f->glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			f->glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			f->glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			f->glTexStorage2D(GL_TEXTURE_2D, 1, plane.internal_format, width, height);
+		}
+		else
+		{
+			f->glBindTexture(GL_TEXTURE_2D, tex[i]);
+			f->glTexImage2D(GL_TEXTURE_2D, 0, plane.internal_format, width, height, 0, plane.format, GL_UNSIGNED_BYTE, nullptr);
+		}
+	}
+	tex_width = this->width;
+	tex_height = this->height;
+}
+
+bool AVOpenGLFrame::Update(AVFrame *frame, AVOpenGLPixelBufferRing *pbo_ring, bool immutable_textures, ChiakiLog *log)
 {
 	auto f = QOpenGLContext::currentContext()->extraFunctions();
 
@@ -218,42 +362,71 @@ bool AVOpenGLFrame::Update(AVFrame *frame, ChiakiLog *log)
 		return false;
 	}
 
+	// the textures may still be read by the last draw of this frame
+	if(render_fence)
+	{
+		f->glWaitSync(render_fence, 0, GL_TIMEOUT_IGNORED);
+		f->glDeleteSync(render_fence);
+		render_fence = nullptr;
+	}
+	if(upload_fence)
+	{
+		f->glDeleteSync(upload_fence);
+		upload_fence = nullptr;
+	}
+
 	width = frame->width;
 	height = frame->height;
+	if(width != tex_width || height != tex_height)
+		AllocateTextures(f, immutable_textures);
 
+	// all planes go into one buffer, keeping the decoder's line size so each plane is a single copy
+	GLintptr offsets[MAX_PANES];
+	size_t copy_sizes[MAX_PANES];
+	GLsizeiptr buf_size = 0;
 	for(int i=0; i<conversion_config->planes; i++)
 	{
-		int width = frame->width / conversion_config->plane_configs[i].width_divider;
-		int height = frame->height / conversion_config->plane_configs[i].height_divider;
-		int size = width * height * conversion_config->plane_configs[i].data_per_pixel;
-
-		f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
-		f->glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
-
-		auto buf = reinterpret_cast<uint8_t *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
-		if(!buf)
-		{
-			CHIAKI_LOGE(log, "AVOpenGLFrame failed to map PBO");
-			continue;
-		}
-
-		if(frame->linesize[i] == width)
-			memcpy(buf, frame->data[i], size);
-		else
+		const PlaneConfig &plane = conversion_config->plane_configs[i];
+		int row_size = frame->width / plane.width_divider * plane.data_per_pixel;
+		int rows = frame->height / plane.height_divider;
+		if(frame->linesize[i] < row_size || frame->linesize[i] % plane.data_per_pixel)
 		{
-			for(int l=0; l<height; l++)
-				memcpy(buf + width * l * conversion_config->plane_configs[i].data_per_pixel, frame->data[i] + frame->linesize[i] * l, width * conversion_config->plane_configs[i].data_per_pixel);
+			CHIAKI_LOGE(log, "AVOpenGLFrame got AVFrame with unsupported line size");
+			return false;
 		}
+		offsets[i] = buf_size;
+		copy_sizes[i] = (size_t)frame->linesize[i] * (rows - 1) + row_size;
+		buf_size += (copy_sizes[i] + PBO_PLANE_ALIGN - 1) & ~(size_t)(PBO_PLANE_ALIGN - 1);
+	}
 
-		f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	uint8_t *buf = pbo_ring->Acquire(f, buf_size, log);
+	if(!buf)
+	{
+		CHIAKI_LOGE(log, "AVOpenGLFrame failed to map PBO");
+		f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+	for(int i=0; i<conversion_config->planes; i++)
+		memcpy(buf + offsets[i], frame->data[i], copy_sizes[i]);
+	pbo_ring->Release(f);
 
+	f->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for(int i=0; i<conversion_config->planes; i++)
+	{
+		const PlaneConfig &plane = conversion_config->plane_configs[i];
+		f->glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->linesize[i] / plane.data_per_pixel);
 		f->glBindTexture(GL_TEXTURE_2D, tex[i]);
-		f->glTexImage2D(GL_TEXTURE_2D, 0, conversion_config->plane_configs[i].internal_format, width, height, 0, conversion_config->plane_configs[i].format, GL_UNSIGNED_BYTE, nullptr);
+		f->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->width / plane.width_divider, frame->height / plane.height_divider,
+				plane.format, GL_UNSIGNED_BYTE, reinterpret_cast<const void *>(offsets[i]));
 	}
+	f->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
+	pbo_ring->Commit(f);
 	f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-	f->glFinish();
+	upload_fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	// the render context can only wait for the fence once it has been submitted
+	f->glFlush();
 
 	return true;
 }
@@ -320,7 +493,6 @@ void AVOpenGLWidget::initializeGL()
 	{
 		frames[i].conversion_config = conversion_config;
 		f->glGenTextures(conversion_config->planes, frames[i].tex);
-		f->glGenBuffers(conversion_config->planes, frames[i].pbo);
 		uint8_t uv_default[] = {0x7f, 0x7f};
 		for(int j=0; j<conversion_config->planes; j++)
 		{
@@ -333,6 +505,10 @@ void AVOpenGLWidget::initializeGL()
 		}
 		frames[i].width = 0;
 		frames[i].height = 0;
+		frames[i].tex_width = 0;
+		frames[i].tex_height = 0;
+		frames[i].upload_fence = nullptr;
+		frames[i].render_fence = nullptr;
 	}
 
 	f->glUseProgram(program);
@@ -446,6 +622,9 @@ void AVOpenGLWidget::paintGL()
 
 	f->glViewport((widget_width - vp_width) / 2, (widget_height - vp_height) / 2, vp_width, vp_height);
 
+	if(frame->upload_fence)
+		f->glWaitSync(frame->upload_fence, 0, GL_TIMEOUT_IGNORED);
+
 	for(int i=0; i<3; i++)
 	{
 		f->glActiveTexture(GL_TEXTURE0 + i);
@@ -454,5 +633,8 @@ void AVOpenGLWidget::paintGL()
 
 	f->glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-	f->glFinish();
+	if(frame->render_fence)
+		f->glDeleteSync(frame->render_fence);
+	frame->render_fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	f->glFlush();
 }
@@ -7,6 +7,7 @@
 #include <QThread>
 #include <QTimer>
 #include <QGuiApplication>
+#include <QScreen>
 #include <QWindow>
 #include <stdio.h>
 #include <QImage>
@@ -23,16 +24,33 @@
 #include <vulkan/vulkan_wayland.h>
 #include <qpa/qplatformnativeinterface.h>
 
+// frames kept in the presentation queue before the oldest one is dropped
+#define PRESENT_QUEUE_MAX_LOWEST_LATENCY 1
+#define PRESENT_QUEUE_MAX_SMOOTHEST 3
+// frames the smoothest policy keeps buffered to absorb network jitter, any more are drained by presenting faster
+#define PRESENT_QUEUE_TARGET_SMOOTHEST 1
+// presenting slightly early is fine, the swapchain holds the frame until the next refresh anyway
+#define PRESENT_SLACK_US 1000
+#define STREAM_FPS_DEFAULT 60
+#define DISPLAY_REFRESH_RATE_DEFAULT 60.0
+
 static inline QString GetShaderCacheFile()
 {
     return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/pl_shader.cache";
 }
 
-AVPlaceboWidget::AVPlaceboWidget(StreamSession *session, ResolutionMode resolution_mode, PlaceboPreset preset)
-    : session(session), resolution_mode(resolution_mode)
+AVPlaceboWidget::AVPlaceboWidget(StreamSession *session, ResolutionMode resolution_mode, PlaceboPreset preset,
+        PlaceboPacing pacing, unsigned int stream_fps)
+    : session(session), pacing(pacing), display_interval_us(0),
+    num_frames_presented(0), num_frames_dropped(0), num_frames_repeated(0), num_frames_late(0),
+    resolution_mode(resolution_mode)
 {
     setSurfaceType(QWindow::VulkanSurface);
 
+    stream_interval_us = 1000000 / (stream_fps ? stream_fps : STREAM_FPS_DEFAULT);
+    CHIAKI_LOGI(session->GetChiakiLog(), "Using %s frame pacing",
+            pacing == PlaceboPacing::Smoothest ? "smoothest" : "lowest latency");
+
     if (preset == PlaceboPreset::Default)
     {
         CHIAKI_LOGI(session->GetChiakiLog(), "Using placebo default preset");
@@ -132,39 +150,99 @@ bool AVPlaceboWidget::QueueFrame(AVFrame *frame) {
         av_frame_free(&frame);
         return false;
     }
-    num_frames_total++;
-    bool render = true;
+    int queue_max = pacing == PlaceboPacing::Smoothest ? PRESENT_QUEUE_MAX_SMOOTHEST : PRESENT_QUEUE_MAX_LOWEST_LATENCY;
     frames_mutex.lock();
-    if (queued_frame) {
+    if (present_stop) {
+        frames_mutex.unlock();
+        av_frame_free(&frame);
+        return false;
+    }
+    frame_queue.enqueue(frame);
+    while (frame_queue.size() > queue_max) {
         CHIAKI_LOGV(session->GetChiakiLog(), "Dropped rendering frame!");
         num_frames_dropped++;
-        av_frame_free(&queued_frame);
-        render = false;
+        AVFrame *dropped = frame_queue.dequeue();
+        av_frame_free(&dropped);
     }
-    queued_frame = frame;
+    bool schedule = !present_scheduled;
+    present_scheduled = true;
+    frames_cond.wakeAll();
     frames_mutex.unlock();
-    if (render) {
-        QMetaObject::invokeMethod(render_thread->parent(), std::bind(&AVPlaceboWidget::RenderFrame, this));
+    if (schedule) {
+        QMetaObject::invokeMethod(render_thread->parent(), std::bind(&AVPlaceboWidget::PresentFrames, this));
     }
     stream_started = true;
     return true;
 }
 
-void AVPlaceboWidget::RenderFrame()
+void AVPlaceboWidget::PresentFrames()
 {
-    struct pl_swapchain_frame sw_frame = {0};
-    struct pl_frame placebo_frame = {0};
-    struct pl_frame target_frame = {0};
+    QMutexLocker locker(&frames_mutex);
+    while (!present_stop && !frame_queue.isEmpty()) {
+        qint64 now_us = pacing_timer.nsecsElapsed() / 1000;
+        if (pacing == PlaceboPacing::Smoothest && next_present_us >= 0 && now_us < next_present_us - PRESENT_SLACK_US) {
+            // new frames and Stop() wake this up early
+            frames_cond.wait(&frames_mutex, (next_present_us - now_us) / 1000);
+            continue;
+        }
+        AVFrame *frame = frame_queue.dequeue();
+        int queued = frame_queue.size();
+        locker.unlock();
+        UpdatePacing(now_us, queued);
+        RenderFrame(frame);
+        locker.relock();
+    }
+    present_scheduled = false;
+}
 
-    frames_mutex.lock();
-    AVFrame *frame = queued_frame;
-    queued_frame = nullptr;
-    frames_mutex.unlock();
+void AVPlaceboWidget::UpdatePacing(qint64 now_us, int queued)
+{
+    qint64 display_us = display_interval_us;
+    qint64 interval_us = std::max(stream_interval_us, display_us);
+
+    num_frames_presented++;
+    if (next_present_us >= 0 && now_us > next_present_us + interval_us / 2) {
+        // the previous frame stayed on screen for every refresh until now
+        num_frames_late++;
+        num_frames_repeated += std::max<qint64>(1, (now_us - next_present_us + display_us / 2) / display_us);
+        next_present_us = now_us;
+    }
 
-    if (!frame) {
-        CHIAKI_LOGE(session->GetChiakiLog(), "No frame to render!");
-        return;
+    if (pacing == PlaceboPacing::Smoothest) {
+        // keep the schedule instead of the actual time, so wakeup jitter does not accumulate
+        if (next_present_us < 0)
+            next_present_us = now_us;
+        if (queued > PRESENT_QUEUE_TARGET_SMOOTHEST)
+            interval_us -= interval_us / 8;
+        next_present_us += interval_us;
+    } else {
+        next_present_us = now_us + interval_us;
     }
+}
+
+void AVPlaceboWidget::UpdateDisplayInterval()
+{
+    double refresh_rate = screen() ? screen()->refreshRate() : 0.0;
+    if (refresh_rate < 1.0)
+        refresh_rate = DISPLAY_REFRESH_RATE_DEFAULT;
+    display_interval_us = (qint64)(1000000.0 / refresh_rate);
+}
+
+AVPlaceboFrameStats AVPlaceboWidget::GetFrameStats() const
+{
+    AVPlaceboFrameStats stats;
+    stats.presented = num_frames_presented;
+    stats.dropped = num_frames_dropped;
+    stats.repeated = num_frames_repeated;
+    stats.late = num_frames_late;
+    return stats;
+}
+
+void AVPlaceboWidget::RenderFrame(AVFrame *frame)
+{
+    struct pl_swapchain_frame sw_frame = {0};
+    struct pl_frame placebo_frame = {0};
+    struct pl_frame target_frame = {0};
 
     struct pl_avframe_params avparams = {
         .frame = frame,
@@ -330,6 +408,13 @@ void AVPlaceboWidget::CreateSwapchain()
         placebo_vulkan->gpu
     );
 
+    frames_mutex.lock();
+    present_stop = false;
+    frames_mutex.unlock();
+    next_present_us = -1;
+    pacing_timer.start();
+    UpdateDisplayInterval();
+
     frame_uploader = new AVPlaceboFrameUploader(session, this);
     frame_uploader_thread = new QThread(this);
     frame_uploader_thread->setObjectName("Frame Uploader");
@@ -356,6 +441,15 @@ void AVPlaceboWidget::ReleaseSwapchain()
     delete frame_uploader;
     frame_uploader = nullptr;
 
+    frames_mutex.lock();
+    present_stop = true;
+    frames_cond.wakeAll();
+    while (!frame_queue.isEmpty()) {
+        AVFrame *frame = frame_queue.dequeue();
+        av_frame_free(&frame);
+    }
+    frames_mutex.unlock();
+
     render_thread->quit();
     render_thread->wait();
     delete render_thread->parent();
@@ -372,6 +466,11 @@ void AVPlaceboWidget::ReleaseSwapchain()
     PFN_vkDestroySurfaceKHR destroySurface = reinterpret_cast<PFN_vkDestroySurfaceKHR>(
             placebo_vk_inst->get_proc_addr(placebo_vk_inst->instance, "vkDestroySurfaceKHR"));
     destroySurface(placebo_vk_inst->instance, surface, nullptr);
+
+    AVPlaceboFrameStats stats = GetFrameStats();
+    CHIAKI_LOGI(session->GetChiakiLog(), "Presented %llu frames, %llu dropped, %llu late, %llu display refreshes repeated",
+            (unsigned long long)stats.presented, (unsigned long long)stats.dropped,
+            (unsigned long long)stats.late, (unsigned long long)stats.repeated);
 }
 
 void AVPlaceboWidget::resizeEvent(QResizeEvent *event)
@@ -384,6 +483,8 @@ void AVPlaceboWidget::resizeEvent(QResizeEvent *event)
     if (!placebo_renderer)
         CreateSwapchain();
 
+    UpdateDisplayInterval();
+
     int width = event->size().width() * this->devicePixelRatio();
     int height = event->size().height() * this->devicePixelRatio();
     pl_swapchain_resize(placebo_swapchain, &width, &height);
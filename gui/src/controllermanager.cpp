@@ -556,6 +556,11 @@ void Controller::SetTriggerEffects(uint8_t type_left, const uint8_t *data_left,
 #endif
 }
 
+void Controller::SetGyroBiasCalibration(bool enabled)
+{
+	orientation_tracker.bias_calibration = enabled;
+}
+
 bool Controller::IsDualSense()
 {
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
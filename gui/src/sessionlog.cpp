@@ -40,10 +40,16 @@ SessionLog::SessionLog(StreamSession *session, uint32_t level_mask, const QStrin
 	}
 
 	CHIAKI_LOGI(&log, "Chiaki Version " CHIAKI_VERSION);
+
+	log_async_active = chiaki_log_async_init(&log_async, &log) == CHIAKI_ERR_SUCCESS;
+	if(!log_async_active)
+		CHIAKI_LOGW(&log, "Failed to start async logging, logging synchronously");
 }
 
 SessionLog::~SessionLog()
 {
+	if(log_async_active)
+		chiaki_log_async_fini(&log_async);
 	delete file;
 }
 
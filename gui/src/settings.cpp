@@ -237,6 +237,22 @@ void Settings::SetPlaceboPreset(PlaceboPreset preset)
 {
 	settings.setValue("settings/placebo_preset", placebo_preset_values[preset]);
 }
+
+static const QMap<PlaceboPacing, QString> placebo_pacing_values = {
+	{ PlaceboPacing::LowestLatency, "lowest_latency" },
+	{ PlaceboPacing::Smoothest, "smoothest" }
+};
+
+PlaceboPacing Settings::GetPlaceboPacing() const
+{
+	auto v = settings.value("settings/placebo_pacing", placebo_pacing_values[PlaceboPacing::LowestLatency]).toString();
+	return placebo_pacing_values.key(v, PlaceboPacing::LowestLatency);
+}
+
+void Settings::SetPlaceboPacing(PlaceboPacing pacing)
+{
+	settings.setValue("settings/placebo_pacing", placebo_pacing_values[pacing]);
+}
 #endif
 
 
@@ -114,11 +114,26 @@ SettingsDialog::SettingsDialog(Settings *settings, QWidget *parent) : QDialog(pa
 	vertical_sdeck_check_box->setChecked(settings->GetVerticalDeckEnabled());
 	connect(vertical_sdeck_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::DeckOrientationChanged);
 
+	gyro_bias_calibration_check_box = new QCheckBox(this);
+	general_layout->addRow(tr("Recalibrate gyro drift while\nthe controller is lying still."), gyro_bias_calibration_check_box);
+	gyro_bias_calibration_check_box->setChecked(settings->GetGyroBiasCalibration());
+	connect(gyro_bias_calibration_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::GyroBiasCalibrationChanged);
+
 	automatic_connect_check_box = new QCheckBox(this);
 	general_layout->addRow(tr("Automatically connect to PlayStation after clicking in GUI."), automatic_connect_check_box);
 	automatic_connect_check_box->setChecked(settings->GetAutomaticConnect());
 	connect(automatic_connect_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::AutomaticConnectChanged);
 
+	fast_startup_check_box = new QCheckBox(this);
+	general_layout->addRow(tr("Fast session startup:\nReuse values negotiated with\nthe console in previous sessions."), fast_startup_check_box);
+	fast_startup_check_box->setChecked(settings->GetFastStartupEnabled());
+	connect(fast_startup_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::FastStartupChanged);
+
+	resume_check_box = new QCheckBox(this);
+	general_layout->addRow(tr("Resume the stream after\nshort network interruptions."), resume_check_box);
+	resume_check_box->setChecked(settings->GetResumeEnabled());
+	connect(resume_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::ResumeChanged);
+
 	auto log_directory_label = new QLineEdit(GetLogBaseDir(), this);
 	log_directory_label->setReadOnly(true);
 	general_layout->addRow(tr("Log Directory:"), log_directory_label);
@@ -397,8 +412,25 @@ SettingsDialog::SettingsDialog(Settings *settings, QWidget *parent) : QDialog(pa
 			placebo_preset_combo_box->setCurrentIndex(placebo_preset_combo_box->count() - 1);
 	}
 	connect(placebo_preset_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(PlaceboPresetSelected()));
+
+	placebo_pacing_combo_box = new QComboBox(this);
+	static const QList<QPair<PlaceboPacing, QString>> placebo_pacing_strings = {
+		{ PlaceboPacing::LowestLatency, "Lowest Latency (show every frame as soon as it is decoded)" },
+		{ PlaceboPacing::Smoothest, "Smoothest (buffer frames and present them evenly)" }
+	};
+	auto current_placebo_pacing = settings->GetPlaceboPacing();
+	for(const auto &p : placebo_pacing_strings)
+	{
+		placebo_pacing_combo_box->addItem(p.second, (int)p.first);
+		if(current_placebo_pacing == p.first)
+			placebo_pacing_combo_box->setCurrentIndex(placebo_pacing_combo_box->count() - 1);
+	}
+	connect(placebo_pacing_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(PlaceboPacingSelected()));
 	if (current_renderer == Renderer::PlaceboVk)
+	{
 		renderer_settings_layout->addRow(tr("Placebo Preset:"), placebo_preset_combo_box);
+		renderer_settings_layout->addRow(tr("Frame Pacing:"), placebo_pacing_combo_box);
+	}
 #endif
 
 	// Registered Consoles
@@ -503,10 +535,25 @@ void SettingsDialog::DeckOrientationChanged()
 	settings->SetVerticalDeckEnabled(vertical_sdeck_check_box->isChecked());
 }
 
+void SettingsDialog::GyroBiasCalibrationChanged()
+{
+	settings->SetGyroBiasCalibration(gyro_bias_calibration_check_box->isChecked());
+}
+
 void SettingsDialog::AutomaticConnectChanged()
 {
 	settings->SetAutomaticConnect(automatic_connect_check_box->isChecked());
 }
+
+void SettingsDialog::FastStartupChanged()
+{
+	settings->SetFastStartupEnabled(fast_startup_check_box->isChecked());
+}
+
+void SettingsDialog::ResumeChanged()
+{
+	settings->SetResumeEnabled(resume_check_box->isChecked());
+}
 #if CHIAKI_GUI_ENABLE_SPEEX
 void SettingsDialog::SpeechProcessingChanged()
 {
@@ -570,6 +617,7 @@ void SettingsDialog::RendererSelected()
 	{
 		codec_combo_box->addItem("H265 HDR (PS5 only)", (int)CHIAKI_CODEC_H265_HDR);
 		renderer_settings_layout->insertRow(1, tr("Placebo Preset:"), placebo_preset_combo_box);
+		renderer_settings_layout->insertRow(2, tr("Frame Pacing:"), placebo_pacing_combo_box);
 	}
 	else if (current_renderer == Renderer::PlaceboVk)
 	{
@@ -581,6 +629,7 @@ void SettingsDialog::RendererSelected()
 		}
 		codec_combo_box->removeItem(codec_combo_box->findData((int)CHIAKI_CODEC_H265_HDR));
 		renderer_settings_layout->removeRow(placebo_preset_combo_box);
+		renderer_settings_layout->removeRow(placebo_pacing_combo_box);
 	}
 #endif
 }
@@ -590,6 +639,11 @@ void SettingsDialog::PlaceboPresetSelected()
 {
 	settings->SetPlaceboPreset((PlaceboPreset)placebo_preset_combo_box->currentData().toInt());
 }
+
+void SettingsDialog::PlaceboPacingSelected()
+{
+	settings->SetPlaceboPacing((PlaceboPacing)placebo_pacing_combo_box->currentData().toInt());
+}
 #endif
 
 void SettingsDialog::UpdateBitratePlaceholder()
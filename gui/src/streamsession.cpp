@@ -8,17 +8,18 @@
 #include <chiaki/streamconnection.h>
 
 #include <QKeyEvent>
-#include <QAudioOutput>
-#include <QAudioInput>
+#include <QThread>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDir>
 
 #include <cstring>
 #include <chiaki/session.h>
 #include <chiaki/time.h>
 
-#define SETSU_UPDATE_INTERVAL_MS 4
-#define STEAMDECK_UPDATE_INTERVAL_MS 4
-#define STEAMDECK_HAPTIC_INTERVAL_MS 10 // check every interval
-#define STEAMDECK_HAPTIC_PACKETS_PER_ANALYSIS 4 // send packets every interval * packets per analysis
+// upper bound for how long stopping the Steam Deck input thread may take
+#define STEAMDECK_INPUT_WAIT_MS 100
+#define STEAMDECK_HAPTIC_PACKETS_PER_ANALYSIS 4 // analyze frequency of this many 10ms packets at once
 #define STEAMDECK_HAPTIC_SAMPLING_RATE 3000
 // DualShock4 touchpad is 1920 x 942
 #define PS4_TOUCHPAD_MAX_X 1920.0f
@@ -28,14 +29,13 @@
 #define PS5_TOUCHPAD_MAX_Y 1079.0f
 
 #define MICROPHONE_SAMPLES 480
+#define AUDIO_STATS_LOG_INTERVAL_MS 10000
+#define DECODER_STATS_LOG_INTERVAL_MS 10000
 #ifdef Q_OS_LINUX
 #define DUALSENSE_AUDIO_DEVICE_NEEDLE "DualSense"
 #else
 #define DUALSENSE_AUDIO_DEVICE_NEEDLE "Wireless Controller"
 #endif
-#if CHIAKI_GUI_ENABLE_SPEEX
-#define ECHO_QUEUE_MAX 40
-#endif
 
 StreamSessionConnectInfo::StreamSessionConnectInfo(
 		Settings *settings,
@@ -69,6 +69,9 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(
 	this->enable_keyboard = false; // TODO: from settings
 	this->enable_dualsense = settings->GetDualSenseEnabled();
 	this->buttons_by_pos = settings->GetButtonsByPosition();
+	this->fast_startup = settings->GetFastStartupEnabled();
+	this->enable_resume = settings->GetResumeEnabled();
+	this->gyro_bias_calibration = settings->GetGyroBiasCalibration();
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 	this->vertical_sdeck = settings->GetVerticalDeckEnabled();
 #endif
@@ -79,15 +82,25 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(
 #endif
 }
 
+static QString HostCachePath()
+{
+	auto base_dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+	if(base_dir.isEmpty() || !QDir().mkpath(base_dir))
+		return QString();
+	return base_dir + "/host.cache";
+}
+
 static void AudioSettingsCb(uint32_t channels, uint32_t rate, void *user);
 static void AudioFrameCb(int16_t *buf, size_t samples_count, void *user);
 static void HapticsFrameCb(uint8_t *buf, size_t buf_size, void *user);
 static void EventCb(ChiakiEvent *event, void *user);
 #if CHIAKI_GUI_ENABLE_SETSU
 static void SessionSetsuCb(SetsuEvent *event, void *user);
+static void *SessionSetsuThreadFunc(void *user);
 #endif
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 static void SessionSDeckCb(SDeckEvent *event, void *user);
+static void *SessionSDeckThreadFunc(void *user);
 #endif
 static void FfmpegFrameCb(ChiakiFfmpegDecoder *decoder, void *user);
 
@@ -98,27 +111,18 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	pi_decoder(nullptr),
 #endif
-	audio_output(nullptr),
-	audio_io(nullptr),
-	audio_input(nullptr),
-	audio_mic(nullptr),
-	haptics_output(0),
+	audio_thread(nullptr),
+	audio_processor(nullptr),
+	haptics_output(0)
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-	sdeck_haptics_senderl(nullptr),
-	sdeck_haptics_senderr(nullptr),
-	haptics_sdeck(0),
-#endif
-#if CHIAKI_GUI_ENABLE_SPEEX
-	echo_resampler_buf(nullptr),
-	mic_resampler_buf(nullptr),
+	,haptics_sdeck(0)
 #endif
-	haptics_resampler_buf(nullptr)
 {
-	mic_buf.buf = nullptr;
 	connected = false;
 	muted = true;
 	mic_connected = false;
 	allow_unmute = false;
+	gyro_bias_calibration = connect_info.gyro_bias_calibration;
 	ChiakiErrorCode err;
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
     haptics_sdeck = 0;
@@ -136,11 +140,15 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 		ffmpeg_decoder = new ChiakiFfmpegDecoder;
 		ChiakiLogSniffer sniffer;
 		chiaki_log_sniffer_init(&sniffer, CHIAKI_LOG_ALL, GetChiakiLog());
-		err = chiaki_ffmpeg_decoder_init(ffmpeg_decoder,
+		ChiakiFfmpegDecoderConfig decoder_config;
+		chiaki_ffmpeg_decoder_config_init(&decoder_config);
+		if(connect_info.video_profile.max_fps)
+			decoder_config.frame_budget_us = 1000000 / connect_info.video_profile.max_fps;
+		err = chiaki_ffmpeg_decoder_init_ex(ffmpeg_decoder,
 				chiaki_log_sniffer_get_log(&sniffer),
 				chiaki_target_is_ps5(connect_info.target) ? connect_info.video_profile.codec : CHIAKI_CODEC_H264,
 				connect_info.hw_decoder.isEmpty() ? NULL : connect_info.hw_decoder.toUtf8().constData(),
-				FfmpegFrameCb, this);
+				&decoder_config, FfmpegFrameCb, this);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
 			QString log = QString::fromUtf8(chiaki_log_sniffer_get_buffer(&sniffer));
@@ -200,24 +208,6 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 
 	chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
 	chiaki_opus_encoder_init(&opus_encoder, log.GetChiakiLog());
-#if CHIAKI_GUI_ENABLE_SPEEX
-	speech_processing_enabled = connect_info.speech_processing_enabled;
-	if(speech_processing_enabled)
-	{
-		echo_state = speex_echo_state_init(MICROPHONE_SAMPLES, MICROPHONE_SAMPLES * 10);
-		preprocess_state = speex_preprocess_state_init(MICROPHONE_SAMPLES, MICROPHONE_SAMPLES * 100);
-		int32_t noise_suppress_level = -1 * connect_info.noise_suppress_level;
-		int32_t echo_suppress_level = -1 * connect_info.echo_suppress_level;
-		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);
-		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_NOISE_SUPPRESS, &noise_suppress_level);
-		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_GET_NOISE_SUPPRESS, &noise_suppress_level);
-		CHIAKI_LOGI(GetChiakiLog(), "Noise suppress level is %i dB", noise_suppress_level);
-		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &echo_suppress_level);
-		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_GET_ECHO_SUPPRESS, &echo_suppress_level);
-		CHIAKI_LOGI(GetChiakiLog(), "Echo suppress level is %i dB", echo_suppress_level);
-		CHIAKI_LOGI(GetChiakiLog(), "Started microphone echo cancellation and noise suppression");
-	}
-#endif
 	audio_buffer_size = connect_info.audio_buffer_size;
 
 	QByteArray host_str = connect_info.host.toUtf8();
@@ -229,6 +219,22 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_connect_info.video_profile_auto_downgrade = true;
 	chiaki_connect_info.enable_keyboard = false;
 	chiaki_connect_info.enable_dualsense = connect_info.enable_dualsense;
+	chiaki_connect_info.enable_resume = connect_info.enable_resume;
+	// upstream is mostly controller input, which should get ahead of bulk traffic on networks that honor DSCP
+	chiaki_connect_info.socket_config.dscp = CHIAKI_SOCKET_DSCP_EF;
+	chiaki_connect_info.socket_config.timestamps = true;
+
+	if(connect_info.fast_startup)
+		chiaki_connect_info.startup_mode = CHIAKI_SESSION_STARTUP_MODE_FAST;
+
+	// the regist key identifies the host without depending on its address, only a digest of it goes to disk
+	QByteArray host_cache_path = HostCachePath().toUtf8();
+	QByteArray host_id = QCryptographicHash::hash(connect_info.regist_key, QCryptographicHash::Sha256).toHex().left(32);
+	if(!host_cache_path.isEmpty())
+	{
+		chiaki_connect_info.host_cache_path = host_cache_path.constData();
+		chiaki_connect_info.host_id = host_id.constData();
+	}
 
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	if(connect_info.decoder == Decoder::Pi && chiaki_connect_info.video_profile.codec != CHIAKI_CODEC_H264)
@@ -273,6 +279,46 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_audio_header_set(&audio_header, 2, 16, MICROPHONE_SAMPLES * 100, MICROPHONE_SAMPLES);
 	chiaki_opus_encoder_header(&audio_header, &opus_encoder, &session);
 
+	// mic, echo cancellation and haptics are processed off the main thread
+#if CHIAKI_GUI_ENABLE_SPEEX
+	speech_processing_enabled = connect_info.speech_processing_enabled;
+	audio_processor = new AudioProcessor(GetChiakiLog(), &opus_encoder, audio_buffer_size, MICROPHONE_SAMPLES,
+			speech_processing_enabled, connect_info.noise_suppress_level, connect_info.echo_suppress_level);
+#else
+	audio_processor = new AudioProcessor(GetChiakiLog(), &opus_encoder, audio_buffer_size, MICROPHONE_SAMPLES, false, 0, 0);
+#endif
+	audio_thread = new QThread(this);
+	audio_thread->setObjectName("Audio Processor");
+	audio_processor->moveToThread(audio_thread);
+	audio_thread->start(QThread::TimeCriticalPriority);
+
+	auto audio_stats_timer = new QTimer(this);
+	connect(audio_stats_timer, &QTimer::timeout, this, [this]{
+		AudioOutputStats stats = audio_processor->GetOutputStats();
+		if(!stats.active)
+			return;
+		CHIAKI_LOGV(GetChiakiLog(), "Audio output latency %.1f ms (jitter buffer %.1f ms, device buffer %.1f ms), drift compensation %+.3f%%, %llu underruns, %llu dropped frames",
+				stats.jitter_buffer_ms + stats.device_buffer_ms, stats.jitter_buffer_ms, stats.device_buffer_ms,
+				(stats.resample_ratio - 1.0) * 100.0,
+				(unsigned long long)stats.underruns, (unsigned long long)stats.dropped_frames);
+	});
+	audio_stats_timer->start(AUDIO_STATS_LOG_INTERVAL_MS);
+
+	if(ffmpeg_decoder)
+	{
+		auto decoder_stats_timer = new QTimer(this);
+		connect(decoder_stats_timer, &QTimer::timeout, this, [this]{
+			ChiakiFfmpegDecoderStats stats;
+			chiaki_ffmpeg_decoder_get_stats(ffmpeg_decoder, &stats);
+			if(!stats.frames_decoded)
+				return;
+			CHIAKI_LOGV(GetChiakiLog(), "Video decode time %.1f ms average, %.1f ms max, degradation level %d, %llu frames decoded, %llu dropped",
+					stats.decode_time_avg_us / 1000.0, stats.decode_time_max_us / 1000.0, (int)stats.degradation,
+					(unsigned long long)stats.frames_decoded, (unsigned long long)stats.frames_dropped);
+		});
+		decoder_stats_timer->start(DECODER_STATS_LOG_INTERVAL_MS);
+	}
+
 	if (connect_info.enable_dualsense)
 	{
 		ChiakiAudioSink haptics_sink;
@@ -287,7 +333,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	else
 	{
 #endif
-		chiaki_session_set_video_sample_cb(&session, chiaki_ffmpeg_decoder_video_sample_cb, ffmpeg_decoder);
+		chiaki_session_set_video_frame_cb(&session, chiaki_ffmpeg_decoder_video_frame_cb, ffmpeg_decoder);
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	}
 #endif
@@ -299,28 +345,36 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	if(connect_info.buttons_by_pos)
 		ControllerManager::GetInstance()->SetButtonsByPos();
 #endif
+	chiaki_controller_state_set_idle(&main_input_state);
 #if CHIAKI_GUI_ENABLE_SETSU
 	setsu_motion_device = nullptr;
 	chiaki_controller_state_set_idle(&setsu_state);
+	chiaki_controller_state_set_idle(&setsu_input_state);
 	setsu_ids=QMap<QPair<QString, SetsuTrackingId>, uint8_t>();
 	orient_dirty = true;
+	setsu_state_dirty = false;
 	chiaki_orientation_tracker_init(&orient_tracker);
+	orient_tracker.bias_calibration = gyro_bias_calibration;
+	setsu_thread_running = false;
+	setsu_thread_stop = false;
 	setsu = setsu_new();
-	auto timer = new QTimer(this);
-	connect(timer, &QTimer::timeout, this, [this]{
-		setsu_poll(setsu, SessionSetsuCb, this);
-		if(orient_dirty)
-		{
-			chiaki_orientation_tracker_apply_to_controller_state(&orient_tracker, &setsu_state);
-			SendFeedbackState();
-			orient_dirty = false;
-		}
-	});
-	timer->start(SETSU_UPDATE_INTERVAL_MS);
+	if(!setsu)
+		CHIAKI_LOGE(GetChiakiLog(), "Failed to initialize Setsu");
+	else if(chiaki_thread_create(&setsu_thread, SessionSetsuThreadFunc, this) == CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_thread_set_name(&setsu_thread, "Setsu Input");
+		setsu_thread_running = true;
+	}
+	else
+		CHIAKI_LOGE(GetChiakiLog(), "Failed to create Setsu input thread");
 #endif
 
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 	chiaki_controller_state_set_idle(&sdeck_state);
+	chiaki_controller_state_set_idle(&sdeck_input_state);
+	sdeck_state_dirty = false;
+	sdeck_thread_running = false;
+	sdeck_thread_stop = false;
 	sdeck = sdeck_new();
 	// no concept of hotplug for Steam Deck so turn off if not detected immediately
 	if(!sdeck)
@@ -332,21 +386,18 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 		if(vertical_sdeck)
 		{
 			chiaki_orientation_tracker_init(&sdeck_orient_tracker);
+			sdeck_orient_tracker.bias_calibration = gyro_bias_calibration;
 			sdeck_orient_dirty = true;
 		}
 		else
 			sdeck_orient_dirty = false;
-		auto sdeck_timer = new QTimer(this);
-		connect(sdeck_timer, &QTimer::timeout, this, [this]{
-			sdeck_read(sdeck, SessionSDeckCb, this);
-			if(sdeck_orient_dirty)
-			{
-				chiaki_orientation_tracker_apply_to_controller_state(&sdeck_orient_tracker, &sdeck_state);
-				SendFeedbackState();
-				sdeck_orient_dirty = false;
-			}
-		});
-		sdeck_timer->start(STEAMDECK_UPDATE_INTERVAL_MS);
+		if(chiaki_thread_create(&sdeck_thread, SessionSDeckThreadFunc, this) == CHIAKI_ERR_SUCCESS)
+		{
+			chiaki_thread_set_name(&sdeck_thread, "SDeck Input");
+			sdeck_thread_running = true;
+		}
+		else
+			CHIAKI_LOGE(GetChiakiLog(), "Failed to create Steam Deck input thread");
 	}
 #endif
 	key_map = connect_info.key_map;
@@ -364,26 +415,39 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 
 StreamSession::~StreamSession()
 {
+	// input threads publish into the session, so stop them before it goes away
+#if CHIAKI_GUI_ENABLE_SETSU
+	StopSetsuThread();
+#endif
+#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
+	StopSDeckThread();
+#endif
+	// the mic sends into the session, so stop it before the session goes away
+	// audio devices must be closed on the processor's own thread before the thread goes away
+	QMetaObject::invokeMethod(audio_processor, [this]() {
+		audio_processor->StopMic();
+		audio_processor->StopOutput();
+	}, Qt::BlockingQueuedConnection);
+	audio_thread->quit();
+	audio_thread->wait();
 	chiaki_session_join(&session);
 	chiaki_session_fini(&session);
+	// session threads push audio and haptics until joined
+	delete audio_thread;
+	delete audio_processor;
 	chiaki_opus_decoder_fini(&opus_decoder);
 	chiaki_opus_encoder_fini(&opus_encoder);
-#if CHIAKI_GUI_ENABLE_SPEEX
-	if(speech_processing_enabled)
-	{
-		speex_echo_state_destroy(echo_state);
-		speex_preprocess_state_destroy(preprocess_state);
-	}
-#endif
 #if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 	for(auto controller : controllers)
 		delete controller;
 #endif
 #if CHIAKI_GUI_ENABLE_SETSU
-	setsu_free(setsu);
+	if(setsu)
+		setsu_free(setsu);
 #endif
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-	sdeck_free(sdeck);
+	if(sdeck)
+		sdeck_free(sdeck);
 #endif
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 	if(pi_decoder)
@@ -402,43 +466,6 @@ StreamSession::~StreamSession()
 		SDL_CloseAudioDevice(haptics_output);
 		haptics_output = 0;
 	}
-	if (haptics_resampler_buf)
-	{
-		free(haptics_resampler_buf);
-		haptics_resampler_buf = nullptr;
-	}
-#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-	if (sdeck_haptics_senderl)
-	{
-		free(sdeck_haptics_senderl);
-		sdeck_haptics_senderl = nullptr;
-	}
-	if (sdeck_haptics_senderr)
-	{
-		free(sdeck_haptics_senderr);
-		sdeck_haptics_senderr = nullptr;
-	}
-	if(mic_buf.buf)
-	{
-		free(mic_buf.buf);
-		mic_buf.buf = nullptr;
-	}
-#endif
-#if CHIAKI_GUI_ENABLE_SPEEX
-	if(speech_processing_enabled)
-	{
-		if(mic_resampler_buf)
-		{
-			free(mic_resampler_buf);
-			mic_resampler_buf = nullptr;
-		}
-		if(echo_resampler_buf)
-		{
-			free(echo_resampler_buf);
-			echo_resampler_buf = nullptr;
-		}
-	}
-#endif
 }
 
 void StreamSession::Start()
@@ -486,6 +513,7 @@ void StreamSession::ToggleMute()
 		muted = false;
 	else
 		muted = true;
+	audio_processor->SetMuted(muted);
 }
 
 void StreamSession::SetLoginPIN(const QString &pin)
@@ -686,6 +714,7 @@ void StreamSession::UpdateGamepads()
 			CHIAKI_LOGI(log.GetChiakiLog(), "Controller %d opened: \"%s\"", controller_id, controller->GetName().toLocal8Bit().constData());
 			connect(controller, &Controller::StateChanged, this, &StreamSession::SendFeedbackState);
 			connect(controller, &Controller::MicButtonPush, this, &StreamSession::ToggleMute);
+			controller->SetGyroBiasCalibration(gyro_bias_calibration);
 			controllers[controller_id] = controller;
 			if (controller->IsDualSense())
 			{
@@ -710,230 +739,57 @@ void StreamSession::SendFeedbackState()
 	ChiakiControllerState state;
 	chiaki_controller_state_set_idle(&state);
 
-#if CHIAKI_GUI_ENABLE_SETSU
-	// setsu is the one that potentially has gyro/accel/orient so copy that directly first
-	state = setsu_state;
-#endif
-
 	for(auto controller : controllers)
 	{
 		auto controller_state = controller->GetState();
 		chiaki_controller_state_or(&state, &state, &controller_state);
 	}
 
-#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-	chiaki_controller_state_or(&state, &state, &sdeck_state);
-#endif
 	chiaki_controller_state_or(&state, &state, &keyboard_state);
 	chiaki_controller_state_or(&state, &state, &touch_state);
-	chiaki_session_set_controller_state(&session, &state);
+	PublishInputState(&main_input_state, state);
 }
 
-void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
+/**
+ * Called from the main thread and the input threads, each passing its own slot in published.
+ */
+void StreamSession::PublishInputState(ChiakiControllerState *published, const ChiakiControllerState &state)
 {
-	delete audio_output;
-	audio_output = nullptr;
-	audio_io = nullptr;
-
-	QAudioFormat audio_format;
-	audio_format.setSampleRate(rate);
-	audio_format.setChannelCount(channels);
-	audio_format.setSampleSize(16);
-	audio_format.setCodec("audio/pcm");
-	audio_format.setSampleType(QAudioFormat::SignedInt);
-
-	QAudioDeviceInfo audio_device_info = audio_out_device_info;
-	if(!audio_device_info.isFormatSupported(audio_format))
-	{
-		CHIAKI_LOGE(log.GetChiakiLog(), "Audio Format with %u channels @ %u Hz not supported by Audio Device %s",
-					channels, rate,
-					audio_device_info.deviceName().toLocal8Bit().constData());
-		return;
-	}
-
-	audio_output = new QAudioOutput(audio_device_info, audio_format, this);
-	audio_output->setBufferSize(audio_buffer_size);
-	audio_io = audio_output->start();
+	QMutexLocker locker(&input_state_mutex);
+	*published = state;
 
-	CHIAKI_LOGI(log.GetChiakiLog(), "Audio Device %s opened with %u channels @ %u Hz, buffer size %u",
-				audio_device_info.deviceName().toLocal8Bit().constData(),
-				channels, rate, audio_output->bufferSize());
-	allow_unmute = true;
-}
-
-void StreamSession::InitMic(unsigned int channels, unsigned int rate)
-{
-	delete audio_input;
-	audio_input = nullptr;
-	audio_mic = nullptr;
-	mic_buf.buf = nullptr;
-#if CHIAKI_GUI_ENABLE_SPEEX
-	mic_resampler_buf = nullptr;
-	echo_resampler_buf = nullptr;
+	ChiakiControllerState fused;
+	chiaki_controller_state_set_idle(&fused);
+#if CHIAKI_GUI_ENABLE_SETSU
+	// setsu is the one that potentially has gyro/accel/orient so copy that directly first
+	fused = setsu_input_state;
 #endif
-
-	mic_buf.current_byte = 0;
-	int16_t mic_buf_size = channels * MICROPHONE_SAMPLES;
-	mic_buf.size_bytes = mic_buf_size * sizeof(int16_t);
-	mic_buf.buf = (int16_t*) calloc(mic_buf_size, sizeof(int16_t));
-
-#if CHIAKI_GUI_ENABLE_SPEEX
-	if(speech_processing_enabled)
-	{
-		SDL_AudioCVT cvt;
-		SDL_BuildAudioCVT(&cvt, AUDIO_S16LSB, 1, 48000, AUDIO_S16LSB, 2, 48000);
-		cvt.len = mic_buf.size_bytes;
-		mic_resampler_buf = (uint8_t*) calloc(cvt.len * cvt.len_mult, sizeof(uint8_t));
-		if(!mic_resampler_buf)
-		{
-			CHIAKI_LOGE(GetChiakiLog(), "Mic resampler buf could not be created, aborting mic startup");
-			return;
-		}
-
-		SDL_AudioCVT cvt2;
-		SDL_BuildAudioCVT(&cvt2, AUDIO_S16LSB, 2, 48000, AUDIO_S16LSB, 1, 48000);
-		cvt2.len = cvt.len * cvt.len_ratio;
-		echo_resampler_buf = (uint8_t*) calloc(cvt2.len * cvt2.len_mult, sizeof(uint8_t));
-		if(!echo_resampler_buf)
-		{
-			CHIAKI_LOGE(GetChiakiLog(), "Echo resampler buf could not be created, aborting mic startup");
-			return;
-		}
-	}
+	chiaki_controller_state_or(&fused, &fused, &main_input_state);
+#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
+	chiaki_controller_state_or(&fused, &fused, &sdeck_input_state);
 #endif
+	chiaki_session_set_controller_state(&session, &fused);
+}
 
-	QAudioFormat audio_format;
-	audio_format.setSampleRate(rate);
-	audio_format.setChannelCount(channels);
-	audio_format.setSampleSize(16);
-	audio_format.setCodec("audio/pcm");
-	audio_format.setSampleType(QAudioFormat::SignedInt);
-
-	QAudioDeviceInfo audio_device_info = audio_in_device_info;
-	if(!audio_device_info.isFormatSupported(audio_format))
-	{
-		CHIAKI_LOGE(log.GetChiakiLog(), "Audio Format with %u channels @ %u Hz not supported by microphone %s",
-					channels, rate,
-					audio_device_info.deviceName().toLocal8Bit().constData());
-		return;
-	}
-	audio_input = new QAudioInput(audio_device_info, audio_format, this);
-	audio_input->setBufferSize(audio_buffer_size);
-	audio_mic = audio_input->start();
-
-	CHIAKI_LOGI(log.GetChiakiLog(), "Microphone %s opened with %u channels @ %u Hz, buffer size %u",
-			audio_device_info.deviceName().toLocal8Bit().constData(),
-			channels, rate, audio_input->bufferSize());
-	connect(audio_mic, SIGNAL(readyRead()), this, SLOT(ReadMic()));
+void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
+{
+	QAudioDeviceInfo device_info = audio_out_device_info;
+	bool success = false;
+	QMetaObject::invokeMethod(audio_processor, [this, device_info, channels, rate, &success]() {
+		success = audio_processor->StartOutput(device_info, channels, rate);
+	}, Qt::BlockingQueuedConnection);
+	if(success)
+		allow_unmute = true;
 }
 
-void StreamSession::ReadMic()
+void StreamSession::InitMic(unsigned int channels, unsigned int rate)
 {
-#if CHIAKI_GUI_ENABLE_SPEEX
-	int16_t echo_buf[mic_buf.size_bytes / sizeof(int16_t)];
-#endif
-	uint32_t mic_bytes_left = mic_buf.size_bytes - mic_buf.current_byte;
-	QByteArray micdata = audio_mic->readAll();
-	// Don't send mic data if muted
-	if(muted)
-		return;
-	qint64 bytes_read = micdata.size();
-	const char * micdataread = micdata.constData();
-	if(bytes_read == 0)
-		return;
-	if(bytes_read < mic_bytes_left)
-	{
-		memcpy((uint8_t *)mic_buf.buf + mic_buf.current_byte, (uint8_t *)micdataread, bytes_read);
-		mic_buf.current_byte += bytes_read;
-	}
-	else
-	{
-		memcpy((uint8_t *)mic_buf.buf + mic_buf.current_byte, (uint8_t *)micdataread, mic_bytes_left);
-#if CHIAKI_GUI_ENABLE_SPEEX
-		SDL_AudioCVT cvt;
-		if(speech_processing_enabled)
-		{
-			// change samples to stereo after processing with SPEEX
-			SDL_BuildAudioCVT(&cvt, AUDIO_S16LSB, 1, 48000, AUDIO_S16LSB, 2, 48000);
-			cvt.len = mic_buf.size_bytes;
-			cvt.buf = mic_resampler_buf;
-			if(!echo_to_cancel.isEmpty())
-			{
-				int16_t *echo = echo_to_cancel.dequeue();
-				speex_echo_cancellation(echo_state, mic_buf.buf, echo, echo_buf);
-				speex_preprocess_run(preprocess_state, echo_buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)echo_buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-			else
-			{
-				memcpy((uint8_t *)mic_buf.buf, (uint8_t *)mic_buf.buf, mic_buf.size_bytes);
-				speex_preprocess_run(preprocess_state, (int16_t *)mic_buf.buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)mic_buf.buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-		}
-		else
-			chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#else
-	    chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#endif
-		bytes_read -= mic_bytes_left;
-		uint32_t frames = bytes_read / mic_buf.size_bytes;
-		for (int i = 0; i < frames; i++)
-		{
-			memcpy((uint8_t *)mic_buf.buf, (uint8_t *)micdataread + mic_bytes_left + i * mic_buf.size_bytes, mic_buf.size_bytes);
-#if CHIAKI_GUI_ENABLE_SPEEX
-		if(speech_processing_enabled)
-		{
-			if(!echo_to_cancel.isEmpty())
-			{
-				int16_t *echo = echo_to_cancel.dequeue();
-				speex_echo_cancellation(echo_state, mic_buf.buf, echo, echo_buf);
-				speex_preprocess_run(preprocess_state, echo_buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)echo_buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-			else
-			{
-				memcpy((uint8_t *)mic_buf.buf, (uint8_t *)mic_buf.buf, mic_buf.size_bytes);
-				speex_preprocess_run(preprocess_state, (int16_t *)mic_buf.buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)mic_buf.buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-		}
-		else
-			chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#else
-	    chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#endif
-		}
-		mic_buf.current_byte = bytes_read % mic_buf.size_bytes;
-		if(mic_buf.current_byte == 0)
-			return;
-		memcpy((uint8_t *)mic_buf.buf, (uint8_t *)micdataread + mic_bytes_left + frames * mic_buf.size_bytes, mic_buf.current_byte);
-	}
+	QAudioDeviceInfo device_info = audio_in_device_info;
+	QMetaObject::invokeMethod(audio_processor, [this, device_info, channels, rate]() {
+		audio_processor->StartMic(device_info, channels, rate);
+	});
 }
+
 void StreamSession::InitHaptics()
 {
 	haptics_output = 0;
@@ -941,7 +797,6 @@ void StreamSession::InitHaptics()
 	sdeck_haptics_senderr = nullptr;
 	sdeck_haptics_senderl = nullptr;
 #endif
-	haptics_resampler_buf = nullptr;
 #ifdef Q_OS_LINUX
 	// Haptics work most reliably with Pipewire, so try to use that if available
 	SDL_SetHint("SDL_AUDIODRIVER", "pipewire");
@@ -962,17 +817,16 @@ void StreamSession::InitHaptics()
 			SDL_GetCurrentAudioDriver());
 	}
 #endif
-
-	SDL_AudioCVT cvt;
-	SDL_BuildAudioCVT(&cvt, AUDIO_S16LSB, 4, 3000, AUDIO_S16LSB, 4, 48000);
-	cvt.len = 240;  // 10 16bit stereo samples
-	haptics_resampler_buf = (uint8_t*) calloc(cvt.len * cvt.len_mult, sizeof(uint8_t));
 }
 
 void StreamSession::DisconnectHaptics()
 {
 	if (this->haptics_output > 0)
 	{
+		// ProcessHaptics() may be queueing to the device on the audio thread, so clear it there before closing
+		QMetaObject::invokeMethod(audio_processor, [this]() {
+			audio_processor->SetHapticsOutput(0);
+		}, Qt::BlockingQueuedConnection);
 		SDL_CloseAudioDevice(haptics_output);
 		this->haptics_output = 0;
 	}
@@ -1009,6 +863,7 @@ void StreamSession::ConnectHaptics()
 			continue;
 		}
 		SDL_PauseAudioDevice(haptics_output, 0);
+		audio_processor->SetHapticsOutput(haptics_output);
 		CHIAKI_LOGI(log.GetChiakiLog(), "Haptics Audio Device '%s' opened with %d channels @ %d Hz, buffer size %u (driver=%s)", device_name, have.channels, have.freq, have.size, SDL_GetCurrentAudioDriver());
 		return;
 	}
@@ -1020,124 +875,21 @@ void StreamSession::ConnectHaptics()
 void StreamSession::ConnectSdeckHaptics()
 {
 	haptics_sdeck++;
-	sdeck_last_haptic = chiaki_time_now_monotonic_ms();
 	const int num_channels = 2; // Left and right haptics
 	const uint32_t samples_per_packet = 120 * sizeof(uint8_t) / (2.0 * sizeof(int16_t));
-	sdeck_queue_segment = samples_per_packet * STEAMDECK_HAPTIC_PACKETS_PER_ANALYSIS;
-	if (sdeck_haptic_init(sdeck, sdeck_queue_segment) < 0)
+	const int analysis_samples = samples_per_packet * STEAMDECK_HAPTIC_PACKETS_PER_ANALYSIS;
+	if (sdeck_haptic_stream_start(sdeck, analysis_samples) < 0)
 	{
 		CHIAKI_LOGE(log.GetChiakiLog(), "Steam Deck Haptics Audio could not be connected :(");
 		return;
 	}
-	CHIAKI_LOGI(log.GetChiakiLog(), "Steam Deck Haptics Audio opened with %d channels @ %d Hz with %u samples per audio analysis.", num_channels, STEAMDECK_HAPTIC_SAMPLING_RATE, sdeck_queue_segment);
-	sdeck_hapticl = {};
-	sdeck_hapticl.reserve(20);
-	sdeck_hapticr = {};
-	sdeck_hapticr.reserve(20);
-	sdeck_skipl = false;
-	sdeck_skipr = false;
-	sdeck_haptics_senderl = (int16_t *) calloc(sdeck_queue_segment, sizeof(uint16_t));
-	sdeck_haptics_senderr = (int16_t *) calloc(sdeck_queue_segment, sizeof(uint16_t));
-
-	qRegisterMetaType<haptic_packet_t>();
-	connect(this, &StreamSession::SdeckHapticPushed, this, &StreamSession::SdeckQueueHaptics);
-	auto sdeck_haptic_interval = STEAMDECK_HAPTIC_PACKETS_PER_ANALYSIS * 10;
-	auto sdeck_haptic_timer = new QTimer(this);
-	connect(sdeck_haptic_timer, &QTimer::timeout, this, [this]{
-		haptic_packet_t haptic_packetl = {}, haptic_packetr = {};
-		bool changedl = false, changedr = false;
-		for(uint64_t i = 0; i < STEAMDECK_HAPTIC_PACKETS_PER_ANALYSIS; i++)
-		{
-			uint64_t current_tick = sdeck_last_haptic + i * 10; // 10ms packet
-			if(!sdeck_hapticl.isEmpty())
-			{
-				uint64_t next_timestamp = sdeck_hapticl.head().timestamp;
-				if(next_timestamp > (current_tick + 10))
-				{
-					memset(sdeck_haptics_senderl + 30 * i, 0, 30);
-					continue;
-				}
-				else
-				{
-					haptic_packetl = sdeck_hapticl.dequeue();
-					memcpy(sdeck_haptics_senderl + 30 * i, haptic_packetl.haptic_packet, 30);
-					changedl = true;
-				}
-			}
-			else
-				memset(sdeck_haptics_senderl + 30 * i, 0, 30);
-
-			if(!sdeck_hapticr.isEmpty())
-			{
-				uint64_t next_timestamp = sdeck_hapticr.head().timestamp;
-				if(next_timestamp > (current_tick + 10))
-				{
-					memset(sdeck_haptics_senderr + 30 * i, 0, 30);
-					continue;
-				}
-				else
-				{
-					haptic_packetr = sdeck_hapticr.dequeue();
-					memcpy(sdeck_haptics_senderr + 30 * i, haptic_packetr.haptic_packet, 30);
-					changedr = true;
-				}
-			}
-			else
-				memset(sdeck_haptics_senderr + 30 * i, 0, 30);
-		}
-
-		if(!changedl || sdeck_skipl)
-			sdeck_skipl = false;
-		else
-		{
-			int intervals = play_pcm_haptic(sdeck, TRACKPAD_LEFT, sdeck_haptics_senderl, sdeck_queue_segment, STEAMDECK_HAPTIC_SAMPLING_RATE);
-			if (intervals < 0)
-				CHIAKI_LOGE(log.GetChiakiLog(), "Failed to submit haptics audio to SteamDeck");
-			else if (intervals == 2)
-				sdeck_skipl = true;
-		}
-		if(!changedr || sdeck_skipr)
-			sdeck_skipr = false;
-		else
-		{
-			int intervals = play_pcm_haptic(sdeck, TRACKPAD_RIGHT, sdeck_haptics_senderr, sdeck_queue_segment, STEAMDECK_HAPTIC_SAMPLING_RATE);
-			if (intervals < 0)
-				CHIAKI_LOGE(log.GetChiakiLog(), "Failed to submit haptics audio to SteamDeck");
-			else if (intervals == 2)
-				sdeck_skipr = true;
-		}
-		sdeck_last_haptic = chiaki_time_now_monotonic_ms();
-	});
-	sdeck_haptic_timer->start(sdeck_haptic_interval);
-	return;
+	CHIAKI_LOGI(log.GetChiakiLog(), "Steam Deck Haptics Audio opened with %d channels @ %d Hz with %u samples per audio analysis.", num_channels, STEAMDECK_HAPTIC_SAMPLING_RATE, analysis_samples);
 }
 #endif
 
 void StreamSession::PushAudioFrame(int16_t *buf, size_t samples_count)
 {
-	if(!audio_io)
-		return;
-
-#if CHIAKI_GUI_ENABLE_SPEEX
-	// change samples to mono for processing with SPEEX
-	if(echo_resampler_buf && speech_processing_enabled && !muted)
-	{
-		SDL_AudioCVT cvt;
-		SDL_BuildAudioCVT(&cvt, AUDIO_S16LSB, 2, 48000, AUDIO_S16LSB, 1, 48000);
-		cvt.len = mic_buf.size_bytes * 2;
-		cvt.buf = echo_resampler_buf;
-		memcpy(echo_resampler_buf, buf, mic_buf.size_bytes * 2);
-		if(SDL_ConvertAudio(&cvt) != 0)
-		{
-			CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample echo audio: %s", SDL_GetError());
-			return;
-		}
-		if(echo_to_cancel.size() >= ECHO_QUEUE_MAX)
-			echo_to_cancel.dequeue();
-		echo_to_cancel.enqueue((int16_t *)echo_resampler_buf);
-	}
-#endif
-	audio_io->write((const char *)buf, static_cast<qint64>(samples_count * 2 * 2));
+	audio_processor->PushAudio(buf, samples_count);
 }
 
 void StreamSession::PushHapticsFrame(uint8_t *buf, size_t buf_size)
@@ -1150,59 +902,12 @@ void StreamSession::PushHapticsFrame(uint8_t *buf, size_t buf_size)
 			CHIAKI_LOGE(log.GetChiakiLog(), "Haptic audio of incompatible size: %u", buf_size);
 			return;
 		}
-		int16_t amplitudel = 0, amplituder = 0;
-		const size_t sample_size = 2 * sizeof(int16_t); // stereo samples
-		haptic_packet_t packetl = {0}, packetr = {0};
-		uint64_t timestamp = chiaki_time_now_monotonic_ms();
-		packetl.timestamp = timestamp;
-		packetr.timestamp = timestamp;
-		size_t buf_count = buf_size / sample_size;
-		for (size_t i = 0; i < buf_count; i++)
-		{
-			size_t cur = i * sample_size;
-			memcpy(&amplitudel, buf + cur, sizeof(int16_t));
-			packetl.haptic_packet[i] = amplitudel;
-			memcpy(&amplituder, buf + cur + sizeof(int16_t), sizeof(int16_t));
-			packetr.haptic_packet[i] = amplituder;
-		}
-		emit SdeckHapticPushed(packetl, packetr);
+		sdeck_haptic_stream_push(sdeck, buf, buf_size);
 		return;
 	}
 #endif
-	if(haptics_output == 0)
-		return;
-	SDL_AudioCVT cvt;
-	// Haptics samples are coming in at 3KHZ, but the DualSense expects 48KHZ
-	SDL_BuildAudioCVT(&cvt, AUDIO_S16LSB, 4, 3000, AUDIO_S16LSB, 4, 48000);
-	cvt.len = buf_size * 2;
-	cvt.buf = haptics_resampler_buf;
-	// Remix to 4 channels
-	for (int i=0; i < buf_size; i+=4)
-	{
-		SDL_memset(haptics_resampler_buf + i * 2, 0, 4);
-		SDL_memcpy(haptics_resampler_buf + (i * 2) + 4, buf + i, 4);
-	}
-	// Resample to 48kHZ
-	if (SDL_ConvertAudio(&cvt) != 0)
-	{
-		CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample haptics audio: %s", SDL_GetError());
-		return;
-	}
-
-	if (SDL_QueueAudio(haptics_output, cvt.buf, cvt.len_cvt) < 0)
-	{
-		CHIAKI_LOGE(log.GetChiakiLog(), "Failed to submit haptics audio to device: %s", SDL_GetError());
-		return;
-	}
-}
-
-#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
-void StreamSession::SdeckQueueHaptics(haptic_packet_t packetl, haptic_packet_t packetr)
-{
-	sdeck_hapticl.enqueue(packetl);
-	sdeck_hapticr.enqueue(packetr);
+	audio_processor->PushHaptics(buf, buf_size);
 }
-#endif
 
 void StreamSession::Event(ChiakiEvent *event)
 {
@@ -1269,7 +974,7 @@ void StreamSession::HandleSDeckEvent(SDeckEvent *event)
 				sdeck_state.orient_x = event->motion.orient_x;
 				sdeck_state.orient_y = event->motion.orient_y;
 				sdeck_state.orient_z = event->motion.orient_z;
-				SendFeedbackState();
+				sdeck_state_dirty = true;
 			}
 			else // swap y with z axis to use roll instead of yaw
 			{
@@ -1333,7 +1038,7 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 						else
 							it++;
 					}
-					SendFeedbackState();
+					setsu_state_dirty = true;
 					break;
 				case SETSU_DEVICE_TYPE_MOTION:
 					if(!setsu_motion_device || strcmp(setsu_device_get_path(setsu_motion_device), event->path))
@@ -1341,6 +1046,7 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 					CHIAKI_LOGI(GetChiakiLog(), "Setsu Motion Device %s disconnected", event->path);
 					setsu_motion_device = nullptr;
 					chiaki_orientation_tracker_init(&orient_tracker);
+					orient_tracker.bias_calibration = gyro_bias_calibration;
 					orient_dirty = true;
 					break;
 			}
@@ -1357,7 +1063,7 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 					break;
 				}
 			}
-			SendFeedbackState();
+			setsu_state_dirty = true;
 			break;
 		case SETSU_EVENT_TOUCH_POSITION: {
 			QPair<QString, SetsuTrackingId> k =  { setsu_device_get_path(event->dev), event->touch.tracking_id };
@@ -1372,14 +1078,16 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 			}
 			else
 				chiaki_controller_state_set_touch_pos(&setsu_state, it.value(), event->touch.x, event->touch.y);
-			SendFeedbackState();
+			setsu_state_dirty = true;
 			break;
 		}
 		case SETSU_EVENT_BUTTON_DOWN:
 			setsu_state.buttons |= CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
+			setsu_state_dirty = true;
 			break;
 		case SETSU_EVENT_BUTTON_UP:
 			setsu_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
+			setsu_state_dirty = true;
 			break;
 		case SETSU_EVENT_MOTION:
 			chiaki_orientation_tracker_update(&orient_tracker,
@@ -1390,6 +1098,79 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 			break;
 	}
 }
+
+/**
+ * Runs on the setsu input thread, blocking until one of the devices delivers new events.
+ * All setsu state except the published one is only touched by this thread.
+ */
+void *StreamSession::SetsuThreadFunc()
+{
+	while(!setsu_thread_stop)
+	{
+		setsu_poll(setsu, SessionSetsuCb, this);
+		if(orient_dirty)
+		{
+			chiaki_orientation_tracker_apply_to_controller_state(&orient_tracker, &setsu_state);
+			orient_dirty = false;
+			setsu_state_dirty = true;
+		}
+		if(setsu_state_dirty)
+		{
+			PublishInputState(&setsu_input_state, setsu_state);
+			setsu_state_dirty = false;
+		}
+		setsu_wait(setsu, -1);
+	}
+	return nullptr;
+}
+
+void StreamSession::StopSetsuThread()
+{
+	if(!setsu_thread_running)
+		return;
+	setsu_thread_stop = true;
+	setsu_wakeup(setsu);
+	chiaki_thread_join(&setsu_thread, nullptr);
+	setsu_thread_running = false;
+}
+#endif
+
+#if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
+/**
+ * Runs on the Steam Deck input thread, blocking in the hid read until the next report arrives.
+ */
+void *StreamSession::SDeckThreadFunc()
+{
+	while(!sdeck_thread_stop)
+	{
+		if(sdeck_read_wait(sdeck, SessionSDeckCb, this, STEAMDECK_INPUT_WAIT_MS) < 0)
+		{
+			CHIAKI_LOGE(GetChiakiLog(), "Failed to read from Steam Deck, stopping Steam Deck input");
+			break;
+		}
+		if(sdeck_orient_dirty)
+		{
+			chiaki_orientation_tracker_apply_to_controller_state(&sdeck_orient_tracker, &sdeck_state);
+			sdeck_orient_dirty = false;
+			sdeck_state_dirty = true;
+		}
+		if(sdeck_state_dirty)
+		{
+			PublishInputState(&sdeck_input_state, sdeck_state);
+			sdeck_state_dirty = false;
+		}
+	}
+	return nullptr;
+}
+
+void StreamSession::StopSDeckThread()
+{
+	if(!sdeck_thread_running)
+		return;
+	sdeck_thread_stop = true;
+	chiaki_thread_join(&sdeck_thread, nullptr);
+	sdeck_thread_running = false;
+}
 #endif
 
 void StreamSession::TriggerFfmpegFrameAvailable()
@@ -1415,9 +1196,11 @@ class StreamSessionPrivate
 		static void Event(StreamSession *session, ChiakiEvent *event)							{ session->Event(event); }
 #if CHIAKI_GUI_ENABLE_SETSU
 		static void HandleSetsuEvent(StreamSession *session, SetsuEvent *event)					{ session->HandleSetsuEvent(event); }
+		static void *SetsuThreadFunc(StreamSession *session)									{ return session->SetsuThreadFunc(); }
 #endif
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 		static void HandleSDeckEvent(StreamSession *session, SDeckEvent *event)					{ session->HandleSDeckEvent(event); }
+		static void *SDeckThreadFunc(StreamSession *session)									{ return session->SDeckThreadFunc(); }
 #endif
 		static void TriggerFfmpegFrameAvailable(StreamSession *session)							{ session->TriggerFfmpegFrameAvailable(); }
 };
@@ -1452,6 +1235,12 @@ static void SessionSetsuCb(SetsuEvent *event, void *user)
 	auto session = reinterpret_cast<StreamSession *>(user);
 	StreamSessionPrivate::HandleSetsuEvent(session, event);
 }
+
+static void *SessionSetsuThreadFunc(void *user)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	return StreamSessionPrivate::SetsuThreadFunc(session);
+}
 #endif
 
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
@@ -1460,6 +1249,12 @@ static void SessionSDeckCb(SDeckEvent *event, void *user)
 	auto session = reinterpret_cast<StreamSession *>(user);
 	StreamSessionPrivate::HandleSDeckEvent(session, event);
 }
+
+static void *SessionSDeckThreadFunc(void *user)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	return StreamSessionPrivate::SDeckThreadFunc(session);
+}
 #endif
 
 static void FfmpegFrameCb(ChiakiFfmpegDecoder *decoder, void *user)
@@ -72,7 +72,8 @@ void StreamWindow::Init()
 		else
 		{
 #if CHIAKI_GUI_ENABLE_PLACEBO
-			auto widget = new AVPlaceboWidget(session, resolution_mode, connect_info.settings->GetPlaceboPreset());
+			auto widget = new AVPlaceboWidget(session, resolution_mode, connect_info.settings->GetPlaceboPreset(),
+					connect_info.settings->GetPlaceboPacing(), connect_info.video_profile.max_fps);
 			widget->installEventFilter(this);
 			widget->HideMouse();
 			auto container_widget = QWidget::createWindowContainer(widget);
@@ -9,6 +9,7 @@
 #include "takion.h"
 #include "thread.h"
 #include "session.h"
+#include "fec.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,10 +23,14 @@ typedef struct chiaki_audio_sender_t
 	bool ps5;
 	ChiakiTakion *takion;
 	uint16_t buf_size_per_unit;
-	uint16_t buf_stride_per_unit;
-	uint8_t *frame_buf;
-	size_t frame_buf_size;
-	uint8_t *filled_packet_buf;
+	ChiakiFecEncoder fec;
+	/**
+	 * Complete packet including header, pre-filled in init.
+	 * Per frame, only the indices are updated and the payload is written and FEC encoded in place.
+	 */
+	uint8_t *packet_buf;
+	size_t packet_header_size;
+	size_t packet_size;
 	ChiakiSeqNum16 frame_index;
 } ChiakiAudioSender;
 
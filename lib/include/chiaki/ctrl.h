@@ -18,7 +18,10 @@
 extern "C" {
 #endif
 
-typedef struct chiaki_ctrl_message_queue_t ChiakiCtrlMessageQueue;
+/**
+ * Capacity for messages queued by other threads until the ctrl thread sends them
+ */
+#define CHIAKI_CTRL_SEND_QUEUE_SIZE 0x2000
 
 typedef struct chiaki_ctrl_t
 {
@@ -29,10 +32,16 @@ typedef struct chiaki_ctrl_t
 	bool login_pin_entered;
 	uint8_t *login_pin;
 	size_t login_pin_size;
-	ChiakiCtrlMessageQueue *msg_queue;
 	ChiakiStopPipe notif_pipe;
 	ChiakiMutex notif_mutex;
 
+	/**
+	 * Complete messages (header and plaintext payload) back to back, protected by notif_mutex.
+	 * The ctrl thread encrypts them in place and sends the whole queue at once.
+	 */
+	uint8_t send_queue[CHIAKI_CTRL_SEND_QUEUE_SIZE];
+	size_t send_queue_size;
+
 	bool login_pin_requested;
 
 	chiaki_socket_t sock;
@@ -42,7 +51,8 @@ typedef struct chiaki_ctrl_t
 #endif
 	uint8_t recv_buf[512];
 
-	size_t recv_buf_size;
+	size_t recv_buf_offset; // start of the data that has not been processed yet
+	size_t recv_buf_size; // end of the received data
 	uint64_t crypt_counter_local;
 	uint64_t crypt_counter_remote;
 	uint32_t keyboard_text_counter;
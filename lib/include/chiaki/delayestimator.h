@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_DELAYESTIMATOR_H
+#define CHIAKI_DELAYESTIMATOR_H
+
+#include "common.h"
+#include "thread.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of frames the delay trend is fitted over
+ */
+#define CHIAKI_DELAY_ESTIMATOR_WINDOW 20
+
+/**
+ * Frames arriving further apart than this start a new measurement instead of counting as delay
+ */
+#define CHIAKI_DELAY_ESTIMATOR_GAP_MAX_US 1000000
+
+typedef struct chiaki_delay_estimate_t
+{
+	uint64_t frames; // frames that contributed to the estimate
+	bool kernel_timestamps; // whether the last frame was measured with kernel receive timestamps
+	double frame_spread_ms; // smoothed time from the first to the last received unit of a frame
+	double frame_interval_ms; // smoothed time between the first units of consecutive frames
+	double gradient_ms; // smoothed change of the one-way delay per frame
+	double queue_delay_ms; // one-way delay above the lowest one seen, i.e. what is currently queued on the way
+	/**
+	 * Slope of the smoothed one-way delay over the last CHIAKI_DELAY_ESTIMATOR_WINDOW frames in ms per ms.
+	 * Positive if queues on the way are growing, i.e. more is sent than the network can carry.
+	 */
+	double trend;
+} ChiakiDelayEstimate;
+
+/**
+ * Estimates how the one-way delay of the video stream develops, from the arrival times of its units.
+ *
+ * There are no send timestamps in the stream, so the console is assumed to send frames at the nominal
+ * frame rate and any deviation of the arrival of consecutive frames from that counts as a change in delay.
+ * Encoder pacing and clock drift add some noise, which the smoothing and the trend fit are meant to absorb.
+ *
+ * Packets are pushed from a single thread, the estimate may be queried from any thread.
+ */
+typedef struct chiaki_delay_estimator_t
+{
+	uint64_t frame_interval_us;
+
+	// frame currently being received
+	bool frame_active;
+	ChiakiSeqNum16 frame_index;
+	uint64_t frame_first_us;
+	uint64_t frame_last_us;
+	bool frame_kernel_timestamps;
+
+	// last finished frame
+	bool prev_valid;
+	ChiakiSeqNum16 prev_frame_index;
+	uint64_t prev_first_us;
+	uint64_t base_us; // origin of the trend window's time axis
+
+	double delay_ms; // accumulated delay changes, relative to an unknown base
+	double delay_min_ms;
+	double delay_smoothed_ms;
+	double window_time_ms[CHIAKI_DELAY_ESTIMATOR_WINDOW];
+	double window_delay_ms[CHIAKI_DELAY_ESTIMATOR_WINDOW];
+	size_t window_pos;
+	size_t window_count;
+
+	ChiakiMutex estimate_mutex; // protects estimate
+	ChiakiDelayEstimate estimate;
+} ChiakiDelayEstimator;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_delay_estimator_init(ChiakiDelayEstimator *estimator);
+CHIAKI_EXPORT void chiaki_delay_estimator_fini(ChiakiDelayEstimator *estimator);
+
+/**
+ * Forget everything measured so far, e.g. for a new stream.
+ * Must not be called concurrently to chiaki_delay_estimator_push_packet().
+ *
+ * @param fps nominal frame rate of the stream, 0 if unknown
+ */
+CHIAKI_EXPORT void chiaki_delay_estimator_reset(ChiakiDelayEstimator *estimator, unsigned int fps);
+
+/**
+ * @param timestamp_us arrival time of the unit, preferably from the kernel, see ChiakiTakionAVPacket
+ */
+CHIAKI_EXPORT void chiaki_delay_estimator_push_packet(ChiakiDelayEstimator *estimator, ChiakiSeqNum16 frame_index,
+		uint64_t timestamp_us, bool kernel_timestamp);
+
+/**
+ * Get the estimate as of the last completed frame.
+ */
+CHIAKI_EXPORT void chiaki_delay_estimator_get(ChiakiDelayEstimator *estimator, ChiakiDelayEstimate *estimate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_DELAYESTIMATOR_H
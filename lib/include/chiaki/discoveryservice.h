@@ -10,17 +10,41 @@
 extern "C" {
 #endif
 
+typedef enum
+{
+	CHIAKI_DISCOVERY_SERVICE_HOST_ADDED,
+	CHIAKI_DISCOVERY_SERVICE_HOST_CHANGED,
+	CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED
+} ChiakiDiscoveryServiceHostEvent;
+
+/**
+ * Called with the whole host table after every change.
+ */
 typedef void (*ChiakiDiscoveryServiceCb)(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user);
 
+/**
+ * Called once for every host that was added, changed or removed.
+ * host and its strings are only valid during the call.
+ */
+typedef void (*ChiakiDiscoveryServiceHostCb)(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user);
+
 typedef struct chiaki_discovery_service_options_t
 {
 	size_t hosts_max;
 	uint64_t host_drop_pings;
 	uint64_t ping_ms;
+	/**
+	 * If greater than ping_ms, the ping interval doubles after every ping that did not change any host, up to this value.
+	 * Any change, chiaki_discovery_service_refresh(), address changes and the link of the interface
+	 * the pings are routed through going up or down reset it to ping_ms.
+	 */
+	uint64_t ping_ms_max;
 	struct sockaddr *send_addr;
 	size_t send_addr_size;
-	ChiakiDiscoveryServiceCb cb;
+	ChiakiDiscoveryServiceCb cb; // may be NULL
 	void *cb_user;
+	ChiakiDiscoveryServiceHostCb host_cb; // may be NULL
+	void *host_cb_user;
 } ChiakiDiscoveryServiceOptions;
 
 typedef struct chiaki_discovery_service_host_discovery_info_t
@@ -35,18 +59,44 @@ typedef struct chiaki_discovery_service_t
 	ChiakiDiscovery discovery;
 
 	uint64_t ping_index;
+	uint64_t ping_interval_ms;
+	bool hosts_changed; // since the last ping
 	ChiakiDiscoveryHost *hosts;
 	ChiakiDiscoveryServiceHostDiscoveryInfo *host_discovery_infos;
 	size_t hosts_count;
+
+	/**
+	 * Open addressing index by host_id into hosts. Values are index + 1, 0 marks an empty slot.
+	 */
+	size_t *host_table;
+	size_t host_table_size; // power of two, at least twice hosts_max
+
+	/**
+	 * protects everything above and should_stop, refresh
+	 */
 	ChiakiMutex state_mutex;
 
 	ChiakiThread thread;
-	ChiakiBoolPredCond stop_cond;
+	ChiakiStopPipe wakeup_pipe;
+	bool should_stop;
+	bool refresh;
+	chiaki_socket_t netif_sock; // notifies about network interface changes, invalid if unsupported on this platform
+
+	// only accessed by the thread
+	uint32_t netif_seq; // of the last request on netif_sock
+	int netif_index; // interface the pings are routed through, 0 if unknown
+	unsigned int netif_link_flags; // IFF_RUNNING and IFF_LOWER_UP of netif_index
+	bool netif_link_flags_valid;
 } ChiakiDiscoveryService;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service);
 
+/**
+ * Ping immediately and reset the ping interval, e.g. when the frontend learned about a network change by itself.
+ */
+CHIAKI_EXPORT void chiaki_discovery_service_refresh(ChiakiDiscoveryService *service);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,31 @@ extern "C" {
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
 
+/**
+ * Encoder for repeatedly encoding frames with the same k and m.
+ * The coding matrix and pointer tables are created once in init, so encoding itself does not allocate.
+ * Not thread-safe, use one encoder per thread.
+ */
+typedef struct chiaki_fec_encoder_t
+{
+	unsigned int k;
+	unsigned int m;
+	int *matrix;
+	uint8_t **data_ptrs;
+	uint8_t **coding_ptrs;
+} ChiakiFecEncoder;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encoder_init(ChiakiFecEncoder *encoder, unsigned int k, unsigned int m);
+CHIAKI_EXPORT void chiaki_fec_encoder_fini(ChiakiFecEncoder *encoder);
+
+/**
+ * Encode in place.
+ *
+ * @param frame_buf k source units followed by space for m coding units, all of them unit_size bytes and contiguous.
+ * The coding units are written directly behind the source units.
+ */
+CHIAKI_EXPORT void chiaki_fec_encoder_encode(ChiakiFecEncoder *encoder, uint8_t *frame_buf, size_t unit_size);
+
 #ifdef __cplusplus
 }
 #endif
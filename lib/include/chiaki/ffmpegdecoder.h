@@ -4,6 +4,7 @@
 #include <chiaki/config.h>
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/framebuffer.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,6 +16,62 @@ typedef struct chiaki_ffmpeg_decoder_t ChiakiFfmpegDecoder;
 
 typedef void (*ChiakiFfmpegFrameAvailable)(ChiakiFfmpegDecoder *decover, void *user);
 
+typedef enum chiaki_ffmpeg_decoder_threading_t
+{
+	/**
+	 * Slice threading for software decoding, nothing for hardware decoding
+	 */
+	CHIAKI_FFMPEG_DECODER_THREADING_AUTO,
+
+	/**
+	 * No added latency, but only helps if the stream has multiple slices per frame
+	 */
+	CHIAKI_FFMPEG_DECODER_THREADING_SLICE,
+
+	/**
+	 * Scales with any stream, but adds one frame of latency per thread.
+	 * Does not work together with low_delay, which is ignored then.
+	 */
+	CHIAKI_FFMPEG_DECODER_THREADING_FRAME,
+
+	CHIAKI_FFMPEG_DECODER_THREADING_NONE
+} ChiakiFfmpegDecoderThreading;
+
+typedef struct chiaki_ffmpeg_decoder_config_t
+{
+	ChiakiFfmpegDecoderThreading threading;
+	int thread_count; // 0 to let ffmpeg decide based on the cpu count
+	bool low_delay; // AV_CODEC_FLAG_LOW_DELAY
+	bool fast; // AV_CODEC_FLAG2_FAST, allows non spec compliant speedups
+
+	/**
+	 * Time that decoding a single frame may take, usually 1/fps. If decoding takes longer on average,
+	 * the loop filter is skipped for more and more frames until it keeps up again.
+	 * 0 to disable this degradation. Only applies to software decoding.
+	 */
+	uint64_t frame_budget_us;
+} ChiakiFfmpegDecoderConfig;
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_config_init(ChiakiFfmpegDecoderConfig *config);
+
+typedef enum chiaki_ffmpeg_decoder_degradation_t
+{
+	CHIAKI_FFMPEG_DECODER_DEGRADATION_NONE,
+	CHIAKI_FFMPEG_DECODER_DEGRADATION_SKIP_LOOP_FILTER_NONREF,
+	CHIAKI_FFMPEG_DECODER_DEGRADATION_SKIP_LOOP_FILTER_ALL,
+	CHIAKI_FFMPEG_DECODER_DEGRADATION_MAX = CHIAKI_FFMPEG_DECODER_DEGRADATION_SKIP_LOOP_FILTER_ALL
+} ChiakiFfmpegDecoderDegradation;
+
+typedef struct chiaki_ffmpeg_decoder_stats_t
+{
+	uint64_t frames_decoded;
+	uint64_t frames_dropped; // decoded, but replaced by a newer frame before being pulled
+	uint64_t decode_time_last_us;
+	uint64_t decode_time_avg_us; // exponential moving average
+	uint64_t decode_time_max_us;
+	ChiakiFfmpegDecoderDegradation degradation;
+} ChiakiFfmpegDecoderStats;
+
 struct chiaki_ffmpeg_decoder_t
 {
 	ChiakiLog *log;
@@ -28,15 +85,41 @@ struct chiaki_ffmpeg_decoder_t
 	ChiakiFfmpegFrameAvailable frame_available_cb;
 	void *frame_available_cb_user;
 	int32_t frames_lost;
+
+	/**
+	 * Frame taken out of the codec to make room for a new packet, returned by the next pull
+	 */
+	AVFrame *pending_frame;
+
+	uint64_t frame_budget_us;
+	uint64_t degradation_frames; // frames since the last change of stats.degradation
+	ChiakiFfmpegDecoderStats stats;
 };
 
+/**
+ * Same as chiaki_ffmpeg_decoder_init_ex() with the config from chiaki_ffmpeg_decoder_config_init().
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
+
+/**
+ * @param config may be NULL for the defaults
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init_ex(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
+		ChiakiCodec codec, const char *hw_decoder_name, const ChiakiFfmpegDecoderConfig *config,
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, void *user);
+
+/**
+ * Same as chiaki_ffmpeg_decoder_video_sample_cb(), but lets ffmpeg hold a reference to the frame instead of copying it.
+ * Use with chiaki_session_set_video_frame_cb().
+ */
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_frame_cb(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user);
 CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, bool hw_download);
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder);
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats);
 
 #ifdef __cplusplus
 }
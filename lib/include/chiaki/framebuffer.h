@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_FRAMEBUFFER_H
+#define CHIAKI_FRAMEBUFFER_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Free buffers a ChiakiFrameBufferPool keeps for reuse, any beyond that are freed when released
+ */
+#define CHIAKI_FRAME_BUFFER_POOL_SIZE 8
+
+/**
+ * Reference-counted buffer holding one compressed video frame.
+ * The data is always followed by at least CHIAKI_VIDEO_BUFFER_PADDING_SIZE allocated bytes.
+ *
+ * References may be taken and released from any thread.
+ * The contents must not be modified anymore as soon as more than one reference exists.
+ */
+typedef struct chiaki_frame_buffer_t ChiakiFrameBuffer;
+
+/**
+ * Recycles ChiakiFrameBuffers, so frames can be passed around by reference without allocating for every frame.
+ */
+typedef struct chiaki_frame_buffer_pool_t ChiakiFrameBufferPool;
+
+CHIAKI_EXPORT ChiakiFrameBufferPool *chiaki_frame_buffer_pool_new(void);
+
+/**
+ * Release the pool. Buffers that are still referenced stay valid, the pool is only freed together with the last of them.
+ */
+CHIAKI_EXPORT void chiaki_frame_buffer_pool_free(ChiakiFrameBufferPool *pool);
+
+/**
+ * Get a buffer from the pool or allocate a new one.
+ *
+ * @param capacity minimum size of the buffer, not including the padding
+ * @return buffer with a single reference, size 0 and undefined contents, or NULL on allocation failure
+ */
+CHIAKI_EXPORT ChiakiFrameBuffer *chiaki_frame_buffer_pool_get(ChiakiFrameBufferPool *pool, size_t capacity);
+
+/**
+ * Allocate a buffer that does not belong to any pool and copy data into it.
+ *
+ * @return buffer with a single reference or NULL on allocation failure
+ */
+CHIAKI_EXPORT ChiakiFrameBuffer *chiaki_frame_buffer_new_copy(const uint8_t *data, size_t size);
+
+CHIAKI_EXPORT ChiakiFrameBuffer *chiaki_frame_buffer_ref(ChiakiFrameBuffer *buffer);
+
+/**
+ * Release a reference. The last one returns the buffer to its pool.
+ * @param buffer may be NULL
+ */
+CHIAKI_EXPORT void chiaki_frame_buffer_unref(ChiakiFrameBuffer *buffer);
+
+/**
+ * @return whether anyone but the caller holds a reference, i.e. the contents must not be modified
+ */
+CHIAKI_EXPORT bool chiaki_frame_buffer_is_shared(ChiakiFrameBuffer *buffer);
+
+CHIAKI_EXPORT uint8_t *chiaki_frame_buffer_data(ChiakiFrameBuffer *buffer);
+CHIAKI_EXPORT size_t chiaki_frame_buffer_size(ChiakiFrameBuffer *buffer);
+
+/**
+ * @return allocated size, not including the padding
+ */
+CHIAKI_EXPORT size_t chiaki_frame_buffer_capacity(ChiakiFrameBuffer *buffer);
+
+/**
+ * Set the size of the valid data and zero the padding after it.
+ * Only allowed while the buffer is not shared.
+ *
+ * @param size must be <= chiaki_frame_buffer_capacity()
+ */
+CHIAKI_EXPORT void chiaki_frame_buffer_set_size(ChiakiFrameBuffer *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_FRAMEBUFFER_H
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "takion.h"
 #include "packetstats.h"
+#include "framebuffer.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -30,6 +31,8 @@ typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
+	ChiakiFrameBufferPool *frame_buffer_pool;
+	ChiakiFrameBuffer *frame_buffer; // buffer of the current frame, frame_buf points into it
 	uint8_t *frame_buf;
 	size_t frame_buf_size;
 	size_t buf_size_per_unit;
@@ -64,6 +67,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
+/**
+ * Same as chiaki_frame_processor_flush(), but hand out the frame as a reference that stays valid
+ * for as long as it is held. The next frame will be assembled in a different buffer then.
+ *
+ * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a new reference
+ * that must be released with chiaki_frame_buffer_unref()
+ */
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_ref(ChiakiFrameProcessor *frame_processor, ChiakiFrameBuffer **frame);
+
 static inline bool chiaki_frame_processor_flush_possible(ChiakiFrameProcessor *frame_processor)
 {
 	return frame_processor->units_source_received + frame_processor->units_fec_received
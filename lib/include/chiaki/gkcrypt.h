@@ -47,6 +47,14 @@ typedef struct chiaki_gkcrypt_t {
 	ChiakiLog *log;
 } ChiakiGKCrypt;
 
+typedef struct chiaki_gkcrypt_gmac_job_t
+{
+	uint64_t key_pos;
+	const uint8_t *buf;
+	size_t buf_size;
+	uint8_t *gmac_out; // CHIAKI_GKCRYPT_GMAC_SIZE bytes
+} ChiakiGKCryptGMacJob;
+
 struct chiaki_session_t;
 
 /**
@@ -64,6 +72,14 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
+/**
+ * Same as calling chiaki_gkcrypt_gmac() for every job, but with a single cipher context
+ * and the GMAC key only derived and set up once for all jobs in the same key period.
+ *
+ * @param jobs will be sorted by key_pos
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_batch(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGMacJob *jobs, size_t jobs_count);
+
 static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	ChiakiGKCrypt *gkcrypt = CHIAKI_NEW(ChiakiGKCrypt);
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_HOSTCACHE_H
+#define CHIAKI_HOSTCACHE_H
+
+#include "common.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Version of the on-disk format. Files with a different version are discarded as a whole.
+ */
+#define CHIAKI_HOST_CACHE_VERSION 1
+
+#define CHIAKI_HOST_CACHE_HOST_ID_SIZE 0x40
+#define CHIAKI_HOST_CACHE_ENTRIES_MAX 64
+
+/**
+ * Values learned from a host during a successful session, to be reused by the next session with the same host.
+ */
+typedef struct chiaki_host_cache_entry_t
+{
+	char host_id[CHIAKI_HOST_CACHE_HOST_ID_SIZE]; // null terminated, must not contain whitespace
+	ChiakiTarget target; // RP-Version accepted by the host
+	uint32_t mtu_in;
+	uint32_t mtu_out;
+	uint64_t rtt_us;
+	uint64_t network_time; // unix time in s when mtu and rtt were measured
+	uint64_t time; // unix time in s when the entry was written
+} ChiakiHostCacheEntry;
+
+/**
+ * Look up the entry for host_id in the cache file at path.
+ * A missing or unreadable file, a file of a different version and corrupt entries all count as a miss.
+ *
+ * @return true if a valid entry was found and written to entry
+ */
+CHIAKI_EXPORT bool chiaki_host_cache_get(const char *path, const char *host_id, ChiakiHostCacheEntry *entry, ChiakiLog *log);
+
+/**
+ * Insert or replace the entry for entry->host_id in the cache file at path.
+ * If the cache is full, the least recently written entry is dropped.
+ * The file is replaced atomically where the platform allows it.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_host_cache_put(const char *path, const ChiakiHostCacheEntry *entry, ChiakiLog *log);
+
+/**
+ * Remove the entry for host_id from the cache file at path, e.g. because the host rejected a cached value.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_host_cache_invalidate(const char *path, const char *host_id, ChiakiLog *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_HOSTCACHE_H
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 
 #include "common.h"
+#include "thread.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,6 +65,39 @@ CHIAKI_EXPORT void chiaki_log_sniffer_fini(ChiakiLogSniffer *sniffer);
 static inline ChiakiLog *chiaki_log_sniffer_get_log(ChiakiLogSniffer *sniffer) { return &sniffer->sniff_log; }
 static inline const char *chiaki_log_sniffer_get_buffer(ChiakiLogSniffer *sniffer) { return sniffer->buf; }
 
+/**
+ * Decouples logging threads from the forward log's callback.
+ *
+ * Messages logged into the async log are put into a lock-free ring and passed to forward_log
+ * by a separate drain thread, so logging never blocks on I/O or other locks held by the callback.
+ * Hexdumps are copied raw and only formatted on the drain thread. Messages from the same call site of
+ * chiaki_log() exceeding CHIAKI_LOG_ASYNC_RATE_BURST per CHIAKI_LOG_ASYNC_RATE_WINDOW_MS are suppressed
+ * and counted instead, as are messages that find the ring full. Wrappers that forward all their messages
+ * through a single chiaki_log() call are throttled as one source, and all hexdumps share one limit.
+ */
+typedef struct chiaki_log_async_t
+{
+	ChiakiLog *forward_log; // The original log, where everything is forwarded from the drain thread
+	ChiakiLog async_log; // The log where others will log into
+	struct chiaki_log_async_queue_t *queue;
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop; // protected by mutex
+} ChiakiLogAsync;
+
+#define CHIAKI_LOG_ASYNC_RATE_WINDOW_MS 1000
+#define CHIAKI_LOG_ASYNC_RATE_BURST 20
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_async_init(ChiakiLogAsync *async, ChiakiLog *forward_log);
+
+/**
+ * Forwards everything that is still queued, then stops the drain thread.
+ * No other thread may log into the async log anymore when this is called.
+ */
+CHIAKI_EXPORT void chiaki_log_async_fini(ChiakiLogAsync *async);
+static inline ChiakiLog *chiaki_log_async_get_log(ChiakiLogAsync *async) { return &async->async_log; }
+
 #ifdef __cplusplus
 }
 #endif
@@ -24,8 +24,29 @@ CHIAKI_EXPORT void chiaki_orientation_init(ChiakiOrientation *orient);
 CHIAKI_EXPORT void chiaki_orientation_update(ChiakiOrientation *orient,
 		float gx, float gy, float gz, float ax, float ay, float az, float beta, float time_step_sec);
 
+/**
+ * Alternative to chiaki_orientation_update() using Mahony's complementary filter,
+ * which corrects with a PI controller instead of a gradient descent step.
+ *
+ * @param integral integral error term, 3 floats that must be kept across calls and start out as 0
+ */
+CHIAKI_EXPORT void chiaki_orientation_update_mahony(ChiakiOrientation *orient, float *integral,
+		float gx, float gy, float gz, float ax, float ay, float az, float kp, float ki, float time_step_sec);
+
+typedef enum chiaki_orientation_filter_t
+{
+	CHIAKI_ORIENTATION_FILTER_MADGWICK,
+	CHIAKI_ORIENTATION_FILTER_MAHONY
+} ChiakiOrientationFilter;
+
 /**
  * Extension of ChiakiOrientation, also tracking an absolute timestamp and the current gyro/accel state
+ *
+ * Every sample should be passed to chiaki_orientation_tracker_update() with the timestamp the device reported it with,
+ * the time step of each integration is derived from those.
+ * If bias_calibration is set, the gyro bias is estimated from every second the device is lying still
+ * and subtracted from all following samples. It is off by default because a device turning very slowly
+ * and steadily can be mistaken for one at rest.
  */
 typedef struct chiaki_orientation_tracker_t
 {
@@ -34,9 +55,22 @@ typedef struct chiaki_orientation_tracker_t
 	ChiakiOrientation orient;
 	uint32_t timestamp;
 	uint64_t sample_index;
+
+	ChiakiOrientationFilter filter;
+	float mahony_integral[3];
+
+	bool bias_calibration;
+	bool gyro_bias_valid;
+	float gyro_bias_x, gyro_bias_y, gyro_bias_z;
+	float rest_accel_x, rest_accel_y, rest_accel_z;
+	float rest_gyro_sum_x, rest_gyro_sum_y, rest_gyro_sum_z;
+	float rest_gyro_sq_sum;
+	uint64_t rest_samples;
+	uint64_t rest_time_us;
 } ChiakiOrientationTracker;
 
 CHIAKI_EXPORT void chiaki_orientation_tracker_init(ChiakiOrientationTracker *tracker);
+CHIAKI_EXPORT void chiaki_orientation_tracker_set_filter(ChiakiOrientationTracker *tracker, ChiakiOrientationFilter filter);
 CHIAKI_EXPORT void chiaki_orientation_tracker_update(ChiakiOrientationTracker *tracker,
 		float gx, float gy, float gz, float ax, float ay, float az, uint32_t timestamp_us);
 CHIAKI_EXPORT void chiaki_orientation_tracker_apply_to_controller_state(ChiakiOrientationTracker *tracker,
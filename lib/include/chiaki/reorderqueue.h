@@ -110,7 +110,7 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_pull(ChiakiReorderQueue *queue, uint64_t
  * Peek the element at a specific index inside the queue.
  *
  * @param index Offset to be added to the begin sequence number, this is NOT a sequence number itself! (0 <= index < count)
- * @param seq_num pointer where the sequence number of the peeked packet is written, undefined contents if false is returned
+ * @param seq_num pointer where the sequence number of the peeked packet is written, undefined contents if false is returned, may be NULL
  * @param user pointer where the user pointer of the pulled packet is written, undefined contents if false is returned
  * @return true if an element was peeked, false if there is no element at index.
  */
@@ -123,6 +123,243 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t
  */
 CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t index);
 
+/**
+ * Define a reorder queue specialized for a sequence number width and element type, with the same semantics
+ * as ChiakiReorderQueue. All functions are static inline and compare sequence numbers directly instead of
+ * through function pointers. Which slots are set is kept in a bitmap instead of next to every element.
+ *
+ * Generates the type name, the drop callback type name##DropCb and the functions prefix##_init(), prefix##_fini(),
+ * prefix##_set_drop_strategy(), prefix##_set_drop_cb(), prefix##_size(), prefix##_count(), prefix##_push(),
+ * prefix##_pull(), prefix##_pull_bulk(), prefix##_peek() and prefix##_drop().
+ *
+ * Invariant: only the bits of elements between begin and begin + count are set.
+ *
+ * @param bits 16 or 32, see ChiakiSeqNum16 and ChiakiSeqNum32
+ */
+#define CHIAKI_DEFINE_REORDER_QUEUE(name, prefix, bits, elem_type) \
+\
+typedef void (*name##DropCb)(ChiakiSeqNum##bits seq_num, elem_type elem, void *cb_user); \
+\
+typedef struct \
+{ \
+	size_t size_exp; \
+	size_t mask; \
+	elem_type *elems; \
+	uint64_t *set_bits; \
+	ChiakiSeqNum##bits begin; \
+	size_t count; \
+	ChiakiReorderQueueDropStrategy drop_strategy; \
+	name##DropCb drop_cb; \
+	void *drop_cb_user; \
+} name; \
+\
+static inline bool prefix##_is_set(name *queue, size_t i)	{ return (queue->set_bits[i >> 6] >> (i & 63)) & 1; } \
+static inline void prefix##_set(name *queue, size_t i)	{ queue->set_bits[i >> 6] |= (uint64_t)1 << (i & 63); } \
+static inline void prefix##_clear(name *queue, size_t i)	{ queue->set_bits[i >> 6] &= ~((uint64_t)1 << (i & 63)); } \
+\
+/** \
+ * @param size_exp exponent for 2 \
+ * @param seq_num_start sequence number of the first expected element \
+ */ \
+static inline ChiakiErrorCode prefix##_init(name *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
+{ \
+	size_t size = (size_t)1 << size_exp; \
+	queue->size_exp = size_exp; \
+	queue->mask = size - 1; \
+	queue->begin = seq_num_start; \
+	queue->count = 0; \
+	queue->drop_strategy = CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END; \
+	queue->drop_cb = NULL; \
+	queue->drop_cb_user = NULL; \
+	queue->elems = (elem_type *)calloc(size, sizeof(elem_type)); \
+	if(!queue->elems) \
+		return CHIAKI_ERR_MEMORY; \
+	queue->set_bits = (uint64_t *)calloc((size + 63) / 64, sizeof(uint64_t)); \
+	if(!queue->set_bits) \
+	{ \
+		free(queue->elems); \
+		return CHIAKI_ERR_MEMORY; \
+	} \
+	return CHIAKI_ERR_SUCCESS; \
+} \
+\
+static inline void prefix##_fini(name *queue) \
+{ \
+	if(queue->drop_cb) \
+	{ \
+		for(size_t i=0; i<queue->count; i++) \
+		{ \
+			ChiakiSeqNum##bits seq_num = (ChiakiSeqNum##bits)(queue->begin + i); \
+			if(prefix##_is_set(queue, seq_num & queue->mask)) \
+				queue->drop_cb(seq_num, queue->elems[seq_num & queue->mask], queue->drop_cb_user); \
+		} \
+	} \
+	free(queue->set_bits); \
+	free(queue->elems); \
+} \
+\
+static inline void prefix##_set_drop_strategy(name *queue, ChiakiReorderQueueDropStrategy drop_strategy) \
+{ \
+	queue->drop_strategy = drop_strategy; \
+} \
+\
+static inline void prefix##_set_drop_cb(name *queue, name##DropCb cb, void *user) \
+{ \
+	queue->drop_cb = cb; \
+	queue->drop_cb_user = user; \
+} \
+\
+static inline size_t prefix##_size(name *queue)	{ return queue->mask + 1; } \
+static inline size_t prefix##_count(name *queue)	{ return queue->count; } \
+\
+/** \
+ * Same as chiaki_reorder_queue_push() \
+ */ \
+static inline void prefix##_push(name *queue, ChiakiSeqNum##bits seq_num, elem_type elem) \
+{ \
+	size_t size = queue->mask + 1; \
+	size_t offset = (ChiakiSeqNum##bits)(seq_num - queue->begin); \
+	if(offset < queue->count) \
+	{ \
+		if(prefix##_is_set(queue, seq_num & queue->mask)) /* received twice */ \
+			goto drop_it; \
+		queue->elems[seq_num & queue->mask] = elem; \
+		prefix##_set(queue, seq_num & queue->mask); \
+		return; \
+	} \
+\
+	if(chiaki_seq_num_##bits##_lt(seq_num, queue->begin)) \
+		goto drop_it; \
+\
+	if(offset >= size) \
+	{ \
+		if(queue->drop_strategy == CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END) \
+			goto drop_it; \
+\
+		/* drop first until empty or enough space */ \
+		while(queue->count > 0 && offset >= size) \
+		{ \
+			size_t i = queue->begin & queue->mask; \
+			if(prefix##_is_set(queue, i)) \
+			{ \
+				prefix##_clear(queue, i); \
+				if(queue->drop_cb) \
+					queue->drop_cb(queue->begin, queue->elems[i], queue->drop_cb_user); \
+			} \
+			queue->begin++; \
+			queue->count--; \
+			offset--; \
+		} \
+\
+		/* empty, just shift to the seq_num */ \
+		if(queue->count == 0) \
+		{ \
+			queue->begin = seq_num; \
+			offset = 0; \
+		} \
+	} \
+\
+	/* slots between the old end and seq_num are already clear */ \
+	queue->count = offset + 1; \
+	queue->elems[seq_num & queue->mask] = elem; \
+	prefix##_set(queue, seq_num & queue->mask); \
+	return; \
+drop_it: \
+	if(queue->drop_cb) \
+		queue->drop_cb(seq_num, elem, queue->drop_cb_user); \
+} \
+\
+/** \
+ * Same as chiaki_reorder_queue_pull() \
+ * @param seq_num may be NULL \
+ * @param elem may be NULL \
+ */ \
+static inline bool prefix##_pull(name *queue, ChiakiSeqNum##bits *seq_num, elem_type *elem) \
+{ \
+	size_t i = queue->begin & queue->mask; \
+	if(queue->count == 0 || !prefix##_is_set(queue, i)) \
+		return false; \
+	prefix##_clear(queue, i); \
+	if(seq_num) \
+		*seq_num = queue->begin; \
+	if(elem) \
+		*elem = queue->elems[i]; \
+	queue->begin++; \
+	queue->count--; \
+	return true; \
+} \
+\
+/** \
+ * Pull all elements that are available in order at once. \
+ * \
+ * @param elems receives the pulled elements \
+ * @param elems_max capacity of elems \
+ * @param seq_num_first receives the sequence number of elems[0], may be NULL \
+ * @return number of pulled elements \
+ */ \
+static inline size_t prefix##_pull_bulk(name *queue, elem_type *elems, size_t elems_max, ChiakiSeqNum##bits *seq_num_first) \
+{ \
+	size_t limit = queue->count < elems_max ? queue->count : elems_max; \
+	size_t begin_i = queue->begin & queue->mask; \
+	size_t n = 0; \
+	for(; n < limit; n++) \
+	{ \
+		size_t i = (begin_i + n) & queue->mask; \
+		if(!prefix##_is_set(queue, i)) \
+			break; \
+		prefix##_clear(queue, i); \
+		elems[n] = queue->elems[i]; \
+	} \
+	if(seq_num_first) \
+		*seq_num_first = queue->begin; \
+	queue->begin = (ChiakiSeqNum##bits)(queue->begin + n); \
+	queue->count -= n; \
+	return n; \
+} \
+\
+/** \
+ * Same as chiaki_reorder_queue_peek() \
+ * @param seq_num may be NULL \
+ */ \
+static inline bool prefix##_peek(name *queue, size_t index, ChiakiSeqNum##bits *seq_num, elem_type *elem) \
+{ \
+	if(index >= queue->count) \
+		return false; \
+	ChiakiSeqNum##bits seq_num_val = (ChiakiSeqNum##bits)(queue->begin + index); \
+	if(!prefix##_is_set(queue, seq_num_val & queue->mask)) \
+		return false; \
+	if(seq_num) \
+		*seq_num = seq_num_val; \
+	*elem = queue->elems[seq_num_val & queue->mask]; \
+	return true; \
+} \
+\
+/** \
+ * Same as chiaki_reorder_queue_drop() \
+ */ \
+static inline void prefix##_drop(name *queue, size_t index) \
+{ \
+	if(index >= queue->count) \
+		return; \
+	ChiakiSeqNum##bits seq_num = (ChiakiSeqNum##bits)(queue->begin + index); \
+	size_t i = seq_num & queue->mask; \
+	if(!prefix##_is_set(queue, i)) \
+		return; \
+	prefix##_clear(queue, i); \
+	if(queue->drop_cb) \
+		queue->drop_cb(seq_num, queue->elems[i], queue->drop_cb_user); \
+\
+	/* reduce count if necessary */ \
+	if(index == queue->count - 1) \
+	{ \
+		while(queue->count > 0 && !prefix##_is_set(queue, (queue->begin + queue->count - 1) & queue->mask)) \
+			queue->count--; \
+	} \
+}
+
+CHIAKI_DEFINE_REORDER_QUEUE(ChiakiReorderQueue16, chiaki_reorder_queue16, 16, void *)
+CHIAKI_DEFINE_REORDER_QUEUE(ChiakiReorderQueue32, chiaki_reorder_queue32, 32, void *)
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,11 +14,23 @@ extern "C" {
 
 #define CHIAKI_RPCRYPT_KEY_SIZE 0x10
 
+/**
+ * Number of ivs that are kept around for reuse and pre-generation
+ */
+#define CHIAKI_RPCRYPT_IV_CACHE_SIZE 32
+
+typedef struct chiaki_rpcrypt_ctx_t ChiakiRPCryptCtx;
+
+/**
+ * Must be initialized with one of the chiaki_rpcrypt_init_*() functions and released with chiaki_rpcrypt_fini().
+ * Not thread-safe, the keyed contexts and the iv cache are shared by all calls, so each thread needs its own ChiakiRPCrypt.
+ */
 typedef struct chiaki_rpcrypt_t
 {
 	ChiakiTarget target;
 	uint8_t bright[CHIAKI_RPCRYPT_KEY_SIZE];
 	uint8_t ambassador[CHIAKI_RPCRYPT_KEY_SIZE];
+	ChiakiRPCryptCtx *ctx; // keyed hmac and aes contexts, created on first use
 } ChiakiRPCrypt;
 
 CHIAKI_EXPORT void chiaki_rpcrypt_bright_ambassador(ChiakiTarget target, uint8_t *bright, uint8_t *ambassador, const uint8_t *nonce, const uint8_t *morning);
@@ -26,9 +38,24 @@ CHIAKI_EXPORT void chiaki_rpcrypt_aeropause_ps4_pre10(uint8_t *aeropause, const
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_aeropause(ChiakiTarget target, size_t key_1_off, uint8_t *aeropause, const uint8_t *ambassador);
 
 CHIAKI_EXPORT void chiaki_rpcrypt_init_auth(ChiakiRPCrypt *rpcrypt, ChiakiTarget target, const uint8_t *nonce, const uint8_t *morning);
+
+/**
+ * Initialize with the same keys as src, but independent contexts, e.g. to use them on another thread.
+ */
+CHIAKI_EXPORT void chiaki_rpcrypt_init_clone(ChiakiRPCrypt *rpcrypt, const ChiakiRPCrypt *src);
+
 CHIAKI_EXPORT void chiaki_rpcrypt_init_regist_ps4_pre10(ChiakiRPCrypt *rpcrypt, const uint8_t *ambassador, uint32_t pin);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_init_regist(ChiakiRPCrypt *rpcrypt, ChiakiTarget target, const uint8_t *ambassador, size_t key_0_off, uint32_t pin);
+CHIAKI_EXPORT void chiaki_rpcrypt_fini(ChiakiRPCrypt *rpcrypt);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_generate_iv(ChiakiRPCrypt *rpcrypt, uint8_t *iv, uint64_t counter);
+
+/**
+ * Generate the ivs for upcoming counters ahead of time, so encrypting or decrypting with them does not need to.
+ *
+ * @param count at most CHIAKI_RPCRYPT_IV_CACHE_SIZE
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_pregenerate_ivs(ChiakiRPCrypt *rpcrypt, uint64_t counter_first, size_t count);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_encrypt(ChiakiRPCrypt *rpcrypt, uint64_t counter, const uint8_t *in, uint8_t *out, size_t sz);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_decrypt(ChiakiRPCrypt *rpcrypt, uint64_t counter, const uint8_t *in, uint8_t *out, size_t sz);
 
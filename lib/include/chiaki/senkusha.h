@@ -11,6 +11,20 @@ extern "C" {
 
 typedef struct chiaki_session_t ChiakiSession;
 
+#define CHIAKI_SENKUSHA_PROBES_MAX 16
+
+/**
+ * A single ping or MTU request that is in flight together with others
+ */
+typedef struct chiaki_senkusha_probe_t
+{
+	uint32_t tag; // random tag for pings, request id for MTU requests
+	uint32_t value; // MTU to test, unused for RTT pings
+	uint64_t send_time_us;
+	uint64_t recv_time_us;
+	bool received;
+} ChiakiSenkushaProbe;
+
 typedef struct senkusha_t
 {
 	ChiakiSession *session;
@@ -22,11 +36,11 @@ typedef struct senkusha_t
 	bool state_failed;
 	bool should_stop;
 	ChiakiSeqNum32 data_ack_seq_num_expected;
-	uint64_t pong_time_us;
 	uint16_t ping_test_index;
-	uint16_t ping_index;
-	uint32_t ping_tag;
-	uint32_t mtu_id;
+
+	ChiakiSenkushaProbe probes[CHIAKI_SENKUSHA_PROBES_MAX];
+	size_t probes_count;
+	size_t probes_received;
 
 	/**
 	 * signaled on change of state_finished or should_stop
@@ -34,14 +48,22 @@ typedef struct senkusha_t
 	ChiakiCond state_cond;
 
 	/**
-	 * protects state, state_finished, state_failed and should_stop
+	 * protects state, state_finished, state_failed, should_stop and probes
 	 */
 	ChiakiMutex state_mutex;
 } ChiakiSenkusha;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, ChiakiSession *session);
 CHIAKI_EXPORT void chiaki_senkusha_fini(ChiakiSenkusha *senkusha);
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us);
+/**
+ * @param rtt_jitter_us mean absolute deviation of the individual ping RTTs from rtt_us
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, uint64_t *rtt_jitter_us);
+
+/**
+ * To be called from a thread other than the one chiaki_senkusha_run() is running on to stop senkusha
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_stop(ChiakiSenkusha *senkusha);
 
 #ifdef __cplusplus
 }
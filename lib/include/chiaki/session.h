@@ -14,6 +14,9 @@
 #include "audio.h"
 #include "controller.h"
 #include "stoppipe.h"
+#include "senkusha.h"
+#include "hostcache.h"
+#include "framebuffer.h"
 
 #include <stdint.h>
 
@@ -69,6 +72,48 @@ CHIAKI_EXPORT void chiaki_connect_video_profile_preset(ChiakiConnectVideoProfile
 
 #define CHIAKI_SESSION_AUTH_SIZE 0x10
 
+typedef enum {
+	CHIAKI_SESSION_STARTUP_MODE_SEQUENTIAL = 0, // session request, ctrl, senkusha and stream connection strictly one after another
+	CHIAKI_SESSION_STARTUP_MODE_FAST = 1 // use startup_hint, run senkusha in parallel to ctrl or skip it if the hint is fresh
+} ChiakiSessionStartupMode;
+
+/**
+ * Maximum age of the network values in a ChiakiSessionStartupHint to skip Senkusha entirely
+ */
+#define CHIAKI_SESSION_STARTUP_HINT_NETWORK_MAX_AGE_MS (30 * 60 * 1000)
+
+/**
+ * Values negotiated with the same host in a previous session, only used with CHIAKI_SESSION_STARTUP_MODE_FAST.
+ */
+typedef struct chiaki_session_startup_hint_t
+{
+	ChiakiTarget target; // RP-Version to request the session with first, unknown target if not known
+	uint32_t mtu_in; // 0 if not known
+	uint32_t mtu_out; // 0 if not known
+	uint64_t rtt_us;
+	uint64_t network_age_ms; // time since mtu_in, mtu_out and rtt_us have been measured, UINT64_MAX if they never were
+} ChiakiSessionStartupHint;
+
+static inline bool chiaki_session_startup_hint_network_fresh(const ChiakiSessionStartupHint *hint)
+{
+	return hint->mtu_in && hint->mtu_out && hint->rtt_us
+		&& hint->network_age_ms <= CHIAKI_SESSION_STARTUP_HINT_NETWORK_MAX_AGE_MS;
+}
+
+/**
+ * Durations of the individual phases of session startup in ms, 0 for phases that have not (yet) happened.
+ */
+typedef struct chiaki_session_startup_timings_t
+{
+	uint64_t session_request_ms; // including re-requests on RP-Version mismatch
+	uint64_t ctrl_ms; // ctrl start until session id was received
+	uint64_t senkusha_ms; // runs in parallel to ctrl if senkusha_parallel is set
+	uint64_t stream_connection_ms; // stream connection start until streaminfo was received
+	uint64_t first_frame_ms; // session start until the first video frame was passed to the video sample callback
+	bool senkusha_skipped;
+	bool senkusha_parallel;
+} ChiakiSessionStartupTimings;
+
 typedef struct chiaki_connect_info_t
 {
 	bool ps5;
@@ -79,6 +124,25 @@ typedef struct chiaki_connect_info_t
 	bool video_profile_auto_downgrade; // Downgrade video_profile if server does not seem to support it.
 	bool enable_keyboard;
 	bool enable_dualsense;
+	ChiakiSessionStartupMode startup_mode;
+	ChiakiSessionStartupHint startup_hint;
+	/**
+	 * Optional, null terminated. If set together with host_id, the startup hint is loaded from this host cache file
+	 * in CHIAKI_SESSION_STARTUP_MODE_FAST when startup_hint contains no target, and the file is updated after each
+	 * successful session in any mode.
+	 */
+	const char *host_cache_path;
+	const char *host_id; // null terminated, see ChiakiHostCacheEntry
+	/**
+	 * If the stream connection is lost while ctrl is still alive, e.g. on Wi-Fi roaming, re-establish it with the
+	 * keys of this session instead of quitting. See CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS.
+	 */
+	bool enable_resume;
+	/**
+	 * Options for the socket of the stream, the receive buffer is sized from video_profile.bitrate
+	 * unless socket_config.rcvbuf_size is set.
+	 */
+	ChiakiSocketConfig socket_config;
 } ChiakiConnectInfo;
 
 
@@ -171,6 +235,12 @@ typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, int32_t frames_lost, void *user);
 
+/**
+ * Same as ChiakiVideoSampleCallback, but passes the frame as a reference-counted buffer,
+ * so the decoder can keep it with chiaki_frame_buffer_ref() instead of copying it.
+ */
+typedef bool (*ChiakiVideoFrameCallback)(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user);
+
 
 
 typedef struct chiaki_session_t
@@ -188,6 +258,13 @@ typedef struct chiaki_session_t
 		bool video_profile_auto_downgrade;
 		bool enable_keyboard;
 		bool enable_dualsense;
+		ChiakiSessionStartupMode startup_mode;
+		ChiakiSessionStartupHint startup_hint;
+		char *host_cache_path; // NULL if no host cache should be used
+		char host_id[CHIAKI_HOST_CACHE_HOST_ID_SIZE];
+		bool target_from_host_cache;
+		bool enable_resume;
+		ChiakiSocketConfig socket_config;
 	} connect_info;
 
 	ChiakiTarget target;
@@ -199,8 +276,22 @@ typedef struct chiaki_session_t
 	uint32_t mtu_in;
 	uint32_t mtu_out;
 	uint64_t rtt_us;
+	uint64_t rtt_jitter_us;
+	bool network_measured; // mtu_in, mtu_out and rtt_us come from Senkusha or a fresh startup hint, not from fallbacks
 	ChiakiECDH ecdh;
 
+	/**
+	 * protected by state_mutex
+	 */
+	ChiakiSessionStartupTimings startup_timings;
+	uint64_t startup_begin_ms;
+
+	/**
+	 * Senkusha that is currently running, to be stopped together with the session.
+	 * protected by state_mutex
+	 */
+	ChiakiSenkusha *senkusha;
+
 	ChiakiQuitReason quit_reason;
 	char *quit_reason_str; // additional reason string from remote
 
@@ -208,6 +299,8 @@ typedef struct chiaki_session_t
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
 	void *video_sample_cb_user;
+	ChiakiVideoFrameCallback video_frame_cb;
+	void *video_frame_cb_user;
 	ChiakiAudioSink audio_sink;
 	ChiakiAudioSink haptics_sink;
 
@@ -246,6 +339,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_connect_microphone(ChiakiSession *s
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_set_text(ChiakiSession *session, const char *text);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_reject(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *session);
+CHIAKI_EXPORT void chiaki_session_get_startup_timings(ChiakiSession *session, ChiakiSessionStartupTimings *timings);
+
+/**
+ * Get the values negotiated in this session to pass them as startup_hint to the next session with the same host.
+ * Only meaningful after CHIAKI_EVENT_CONNECTED.
+ */
+CHIAKI_EXPORT void chiaki_session_get_startup_hint(ChiakiSession *session, ChiakiSessionStartupHint *hint);
+
+/**
+ * Get how the delay of the video stream currently develops, e.g. to lower the bitrate or grow buffers when it rises.
+ * May be called from any thread while the session is running.
+ */
+CHIAKI_EXPORT void chiaki_session_get_delay_estimate(ChiakiSession *session, ChiakiDelayEstimate *estimate);
 
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
@@ -259,6 +365,15 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+/**
+ * Takes precedence over the callback set with chiaki_session_set_video_sample_cb()
+ */
+static inline void chiaki_session_set_video_frame_cb(ChiakiSession *session, ChiakiVideoFrameCallback cb, void *user)
+{
+	session->video_frame_cb = cb;
+	session->video_frame_cb_user = user;
+}
+
 /**
  * @param sink contents are copied
  */
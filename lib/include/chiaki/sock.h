@@ -6,6 +6,8 @@
 #include "common.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +36,65 @@ typedef int chiaki_socket_t;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_nonblock(chiaki_socket_t sock, bool nonblock);
 
+struct chiaki_log_t;
+
+/**
+ * Expedited Forwarding, for low-latency traffic like controller input
+ */
+#define CHIAKI_SOCKET_DSCP_EF 46
+
+/**
+ * Options for UDP sockets carrying a stream. Zero-initialized, only the receive buffer is sized automatically.
+ * Options not supported by the platform are skipped with a warning.
+ */
+typedef struct chiaki_socket_config_t
+{
+	uint32_t rcvbuf_size; // SO_RCVBUF in bytes, 0 to choose automatically
+	uint32_t busy_poll_us; // SO_BUSY_POLL, only Linux, 0 to disable
+	uint8_t dscp; // DiffServ code point for outgoing packets, 0 to leave them unmarked
+	bool timestamps; // request kernel receive timestamps, see ChiakiSocketRecvInfo
+	bool gro; // UDP generic receive offload, only Linux, receiving may return multiple datagrams at once
+} ChiakiSocketConfig;
+
+/**
+ * What chiaki_socket_configure() actually enabled
+ */
+typedef struct chiaki_socket_features_t
+{
+	uint32_t rcvbuf_size; // as reported by the kernel, may differ from the requested size
+	bool timestamps;
+	bool gro;
+} ChiakiSocketFeatures;
+
+/**
+ * @param family address family of sock, for the DSCP option
+ * @param rcvbuf_size_default receive buffer size to use if config->rcvbuf_size is 0
+ * @param features optional, receives what could be enabled
+ * @return an error only if setting the receive buffer size failed, everything else is optional
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_configure(chiaki_socket_t sock, int family, const ChiakiSocketConfig *config,
+		uint32_t rcvbuf_size_default, struct chiaki_log_t *log, ChiakiSocketFeatures *features);
+
+/**
+ * Receive buffer size that holds the given time of data at the given bitrate, but at least min_size.
+ */
+CHIAKI_EXPORT uint32_t chiaki_socket_rcvbuf_size_for_bitrate(uint32_t bitrate_kbps, uint32_t duration_ms, uint32_t min_size);
+
+typedef struct chiaki_socket_recv_info_t
+{
+	uint64_t timestamp_us; // arrival time on the clock of chiaki_time_now_monotonic_us()
+	bool kernel_timestamp; // whether timestamp_us is when the kernel received the packet, otherwise when recv returned
+	size_t segment_size; // if GRO merged multiple datagrams, size of each one except for the last, otherwise 0
+} ChiakiSocketRecvInfo;
+
+/**
+ * Like recv(), additionally reporting when the packet arrived.
+ *
+ * @param info optional
+ * @return the received size, or < 0 on error like recv()
+ */
+CHIAKI_EXPORT int chiaki_socket_recv(chiaki_socket_t sock, uint8_t *buf, size_t buf_size, ChiakiSocketRecvInfo *info);
+
 #ifdef __cplusplus
 }
 #endif
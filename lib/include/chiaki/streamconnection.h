@@ -11,6 +11,7 @@
 #include "audioreceiver.h"
 #include "videoreceiver.h"
 #include "congestioncontrol.h"
+#include "delayestimator.h"
 
 #include <stdbool.h>
 
@@ -20,6 +21,24 @@ extern "C" {
 
 typedef struct chiaki_session_t ChiakiSession;
 
+/**
+ * Time without any packet from the console after which the Takion connection is considered lost,
+ * only if resume is enabled in ChiakiConnectInfo
+ */
+#define CHIAKI_STREAM_CONNECTION_LOST_TIMEOUT_MS 2000
+
+/**
+ * Time after losing the Takion connection during which resuming is attempted,
+ * including the connect and handshake of each attempt
+ */
+#define CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS 10000
+
+/**
+ * Wait before the second attempt to resume, doubling with every further attempt up to the max
+ */
+#define CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MS 250
+#define CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MAX_MS 2000
+
 typedef struct chiaki_stream_connection_t
 {
 	struct chiaki_session_t *session;
@@ -33,6 +52,7 @@ typedef struct chiaki_stream_connection_t
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
 	ChiakiAudioReceiver *haptics_receiver;
+	ChiakiDelayEstimator delay_estimator;
 
 	ChiakiFeedbackSender feedback_sender;
 	ChiakiCongestionControl congestion_control;
@@ -47,12 +67,12 @@ typedef struct chiaki_stream_connection_t
 	ChiakiMutex feedback_sender_mutex;
 
 	/**
-	 * signaled on change of state_finished or should_stop
+	 * signaled on change of state_finished, should_stop or takion_lost
 	 */
 	ChiakiCond state_cond;
 
 	/**
-	 * protects state, state_finished, state_failed and should_stop
+	 * protects state, state_finished, state_failed, should_stop and takion_lost
 	 */
 	ChiakiMutex state_mutex;
 
@@ -62,6 +82,8 @@ typedef struct chiaki_stream_connection_t
 	bool should_stop;
 	bool remote_disconnected;
 	char *remote_disconnect_reason;
+	bool takion_lost; // Takion ended by itself while streaming
+	unsigned int resume_count; // how often the stream was resumed after losing Takion
 } ChiakiStreamConnection;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session);
@@ -78,6 +100,21 @@ CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_toggle_mute_direct_message(
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_stop(ChiakiStreamConnection *stream_connection);
 
+/**
+ * Clamp timeout_ms of a step of resuming to what is left of the resume window.
+ *
+ * @param lost_ms monotonic time when the connection was lost
+ * @param now_ms current monotonic time
+ * @return timeout_ms or less, 0 if the window is over
+ */
+CHIAKI_EXPORT uint64_t chiaki_stream_connection_resume_timeout_ms(uint64_t lost_ms, uint64_t now_ms, uint64_t timeout_ms);
+
+/**
+ * @param attempt number of failed attempts to resume so far, starting at 1
+ * @return time to wait before the next attempt, not yet clamped to the resume window
+ */
+CHIAKI_EXPORT uint64_t chiaki_stream_connection_resume_retry_interval_ms(unsigned int attempt);
+
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end);
 
 #ifdef __cplusplus
@@ -48,6 +48,9 @@ typedef struct chiaki_takion_av_packet_t
 
 	uint64_t key_pos;
 
+	uint64_t recv_timestamp_us; // arrival on the clock of chiaki_time_now_monotonic_us(), see ChiakiSocketRecvInfo
+	bool recv_timestamp_kernel; // whether recv_timestamp_us comes from the kernel
+
 	uint8_t *data; // not owned
 	size_t data_size;
 } ChiakiTakionAVPacket;
@@ -108,8 +111,29 @@ typedef struct chiaki_takion_connect_info_t
 	bool enable_crypt;
 	bool enable_dualsense;
 	uint8_t protocol_version;
+	/**
+	 * If no packet at all is received for this long after the connection has been established,
+	 * the connection is considered lost and a CHIAKI_TAKION_EVENT_TYPE_DISCONNECT is emitted.
+	 * 0 to wait forever.
+	 */
+	uint64_t recv_timeout_ms;
+	ChiakiSocketConfig socket_config;
+	uint32_t bitrate_kbps; // expected bitrate for sizing the receive buffer if socket_config doesn't, 0 if unknown
 } ChiakiTakionConnectInfo;
 
+/**
+ * Statistics about receiving from the socket, only accessed by the Takion thread
+ */
+typedef struct chiaki_takion_recv_stats_t
+{
+	uint64_t packets;
+	uint64_t packets_kernel_timestamp;
+	uint64_t queue_delay_us_avg; // smoothed time packets waited in the socket buffer, only from kernel timestamps
+	uint64_t queue_delay_us_max;
+	uint64_t queue_jitter_us; // smoothed variation of the queueing delay between packets, like RFC 3550 interarrival jitter
+	uint64_t queue_delay_us_prev;
+} ChiakiTakionRecvStats;
+
 
 typedef struct chiaki_takion_t
 {
@@ -130,10 +154,14 @@ typedef struct chiaki_takion_t
 	/**
 	 * Array to be temporarily allocated when non-data packets come, enable_crypt is true, but gkcrypt_remote is NULL
 	 * to not ignore any MACs in this period.
+	 * It starts out with postponed_packets_size_initial entries, enough for the burst expected at the connection's bitrate,
+	 * and grows if that was not enough.
 	 */
 	struct chiaki_takion_postponed_packet_t *postponed_packets;
 	size_t postponed_packets_size;
 	size_t postponed_packets_count;
+	size_t postponed_packets_size_initial;
+	uint64_t postponed_packets_dropped;
 
 	ChiakiGKCrypt *gkcrypt_local; // if NULL (default), no gmac is calculated and nothing is encrypted
 	uint64_t key_pos_local;
@@ -141,7 +169,7 @@ typedef struct chiaki_takion_t
 
 	ChiakiGKCrypt *gkcrypt_remote; // if NULL (default), remote gmacs are IGNORED (!) and everything is expected to be unencrypted
 
-	ChiakiReorderQueue data_queue;
+	ChiakiReorderQueue32 data_queue;
 	ChiakiTakionSendBuffer send_buffer;
 
 	ChiakiTakionCallback cb;
@@ -165,6 +193,11 @@ typedef struct chiaki_takion_t
 	ChiakiKeyState key_state;
 
 	bool enable_dualsense;
+	uint64_t recv_timeout_ms; // 0 for no timeout
+
+	bool recv_gro; // whether the socket may return multiple datagrams at once
+	ChiakiSocketRecvInfo recv_info; // of the packet currently being handled
+	ChiakiTakionRecvStats recv_stats;
 } ChiakiTakion;
 
 
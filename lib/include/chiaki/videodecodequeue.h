@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_VIDEODECODEQUEUE_H
+#define CHIAKI_VIDEODECODEQUEUE_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "seqnum.h"
+#include "framebuffer.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Compressed frames the queue can hold, must be a power of 2
+ */
+#define CHIAKI_VIDEO_DECODE_QUEUE_SIZE 8
+
+/**
+ * Queued frames, including the one currently being decoded, at which the queue overflows.
+ * The remaining space is reserved for keyframes and headers.
+ */
+#define CHIAKI_VIDEO_DECODE_QUEUE_DEPTH_MAX 4
+
+/**
+ * Frames that are dropped waiting for a keyframe after an overflow before giving up and decoding anyway
+ */
+#define CHIAKI_VIDEO_DECODE_QUEUE_KEYFRAME_WAIT_MAX 120
+
+/**
+ * @param frame only valid during the call, unless another reference is taken with chiaki_frame_buffer_ref()
+ * @return whether the frame was decoded successfully
+ */
+typedef bool (*ChiakiVideoDecodeQueueCallback)(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user);
+
+/**
+ * Decouples the thread receiving video from the one decoding it.
+ *
+ * References to frames are put into a lock-free single producer, single consumer ring and passed to the callback
+ * on a dedicated decode thread, so a slow decoder never blocks network I/O.
+ * If the ring overflows, all queued frames that are not keyframes are discarded and new frames are
+ * dropped until the next keyframe, as anything in between could not be decoded correctly anyway.
+ */
+typedef struct chiaki_video_decode_queue_t
+{
+	ChiakiLog *log;
+	ChiakiCodec codec;
+	ChiakiVideoDecodeQueueCallback cb;
+	void *cb_user;
+	struct chiaki_video_decode_queue_ring_t *ring;
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop; // protected by mutex
+
+	// only accessed by the producer
+	bool waiting_for_keyframe;
+	unsigned int keyframe_wait_count;
+	int32_t frames_lost;
+} ChiakiVideoDecodeQueue;
+
+typedef struct chiaki_video_decode_queue_stats_t
+{
+	uint64_t frames_pushed;
+	uint64_t frames_decoded;
+	uint64_t frames_dropped; // discarded because of an overflow
+	uint64_t overflows;
+} ChiakiVideoDecodeQueueStats;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_decode_queue_init(ChiakiVideoDecodeQueue *queue, ChiakiLog *log, ChiakiCodec codec,
+		ChiakiVideoDecodeQueueCallback cb, void *cb_user);
+
+/**
+ * Stops the decode thread. Frames that are still queued are discarded.
+ */
+CHIAKI_EXPORT void chiaki_video_decode_queue_fini(ChiakiVideoDecodeQueue *queue);
+
+/**
+ * Queue a frame. Must always be called from the same thread.
+ *
+ * @param frame the queue takes its own reference, the caller keeps theirs
+ * @param frame_index index of the frame, reported back by chiaki_video_decode_queue_take_failed()
+ * @param header true for codec headers, which are never dropped
+ * @return false if the frame was dropped because of an overflow
+ */
+CHIAKI_EXPORT bool chiaki_video_decode_queue_push(ChiakiVideoDecodeQueue *queue, ChiakiFrameBuffer *frame,
+		int32_t frames_lost, ChiakiSeqNum16 frame_index, bool header);
+
+/**
+ * Get the index of the first frame that could not be decoded or was discarded from the queue, since the last call.
+ * @return false if no frame failed
+ */
+CHIAKI_EXPORT bool chiaki_video_decode_queue_take_failed(ChiakiVideoDecodeQueue *queue, ChiakiSeqNum16 *frame_index);
+
+/**
+ * Stop dropping frames after an overflow before the next keyframe arrives,
+ * because the caller knows that the next frame is decodable anyway. Same thread as push.
+ */
+CHIAKI_EXPORT void chiaki_video_decode_queue_resume(ChiakiVideoDecodeQueue *queue);
+
+CHIAKI_EXPORT void chiaki_video_decode_queue_get_stats(ChiakiVideoDecodeQueue *queue, ChiakiVideoDecodeQueueStats *stats);
+
+/**
+ * @return whether an Annex B frame starts with a keyframe, i.e. decoding can start with it
+ */
+CHIAKI_EXPORT bool chiaki_video_frame_is_keyframe(ChiakiCodec codec, const uint8_t *buf, size_t buf_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEODECODEQUEUE_H
@@ -8,6 +8,8 @@
 #include "video.h"
 #include "takion.h"
 #include "frameprocessor.h"
+#include "videodecodequeue.h"
+#include "videorecovery.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,16 +26,17 @@ typedef struct chiaki_video_receiver_t
 	int profile_cur; // < 1 if no profile selected yet, else index in profiles
 
 	int32_t frame_index_cur; // frame that is currently being filled
-	int32_t frame_index_prev; // last frame that has been at least partially decoded
-	int32_t frame_index_prev_complete; // last frame that has been completely decoded
+	int32_t frame_index_prev; // last frame that has been flushed, successfully or not
 	ChiakiFrameProcessor frame_processor;
 	ChiakiPacketStats *packet_stats;
-
-	uint8_t *old_frame;
-	size_t old_frame_size;
-	size_t old_frame_allocd;
+	ChiakiVideoRecovery recovery;
 
 	int32_t frames_lost;
+	bool resumed; // the stream continues on a new connection, nothing received since
+	bool first_frame_flushed; // only accessed by the decode thread
+
+	ChiakiVideoDecodeQueue decode_queue;
+	bool decode_queue_enabled; // if false, video_sample_cb is called synchronously
 } ChiakiVideoReceiver;
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
@@ -50,6 +53,14 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet);
 
+/**
+ * Prepare for the stream continuing on a new connection, for which frame indices start over.
+ * Everything up to the first frame received afterwards is reported as lost, so decoding only continues
+ * once the console sent a keyframe or invalidated its references.
+ * Must not be called while packets are being received.
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_resume(ChiakiVideoReceiver *video_receiver);
+
 static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	ChiakiVideoReceiver *video_receiver = CHIAKI_NEW(ChiakiVideoReceiver);
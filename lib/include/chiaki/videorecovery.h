@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_VIDEORECOVERY_H
+#define CHIAKI_VIDEORECOVERY_H
+
+#include "common.h"
+#include "log.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Assumed round trip time if none has been measured
+ */
+#define CHIAKI_VIDEO_RECOVERY_RTT_DEFAULT_US 50000
+
+/**
+ * Time on top of the round trip time after a recovery request, after which frames are assumed to be
+ * encoded without any reference to the lost frames
+ */
+#define CHIAKI_VIDEO_RECOVERY_RESUME_MARGIN_US 20000
+
+/**
+ * Time after which frames are decoded again even though no recovery happened, to not freeze the picture forever
+ */
+#define CHIAKI_VIDEO_RECOVERY_TIMEOUT_US 1000000
+
+typedef struct chiaki_video_frame_info_t
+{
+	bool valid; // whether any slice was found, otherwise only max_temporal_id is meaningful
+	bool keyframe; // decoding can start at this frame, i.e. it is an IDR/IRAP or carries a recovery point with recovery_frame_cnt 0
+	bool reference; // later frames may reference this frame
+	bool sub_layer_non_reference; // H.265 only, referenced only by higher sub-layers, which is not reflected in reference
+	uint8_t temporal_id; // H.265 only, TemporalId of the slice
+	int max_temporal_id; // H.265 only, highest TemporalId of the stream if the frame contains an SPS, else -1
+	bool recovery_point; // carries a recovery point SEI
+	unsigned int recovery_frame_cnt; // frames after the recovery point until the output is correct
+} ChiakiVideoFrameInfo;
+
+/**
+ * Parse the NAL unit headers at the beginning of an Annex B frame or codec header.
+ * Partial frames are fine as long as the beginning is intact.
+ */
+CHIAKI_EXPORT void chiaki_video_frame_info_parse(ChiakiCodec codec, const uint8_t *buf, size_t buf_size, ChiakiVideoFrameInfo *info);
+
+typedef struct chiaki_video_recovery_stats_t
+{
+	uint64_t losses; // losses that broke the reference chain
+	uint64_t losses_non_reference; // lost frames that nothing depended on
+	uint64_t frames_withheld;
+	uint64_t requests;
+	uint64_t recoveries_keyframe;
+	uint64_t recoveries_invalidation;
+	uint64_t timeouts;
+	uint64_t broken_us_total; // time without decodable frames
+	uint64_t broken_us_max;
+} ChiakiVideoRecoveryStats;
+
+/**
+ * Decides which frames can be decoded after a loss and when to ask the console for recovery.
+ *
+ * As soon as a frame that may be referenced is lost, all following frames are withheld from the decoder,
+ * instead of letting it smear corrupt output across the screen. The lost range is reported to the console,
+ * which reacts by invalidating the affected references in its encoder or sending a keyframe.
+ * Decoding resumes at the next keyframe or at the first frame that arrives later than one round trip after
+ * the last report, which can no longer reference anything that was lost.
+ * Frames from a recovery point on are decoded again, but only count as recovered after its recovery_frame_cnt.
+ *
+ * H.265 sub-layer non-reference pictures are only skipped on loss if they belong to the highest sub-layer,
+ * which is known from the SPS, either in the codec header or in a keyframe.
+ *
+ * Not thread-safe, all functions must be called from the thread receiving video.
+ */
+typedef struct chiaki_video_recovery_t
+{
+	ChiakiLog *log;
+	uint64_t rtt_us;
+
+	bool broken; // a reference was lost and no decodable frame has arrived yet
+	ChiakiSeqNum16 lost_first;
+	ChiakiSeqNum16 lost_last; // including withheld frames
+	uint64_t broken_since_us;
+	bool request_due; // new frames were lost since the last request
+	bool request_sent;
+	uint64_t request_us; // time of the last request, valid if request_sent
+	bool recovery_point_pending; // frames are decoded again, but the output is only correct from recovery_point_end on
+	ChiakiSeqNum16 recovery_point_end;
+
+	int max_temporal_id; // highest H.265 TemporalId of the stream, -1 if unknown
+
+	ChiakiVideoRecoveryStats stats;
+} ChiakiVideoRecovery;
+
+CHIAKI_EXPORT void chiaki_video_recovery_init(ChiakiVideoRecovery *recovery, ChiakiLog *log);
+
+/**
+ * @param rtt_us 0 if unknown
+ */
+CHIAKI_EXPORT void chiaki_video_recovery_set_rtt(ChiakiVideoRecovery *recovery, uint64_t rtt_us);
+
+/**
+ * Pass the codec header sent by the console before the first frame of a profile.
+ */
+CHIAKI_EXPORT void chiaki_video_recovery_header(ChiakiVideoRecovery *recovery, const ChiakiVideoFrameInfo *info);
+
+/**
+ * Report frames that were never received, could not be reconstructed or failed to decode.
+ *
+ * @param info what could be parsed from the parts of the frame that did arrive, NULL if nothing is known
+ */
+CHIAKI_EXPORT void chiaki_video_recovery_frames_lost(ChiakiVideoRecovery *recovery, ChiakiSeqNum16 first, ChiakiSeqNum16 last,
+		const ChiakiVideoFrameInfo *info, uint64_t now_us);
+
+/**
+ * Decide about a complete frame. If false is returned, the frame must not be passed to the decoder.
+ */
+CHIAKI_EXPORT bool chiaki_video_recovery_frame_decodable(ChiakiVideoRecovery *recovery, ChiakiSeqNum16 frame_index,
+		const ChiakiVideoFrameInfo *info, uint64_t now_us);
+
+/**
+ * Check whether recovery should be requested from the console now, either because of a new loss
+ * or because an earlier request had no effect.
+ *
+ * @param first receives the first frame to report as corrupt
+ * @param last receives the last frame to report as corrupt
+ */
+CHIAKI_EXPORT bool chiaki_video_recovery_poll_request(ChiakiVideoRecovery *recovery, uint64_t now_us,
+		ChiakiSeqNum16 *first, ChiakiSeqNum16 *last);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEORECOVERY_H
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_ATOMIC_H
+#define CHIAKI_ATOMIC_H
+
+/*
+ * Minimal atomics for lock-free code in the lib.
+ *
+ * C11 <stdatomic.h> where available, Interlocked intrinsics for the MSVC C compiler, which has no <stdatomic.h>.
+ * The intrinsics are full barriers, so there every memory order behaves like seq_cst.
+ *
+ * Types: ChiakiAtomicU32 (uint32_t), ChiakiAtomicI32 (int32_t), ChiakiAtomicU64 (uint64_t),
+ * ChiakiAtomicSize (size_t), ChiakiAtomicPtr (uintptr_t), ChiakiAtomicBool (bool)
+ * Functions: prefix_init(), prefix_load(), prefix_store(), prefix_exchange(), prefix_compare_exchange()
+ * and, except for bool, prefix_fetch_add() and prefix_fetch_sub()
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+
+#include <intrin.h>
+
+typedef int ChiakiMemoryOrder;
+#define CHIAKI_MEMORY_ORDER_RELAXED 0
+#define CHIAKI_MEMORY_ORDER_ACQUIRE 1
+#define CHIAKI_MEMORY_ORDER_RELEASE 2
+#define CHIAKI_MEMORY_ORDER_ACQ_REL 3
+#define CHIAKI_MEMORY_ORDER_SEQ_CST 4
+
+#define CHIAKI_ATOMIC_DEFINE_32(name, prefix, type) \
+typedef struct { volatile long v; } name; \
+static inline void prefix##_init(name *a, type v) { a->v = (long)v; } \
+static inline type prefix##_load(name *a, ChiakiMemoryOrder o) { (void)o; return (type)_InterlockedCompareExchange(&a->v, 0, 0); } \
+static inline void prefix##_store(name *a, type v, ChiakiMemoryOrder o) { (void)o; _InterlockedExchange(&a->v, (long)v); } \
+static inline type prefix##_exchange(name *a, type v, ChiakiMemoryOrder o) { (void)o; return (type)_InterlockedExchange(&a->v, (long)v); } \
+static inline bool prefix##_compare_exchange(name *a, type *expected, type desired, ChiakiMemoryOrder o) \
+{ \
+	(void)o; \
+	long prev = _InterlockedCompareExchange(&a->v, (long)desired, (long)*expected); \
+	if(prev == (long)*expected) \
+		return true; \
+	*expected = (type)prev; \
+	return false; \
+}
+
+#define CHIAKI_ATOMIC_DEFINE_32_ARITH(name, prefix, type) \
+static inline type prefix##_fetch_add(name *a, type v, ChiakiMemoryOrder o) { (void)o; return (type)_InterlockedExchangeAdd(&a->v, (long)v); } \
+static inline type prefix##_fetch_sub(name *a, type v, ChiakiMemoryOrder o) { (void)o; return (type)_InterlockedExchangeAdd(&a->v, -(long)v); }
+
+// 64 bit exchange and add are no intrinsics on 32 bit x86, so everything goes through compare-exchange
+#define CHIAKI_ATOMIC_DEFINE_64(name, prefix, type) \
+typedef struct { volatile __int64 v; } name; \
+static inline void prefix##_init(name *a, type v) { a->v = (__int64)v; } \
+static inline type prefix##_load(name *a, ChiakiMemoryOrder o) { (void)o; return (type)_InterlockedCompareExchange64(&a->v, 0, 0); } \
+static inline type prefix##_exchange(name *a, type v, ChiakiMemoryOrder o) \
+{ \
+	(void)o; \
+	__int64 prev = a->v; \
+	__int64 cur; \
+	while((cur = _InterlockedCompareExchange64(&a->v, (__int64)v, prev)) != prev) \
+		prev = cur; \
+	return (type)prev; \
+} \
+static inline void prefix##_store(name *a, type v, ChiakiMemoryOrder o) { prefix##_exchange(a, v, o); } \
+static inline bool prefix##_compare_exchange(name *a, type *expected, type desired, ChiakiMemoryOrder o) \
+{ \
+	(void)o; \
+	__int64 prev = _InterlockedCompareExchange64(&a->v, (__int64)desired, (__int64)*expected); \
+	if(prev == (__int64)*expected) \
+		return true; \
+	*expected = (type)prev; \
+	return false; \
+} \
+static inline type prefix##_fetch_add(name *a, type v, ChiakiMemoryOrder o) \
+{ \
+	(void)o; \
+	__int64 prev = a->v; \
+	__int64 cur; \
+	while((cur = _InterlockedCompareExchange64(&a->v, prev + (__int64)v, prev)) != prev) \
+		prev = cur; \
+	return (type)prev; \
+} \
+static inline type prefix##_fetch_sub(name *a, type v, ChiakiMemoryOrder o) { return prefix##_fetch_add(a, (type)0 - v, o); }
+
+CHIAKI_ATOMIC_DEFINE_32(ChiakiAtomicU32, chiaki_atomic_u32, uint32_t)
+CHIAKI_ATOMIC_DEFINE_32_ARITH(ChiakiAtomicU32, chiaki_atomic_u32, uint32_t)
+CHIAKI_ATOMIC_DEFINE_32(ChiakiAtomicI32, chiaki_atomic_i32, int32_t)
+CHIAKI_ATOMIC_DEFINE_32_ARITH(ChiakiAtomicI32, chiaki_atomic_i32, int32_t)
+CHIAKI_ATOMIC_DEFINE_32(ChiakiAtomicBool, chiaki_atomic_bool, bool)
+CHIAKI_ATOMIC_DEFINE_64(ChiakiAtomicU64, chiaki_atomic_u64, uint64_t)
+#ifdef _WIN64
+CHIAKI_ATOMIC_DEFINE_64(ChiakiAtomicSize, chiaki_atomic_size, size_t)
+CHIAKI_ATOMIC_DEFINE_64(ChiakiAtomicPtr, chiaki_atomic_ptr, uintptr_t)
+#else
+CHIAKI_ATOMIC_DEFINE_32(ChiakiAtomicSize, chiaki_atomic_size, size_t)
+CHIAKI_ATOMIC_DEFINE_32_ARITH(ChiakiAtomicSize, chiaki_atomic_size, size_t)
+CHIAKI_ATOMIC_DEFINE_32(ChiakiAtomicPtr, chiaki_atomic_ptr, uintptr_t)
+CHIAKI_ATOMIC_DEFINE_32_ARITH(ChiakiAtomicPtr, chiaki_atomic_ptr, uintptr_t)
+#endif
+
+#else
+
+#include <stdatomic.h>
+
+typedef memory_order ChiakiMemoryOrder;
+#define CHIAKI_MEMORY_ORDER_RELAXED memory_order_relaxed
+#define CHIAKI_MEMORY_ORDER_ACQUIRE memory_order_acquire
+#define CHIAKI_MEMORY_ORDER_RELEASE memory_order_release
+#define CHIAKI_MEMORY_ORDER_ACQ_REL memory_order_acq_rel
+#define CHIAKI_MEMORY_ORDER_SEQ_CST memory_order_seq_cst
+
+// a failed compare-exchange only loads, so it must not use a release order
+#define CHIAKI_MEMORY_ORDER_FAILURE(o) \
+	((o) == memory_order_acq_rel ? memory_order_acquire : (o) == memory_order_release ? memory_order_relaxed : (o))
+
+#define CHIAKI_ATOMIC_DEFINE(name, prefix, type) \
+typedef struct { _Atomic(type) v; } name; \
+static inline void prefix##_init(name *a, type v) { atomic_init(&a->v, v); } \
+static inline type prefix##_load(name *a, ChiakiMemoryOrder o) { return atomic_load_explicit(&a->v, o); } \
+static inline void prefix##_store(name *a, type v, ChiakiMemoryOrder o) { atomic_store_explicit(&a->v, v, o); } \
+static inline type prefix##_exchange(name *a, type v, ChiakiMemoryOrder o) { return atomic_exchange_explicit(&a->v, v, o); } \
+static inline bool prefix##_compare_exchange(name *a, type *expected, type desired, ChiakiMemoryOrder o) \
+{ \
+	return atomic_compare_exchange_strong_explicit(&a->v, expected, desired, o, CHIAKI_MEMORY_ORDER_FAILURE(o)); \
+}
+
+#define CHIAKI_ATOMIC_DEFINE_ARITH(name, prefix, type) \
+static inline type prefix##_fetch_add(name *a, type v, ChiakiMemoryOrder o) { return atomic_fetch_add_explicit(&a->v, v, o); } \
+static inline type prefix##_fetch_sub(name *a, type v, ChiakiMemoryOrder o) { return atomic_fetch_sub_explicit(&a->v, v, o); }
+
+CHIAKI_ATOMIC_DEFINE(ChiakiAtomicU32, chiaki_atomic_u32, uint32_t)
+CHIAKI_ATOMIC_DEFINE_ARITH(ChiakiAtomicU32, chiaki_atomic_u32, uint32_t)
+CHIAKI_ATOMIC_DEFINE(ChiakiAtomicI32, chiaki_atomic_i32, int32_t)
+CHIAKI_ATOMIC_DEFINE_ARITH(ChiakiAtomicI32, chiaki_atomic_i32, int32_t)
+CHIAKI_ATOMIC_DEFINE(ChiakiAtomicBool, chiaki_atomic_bool, bool)
+CHIAKI_ATOMIC_DEFINE(ChiakiAtomicU64, chiaki_atomic_u64, uint64_t)
+CHIAKI_ATOMIC_DEFINE_ARITH(ChiakiAtomicU64, chiaki_atomic_u64, uint64_t)
+CHIAKI_ATOMIC_DEFINE(ChiakiAtomicSize, chiaki_atomic_size, size_t)
+CHIAKI_ATOMIC_DEFINE_ARITH(ChiakiAtomicSize, chiaki_atomic_size, size_t)
+CHIAKI_ATOMIC_DEFINE(ChiakiAtomicPtr, chiaki_atomic_ptr, uintptr_t)
+CHIAKI_ATOMIC_DEFINE_ARITH(ChiakiAtomicPtr, chiaki_atomic_ptr, uintptr_t)
+
+#endif
+
+#endif // CHIAKI_ATOMIC_H
@@ -109,6 +109,14 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 		chiaki_packet_stats_push_seq(audio_receiver->packet_stats, packet->frame_index);
 }
 
+CHIAKI_EXPORT void chiaki_audio_receiver_reset(ChiakiAudioReceiver *audio_receiver)
+{
+	chiaki_mutex_lock(&audio_receiver->mutex);
+	audio_receiver->frame_index_prev = 0;
+	audio_receiver->frame_index_startup = true;
+	chiaki_mutex_unlock(&audio_receiver->mutex);
+}
+
 static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
 {
 	chiaki_mutex_lock(&audio_receiver->mutex);
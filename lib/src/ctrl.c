@@ -29,6 +29,11 @@
 
 #define CTRL_EXPECT_TIMEOUT 5000
 
+#define CTRL_MESSAGE_HEADER_SIZE 8
+
+// ivs to have ready for each direction while waiting for messages
+#define CTRL_IV_PREGENERATE_COUNT 4
+
 typedef enum ctrl_message_type_t {
 	CTRL_MESSAGE_TYPE_SESSION_ID = 0x33,
 	CTRL_MESSAGE_TYPE_HEARTBEAT_REQ = 0xfe,
@@ -55,14 +60,6 @@ typedef enum ctrl_login_state_t {
 	CTRL_LOGIN_STATE_PIN_INCORRECT = 0x1
 } CtrlLoginState;
 
-struct chiaki_ctrl_message_queue_t
-{
-	ChiakiCtrlMessageQueue *next;
-	uint16_t type;
-	uint8_t *payload;
-	size_t payload_size;
-};
-
 typedef struct ctrl_keyboard_open_t
 {
 	uint8_t unk[0x1C];
@@ -93,6 +90,9 @@ void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
 
 static void *ctrl_thread_func(void *user);
 static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size);
+static uint8_t *ctrl_send_queue_reserve(ChiakiCtrl *ctrl, uint16_t type, size_t payload_size);
+static ChiakiErrorCode ctrl_send_queue_append(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size);
+static ChiakiErrorCode ctrl_send_queue_flush(ChiakiCtrl *ctrl);
 static void ctrl_enable_features(ChiakiCtrl *ctrl);
 static void ctrl_message_received_session_id(ChiakiCtrl *ctrl, uint8_t *payload, size_t payload_size);
 static void ctrl_message_received_heartbeat_req(ChiakiCtrl *ctrl, uint8_t *payload, size_t payload_size);
@@ -111,7 +111,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_init(ChiakiCtrl *ctrl, ChiakiSession *
 	ctrl->login_pin_requested = false;
 	ctrl->login_pin = NULL;
 	ctrl->login_pin_size = 0;
-	ctrl->msg_queue = NULL;
+	ctrl->send_queue_size = 0;
+	ctrl->recv_buf_offset = 0;
+	ctrl->recv_buf_size = 0;
 	ctrl->keyboard_text_counter = 0;
 
 	ChiakiErrorCode err = chiaki_stop_pipe_init(&ctrl->notif_pipe);
@@ -160,47 +162,17 @@ CHIAKI_EXPORT void chiaki_ctrl_fini(ChiakiCtrl *ctrl)
 	free(ctrl->login_pin);
 }
 
-static void ctrl_message_queue_free(ChiakiCtrlMessageQueue *queue)
-{
-	free(queue->payload);
-	free(queue);
-}
-
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_send_message(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size)
 {
-	ChiakiCtrlMessageQueue *queue = CHIAKI_NEW(ChiakiCtrlMessageQueue);
-	if(!queue)
-		return CHIAKI_ERR_MEMORY;
-	queue->next = NULL;
-	queue->type = type;
-	if(payload)
-	{
-		queue->payload = malloc(payload_size);
-		if(!queue->payload)
-		{
-			free(queue);
-			return CHIAKI_ERR_MEMORY;
-		}
-		memcpy(queue->payload, payload, payload_size);
-		queue->payload_size = payload_size;
-	}
-	else
-	{
-		queue->payload = NULL;
-		queue->payload_size = 0;
-	}
 	ChiakiErrorCode err = chiaki_mutex_lock(&ctrl->notif_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	if(!ctrl->msg_queue)
-		ctrl->msg_queue = queue;
-	else
+	err = ctrl_send_queue_append(ctrl, type, payload, payload_size);
+	chiaki_mutex_unlock(&ctrl->notif_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		ChiakiCtrlMessageQueue *c = ctrl->msg_queue;
-		while(c->next)
-			c = c->next;
-		c->next = queue;
+		CHIAKI_LOGE(ctrl->session->log, "Ctrl send queue full, dropping message type %#x", (unsigned int)type);
+		return err;
 	}
-	chiaki_mutex_unlock(&ctrl->notif_mutex);
 	chiaki_stop_pipe_stop(&ctrl->notif_pipe);
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -232,22 +204,26 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_keyboard_set_text(ChiakiCtrl *ctrl, co
 	const uint32_t length = strlen(text);
 	const size_t payload_size = sizeof(CtrlKeyboardTextRequestMessage) + length;
 
-	uint8_t *payload = malloc(payload_size);
+	// build the message right inside the send queue
+	ChiakiErrorCode err = chiaki_mutex_lock(&ctrl->notif_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	uint8_t *payload = ctrl_send_queue_reserve(ctrl, CTRL_MESSAGE_TYPE_KEYBOARD_TEXT_CHANGE_REQ, payload_size);
 	if(!payload)
-		return CHIAKI_ERR_MEMORY;
-	memset(payload, 0, payload_size);
-	memcpy(payload + sizeof(CtrlKeyboardTextRequestMessage), text, length);
-
-	CtrlKeyboardTextRequestMessage *msg = (CtrlKeyboardTextRequestMessage *)payload;
-	msg->counter = ntohl(++ctrl->keyboard_text_counter);
-	msg->text_length1 = ntohl(length);
-	msg->text_length2 = ntohl(length);
-
-	ChiakiErrorCode err;
-	err = chiaki_ctrl_send_message(ctrl, CTRL_MESSAGE_TYPE_KEYBOARD_TEXT_CHANGE_REQ, payload, payload_size);
+	{
+		chiaki_mutex_unlock(&ctrl->notif_mutex);
+		CHIAKI_LOGE(ctrl->session->log, "Ctrl send queue full, dropping keyboard text");
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	}
+	CtrlKeyboardTextRequestMessage msg = { 0 };
+	msg.counter = ntohl(++ctrl->keyboard_text_counter);
+	msg.text_length1 = ntohl(length);
+	msg.text_length2 = ntohl(length);
+	memcpy(payload, &msg, sizeof(msg));
+	memcpy(payload + sizeof(msg), text, length);
+	chiaki_mutex_unlock(&ctrl->notif_mutex);
 
-	free(payload);
-	return err;
+	chiaki_stop_pipe_stop(&ctrl->notif_pipe);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_keyboard_accept(ChiakiCtrl *ctrl)
@@ -295,14 +271,15 @@ static void *ctrl_thread_func(void *user)
 	while(true)
 	{
 		bool overflow = false;
-		while(ctrl->recv_buf_size >= 8)
+		while(ctrl->recv_buf_size - ctrl->recv_buf_offset >= CTRL_MESSAGE_HEADER_SIZE)
 		{
-			uint32_t payload_size = *((uint32_t *)ctrl->recv_buf);
+			uint8_t *msg = ctrl->recv_buf + ctrl->recv_buf_offset;
+			uint32_t payload_size = *((chiaki_unaligned_uint32_t *)msg);
 			payload_size = ntohl(payload_size);
 
-			if(ctrl->recv_buf_size < 8 + payload_size)
+			if(ctrl->recv_buf_size - ctrl->recv_buf_offset < CTRL_MESSAGE_HEADER_SIZE + (size_t)payload_size)
 			{
-				if(8 + payload_size > sizeof(ctrl->recv_buf))
+				if(CTRL_MESSAGE_HEADER_SIZE + (size_t)payload_size > sizeof(ctrl->recv_buf))
 				{
 					CHIAKI_LOGE(ctrl->session->log, "Ctrl buffer overflow!");
 					overflow = true;
@@ -310,13 +287,11 @@ static void *ctrl_thread_func(void *user)
 				break;
 			}
 
-			uint16_t msg_type = *((chiaki_unaligned_uint16_t *)(ctrl->recv_buf + 4));
+			uint16_t msg_type = *((chiaki_unaligned_uint16_t *)(msg + 4));
 			msg_type = ntohs(msg_type);
 
-			ctrl_message_received(ctrl, msg_type, ctrl->recv_buf + 8, (size_t)payload_size);
-			ctrl->recv_buf_size -= 8 + payload_size;
-			if(ctrl->recv_buf_size > 0)
-				memmove(ctrl->recv_buf, ctrl->recv_buf + 8 + payload_size, ctrl->recv_buf_size);
+			ctrl_message_received(ctrl, msg_type, msg + CTRL_MESSAGE_HEADER_SIZE, (size_t)payload_size);
+			ctrl->recv_buf_offset += CTRL_MESSAGE_HEADER_SIZE + payload_size;
 		}
 
 		if(overflow)
@@ -325,6 +300,20 @@ static void *ctrl_thread_func(void *user)
 			break;
 		}
 
+		// only move the beginning of a partial message to the front once there is no more space behind it
+		if(ctrl->recv_buf_offset == ctrl->recv_buf_size)
+			ctrl->recv_buf_offset = ctrl->recv_buf_size = 0;
+		else if(ctrl->recv_buf_size == sizeof(ctrl->recv_buf))
+		{
+			ctrl->recv_buf_size -= ctrl->recv_buf_offset;
+			memmove(ctrl->recv_buf, ctrl->recv_buf + ctrl->recv_buf_offset, ctrl->recv_buf_size);
+			ctrl->recv_buf_offset = 0;
+		}
+
+		// cached ivs are only recomputed when the counters have moved on
+		chiaki_rpcrypt_pregenerate_ivs(&ctrl->session->rpcrypt, ctrl->crypt_counter_local, CTRL_IV_PREGENERATE_COUNT);
+		chiaki_rpcrypt_pregenerate_ivs(&ctrl->session->rpcrypt, ctrl->crypt_counter_remote, CTRL_IV_PREGENERATE_COUNT);
+
 		chiaki_mutex_unlock(&ctrl->notif_mutex);
 		err = chiaki_stop_pipe_select_single(&ctrl->notif_pipe, ctrl->sock, false, UINT64_MAX);
 		chiaki_mutex_lock(&ctrl->notif_mutex);
@@ -332,12 +321,9 @@ static void *ctrl_thread_func(void *user)
 		bool msg_queue_updated = false;
 		if(err == CHIAKI_ERR_CANCELED)
 		{
-			while(ctrl->msg_queue)
+			if(ctrl->send_queue_size > 0)
 			{
-				ctrl_message_send(ctrl, ctrl->msg_queue->type, ctrl->msg_queue->payload, ctrl->msg_queue->payload_size);
-				ChiakiCtrlMessageQueue *next = ctrl->msg_queue->next;
-				ctrl_message_queue_free(ctrl->msg_queue);
-				ctrl->msg_queue = next;
+				ctrl_send_queue_flush(ctrl);
 				msg_queue_updated = true;
 			}
 
@@ -391,64 +377,106 @@ static void *ctrl_thread_func(void *user)
 	return NULL;
 }
 
-static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size)
+/**
+ * Append a message to the send queue, notif_mutex must be locked.
+ *
+ * @return pointer where the plaintext payload must be written, or NULL if the queue is full
+ */
+static uint8_t *ctrl_send_queue_reserve(ChiakiCtrl *ctrl, uint16_t type, size_t payload_size)
 {
-	assert(payload_size == 0 || payload);
+	if(payload_size > UINT32_MAX
+		|| CTRL_MESSAGE_HEADER_SIZE + payload_size > sizeof(ctrl->send_queue) - ctrl->send_queue_size)
+		return NULL;
 
-	CHIAKI_LOGV(ctrl->session->log, "Ctrl sending message type %x, size %llx\n",
-			(unsigned int)type, (unsigned long long)payload_size);
-	if(payload)
-		chiaki_log_hexdump(ctrl->session->log, CHIAKI_LOG_VERBOSE, payload, payload_size);
+	uint8_t *msg = ctrl->send_queue + ctrl->send_queue_size;
+	*((chiaki_unaligned_uint32_t *)msg) = htonl((uint32_t)payload_size);
+	*((chiaki_unaligned_uint16_t *)(msg + 4)) = htons(type);
+	*((chiaki_unaligned_uint16_t *)(msg + 6)) = 0;
+	ctrl->send_queue_size += CTRL_MESSAGE_HEADER_SIZE + payload_size;
+	return msg + CTRL_MESSAGE_HEADER_SIZE;
+}
+
+static ChiakiErrorCode ctrl_send_queue_append(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size)
+{
+	assert(payload_size == 0 || payload);
+	uint8_t *dst = ctrl_send_queue_reserve(ctrl, type, payload_size);
+	if(!dst)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	if(payload_size)
+		memcpy(dst, payload, payload_size);
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	uint8_t *enc = NULL;
-	if(payload && payload_size)
+/**
+ * Encrypt all queued messages in place and send them with a single call, notif_mutex must be locked.
+ * Only called from the ctrl thread, which owns crypt_counter_local.
+ */
+static ChiakiErrorCode ctrl_send_queue_flush(ChiakiCtrl *ctrl)
+{
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	for(size_t off=0; off<ctrl->send_queue_size;)
 	{
-		enc = malloc(payload_size);
-		if(!enc)
-			return CHIAKI_ERR_MEMORY;
-		ChiakiErrorCode err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, ctrl->crypt_counter_local++, payload, enc, payload_size);
-		if(err != CHIAKI_ERR_SUCCESS)
+		uint8_t *msg = ctrl->send_queue + off;
+		size_t payload_size = ntohl(*((chiaki_unaligned_uint32_t *)msg));
+		uint8_t *payload = msg + CTRL_MESSAGE_HEADER_SIZE;
+
+		CHIAKI_LOGV(ctrl->session->log, "Ctrl sending message type %x, size %llx\n",
+				(unsigned int)ntohs(*((chiaki_unaligned_uint16_t *)(msg + 4))), (unsigned long long)payload_size);
+		if(payload_size)
 		{
-			CHIAKI_LOGE(ctrl->session->log, "Ctrl failed to encrypt payload");
-			free(enc);
-			return err;
+			chiaki_log_hexdump(ctrl->session->log, CHIAKI_LOG_VERBOSE, payload, payload_size);
+			err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, ctrl->crypt_counter_local++, payload, payload, payload_size);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGE(ctrl->session->log, "Ctrl failed to encrypt payload");
+				goto beach;
+			}
 		}
+		off += CTRL_MESSAGE_HEADER_SIZE + payload_size;
 	}
 
-#ifdef __GNUC__
-	__attribute__((aligned(__alignof__(uint32_t))))
-#endif
-	uint8_t header[8];
-	*((uint32_t *)header) = htonl((uint32_t)payload_size);
-	*((uint16_t *)(header + 4)) = htons(type);
-	*((uint16_t *)(header + 6)) = 0;
-
-	int sent = send(ctrl->sock, header, sizeof(header), 0);
-	if(sent < 0)
-	{
-		CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message Header");
-		return CHIAKI_ERR_NETWORK;
-	}
-
-	if(enc)
+	size_t sent_total = 0;
+	while(sent_total < ctrl->send_queue_size)
 	{
-		sent = send(ctrl->sock, enc, payload_size, 0);
-		free(enc);
+		int sent = send(ctrl->sock, (const char *)ctrl->send_queue + sent_total, ctrl->send_queue_size - sent_total, 0);
 		if(sent < 0)
 		{
-			CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message Payload");
-			return CHIAKI_ERR_NETWORK;
+			CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Messages: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			err = CHIAKI_ERR_NETWORK;
+			goto beach;
 		}
+		sent_total += (size_t)sent;
 	}
 
-	return CHIAKI_ERR_SUCCESS;
+beach:
+	ctrl->send_queue_size = 0;
+	return err;
+}
+
+/**
+ * Send a message from the ctrl thread right away, together with everything that is already queued.
+ */
+static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size)
+{
+	ChiakiErrorCode err = ctrl_send_queue_append(ctrl, type, payload, payload_size);
+	if(err == CHIAKI_ERR_BUF_TOO_SMALL && ctrl->send_queue_size > 0)
+	{
+		ctrl_send_queue_flush(ctrl);
+		err = ctrl_send_queue_append(ctrl, type, payload, payload_size);
+	}
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(ctrl->session->log, "Ctrl message type %#x is too big to send", (unsigned int)type);
+		return err;
+	}
+	return ctrl_send_queue_flush(ctrl);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode ctrl_message_connect_microphone(ChiakiCtrl *ctrl)
 {
 	CHIAKI_LOGV(ctrl->session->log, "Ctrl sending microphone connect message");
 	uint8_t connect[2] = {0x00, 0x00};
-	ChiakiErrorCode err = ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_MIC_CONNECT, connect, 0x2);
+	ChiakiErrorCode err = chiaki_ctrl_send_message(ctrl, CTRL_MESSAGE_TYPE_MIC_CONNECT, connect, 0x2);
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -458,13 +486,20 @@ CHIAKI_EXPORT ChiakiErrorCode ctrl_message_connect_microphone(ChiakiCtrl *ctrl)
 	return CHIAKI_ERR_SUCCESS;
 }
 
+static void ctrl_mic_toggle_payload(uint8_t *toggle, bool muted)
+{
+	toggle[0] = 0;
+	toggle[1] = 1;
+	toggle[2] = muted ? 0 : 1;
+	toggle[3] = 89;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode ctrl_message_toggle_microphone(ChiakiCtrl *ctrl, bool muted)
 {
 	CHIAKI_LOGV(ctrl->session->log, "Ctrl sending toggle microphone mute message: %s", muted ? "unmute": "mute");
-	uint8_t toggle[0x4] = {0, 1, 1, 89};
-	if(muted)
-		toggle[2] = 0;
-	ChiakiErrorCode err = ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_MIC_TOGGLE, toggle, 0x4);
+	uint8_t toggle[0x4];
+	ctrl_mic_toggle_payload(toggle, muted);
+	ChiakiErrorCode err = chiaki_ctrl_send_message(ctrl, CTRL_MESSAGE_TYPE_MIC_TOGGLE, toggle, 0x4);
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -540,8 +575,11 @@ static void ctrl_enable_features(ChiakiCtrl *ctrl)
 		ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_KEYBOARD_ENABLE, signature, 0x10);
 		ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_KEYBOARD_ENABLE_TOGGLE, &enable, 1);
 	}
-	ctrl_message_toggle_microphone(ctrl, false);
-	ctrl_message_toggle_microphone(ctrl, false);
+	// called on the ctrl thread with notif_mutex locked, so send directly instead of through chiaki_ctrl_send_message()
+	uint8_t toggle[0x4];
+	ctrl_mic_toggle_payload(toggle, false);
+	ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_MIC_TOGGLE, toggle, 0x4);
+	ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_MIC_TOGGLE, toggle, 0x4);
 	uint8_t display[0x4] = { 0x00, 0x00, 0x00, 0x00 };
 	ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_DISPLAY_DEVICES, display, 0x4);
 }
@@ -1038,6 +1076,7 @@ static ChiakiErrorCode ctrl_connect(ChiakiCtrl *ctrl)
 	ctrl->sock = sock;
 
 	// if we already got more data than the header, put the rest in the buffer.
+	ctrl->recv_buf_offset = 0;
 	ctrl->recv_buf_size = received_size - header_size;
 	if(ctrl->recv_buf_size > 0)
 		memcpy(ctrl->recv_buf, buf + header_size, ctrl->recv_buf_size);
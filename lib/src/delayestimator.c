@@ -0,0 +1,164 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/delayestimator.h>
+
+#include <string.h>
+
+#define FPS_DEFAULT 60
+
+// gains of the exponential smoothing
+#define SMOOTHING_STATS 0.125
+#define SMOOTHING_DELAY 0.1
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_delay_estimator_init(ChiakiDelayEstimator *estimator)
+{
+	ChiakiErrorCode err = chiaki_mutex_init(&estimator->estimate_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_delay_estimator_reset(estimator, 0);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_fini(ChiakiDelayEstimator *estimator)
+{
+	chiaki_mutex_fini(&estimator->estimate_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_reset(ChiakiDelayEstimator *estimator, unsigned int fps)
+{
+	estimator->frame_interval_us = 1000000 / (fps ? fps : FPS_DEFAULT);
+	estimator->frame_active = false;
+	estimator->prev_valid = false;
+	estimator->delay_ms = 0.0;
+	estimator->delay_min_ms = 0.0;
+	estimator->delay_smoothed_ms = 0.0;
+	estimator->window_pos = 0;
+	estimator->window_count = 0;
+
+	chiaki_mutex_lock(&estimator->estimate_mutex);
+	memset(&estimator->estimate, 0, sizeof(estimator->estimate));
+	chiaki_mutex_unlock(&estimator->estimate_mutex);
+}
+
+static double smooth(double avg, double value, double gain, bool first)
+{
+	return first ? value : avg + gain * (value - avg);
+}
+
+/**
+ * Least squares slope of the delay over time in the window
+ */
+static double delay_trend(ChiakiDelayEstimator *estimator)
+{
+	size_t n = estimator->window_count;
+	if(n < 2)
+		return 0.0;
+	double time_avg = 0.0, delay_avg = 0.0;
+	for(size_t i=0; i<n; i++)
+	{
+		time_avg += estimator->window_time_ms[i];
+		delay_avg += estimator->window_delay_ms[i];
+	}
+	time_avg /= n;
+	delay_avg /= n;
+	double num = 0.0, denom = 0.0;
+	for(size_t i=0; i<n; i++)
+	{
+		double dt = estimator->window_time_ms[i] - time_avg;
+		num += dt * (estimator->window_delay_ms[i] - delay_avg);
+		denom += dt * dt;
+	}
+	return denom > 0.0 ? num / denom : 0.0;
+}
+
+static void delay_estimator_frame_finished(ChiakiDelayEstimator *estimator)
+{
+	ChiakiDelayEstimate estimate;
+	chiaki_mutex_lock(&estimator->estimate_mutex);
+	estimate = estimator->estimate;
+	chiaki_mutex_unlock(&estimator->estimate_mutex);
+
+	bool first = estimate.frames == 0;
+	estimate.kernel_timestamps = estimator->frame_kernel_timestamps;
+	double spread_ms = (double)(estimator->frame_last_us - estimator->frame_first_us) / 1000.0;
+	estimate.frame_spread_ms = smooth(estimate.frame_spread_ms, spread_ms, SMOOTHING_STATS, first);
+
+	ChiakiSeqNum16 frames_since_prev = (ChiakiSeqNum16)(estimator->frame_index - estimator->prev_frame_index);
+	uint64_t delta_us = estimator->frame_first_us - estimator->prev_first_us;
+	if(estimator->prev_valid && estimator->frame_first_us >= estimator->prev_first_us
+		&& frames_since_prev > 0 && frames_since_prev < 0x8000 && delta_us < CHIAKI_DELAY_ESTIMATOR_GAP_MAX_US)
+	{
+		double interval_ms = (double)delta_us / 1000.0 / frames_since_prev;
+		double gradient_ms = ((double)delta_us - (double)frames_since_prev * estimator->frame_interval_us) / 1000.0;
+		bool first_delta = estimator->window_count == 0;
+		estimate.frame_interval_ms = smooth(estimate.frame_interval_ms, interval_ms, SMOOTHING_STATS, first_delta);
+		estimate.gradient_ms = smooth(estimate.gradient_ms, gradient_ms / frames_since_prev, SMOOTHING_STATS, first_delta);
+
+		estimator->delay_ms += gradient_ms;
+		if(estimator->delay_ms < estimator->delay_min_ms)
+			estimator->delay_min_ms = estimator->delay_ms;
+		estimator->delay_smoothed_ms = smooth(estimator->delay_smoothed_ms, estimator->delay_ms, SMOOTHING_DELAY, first_delta);
+		estimate.queue_delay_ms = estimator->delay_ms - estimator->delay_min_ms;
+
+		estimator->window_time_ms[estimator->window_pos] = (double)(estimator->frame_first_us - estimator->base_us) / 1000.0;
+		estimator->window_delay_ms[estimator->window_pos] = estimator->delay_smoothed_ms;
+		estimator->window_pos = (estimator->window_pos + 1) % CHIAKI_DELAY_ESTIMATOR_WINDOW;
+		if(estimator->window_count < CHIAKI_DELAY_ESTIMATOR_WINDOW)
+			estimator->window_count++;
+		estimate.trend = delay_trend(estimator);
+	}
+	else
+	{
+		// first frame or after a gap, the delay can only be compared from here on
+		estimator->base_us = estimator->frame_first_us;
+		estimator->delay_ms = 0.0;
+		estimator->delay_min_ms = 0.0;
+		estimator->delay_smoothed_ms = 0.0;
+		estimator->window_pos = 0;
+		estimator->window_count = 0;
+		estimate.trend = 0.0;
+		estimate.queue_delay_ms = 0.0;
+	}
+	estimate.frames++;
+
+	estimator->prev_valid = true;
+	estimator->prev_frame_index = estimator->frame_index;
+	estimator->prev_first_us = estimator->frame_first_us;
+
+	chiaki_mutex_lock(&estimator->estimate_mutex);
+	estimator->estimate = estimate;
+	chiaki_mutex_unlock(&estimator->estimate_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_push_packet(ChiakiDelayEstimator *estimator, ChiakiSeqNum16 frame_index,
+		uint64_t timestamp_us, bool kernel_timestamp)
+{
+	if(estimator->frame_active)
+	{
+		if(frame_index == estimator->frame_index)
+		{
+			if(timestamp_us < estimator->frame_first_us)
+				estimator->frame_first_us = timestamp_us;
+			if(timestamp_us > estimator->frame_last_us)
+				estimator->frame_last_us = timestamp_us;
+			estimator->frame_kernel_timestamps = estimator->frame_kernel_timestamps && kernel_timestamp;
+			return;
+		}
+		if(!chiaki_seq_num_16_gt(frame_index, estimator->frame_index))
+			return; // late unit of an older frame
+		delay_estimator_frame_finished(estimator);
+	}
+
+	estimator->frame_active = true;
+	estimator->frame_index = frame_index;
+	estimator->frame_first_us = timestamp_us;
+	estimator->frame_last_us = timestamp_us;
+	estimator->frame_kernel_timestamps = kernel_timestamp;
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_get(ChiakiDelayEstimator *estimator, ChiakiDelayEstimate *estimate)
+{
+	chiaki_mutex_lock(&estimator->estimate_mutex);
+	*estimate = estimator->estimate;
+	chiaki_mutex_unlock(&estimator->estimate_mutex);
+}
@@ -11,17 +11,29 @@
 #include <netinet/in.h>
 #endif
 
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if.h>
+#endif
+
 static void *discovery_service_thread_func(void *user);
 static void discovery_service_ping(ChiakiDiscoveryService *service);
 static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service);
 static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *user);
 static void discovery_service_report_state(ChiakiDiscoveryService *service);
+static chiaki_socket_t discovery_service_netif_sock_open(ChiakiDiscoveryService *service);
+static bool discovery_service_netif_changed(ChiakiDiscoveryService *service);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log)
 {
 	service->log = log;
 	service->options = *options;
 	service->ping_index = 0;
+	service->ping_interval_ms = service->options.ping_ms;
+	service->hosts_changed = false;
+	service->should_stop = false;
+	service->refresh = false;
 
 	service->hosts = calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryHost));
 	if(!service->hosts)
@@ -37,9 +49,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryServi
 
 	service->hosts_count = 0;
 
+	service->host_table_size = 4;
+	while(service->host_table_size < service->options.hosts_max * 2)
+		service->host_table_size <<= 1;
+	service->host_table = calloc(service->host_table_size, sizeof(size_t));
+	if(!service->host_table)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_host_discovery_infos;
+	}
+
 	err = chiaki_mutex_init(&service->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_host_discovery_infos;
+		goto error_host_table;
 
 	service->options.send_addr = malloc(service->options.send_addr_size);
 	if(!service->options.send_addr)
@@ -53,25 +75,35 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryServi
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_send_addr;
 
-	err = chiaki_bool_pred_cond_init(&service->stop_cond);
+	err = chiaki_stop_pipe_init(&service->wakeup_pipe);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_discovery;
 
+	service->netif_seq = 0;
+	service->netif_index = 0;
+	service->netif_link_flags = 0;
+	service->netif_link_flags_valid = false;
+	service->netif_sock = discovery_service_netif_sock_open(service);
+
 	err = chiaki_thread_create(&service->thread, discovery_service_thread_func, service);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_stop_cond;
+		goto error_wakeup_pipe;
 
 	chiaki_thread_set_name(&service->thread, "Chiaki Discovery Service");
 
 	return CHIAKI_ERR_SUCCESS;
-error_stop_cond:
-	chiaki_bool_pred_cond_fini(&service->stop_cond);
+error_wakeup_pipe:
+	if(!CHIAKI_SOCKET_IS_INVALID(service->netif_sock))
+		CHIAKI_SOCKET_CLOSE(service->netif_sock);
+	chiaki_stop_pipe_fini(&service->wakeup_pipe);
 error_discovery:
 	chiaki_discovery_fini(&service->discovery);
 error_send_addr:
 	free(service->options.send_addr);
 error_state_mutex:
 	chiaki_mutex_fini(&service->state_mutex);
+error_host_table:
+	free(service->host_table);
 error_host_discovery_infos:
 	free(service->host_discovery_infos);
 error_hosts:
@@ -81,9 +113,16 @@ error_hosts:
 
 CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service)
 {
-	chiaki_bool_pred_cond_signal(&service->stop_cond);
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	service->should_stop = true;
+	chiaki_stop_pipe_stop(&service->wakeup_pipe);
+	chiaki_mutex_unlock(&service->state_mutex);
+
 	chiaki_thread_join(&service->thread, NULL);
-	chiaki_bool_pred_cond_fini(&service->stop_cond);
+	if(!CHIAKI_SOCKET_IS_INVALID(service->netif_sock))
+		CHIAKI_SOCKET_CLOSE(service->netif_sock);
+	chiaki_stop_pipe_fini(&service->wakeup_pipe);
 	chiaki_discovery_fini(&service->discovery);
 	chiaki_mutex_fini(&service->state_mutex);
 	free(service->options.send_addr);
@@ -96,35 +135,87 @@ CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service
 #undef FREE_STRING
 	}
 
+	free(service->host_table);
 	free(service->host_discovery_infos);
 	free(service->hosts);
 }
 
+CHIAKI_EXPORT void chiaki_discovery_service_refresh(ChiakiDiscoveryService *service)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	service->refresh = true;
+	chiaki_stop_pipe_stop(&service->wakeup_pipe);
+	chiaki_mutex_unlock(&service->state_mutex);
+}
+
 static void *discovery_service_thread_func(void *user)
 {
 	ChiakiDiscoveryService *service = user;
 
-	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&service->stop_cond);
+	ChiakiDiscoveryThread discovery_thread;
+	ChiakiErrorCode err = chiaki_discovery_thread_start(&discovery_thread, &service->discovery, discovery_service_host_received, service);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return NULL;
 
-	ChiakiDiscoveryThread discovery_thread;
-	err = chiaki_discovery_thread_start(&discovery_thread, &service->discovery, discovery_service_host_received, service);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+	discovery_service_ping(service);
 
 	while(true)
 	{
-		err = chiaki_bool_pred_cond_timedwait(&service->stop_cond, service->options.ping_ms);
-		if(err != CHIAKI_ERR_TIMEOUT)
+		err = chiaki_mutex_lock(&service->state_mutex);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		uint64_t timeout_ms = service->ping_interval_ms;
+		chiaki_mutex_unlock(&service->state_mutex);
+
+		err = chiaki_stop_pipe_select_single(&service->wakeup_pipe, service->netif_sock, false, timeout_ms);
+
+		bool reset_interval = false;
+		if(err == CHIAKI_ERR_CANCELED)
+		{
+			// reset before reading the flags so a wakeup that comes in between is not lost
+			chiaki_stop_pipe_reset(&service->wakeup_pipe);
+			err = chiaki_mutex_lock(&service->state_mutex);
+			assert(err == CHIAKI_ERR_SUCCESS);
+			bool stop = service->should_stop;
+			reset_interval = service->refresh;
+			service->refresh = false;
+			chiaki_mutex_unlock(&service->state_mutex);
+			if(stop)
+				break;
+			if(!reset_interval)
+				continue;
+			CHIAKI_LOGV(service->log, "Discovery Service refresh requested");
+		}
+		else if(err == CHIAKI_ERR_SUCCESS)
+		{
+			if(!discovery_service_netif_changed(service))
+				continue;
+			CHIAKI_LOGI(service->log, "Discovery Service detected network interface change, probing for hosts");
+			reset_interval = true;
+		}
+		else if(err != CHIAKI_ERR_TIMEOUT)
+		{
+			CHIAKI_LOGE(service->log, "Discovery Service failed to wait for next ping");
 			break;
+		}
+
 		discovery_service_ping(service);
+
+		err = chiaki_mutex_lock(&service->state_mutex);
+		assert(err == CHIAKI_ERR_SUCCESS);
+		if(reset_interval || service->hosts_changed || service->options.ping_ms_max <= service->options.ping_ms)
+			service->ping_interval_ms = service->options.ping_ms;
+		else if(service->ping_interval_ms < service->options.ping_ms_max)
+		{
+			service->ping_interval_ms *= 2;
+			if(service->ping_interval_ms > service->options.ping_ms_max)
+				service->ping_interval_ms = service->options.ping_ms_max;
+		}
+		service->hosts_changed = false;
+		chiaki_mutex_unlock(&service->state_mutex);
 	}
 
 	chiaki_discovery_thread_stop(&discovery_thread);
-
-beach:
-	chiaki_bool_pred_cond_unlock(&service->stop_cond);
 	return NULL;
 }
 
@@ -164,43 +255,105 @@ static void discovery_service_ping(ChiakiDiscoveryService *service)
 		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping for PS5");
 }
 
-static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
+static size_t host_id_hash(const char *host_id)
 {
-	// service->state_mutex must be locked
+	// FNV-1a
+	uint32_t h = 0x811c9dc5;
+	for(; *host_id; host_id++)
+	{
+		h ^= (uint8_t)*host_id;
+		h *= 0x01000193;
+	}
+	return h;
+}
 
-	bool change = false;
+/**
+ * @return the slot in host_table that either contains host_id or is the empty slot where it would be inserted
+ */
+static size_t host_table_slot(ChiakiDiscoveryService *service, const char *host_id)
+{
+	// service->state_mutex must be locked
+	size_t mask = service->host_table_size - 1;
+	for(size_t slot = host_id_hash(host_id) & mask; ; slot = (slot + 1) & mask)
+	{
+		size_t v = service->host_table[slot];
+		if(!v || strcmp(service->hosts[v - 1].host_id, host_id) == 0)
+			return slot;
+	}
+}
 
-	for(size_t i=0; i<service->hosts_count; i++)
+static void host_table_remove_slot(ChiakiDiscoveryService *service, size_t slot)
+{
+	// service->state_mutex must be locked
+	// backward shift deletion, keeps all probe sequences intact without tombstones
+	size_t mask = service->host_table_size - 1;
+	service->host_table[slot] = 0;
+	for(size_t next = (slot + 1) & mask; service->host_table[next]; next = (next + 1) & mask)
 	{
-		if(service->host_discovery_infos[i].last_ping_index + service->options.host_drop_pings >= service->ping_index)
+		size_t ideal = host_id_hash(service->hosts[service->host_table[next] - 1].host_id) & mask;
+		// leave the entry where it is if its ideal slot lies cyclically in (slot, next]
+		bool keep = slot <= next
+			? (slot < ideal && ideal <= next)
+			: (slot < ideal || ideal <= next);
+		if(keep)
 			continue;
+		service->host_table[slot] = service->host_table[next];
+		service->host_table[next] = 0;
+		slot = next;
+	}
+}
 
-		ChiakiDiscoveryHost *host = &service->hosts[i];
-		CHIAKI_LOGI(service->log, "Discovery Service: Host with id %s is no longer available", host->host_id ? host->host_id : "");
+static void discovery_service_remove_host(ChiakiDiscoveryService *service, size_t index)
+{
+	// service->state_mutex must be locked
+	ChiakiDiscoveryHost *host = &service->hosts[index];
+	host_table_remove_slot(service, host_table_slot(service, host->host_id));
+
+	if(service->options.host_cb)
+		service->options.host_cb(CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED, host, service->options.host_cb_user);
 
 #define FREE_STRING(name) do { free((char *)host->name); } while(0)
-		CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
+	CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
 #undef FREE_STRING
 
-		if(i < service->hosts_count - 1)
-		{
-			memmove(service->host_discovery_infos + i,
-					service->host_discovery_infos + i + 1,
-					sizeof(ChiakiDiscoveryServiceHostDiscoveryInfo) * (service->hosts_count - i - 1));
+	// move the last host into the gap instead of shifting all following ones
+	size_t last = service->hosts_count - 1;
+	if(index != last)
+	{
+		service->host_table[host_table_slot(service, service->hosts[last].host_id)] = index + 1;
+		service->hosts[index] = service->hosts[last];
+		service->host_discovery_infos[index] = service->host_discovery_infos[last];
+	}
+	service->hosts_count--;
+}
 
-			memmove(service->hosts + i,
-					service->hosts + i + 1,
-					sizeof(ChiakiDiscoveryHost) * (service->hosts_count - i - 1));
+static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
+{
+	// service->state_mutex must be locked
+
+	bool change = false;
+
+	for(size_t i=0; i<service->hosts_count;)
+	{
+		if(service->host_discovery_infos[i].last_ping_index + service->options.host_drop_pings >= service->ping_index)
+		{
+			i++;
+			continue;
 		}
 
-		change = true;
+		ChiakiDiscoveryHost *host = &service->hosts[i];
+		CHIAKI_LOGI(service->log, "Discovery Service: Host with id %s is no longer available", host->host_id);
 
-		i--;
-		service->hosts_count--;
+		// the last host is moved to i, so don't advance
+		discovery_service_remove_host(service, i);
+		change = true;
 	}
 
 	if(change)
+	{
+		service->hosts_changed = true;
 		discovery_service_report_state(service);
+	}
 }
 
 static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *user)
@@ -218,22 +371,12 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
+	bool added = false;
 	bool change = false;
 
-	size_t index = SIZE_MAX;
-	for(size_t i=0; i<service->hosts_count; i++)
-	{
-		if(!service->hosts[i].host_id)
-			continue;
-
-		if(strcmp(service->hosts[i].host_id, host->host_id) == 0)
-		{
-			index = i;
-			break;
-		}
-	}
-
-	if(index == SIZE_MAX)
+	size_t slot = host_table_slot(service, host->host_id);
+	size_t index;
+	if(!service->host_table[slot])
 	{
 		if(service->hosts_count == service->options.hosts_max)
 		{
@@ -243,10 +386,17 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 
 		CHIAKI_LOGI(service->log, "Discovery Service detected new host with id %s", host->host_id);
 
-		change = true;
-		index = service->hosts_count++;
+		index = service->hosts_count;
 		memset(&service->hosts[index], 0, sizeof(ChiakiDiscoveryHost));
+		service->hosts[index].host_id = strdup(host->host_id);
+		if(!service->hosts[index].host_id)
+			goto rzcon;
+		service->hosts_count++;
+		service->host_table[slot] = index + 1;
+		added = true;
 	}
+	else
+		index = service->host_table[slot] - 1;
 
 	service->host_discovery_infos[index].last_ping_index = service->ping_index;
 
@@ -276,8 +426,16 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 
 #undef UPDATE_STRING
 
-	if(change)
+	if(added || change)
+	{
+		service->hosts_changed = true;
+		if(service->options.host_cb)
+		{
+			service->options.host_cb(added ? CHIAKI_DISCOVERY_SERVICE_HOST_ADDED : CHIAKI_DISCOVERY_SERVICE_HOST_CHANGED,
+					host_slot, service->options.host_cb_user);
+		}
 		discovery_service_report_state(service);
+	}
 
 rzcon:
 	chiaki_mutex_unlock(&service->state_mutex);
@@ -289,3 +447,194 @@ static void discovery_service_report_state(ChiakiDiscoveryService *service)
 	if(service->options.cb)
 		service->options.cb(service->hosts, service->hosts_count, service->options.cb_user);
 }
+
+#ifdef __linux__
+#define NETIF_LINK_FLAGS (IFF_RUNNING | IFF_LOWER_UP)
+
+static void discovery_service_netif_send(ChiakiDiscoveryService *service, struct nlmsghdr *msg)
+{
+	msg->nlmsg_flags = NLM_F_REQUEST;
+	msg->nlmsg_seq = ++service->netif_seq;
+	if(send(service->netif_sock, msg, msg->nlmsg_len, 0) < 0)
+		CHIAKI_LOGW(service->log, "Discovery Service failed to send netlink request");
+}
+
+/**
+ * Ask which interface the pings are routed through, answered by an RTM_NEWROUTE.
+ */
+static void discovery_service_netif_request_route(ChiakiDiscoveryService *service)
+{
+	struct
+	{
+		struct nlmsghdr hdr;
+		struct rtmsg rt;
+		uint8_t attrs[RTA_SPACE(sizeof(struct in6_addr))];
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_type = RTM_GETROUTE;
+	req.rt.rtm_family = service->options.send_addr->sa_family;
+
+	const void *dst;
+	size_t dst_size;
+	if(req.rt.rtm_family == AF_INET6)
+	{
+		dst = &((struct sockaddr_in6 *)service->options.send_addr)->sin6_addr;
+		dst_size = sizeof(struct in6_addr);
+	}
+	else
+	{
+		dst = &((struct sockaddr_in *)service->options.send_addr)->sin_addr;
+		dst_size = sizeof(struct in_addr);
+	}
+	req.rt.rtm_dst_len = (unsigned char)(dst_size * 8);
+	struct rtattr *attr = (struct rtattr *)req.attrs;
+	attr->rta_type = RTA_DST;
+	attr->rta_len = RTA_LENGTH(dst_size);
+	memcpy(RTA_DATA(attr), dst, dst_size);
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(req.rt)) + RTA_SPACE(dst_size);
+
+	service->netif_index = 0;
+	service->netif_link_flags_valid = false;
+	discovery_service_netif_send(service, &req.hdr);
+}
+
+/**
+ * Ask for the current state of netif_index, answered by an RTM_NEWLINK.
+ */
+static void discovery_service_netif_request_link(ChiakiDiscoveryService *service)
+{
+	struct
+	{
+		struct nlmsghdr hdr;
+		struct ifinfomsg ifi;
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.hdr.nlmsg_type = RTM_GETLINK;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = service->netif_index;
+	discovery_service_netif_send(service, &req.hdr);
+}
+
+static int discovery_service_netif_route_oif(struct nlmsghdr *msg)
+{
+	struct rtmsg *rt = NLMSG_DATA(msg);
+	int len = (int)RTM_PAYLOAD(msg);
+	for(struct rtattr *attr = RTM_RTA(rt); RTA_OK(attr, len); attr = RTA_NEXT(attr, len))
+	{
+		if(attr->rta_type == RTA_OIF && RTA_PAYLOAD(attr) >= sizeof(int))
+			return *(int *)RTA_DATA(attr);
+	}
+	return 0;
+}
+#endif
+
+static chiaki_socket_t discovery_service_netif_sock_open(ChiakiDiscoveryService *service)
+{
+#ifdef __linux__
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if(fd < 0)
+	{
+		CHIAKI_LOGW(service->log, "Discovery Service failed to create netlink socket, network interface changes will not be detected");
+		return CHIAKI_INVALID_SOCKET;
+	}
+
+	struct sockaddr_nl addr = { 0 };
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		CHIAKI_LOGW(service->log, "Discovery Service failed to bind netlink socket, network interface changes will not be detected");
+		close(fd);
+		return CHIAKI_INVALID_SOCKET;
+	}
+	service->netif_sock = fd;
+	discovery_service_netif_request_route(service);
+	return fd;
+#else
+	(void)service;
+	return CHIAKI_INVALID_SOCKET;
+#endif
+}
+
+/**
+ * Drain all pending notifications and answers to requests from netif_sock.
+ * @return whether any of them was about an address change or the link of the interface in use going up or down
+ */
+static bool discovery_service_netif_changed(ChiakiDiscoveryService *service)
+{
+#ifdef __linux__
+	bool changed = false;
+	bool request_route = false;
+	uint8_t buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	while(true)
+	{
+		ssize_t received = recv(service->netif_sock, buf, sizeof(buf), 0);
+		if(received <= 0)
+			break;
+		int len = (int)received;
+		for(struct nlmsghdr *msg = (struct nlmsghdr *)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len))
+		{
+			switch(msg->nlmsg_type)
+			{
+				case RTM_NEWROUTE:
+					// route notifications are not subscribed, so this can only be the answer to the request
+					if(msg->nlmsg_seq != service->netif_seq || msg->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+						break;
+					service->netif_index = discovery_service_netif_route_oif(msg);
+					service->netif_link_flags_valid = false;
+					CHIAKI_LOGV(service->log, "Discovery Service pings are routed through interface %d", service->netif_index);
+					if(service->netif_index)
+						discovery_service_netif_request_link(service);
+					break;
+				case RTM_NEWADDR:
+				case RTM_DELADDR:
+					// may also change the route
+					changed = true;
+					request_route = true;
+					break;
+				case RTM_NEWLINK:
+				case RTM_DELLINK:
+				{
+					if(msg->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+						break;
+					struct ifinfomsg *ifi = NLMSG_DATA(msg);
+					if(!service->netif_index)
+					{
+						// no route yet, so the interface that just came up may be what was missing
+						if(msg->nlmsg_type == RTM_NEWLINK && !(ifi->ifi_flags & IFF_LOOPBACK)
+							&& (ifi->ifi_flags & NETIF_LINK_FLAGS) == NETIF_LINK_FLAGS)
+						{
+							changed = true;
+							request_route = true;
+						}
+						break;
+					}
+					if(ifi->ifi_index != service->netif_index)
+						break;
+					if(msg->nlmsg_type == RTM_DELLINK)
+					{
+						changed = true;
+						request_route = true;
+						break;
+					}
+					unsigned int link_flags = ifi->ifi_flags & NETIF_LINK_FLAGS;
+					if(service->netif_link_flags_valid && link_flags != service->netif_link_flags)
+						changed = true;
+					service->netif_link_flags = link_flags;
+					service->netif_link_flags_valid = true;
+					break;
+				}
+				default:
+					break;
+			}
+		}
+	}
+	if(request_route)
+		discovery_service_netif_request_route(service);
+	return changed;
+#else
+	(void)service;
+	return false;
+#endif
+}
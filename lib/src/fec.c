@@ -127,3 +127,45 @@ error_matrix:
 	free(matrix);
 	return err;
 }
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encoder_init(ChiakiFecEncoder *encoder, unsigned int k, unsigned int m)
+{
+	encoder->k = k;
+	encoder->m = m;
+	encoder->matrix = create_matrix(k, m);
+	if(!encoder->matrix)
+		return CHIAKI_ERR_MEMORY;
+
+	encoder->data_ptrs = calloc(k, sizeof(uint8_t *));
+	if(!encoder->data_ptrs)
+		goto error_matrix;
+
+	encoder->coding_ptrs = calloc(m, sizeof(uint8_t *));
+	if(!encoder->coding_ptrs)
+		goto error_data_ptrs;
+
+	return CHIAKI_ERR_SUCCESS;
+error_data_ptrs:
+	free(encoder->data_ptrs);
+error_matrix:
+	free(encoder->matrix);
+	return CHIAKI_ERR_MEMORY;
+}
+
+CHIAKI_EXPORT void chiaki_fec_encoder_fini(ChiakiFecEncoder *encoder)
+{
+	free(encoder->coding_ptrs);
+	free(encoder->data_ptrs);
+	free(encoder->matrix);
+}
+
+CHIAKI_EXPORT void chiaki_fec_encoder_encode(ChiakiFecEncoder *encoder, uint8_t *frame_buf, size_t unit_size)
+{
+	for(size_t i=0; i<encoder->k; i++)
+		encoder->data_ptrs[i] = frame_buf + unit_size * i;
+	for(size_t i=0; i<encoder->m; i++)
+		encoder->coding_ptrs[i] = frame_buf + unit_size * (encoder->k + i);
+
+	jerasure_matrix_encode(encoder->k, encoder->m, CHIAKI_FEC_WORDSIZE, encoder->matrix,
+			(char **)encoder->data_ptrs, (char **)encoder->coding_ptrs, unit_size);
+}
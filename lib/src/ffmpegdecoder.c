@@ -1,9 +1,24 @@
 
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/time.h>
+#include <chiaki/video.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixdesc.h>
 
+#include <string.h>
+
+// decode_time_avg_us moves by 1/DECODE_TIME_AVG_WEIGHT of the difference with every frame
+#define DECODE_TIME_AVG_WEIGHT 16
+// degrade if the average decode time is above this percentage of the frame budget
+#define DEGRADE_BUDGET_PERCENT 90
+// recover if it is below this percentage
+#define RECOVER_BUDGET_PERCENT 50
+// frames to let the average settle after a change before degrading further
+#define DEGRADE_HOLD_FRAMES 60
+// recovering is only attempted after a longer time to avoid oscillating
+#define RECOVER_HOLD_FRAMES 600
+
 static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 {
 	switch(codec)
@@ -16,15 +31,88 @@ static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 	}
 }
 
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_config_init(ChiakiFfmpegDecoderConfig *config)
+{
+	config->threading = CHIAKI_FFMPEG_DECODER_THREADING_AUTO;
+	config->thread_count = 0;
+	config->low_delay = true;
+	config->fast = false;
+	config->frame_budget_us = 0;
+}
+
+static const char *active_threading_name(int active_thread_type)
+{
+	if(active_thread_type & FF_THREAD_FRAME)
+		return "frame";
+	if(active_thread_type & FF_THREAD_SLICE)
+		return "slice";
+	return "no";
+}
+
+static void apply_config(ChiakiFfmpegDecoder *decoder, const ChiakiFfmpegDecoderConfig *config, bool hw)
+{
+	AVCodecContext *ctx = decoder->codec_context;
+	ChiakiFfmpegDecoderThreading threading = config->threading;
+	if(threading == CHIAKI_FFMPEG_DECODER_THREADING_AUTO && !hw)
+		threading = CHIAKI_FFMPEG_DECODER_THREADING_SLICE;
+	bool low_delay = config->low_delay;
+	switch(threading)
+	{
+		case CHIAKI_FFMPEG_DECODER_THREADING_SLICE:
+			ctx->thread_type = FF_THREAD_SLICE;
+			ctx->thread_count = config->thread_count;
+			break;
+		case CHIAKI_FFMPEG_DECODER_THREADING_FRAME:
+			ctx->thread_type = FF_THREAD_FRAME;
+			ctx->thread_count = config->thread_count;
+			// ffmpeg silently falls back to no threading at all if both are set
+			if(low_delay)
+			{
+				CHIAKI_LOGW(decoder->log, "FFMPEG decoder frame threading was requested, which does not work with low delay, disabling low delay");
+				low_delay = false;
+			}
+			break;
+		case CHIAKI_FFMPEG_DECODER_THREADING_NONE:
+			ctx->thread_count = 1;
+			break;
+		default:
+			break;
+	}
+	if(low_delay)
+		ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	if(config->fast)
+		ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+
+	// hardware decoders are fixed function, skipping work does not make them faster
+	decoder->frame_budget_us = hw ? 0 : config->frame_budget_us;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
+{
+	return chiaki_ffmpeg_decoder_init_ex(decoder, log, codec, hw_decoder_name, NULL, frame_available_cb, frame_available_cb_user);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init_ex(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
+		ChiakiCodec codec, const char *hw_decoder_name, const ChiakiFfmpegDecoderConfig *config,
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
 {
 	decoder->log = log;
 	decoder->frame_available_cb = frame_available_cb;
 	decoder->frame_available_cb_user = frame_available_cb_user;
 	decoder->hdr_enabled = codec == CHIAKI_CODEC_H265_HDR;
 	decoder->frames_lost = 0;
+	decoder->pending_frame = NULL;
+	decoder->degradation_frames = 0;
+	memset(&decoder->stats, 0, sizeof(decoder->stats));
+
+	ChiakiFfmpegDecoderConfig default_config;
+	if(!config)
+	{
+		chiaki_ffmpeg_decoder_config_init(&default_config);
+		config = &default_config;
+	}
 
 	ChiakiErrorCode err = chiaki_mutex_init(&decoder->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -85,12 +173,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 		CHIAKI_LOGI(log, "Using hardware decoder \"%s\" with pix_fmt=%s", hw_decoder_name, av_get_pix_fmt_name(decoder->hw_pix_fmt));
 	}
 
+	apply_config(decoder, config, hw_decoder_name != NULL);
+
 	if(avcodec_open2(decoder->codec_context, decoder->av_codec, NULL) < 0)
 	{
 		CHIAKI_LOGE(log, "Failed to open codec context");
 		goto error_codec_context;
 	}
 
+	// only known after opening, ffmpeg may pick another thread type or count than requested
+	AVCodecContext *ctx = decoder->codec_context;
+	CHIAKI_LOGI(log, "FFMPEG decoder using %s threading with %d threads%s%s, frame budget %llu us",
+			active_threading_name(ctx->active_thread_type), ctx->thread_count,
+			(ctx->flags & AV_CODEC_FLAG_LOW_DELAY) ? ", low delay" : "",
+			(ctx->flags2 & AV_CODEC_FLAG2_FAST) ? ", fast" : "",
+			(unsigned long long)decoder->frame_budget_us);
+
 	return CHIAKI_ERR_SUCCESS;
 error_codec_context:
 	if(decoder->hw_device_ctx)
@@ -103,6 +201,8 @@ error_mutex:
 
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 {
+	if(decoder->pending_frame)
+		av_frame_free(&decoder->pending_frame);
 	avcodec_close(decoder->codec_context);
 	avcodec_free_context(&decoder->codec_context);
 	if(decoder->hw_device_ctx)
@@ -123,24 +223,66 @@ static int32_t frames_lost_inc(int32_t current, int32_t lost)
 	return ret > 20 ? 20 : ret;
 }
 
-CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, void *user)
+static void set_degradation(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderDegradation degradation)
 {
-	ChiakiFfmpegDecoder *decoder = user;
+	switch(degradation)
+	{
+		case CHIAKI_FFMPEG_DECODER_DEGRADATION_NONE:
+			decoder->codec_context->skip_loop_filter = AVDISCARD_DEFAULT;
+			break;
+		case CHIAKI_FFMPEG_DECODER_DEGRADATION_SKIP_LOOP_FILTER_NONREF:
+			decoder->codec_context->skip_loop_filter = AVDISCARD_NONREF;
+			break;
+		case CHIAKI_FFMPEG_DECODER_DEGRADATION_SKIP_LOOP_FILTER_ALL:
+			decoder->codec_context->skip_loop_filter = AVDISCARD_ALL;
+			break;
+	}
+	CHIAKI_LOGI(decoder->log, "FFMPEG decoder %s to degradation level %d, average decode time %llu us for a budget of %llu us",
+			degradation > decoder->stats.degradation ? "degrading" : "recovering", (int)degradation,
+			(unsigned long long)decoder->stats.decode_time_avg_us, (unsigned long long)decoder->frame_budget_us);
+	decoder->stats.degradation = degradation;
+	decoder->degradation_frames = 0;
+}
+
+static void update_decode_time(ChiakiFfmpegDecoder *decoder, uint64_t decode_time_us)
+{
+	ChiakiFfmpegDecoderStats *stats = &decoder->stats;
+	stats->decode_time_last_us = decode_time_us;
+	if(decode_time_us > stats->decode_time_max_us)
+		stats->decode_time_max_us = decode_time_us;
+	if(!stats->decode_time_avg_us)
+		stats->decode_time_avg_us = decode_time_us;
+	else
+		stats->decode_time_avg_us = (int64_t)stats->decode_time_avg_us
+			+ ((int64_t)decode_time_us - (int64_t)stats->decode_time_avg_us) / DECODE_TIME_AVG_WEIGHT;
+
+	if(!decoder->frame_budget_us)
+		return;
+	decoder->degradation_frames++;
+	uint64_t avg_percent = stats->decode_time_avg_us * 100 / decoder->frame_budget_us;
+	if(avg_percent > DEGRADE_BUDGET_PERCENT
+			&& stats->degradation < CHIAKI_FFMPEG_DECODER_DEGRADATION_MAX
+			&& decoder->degradation_frames >= DEGRADE_HOLD_FRAMES)
+		set_degradation(decoder, stats->degradation + 1);
+	else if(avg_percent < RECOVER_BUDGET_PERCENT
+			&& stats->degradation > CHIAKI_FFMPEG_DECODER_DEGRADATION_NONE
+			&& decoder->degradation_frames >= RECOVER_HOLD_FRAMES)
+		set_degradation(decoder, stats->degradation - 1);
+}
 
+static bool decode_packet(ChiakiFfmpegDecoder *decoder, AVPacket *packet, int32_t frames_lost)
+{
 	chiaki_mutex_lock(&decoder->mutex);
 	decoder->frames_lost = frames_lost_inc(decoder->frames_lost, frames_lost);
-	AVPacket packet;
-	av_init_packet(&packet);
-	packet.data = buf;
-	packet.size = buf_size;
+	uint64_t decode_start_us = chiaki_time_now_monotonic_us();
 	int r;
 send_packet:
-	r = avcodec_send_packet(decoder->codec_context, &packet);
+	r = avcodec_send_packet(decoder->codec_context, packet);
 	if(r != 0)
 	{
 		if(r == AVERROR(EAGAIN))
 		{
-			CHIAKI_LOGE(decoder->log, "AVCodec internal buffer is full removing frames before pushing");
+			// nobody pulled the last frame yet, move it out of the way instead of throwing it away
 			AVFrame *frame = av_frame_alloc();
 			if(!frame)
 			{
@@ -148,12 +290,19 @@ send_packet:
 				goto hell;
 			}
 			r = avcodec_receive_frame(decoder->codec_context, frame);
-			av_frame_free(&frame);
 			if(r != 0)
 			{
+				av_frame_free(&frame);
 				CHIAKI_LOGE(decoder->log, "Failed to pull frame");
 				goto hell;
 			}
+			decoder->stats.frames_decoded++;
+			if(decoder->pending_frame)
+			{
+				av_frame_free(&decoder->pending_frame);
+				decoder->stats.frames_dropped++;
+			}
+			decoder->pending_frame = frame;
 			goto send_packet;
 		}
 		else
@@ -164,6 +313,7 @@ send_packet:
 			goto hell;
 		}
 	}
+	update_decode_time(decoder, chiaki_time_now_monotonic_us() - decode_start_us);
 	chiaki_mutex_unlock(&decoder->mutex);
 
 	decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
@@ -173,16 +323,54 @@ hell:
 	return false;
 }
 
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, void *user)
+{
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = buf;
+	packet.size = buf_size;
+	return decode_packet(user, &packet, frames_lost);
+}
+
+static void frame_buffer_release(void *opaque, uint8_t *data)
+{
+	chiaki_frame_buffer_unref(opaque);
+}
+
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_frame_cb(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	// without a buffer reference, ffmpeg would copy the packet to keep it around
+	AVBufferRef *buf = av_buffer_create(chiaki_frame_buffer_data(frame),
+			chiaki_frame_buffer_size(frame) + CHIAKI_VIDEO_BUFFER_PADDING_SIZE,
+			frame_buffer_release, chiaki_frame_buffer_ref(frame), AV_BUFFER_FLAG_READONLY);
+	if(!buf)
+	{
+		chiaki_frame_buffer_unref(frame);
+		CHIAKI_LOGE(decoder->log, "Failed to create AVBufferRef for frame");
+		return false;
+	}
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.buf = buf;
+	packet.data = buf->data;
+	packet.size = chiaki_frame_buffer_size(frame);
+	bool succ = decode_packet(decoder, &packet, frames_lost);
+	av_buffer_unref(&packet.buf);
+	return succ;
+}
+
 static AVFrame *pull_from_hw(ChiakiFfmpegDecoder *decoder, AVFrame *hw_frame)
 {
 	AVFrame *sw_frame = av_frame_alloc();
 	if(av_hwframe_transfer_data(sw_frame, hw_frame, 0) < 0)
 	{
 		CHIAKI_LOGE(decoder->log, "Failed to transfer frame from hardware");
-		av_frame_unref(sw_frame);
-		sw_frame = NULL;
+		av_frame_free(&sw_frame);
 	}
-	av_frame_unref(hw_frame);
+	av_frame_free(&hw_frame);
 	return sw_frame;
 }
 
@@ -190,36 +378,39 @@ CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *dec
 {
 	chiaki_mutex_lock(&decoder->mutex);
 	// always try to pull as much as possible and return only the very last frame
-	AVFrame *frame_last = NULL;
-	AVFrame *frame = NULL;
+	AVFrame *frame = decoder->pending_frame;
+	decoder->pending_frame = NULL;
+	AVFrame *next_frame = NULL;
 	while(true)
 	{
-		AVFrame *next_frame;
-		if(frame_last)
-		{
-			av_frame_unref(frame_last);
-			next_frame = frame_last;
-		}
-		else
+		if(!next_frame)
 		{
 			next_frame = av_frame_alloc();
 			if(!next_frame)
 				break;
 		}
-		frame_last = frame;
-		frame = next_frame;
-		int r = avcodec_receive_frame(decoder->codec_context, frame);
-		if(!r)
-			frame = hw_download && decoder->hw_device_ctx ? pull_from_hw(decoder, frame) : frame;
-		else
+		int r = avcodec_receive_frame(decoder->codec_context, next_frame);
+		if(r)
 		{
 			if(r != AVERROR(EAGAIN))
 				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
-			av_frame_free(&frame);
-			frame = frame_last;
 			break;
 		}
+		decoder->stats.frames_decoded++;
+		AVFrame *prev_frame = frame;
+		frame = next_frame;
+		next_frame = prev_frame;
+		if(next_frame)
+		{
+			av_frame_unref(next_frame);
+			decoder->stats.frames_dropped++;
+		}
 	}
+	if(next_frame)
+		av_frame_free(&next_frame);
+	// only download the frame that is actually returned
+	if(frame && hw_download && decoder->hw_device_ctx)
+		frame = pull_from_hw(decoder, frame);
 	if(frame && decoder->frames_lost)
 	{
 		decoder->frames_lost--;
@@ -243,3 +434,9 @@ CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFf
 	}
 }
 
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	*stats = decoder->stats;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
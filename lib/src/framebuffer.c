@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/framebuffer.h>
+#include <chiaki/thread.h>
+#include <chiaki/video.h>
+
+#include "atomic.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct chiaki_frame_buffer_t
+{
+	ChiakiAtomicU32 refs;
+	ChiakiFrameBufferPool *pool; // NULL if standalone
+	ChiakiFrameBuffer *next_free;
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+};
+
+struct chiaki_frame_buffer_pool_t
+{
+	/**
+	 * One for the owner and one for every buffer that is currently handed out
+	 */
+	ChiakiAtomicU32 refs;
+
+	ChiakiMutex mutex;
+	ChiakiFrameBuffer *free_list; // protected by mutex
+	size_t free_count; // protected by mutex
+};
+
+static void frame_buffer_free(ChiakiFrameBuffer *buffer)
+{
+	free(buffer->data);
+	free(buffer);
+}
+
+static ChiakiFrameBuffer *frame_buffer_alloc(size_t capacity)
+{
+	ChiakiFrameBuffer *buffer = calloc(1, sizeof(ChiakiFrameBuffer));
+	if(!buffer)
+		return NULL;
+	buffer->data = malloc(capacity + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	if(!buffer->data)
+	{
+		free(buffer);
+		return NULL;
+	}
+	buffer->capacity = capacity;
+	chiaki_atomic_u32_init(&buffer->refs, 1);
+	return buffer;
+}
+
+static void frame_buffer_pool_unref(ChiakiFrameBufferPool *pool)
+{
+	if(chiaki_atomic_u32_fetch_sub(&pool->refs, 1, CHIAKI_MEMORY_ORDER_ACQ_REL) != 1)
+		return;
+	ChiakiFrameBuffer *buffer = pool->free_list;
+	while(buffer)
+	{
+		ChiakiFrameBuffer *next = buffer->next_free;
+		frame_buffer_free(buffer);
+		buffer = next;
+	}
+	chiaki_mutex_fini(&pool->mutex);
+	free(pool);
+}
+
+CHIAKI_EXPORT ChiakiFrameBufferPool *chiaki_frame_buffer_pool_new(void)
+{
+	ChiakiFrameBufferPool *pool = calloc(1, sizeof(ChiakiFrameBufferPool));
+	if(!pool)
+		return NULL;
+	if(chiaki_mutex_init(&pool->mutex, false) != CHIAKI_ERR_SUCCESS)
+	{
+		free(pool);
+		return NULL;
+	}
+	chiaki_atomic_u32_init(&pool->refs, 1);
+	pool->free_list = NULL;
+	pool->free_count = 0;
+	return pool;
+}
+
+CHIAKI_EXPORT void chiaki_frame_buffer_pool_free(ChiakiFrameBufferPool *pool)
+{
+	if(!pool)
+		return;
+	frame_buffer_pool_unref(pool);
+}
+
+CHIAKI_EXPORT ChiakiFrameBuffer *chiaki_frame_buffer_pool_get(ChiakiFrameBufferPool *pool, size_t capacity)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiFrameBuffer *buffer = pool->free_list;
+	if(buffer)
+	{
+		pool->free_list = buffer->next_free;
+		pool->free_count--;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(buffer && buffer->capacity < capacity)
+	{
+		// grow generously so a slowly increasing bitrate does not cause a realloc on every frame
+		size_t capacity_new = capacity + capacity / 4;
+		uint8_t *data = realloc(buffer->data, capacity_new + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		if(!data)
+		{
+			frame_buffer_free(buffer);
+			return NULL;
+		}
+		buffer->data = data;
+		buffer->capacity = capacity_new;
+	}
+	else if(!buffer)
+	{
+		buffer = frame_buffer_alloc(capacity);
+		if(!buffer)
+			return NULL;
+	}
+
+	chiaki_atomic_u32_store(&buffer->refs, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+	buffer->pool = pool;
+	buffer->next_free = NULL;
+	buffer->size = 0;
+	chiaki_atomic_u32_fetch_add(&pool->refs, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+	return buffer;
+}
+
+CHIAKI_EXPORT ChiakiFrameBuffer *chiaki_frame_buffer_new_copy(const uint8_t *data, size_t size)
+{
+	ChiakiFrameBuffer *buffer = frame_buffer_alloc(size);
+	if(!buffer)
+		return NULL;
+	memcpy(buffer->data, data, size);
+	chiaki_frame_buffer_set_size(buffer, size);
+	return buffer;
+}
+
+CHIAKI_EXPORT ChiakiFrameBuffer *chiaki_frame_buffer_ref(ChiakiFrameBuffer *buffer)
+{
+	chiaki_atomic_u32_fetch_add(&buffer->refs, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+	return buffer;
+}
+
+CHIAKI_EXPORT void chiaki_frame_buffer_unref(ChiakiFrameBuffer *buffer)
+{
+	if(!buffer)
+		return;
+	// acq_rel so all accesses through other references happen before the buffer is reused
+	if(chiaki_atomic_u32_fetch_sub(&buffer->refs, 1, CHIAKI_MEMORY_ORDER_ACQ_REL) != 1)
+		return;
+
+	ChiakiFrameBufferPool *pool = buffer->pool;
+	if(!pool)
+	{
+		frame_buffer_free(buffer);
+		return;
+	}
+
+	chiaki_mutex_lock(&pool->mutex);
+	if(pool->free_count < CHIAKI_FRAME_BUFFER_POOL_SIZE)
+	{
+		buffer->next_free = pool->free_list;
+		pool->free_list = buffer;
+		pool->free_count++;
+		buffer = NULL;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+	if(buffer)
+		frame_buffer_free(buffer);
+
+	frame_buffer_pool_unref(pool);
+}
+
+CHIAKI_EXPORT bool chiaki_frame_buffer_is_shared(ChiakiFrameBuffer *buffer)
+{
+	return chiaki_atomic_u32_load(&buffer->refs, CHIAKI_MEMORY_ORDER_ACQUIRE) > 1;
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_frame_buffer_data(ChiakiFrameBuffer *buffer)
+{
+	return buffer->data;
+}
+
+CHIAKI_EXPORT size_t chiaki_frame_buffer_size(ChiakiFrameBuffer *buffer)
+{
+	return buffer->size;
+}
+
+CHIAKI_EXPORT size_t chiaki_frame_buffer_capacity(ChiakiFrameBuffer *buffer)
+{
+	return buffer->capacity;
+}
+
+CHIAKI_EXPORT void chiaki_frame_buffer_set_size(ChiakiFrameBuffer *buffer, size_t size)
+{
+	assert(size <= buffer->capacity);
+	buffer->size = size;
+	memset(buffer->data + size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+}
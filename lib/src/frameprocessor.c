@@ -44,6 +44,8 @@ struct chiaki_frame_unit_t
 CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
 {
 	frame_processor->log = log;
+	frame_processor->frame_buffer_pool = NULL;
+	frame_processor->frame_buffer = NULL;
 	frame_processor->frame_buf = NULL;
 	frame_processor->frame_buf_size = 0;
 	frame_processor->buf_size_per_unit = 0;
@@ -60,7 +62,8 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
-	free(frame_processor->frame_buf);
+	chiaki_frame_buffer_unref(frame_processor->frame_buffer);
+	chiaki_frame_buffer_pool_free(frame_processor->frame_buffer_pool);
 	free(frame_processor->unit_slots);
 }
 
@@ -131,16 +134,26 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	if(frame_processor->unit_slots_size > SIZE_MAX / frame_processor->buf_stride_per_unit)
 		return CHIAKI_ERR_OVERFLOW;
 	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_stride_per_unit;
-	if(frame_processor->frame_buf_size < frame_buf_size_required)
+	if(!frame_processor->frame_buffer
+		|| frame_processor->frame_buf_size < frame_buf_size_required
+		|| chiaki_frame_buffer_is_shared(frame_processor->frame_buffer))
 	{
-		free(frame_processor->frame_buf);
-		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
-		if(!frame_processor->frame_buf)
+		// the previous frame may still be referenced, e.g. by the decoder, so it must not be overwritten
+		chiaki_frame_buffer_unref(frame_processor->frame_buffer);
+		frame_processor->frame_buffer = NULL;
+		frame_processor->frame_buf = NULL;
+		frame_processor->frame_buf_size = 0;
+		if(!frame_processor->frame_buffer_pool)
 		{
-			frame_processor->frame_buf_size = 0;
-			return CHIAKI_ERR_MEMORY;
+			frame_processor->frame_buffer_pool = chiaki_frame_buffer_pool_new();
+			if(!frame_processor->frame_buffer_pool)
+				return CHIAKI_ERR_MEMORY;
 		}
-		frame_processor->frame_buf_size = frame_buf_size_required;
+		frame_processor->frame_buffer = chiaki_frame_buffer_pool_get(frame_processor->frame_buffer_pool, frame_buf_size_required);
+		if(!frame_processor->frame_buffer)
+			return CHIAKI_ERR_MEMORY;
+		frame_processor->frame_buf = chiaki_frame_buffer_data(frame_processor->frame_buffer);
+		frame_processor->frame_buf_size = chiaki_frame_buffer_capacity(frame_processor->frame_buffer);
 	}
 	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 
@@ -175,7 +188,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	}
 
 	unit->data_size = packet->data_size;
-	if(!frame_processor->flushed)
+	if(!frame_processor->flushed && frame_processor->frame_buf)
 	{
 		memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
 				packet->data,
@@ -264,9 +277,9 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+static ChiakiFrameProcessorFlushResult frame_processor_flush(ChiakiFrameProcessor *frame_processor)
 {
-	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
+	if(frame_processor->units_source_expected == 0 || frame_processor->flushed || !frame_processor->frame_buffer)
 		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
 
 	//CHIAKI_LOGD(NULL, "source: %u, fec: %u",
@@ -306,7 +319,27 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 
 	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur);
 
+	chiaki_frame_buffer_set_size(frame_processor->frame_buffer, cur);
+	// the buffer may be shared from now on, late units must not be written into it anymore
+	frame_processor->flushed = true;
+	return result;
+}
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+{
+	ChiakiFrameProcessorFlushResult result = frame_processor_flush(frame_processor);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
 	*frame = frame_processor->frame_buf;
-	*frame_size = cur;
+	*frame_size = chiaki_frame_buffer_size(frame_processor->frame_buffer);
+	return result;
+}
+
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush_ref(ChiakiFrameProcessor *frame_processor, ChiakiFrameBuffer **frame)
+{
+	ChiakiFrameProcessorFlushResult result = frame_processor_flush(frame_processor);
+	if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+		return result;
+	*frame = chiaki_frame_buffer_ref(frame_processor->frame_buffer);
 	return result;
 }
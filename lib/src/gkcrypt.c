@@ -352,15 +352,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uin
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+static uint64_t gkcrypt_gmac_key_index(uint64_t key_pos)
 {
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
-
-	uint8_t *gmac_key = gkcrypt->key_gmac_current;
-	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+	return (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+}
 
+/**
+ * @param gmac_key_tmp storage for the key if it is not the current one
+ * @return the GMAC key for key_index
+ */
+static const uint8_t *gkcrypt_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t key_index, uint8_t *gmac_key_tmp)
+{
 	if(key_index > gkcrypt->key_gmac_index_current)
 	{
 		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
@@ -368,8 +370,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64
 	else if(key_index < gkcrypt->key_gmac_index_current)
 	{
 		chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
-		gmac_key = gmac_key_tmp;
+		return gmac_key_tmp;
 	}
+	return gkcrypt->key_gmac_current;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+
+	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	const uint8_t *gmac_key = gkcrypt_gmac_key(gkcrypt, gkcrypt_gmac_key_index(key_pos), gmac_key_tmp);
 
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 	// build mbedtls gcm context AES_128_GCM
@@ -459,6 +471,107 @@ fail:
 #endif
 }
 
+static int gmac_job_cmp(const void *a, const void *b)
+{
+	const ChiakiGKCryptGMacJob *job_a = a;
+	const ChiakiGKCryptGMacJob *job_b = b;
+	if(job_a->key_pos < job_b->key_pos)
+		return -1;
+	return job_a->key_pos > job_b->key_pos ? 1 : 0;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_batch(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGMacJob *jobs, size_t jobs_count)
+{
+	if(!jobs_count)
+		return CHIAKI_ERR_SUCCESS;
+
+	// in ascending order, every key is derived once and the current key only ever advances
+	qsort(jobs, jobs_count, sizeof(ChiakiGKCryptGMacJob), gmac_job_cmp);
+
+	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint64_t key_index_set = 0;
+	bool key_set = false;
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	mbedtls_gcm_context actx;
+	mbedtls_gcm_init(&actx);
+
+	for(size_t i=0; i<jobs_count; i++)
+	{
+		ChiakiGKCryptGMacJob *job = &jobs[i];
+		uint64_t key_index = gkcrypt_gmac_key_index(job->key_pos);
+		if(!key_set || key_index != key_index_set)
+		{
+			const uint8_t *gmac_key = gkcrypt_gmac_key(gkcrypt, key_index, gmac_key_tmp);
+			if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
+			{
+				ret = CHIAKI_ERR_UNKNOWN;
+				break;
+			}
+			key_index_set = key_index;
+			key_set = true;
+		}
+
+		uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		counter_add(iv, gkcrypt->iv, job->key_pos / 0x10);
+		if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+			   0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
+			   job->buf, job->buf_size, NULL, NULL,
+			   CHIAKI_GKCRYPT_GMAC_SIZE, job->gmac_out) != 0)
+		{
+			ret = CHIAKI_ERR_UNKNOWN;
+			break;
+		}
+	}
+
+	mbedtls_gcm_free(&actx);
+	return ret;
+#else
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return CHIAKI_ERR_MEMORY;
+
+	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+		|| !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
+	{
+		ret = CHIAKI_ERR_UNKNOWN;
+		goto fail_cipher;
+	}
+
+	for(size_t i=0; i<jobs_count; i++)
+	{
+		ChiakiGKCryptGMacJob *job = &jobs[i];
+		uint64_t key_index = gkcrypt_gmac_key_index(job->key_pos);
+		const uint8_t *gmac_key = NULL; // keep the key schedule from the previous job
+		if(!key_set || key_index != key_index_set)
+		{
+			gmac_key = gkcrypt_gmac_key(gkcrypt, key_index, gmac_key_tmp);
+			key_index_set = key_index;
+			key_set = true;
+		}
+
+		uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		counter_add(iv, gkcrypt->iv, job->key_pos / 0x10);
+		int len;
+		if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, iv, 1)
+			|| !EVP_EncryptUpdate(ctx, NULL, &len, job->buf, (int)job->buf_size)
+			|| !EVP_EncryptFinal_ex(ctx, NULL, &len)
+			|| !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, job->gmac_out))
+		{
+			ret = CHIAKI_ERR_UNKNOWN;
+			goto fail_cipher;
+		}
+	}
+
+fail_cipher:
+	EVP_CIPHER_CTX_free(ctx);
+	return ret;
+#endif
+}
+
 static bool key_buf_mutex_pred(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
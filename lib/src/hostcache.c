@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/hostcache.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#define HOST_CACHE_MAGIC "chiaki-host-cache"
+#define HOST_CACHE_LINE_SIZE 0x100
+
+// keep in sync with CHIAKI_HOST_CACHE_HOST_ID_SIZE
+#define HOST_CACHE_ENTRY_FMT "%63s %u %u %u %llu %llu %llu"
+
+/**
+ * @param entries must hold at least CHIAKI_HOST_CACHE_ENTRIES_MAX entries
+ * @return number of valid entries read
+ */
+static size_t host_cache_read(const char *path, ChiakiHostCacheEntry *entries, ChiakiLog *log)
+{
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return 0;
+
+	char line[HOST_CACHE_LINE_SIZE];
+	unsigned int version = 0;
+	if(!fgets(line, sizeof(line), f) || sscanf(line, HOST_CACHE_MAGIC " %u", &version) != 1)
+	{
+		CHIAKI_LOGW(log, "Host cache %s is corrupt, ignoring it", path);
+		fclose(f);
+		return 0;
+	}
+
+	if(version != CHIAKI_HOST_CACHE_VERSION)
+	{
+		CHIAKI_LOGI(log, "Host cache %s has version %u, expected %u, ignoring it", path, version, (unsigned int)CHIAKI_HOST_CACHE_VERSION);
+		fclose(f);
+		return 0;
+	}
+
+	size_t count = 0;
+	while(count < CHIAKI_HOST_CACHE_ENTRIES_MAX && fgets(line, sizeof(line), f))
+	{
+		ChiakiHostCacheEntry *entry = &entries[count];
+		memset(entry, 0, sizeof(*entry));
+		unsigned int target, mtu_in, mtu_out;
+		unsigned long long rtt_us, network_time, written;
+		if(sscanf(line, HOST_CACHE_ENTRY_FMT,
+				entry->host_id, &target, &mtu_in, &mtu_out,
+				&rtt_us, &network_time, &written) != 7)
+		{
+			CHIAKI_LOGW(log, "Host cache %s contains a corrupt entry, skipping it", path);
+			continue;
+		}
+		entry->target = (ChiakiTarget)target;
+		entry->mtu_in = mtu_in;
+		entry->mtu_out = mtu_out;
+		entry->rtt_us = rtt_us;
+		entry->network_time = network_time;
+		entry->time = written;
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+static ChiakiErrorCode host_cache_write(const char *path, const ChiakiHostCacheEntry *entries, size_t count, ChiakiLog *log)
+{
+	size_t path_len = strlen(path);
+	char *tmp_path = malloc(path_len + 5);
+	if(!tmp_path)
+		return CHIAKI_ERR_MEMORY;
+	memcpy(tmp_path, path, path_len);
+	memcpy(tmp_path + path_len, ".tmp", 5);
+
+	FILE *f = fopen(tmp_path, "w");
+	if(!f)
+	{
+		CHIAKI_LOGE(log, "Failed to open %s for writing host cache", tmp_path);
+		free(tmp_path);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	bool ok = fprintf(f, HOST_CACHE_MAGIC " %u\n", (unsigned int)CHIAKI_HOST_CACHE_VERSION) > 0;
+	for(size_t i = 0; ok && i < count; i++)
+	{
+		const ChiakiHostCacheEntry *entry = &entries[i];
+		ok = fprintf(f, "%s %u %u %u %llu %llu %llu\n",
+				entry->host_id, (unsigned int)entry->target, (unsigned int)entry->mtu_in, (unsigned int)entry->mtu_out,
+				(unsigned long long)entry->rtt_us,
+				(unsigned long long)entry->network_time,
+				(unsigned long long)entry->time) > 0;
+	}
+	if(fclose(f) != 0)
+		ok = false;
+
+	if(ok)
+	{
+#ifdef _WIN32
+		// rename does not replace existing files on windows
+		remove(path);
+#endif
+		ok = rename(tmp_path, path) == 0;
+	}
+
+	if(!ok)
+	{
+		CHIAKI_LOGE(log, "Failed to write host cache %s", path);
+		remove(tmp_path);
+	}
+
+	free(tmp_path);
+	return ok ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+}
+
+static bool host_id_valid(const char *host_id)
+{
+	size_t len = strlen(host_id);
+	if(!len || len >= CHIAKI_HOST_CACHE_HOST_ID_SIZE)
+		return false;
+	for(size_t i = 0; i < len; i++)
+	{
+		if(host_id[i] <= ' ')
+			return false;
+	}
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_host_cache_get(const char *path, const char *host_id, ChiakiHostCacheEntry *entry, ChiakiLog *log)
+{
+	if(!host_id_valid(host_id))
+		return false;
+
+	ChiakiHostCacheEntry *entries = calloc(CHIAKI_HOST_CACHE_ENTRIES_MAX, sizeof(ChiakiHostCacheEntry));
+	if(!entries)
+		return false;
+
+	bool found = false;
+	size_t count = host_cache_read(path, entries, log);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(strcmp(entries[i].host_id, host_id) == 0)
+		{
+			*entry = entries[i];
+			found = true;
+			break;
+		}
+	}
+
+	free(entries);
+	return found;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_host_cache_put(const char *path, const ChiakiHostCacheEntry *entry, ChiakiLog *log)
+{
+	if(!host_id_valid(entry->host_id))
+		return CHIAKI_ERR_INVALID_DATA;
+
+	ChiakiHostCacheEntry *entries = calloc(CHIAKI_HOST_CACHE_ENTRIES_MAX, sizeof(ChiakiHostCacheEntry));
+	if(!entries)
+		return CHIAKI_ERR_MEMORY;
+
+	size_t count = host_cache_read(path, entries, log);
+	size_t index = count;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(strcmp(entries[i].host_id, entry->host_id) == 0)
+		{
+			index = i;
+			break;
+		}
+	}
+
+	if(index == CHIAKI_HOST_CACHE_ENTRIES_MAX)
+	{
+		// full, replace the least recently written entry
+		index = 0;
+		for(size_t i = 1; i < count; i++)
+		{
+			if(entries[i].time < entries[index].time)
+				index = i;
+		}
+	}
+	else if(index == count)
+		count++;
+
+	entries[index] = *entry;
+	if(!entries[index].time)
+		entries[index].time = (uint64_t)time(NULL);
+
+	ChiakiErrorCode err = host_cache_write(path, entries, count, log);
+	free(entries);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_host_cache_invalidate(const char *path, const char *host_id, ChiakiLog *log)
+{
+	ChiakiHostCacheEntry *entries = calloc(CHIAKI_HOST_CACHE_ENTRIES_MAX, sizeof(ChiakiHostCacheEntry));
+	if(!entries)
+		return CHIAKI_ERR_MEMORY;
+
+	size_t count = host_cache_read(path, entries, log);
+	size_t kept = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(strcmp(entries[i].host_id, host_id) == 0)
+			continue;
+		if(kept != i)
+			entries[kept] = entries[i];
+		kept++;
+	}
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	if(kept != count)
+		err = host_cache_write(path, entries, kept, log);
+	free(entries);
+	return err;
+}
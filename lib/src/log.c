@@ -1,10 +1,26 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/log.h>
+#include <chiaki/time.h>
+
+#include "atomic.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <assert.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#pragma intrinsic(_ReturnAddress)
+#define LOG_CALL_SITE() _ReturnAddress()
+#else
+#define LOG_CALL_SITE() __builtin_return_address(0)
+#endif
+
+static void log_async_cb(ChiakiLogLevel level, const char *msg, void *user);
+static void log_async_push_fmt(ChiakiLogAsync *async, ChiakiLogLevel level, const void *call_site, const char *fmt, va_list args);
+static void log_async_push_hexdump(ChiakiLogAsync *async, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size);
 
 CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level)
 {
@@ -67,6 +83,16 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 		return;
 
 	va_list args;
+
+	if(log && log->cb == log_async_cb)
+	{
+		// format directly into the queue
+		va_start(args, fmt);
+		log_async_push_fmt(log->user, level, LOG_CALL_SITE(), fmt, args);
+		va_end(args);
+		return;
+	}
+
 	char buf[0x100];
 	char *msg = buf;
 
@@ -106,14 +132,10 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 
 static const char hex_char[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
 
-CHIAKI_EXPORT void chiaki_log_hexdump(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size)
+static void log_hexdump(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size, size_t offset)
 {
-	if(log && !(log->level_mask & level))
-		return;
-
-	chiaki_log(log, level, "offset 0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f  0123456789abcdef");
-
-	size_t offset = 0;
+	if(!offset)
+		chiaki_log(log, level, "offset 0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f  0123456789abcdef");
 
 	char hex_buf[HEXDUMP_WIDTH * 3 + 1];
 	char ascii_buf[HEXDUMP_WIDTH + 1];
@@ -147,7 +169,7 @@ CHIAKI_EXPORT void chiaki_log_hexdump(ChiakiLog *log, ChiakiLogLevel level, cons
 			hex_buf[i*3+2] = ' ';
 		}
 
-		chiaki_log(log, level, "%6x %s%s", offset, hex_buf, ascii_buf);
+		chiaki_log(log, level, "%6x %s%s", (unsigned int)offset, hex_buf, ascii_buf);
 
 		if(buf_size > HEXDUMP_WIDTH)
 		{
@@ -160,6 +182,21 @@ CHIAKI_EXPORT void chiaki_log_hexdump(ChiakiLog *log, ChiakiLogLevel level, cons
 	}
 }
 
+CHIAKI_EXPORT void chiaki_log_hexdump(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size)
+{
+	if(log && !(log->level_mask & level))
+		return;
+
+	if(log && log->cb == log_async_cb)
+	{
+		// only copy the raw data here, lines are formatted on the drain thread
+		log_async_push_hexdump(log->user, level, buf, buf_size);
+		return;
+	}
+
+	log_hexdump(log, level, buf, buf_size, 0);
+}
+
 CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size)
 {
 	if(log && !(log->level_mask & level))
@@ -225,3 +262,369 @@ static void log_sniffer_cb(ChiakiLogLevel level, const char *msg, void *user)
 	if(sniffer->forward_log)
 		chiaki_log(sniffer->forward_log, level, "%s", msg);
 }
+
+#define LOG_ASYNC_RECORDS_COUNT 512 // must be a power of two
+#define LOG_ASYNC_RECORD_DATA_SIZE (HEXDUMP_WIDTH * 0xf)
+#define LOG_ASYNC_RATE_SLOTS 64
+#define LOG_ASYNC_DRAIN_WAIT_MS 50
+
+typedef enum log_async_record_type_t
+{
+	LOG_ASYNC_RECORD_MSG,
+	LOG_ASYNC_RECORD_MSG_HEAP, // message did not fit into data, heap_msg must be freed
+	LOG_ASYNC_RECORD_HEXDUMP
+} LogAsyncRecordType;
+
+typedef struct log_async_record_t
+{
+	/**
+	 * position in the queue this record is ready to be written for (seq == pos)
+	 * or read from (seq == pos + 1)
+	 */
+	ChiakiAtomicSize seq;
+	ChiakiLogLevel level;
+	LogAsyncRecordType type;
+	size_t offset; // hexdump only
+	size_t size; // hexdump only
+	char *heap_msg;
+	char data[LOG_ASYNC_RECORD_DATA_SIZE];
+} LogAsyncRecord;
+
+typedef struct log_async_rate_t
+{
+	ChiakiAtomicPtr key; // call site of chiaki_log()
+	ChiakiAtomicPtr what; // const char *, names the key's messages when reporting suppressed ones
+	ChiakiAtomicU64 window_begin_ms;
+	ChiakiAtomicU32 count;
+	ChiakiAtomicU32 suppressed;
+} LogAsyncRate;
+
+/**
+ * Bounded multi-producer queue, consumed only by the drain thread
+ */
+struct chiaki_log_async_queue_t
+{
+	LogAsyncRecord records[LOG_ASYNC_RECORDS_COUNT];
+	ChiakiAtomicSize enqueue_pos;
+	size_t dequeue_pos;
+	ChiakiAtomicU32 dropped;
+	ChiakiAtomicBool drain_waiting;
+	LogAsyncRate rates[LOG_ASYNC_RATE_SLOTS];
+};
+
+static void *log_async_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_async_init(ChiakiLogAsync *async, ChiakiLog *forward_log)
+{
+	async->forward_log = forward_log;
+	async->should_stop = false;
+	chiaki_log_init(&async->async_log, forward_log ? forward_log->level_mask : CHIAKI_LOG_ALL, log_async_cb, async);
+
+	struct chiaki_log_async_queue_t *queue = calloc(1, sizeof(struct chiaki_log_async_queue_t));
+	if(!queue)
+		return CHIAKI_ERR_MEMORY;
+	for(size_t i=0; i<LOG_ASYNC_RECORDS_COUNT; i++)
+		chiaki_atomic_size_init(&queue->records[i].seq, i);
+	chiaki_atomic_size_init(&queue->enqueue_pos, 0);
+	queue->dequeue_pos = 0;
+	chiaki_atomic_u32_init(&queue->dropped, 0);
+	chiaki_atomic_bool_init(&queue->drain_waiting, false);
+	for(size_t i=0; i<LOG_ASYNC_RATE_SLOTS; i++)
+	{
+		chiaki_atomic_ptr_init(&queue->rates[i].key, 0);
+		chiaki_atomic_ptr_init(&queue->rates[i].what, 0);
+		chiaki_atomic_u64_init(&queue->rates[i].window_begin_ms, 0);
+		chiaki_atomic_u32_init(&queue->rates[i].count, 0);
+		chiaki_atomic_u32_init(&queue->rates[i].suppressed, 0);
+	}
+	async->queue = queue;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&async->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_queue;
+
+	err = chiaki_cond_init(&async->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&async->thread, log_async_thread_func, async);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	chiaki_thread_set_name(&async->thread, "Chiaki Log");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&async->cond);
+error_mutex:
+	chiaki_mutex_fini(&async->mutex);
+error_queue:
+	free(queue);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_log_async_fini(ChiakiLogAsync *async)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&async->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	async->should_stop = true;
+	chiaki_cond_signal(&async->cond);
+	chiaki_mutex_unlock(&async->mutex);
+
+	chiaki_thread_join(&async->thread, NULL);
+	chiaki_cond_fini(&async->cond);
+	chiaki_mutex_fini(&async->mutex);
+	free(async->queue);
+}
+
+/**
+ * @return the reserved record, which must be passed to log_async_commit() afterwards, or NULL if the queue is full
+ */
+static LogAsyncRecord *log_async_reserve(struct chiaki_log_async_queue_t *queue, size_t *pos_out)
+{
+	size_t pos = chiaki_atomic_size_load(&queue->enqueue_pos, CHIAKI_MEMORY_ORDER_RELAXED);
+	while(true)
+	{
+		LogAsyncRecord *record = &queue->records[pos & (LOG_ASYNC_RECORDS_COUNT - 1)];
+		size_t seq = chiaki_atomic_size_load(&record->seq, CHIAKI_MEMORY_ORDER_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0)
+		{
+			if(chiaki_atomic_size_compare_exchange(&queue->enqueue_pos, &pos, pos + 1, CHIAKI_MEMORY_ORDER_RELAXED))
+			{
+				*pos_out = pos;
+				return record;
+			}
+			// pos was updated by the failed exchange
+		}
+		else if(diff < 0)
+		{
+			chiaki_atomic_u32_fetch_add(&queue->dropped, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+			return NULL;
+		}
+		else
+			pos = chiaki_atomic_size_load(&queue->enqueue_pos, CHIAKI_MEMORY_ORDER_RELAXED);
+	}
+}
+
+static void log_async_commit(ChiakiLogAsync *async, LogAsyncRecord *record, size_t pos)
+{
+	chiaki_atomic_size_store(&record->seq, pos + 1, CHIAKI_MEMORY_ORDER_RELEASE);
+	// signaling without the mutex may miss a drain thread that is just going to sleep,
+	// which only delays the record by LOG_ASYNC_DRAIN_WAIT_MS, but never blocks here.
+	if(chiaki_atomic_bool_load(&async->queue->drain_waiting, CHIAKI_MEMORY_ORDER_RELAXED))
+		chiaki_cond_signal(&async->cond);
+}
+
+static void log_async_push_str(ChiakiLogAsync *async, ChiakiLogLevel level, const char *msg)
+{
+	size_t pos;
+	LogAsyncRecord *record = log_async_reserve(async->queue, &pos);
+	if(!record)
+		return;
+	record->level = level;
+	record->type = LOG_ASYNC_RECORD_MSG;
+	size_t len = strlen(msg);
+	if(len >= sizeof(record->data))
+	{
+		record->heap_msg = malloc(len + 1);
+		if(record->heap_msg)
+		{
+			memcpy(record->heap_msg, msg, len + 1);
+			record->type = LOG_ASYNC_RECORD_MSG_HEAP;
+		}
+		else
+			len = sizeof(record->data) - 1;
+	}
+	if(record->type == LOG_ASYNC_RECORD_MSG)
+	{
+		memcpy(record->data, msg, len);
+		record->data[len] = '\0';
+	}
+	log_async_commit(async, record, pos);
+}
+
+/**
+ * @return whether a message with the given key may be logged now
+ */
+static bool log_async_rate_allow(ChiakiLogAsync *async, const void *key, const char *what)
+{
+	uintptr_t key_v = (uintptr_t)key;
+	// call sites are not aligned, but only a few bytes apart
+	LogAsyncRate *rate = &async->queue->rates[(key_v ^ (key_v >> 6)) % LOG_ASYNC_RATE_SLOTS];
+	uint64_t now = chiaki_time_now_monotonic_ms();
+
+	// Races between threads only make the limit slightly less exact.
+	unsigned int suppressed = 0;
+	const char *suppressed_what = NULL;
+	if(chiaki_atomic_ptr_load(&rate->key, CHIAKI_MEMORY_ORDER_RELAXED) != key_v
+		|| now - chiaki_atomic_u64_load(&rate->window_begin_ms, CHIAKI_MEMORY_ORDER_RELAXED) >= CHIAKI_LOG_ASYNC_RATE_WINDOW_MS)
+	{
+		// the slot may have belonged to another key, whose suppressed messages must be reported under its own name
+		suppressed = chiaki_atomic_u32_exchange(&rate->suppressed, 0, CHIAKI_MEMORY_ORDER_RELAXED);
+		suppressed_what = (const char *)chiaki_atomic_ptr_exchange(&rate->what, (uintptr_t)what, CHIAKI_MEMORY_ORDER_RELAXED);
+		chiaki_atomic_ptr_store(&rate->key, key_v, CHIAKI_MEMORY_ORDER_RELAXED);
+		chiaki_atomic_u64_store(&rate->window_begin_ms, now, CHIAKI_MEMORY_ORDER_RELAXED);
+		chiaki_atomic_u32_store(&rate->count, 0, CHIAKI_MEMORY_ORDER_RELAXED);
+	}
+
+	if(suppressed && suppressed_what)
+	{
+		char msg[0x80];
+		snprintf(msg, sizeof(msg), "Suppressed %u log messages like \"%.48s\"", suppressed, suppressed_what);
+		log_async_push_str(async, CHIAKI_LOG_WARNING, msg);
+	}
+
+	if(chiaki_atomic_u32_fetch_add(&rate->count, 1, CHIAKI_MEMORY_ORDER_RELAXED) < CHIAKI_LOG_ASYNC_RATE_BURST)
+		return true;
+	chiaki_atomic_u32_fetch_add(&rate->suppressed, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+	return false;
+}
+
+/**
+ * @param call_site rate limiting key, so messages passed through a shared format like "%s" are only
+ * throttled together if they are logged from the same place
+ */
+static void log_async_push_fmt(ChiakiLogAsync *async, ChiakiLogLevel level, const void *call_site, const char *fmt, va_list args)
+{
+	if(!log_async_rate_allow(async, call_site, fmt))
+		return;
+
+	size_t pos;
+	LogAsyncRecord *record = log_async_reserve(async->queue, &pos);
+	if(!record)
+		return;
+	record->level = level;
+	record->type = LOG_ASYNC_RECORD_MSG;
+
+	va_list args_copy;
+	va_copy(args_copy, args);
+	int written = vsnprintf(record->data, sizeof(record->data), fmt, args);
+	if(written < 0)
+		record->data[0] = '\0';
+	else if((size_t)written >= sizeof(record->data))
+	{
+		// keep the truncated message if this fails
+		record->heap_msg = malloc(written + 1);
+		if(record->heap_msg && vsnprintf(record->heap_msg, written + 1, fmt, args_copy) >= 0)
+			record->type = LOG_ASYNC_RECORD_MSG_HEAP;
+		else
+		{
+			free(record->heap_msg);
+			record->heap_msg = NULL;
+		}
+	}
+	va_end(args_copy);
+
+	log_async_commit(async, record, pos);
+}
+
+static void log_async_push_hexdump(ChiakiLogAsync *async, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size)
+{
+	static const char hexdump_key[] = "hexdump";
+	if(!log_async_rate_allow(async, hexdump_key, hexdump_key))
+		return;
+
+	// split into records, each holding a whole number of lines
+	size_t offset = 0;
+	do
+	{
+		size_t pos;
+		LogAsyncRecord *record = log_async_reserve(async->queue, &pos);
+		if(!record)
+			return;
+		size_t size = buf_size - offset;
+		if(size > sizeof(record->data))
+			size = sizeof(record->data);
+		record->level = level;
+		record->type = LOG_ASYNC_RECORD_HEXDUMP;
+		record->offset = offset;
+		record->size = size;
+		memcpy(record->data, buf + offset, size);
+		log_async_commit(async, record, pos);
+		offset += size;
+	} while(offset < buf_size);
+}
+
+static void log_async_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	// only reached for messages passed to the callback directly, chiaki_log() formats into the queue itself
+	log_async_push_str(user, level, msg);
+}
+
+static void log_async_drain(ChiakiLogAsync *async)
+{
+	struct chiaki_log_async_queue_t *queue = async->queue;
+	while(true)
+	{
+		size_t pos = queue->dequeue_pos;
+		LogAsyncRecord *record = &queue->records[pos & (LOG_ASYNC_RECORDS_COUNT - 1)];
+		if(chiaki_atomic_size_load(&record->seq, CHIAKI_MEMORY_ORDER_ACQUIRE) != pos + 1)
+			break;
+
+		switch(record->type)
+		{
+			case LOG_ASYNC_RECORD_MSG:
+				chiaki_log(async->forward_log, record->level, "%s", record->data);
+				break;
+			case LOG_ASYNC_RECORD_MSG_HEAP:
+				chiaki_log(async->forward_log, record->level, "%s", record->heap_msg);
+				free(record->heap_msg);
+				record->heap_msg = NULL;
+				break;
+			case LOG_ASYNC_RECORD_HEXDUMP:
+				if(!async->forward_log || (async->forward_log->level_mask & record->level))
+					log_hexdump(async->forward_log, record->level, (const uint8_t *)record->data, record->size, record->offset);
+				break;
+		}
+
+		queue->dequeue_pos = pos + 1;
+		chiaki_atomic_size_store(&record->seq, pos + LOG_ASYNC_RECORDS_COUNT, CHIAKI_MEMORY_ORDER_RELEASE);
+	}
+
+	unsigned int dropped = chiaki_atomic_u32_exchange(&queue->dropped, 0, CHIAKI_MEMORY_ORDER_RELAXED);
+	if(dropped)
+		chiaki_log(async->forward_log, CHIAKI_LOG_WARNING, "Log queue was full, dropped %u log messages", dropped);
+}
+
+static bool log_async_pending(struct chiaki_log_async_queue_t *queue)
+{
+	size_t pos = queue->dequeue_pos;
+	LogAsyncRecord *record = &queue->records[pos & (LOG_ASYNC_RECORDS_COUNT - 1)];
+	return chiaki_atomic_size_load(&record->seq, CHIAKI_MEMORY_ORDER_ACQUIRE) == pos + 1
+		|| chiaki_atomic_u32_load(&queue->dropped, CHIAKI_MEMORY_ORDER_RELAXED);
+}
+
+static void *log_async_thread_func(void *user)
+{
+	ChiakiLogAsync *async = user;
+	struct chiaki_log_async_queue_t *queue = async->queue;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&async->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	while(!async->should_stop)
+	{
+		chiaki_mutex_unlock(&async->mutex);
+		log_async_drain(async);
+		err = chiaki_mutex_lock(&async->mutex);
+		assert(err == CHIAKI_ERR_SUCCESS);
+
+		chiaki_atomic_bool_store(&queue->drain_waiting, true, CHIAKI_MEMORY_ORDER_RELAXED);
+		if(!async->should_stop && !log_async_pending(queue))
+			chiaki_cond_timedwait(&async->cond, &async->mutex, LOG_ASYNC_DRAIN_WAIT_MS);
+		chiaki_atomic_bool_store(&queue->drain_waiting, false, CHIAKI_MEMORY_ORDER_RELAXED);
+	}
+	chiaki_mutex_unlock(&async->mutex);
+
+	log_async_drain(async);
+
+	for(size_t i=0; i<LOG_ASYNC_RATE_SLOTS; i++)
+	{
+		LogAsyncRate *rate = &queue->rates[i];
+		unsigned int suppressed = chiaki_atomic_u32_load(&rate->suppressed, CHIAKI_MEMORY_ORDER_RELAXED);
+		const char *what = (const char *)chiaki_atomic_ptr_load(&rate->what, CHIAKI_MEMORY_ORDER_RELAXED);
+		if(suppressed && what)
+			chiaki_log(async->forward_log, CHIAKI_LOG_WARNING, "Suppressed %u log messages like \"%.48s\"",
+					suppressed, what);
+	}
+	return NULL;
+}
@@ -11,6 +11,22 @@
 #define WARMUP_SAMPLES_COUNT 30
 #define BETA_WARMUP 20.0f
 #define BETA_DEFAULT 0.05f
+#define MAHONY_KP_WARMUP 10.0f
+#define MAHONY_KP_DEFAULT 0.5f
+#define MAHONY_KI_DEFAULT 0.01f
+
+// samples further apart than this are not integrated, e.g. after the device was asleep
+#define TIME_STEP_MAX_US 250000
+
+// gyro is considered at rest below this magnitude in rad/s and while accel stays within the factor of where the rest started
+#define REST_GYRO_MAX 0.06f
+#define REST_ACCEL_DELTA_MAX 0.02f
+// variance of the gyro over a rest period in (rad/s)^2, above that the device is moving slowly rather than lying still
+#define REST_GYRO_VAR_MAX 0.0001f
+// duration of a rest period, after which its mean gyro is blended into the bias
+#define REST_TIME_MIN_US 1000000
+#define REST_SAMPLES_MIN 50
+#define BIAS_GAIN 0.25f
 
 CHIAKI_EXPORT void chiaki_orientation_init(ChiakiOrientation *orient)
 {
@@ -106,6 +122,67 @@ CHIAKI_EXPORT void chiaki_orientation_update(ChiakiOrientation *orient,
 	orient->w = q0;
 }
 
+CHIAKI_EXPORT void chiaki_orientation_update_mahony(ChiakiOrientation *orient, float *integral,
+		float gx, float gy, float gz, float ax, float ay, float az, float kp, float ki, float time_step_sec)
+{
+	float q0 = orient->w, q1 = orient->x, q2 = orient->y, q3 = orient->z;
+	// Mahony's IMU algorithm.
+	// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
+	float recip_norm;
+
+	// Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+	if(!((ax == 0.0f) && (ay == 0.0f) && (az == 0.0f)))
+	{
+		recip_norm = inv_sqrt(ax * ax + ay * ay + az * az);
+		ax *= recip_norm;
+		ay *= recip_norm;
+		az *= recip_norm;
+
+		// Estimated direction of gravity
+		float vx = 2.0f * (q1 * q3 - q0 * q2);
+		float vy = 2.0f * (q0 * q1 + q2 * q3);
+		float vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+		// Error is cross product between estimated and measured direction of gravity
+		float ex = ay * vz - az * vy;
+		float ey = az * vx - ax * vz;
+		float ez = ax * vy - ay * vx;
+
+		if(ki > 0.0f)
+		{
+			integral[0] += 2.0f * ki * ex * time_step_sec;
+			integral[1] += 2.0f * ki * ey * time_step_sec;
+			integral[2] += 2.0f * ki * ez * time_step_sec;
+			gx += integral[0];
+			gy += integral[1];
+			gz += integral[2];
+		}
+		else
+			integral[0] = integral[1] = integral[2] = 0.0f;
+
+		gx += 2.0f * kp * ex;
+		gy += 2.0f * kp * ey;
+		gz += 2.0f * kp * ez;
+	}
+
+	// Integrate rate of change of quaternion
+	gx *= 0.5f * time_step_sec;
+	gy *= 0.5f * time_step_sec;
+	gz *= 0.5f * time_step_sec;
+	float qa = q0, qb = q1, qc = q2;
+	q0 += -qb * gx - qc * gy - q3 * gz;
+	q1 += qa * gx + qc * gz - q3 * gy;
+	q2 += qa * gy - qb * gz + q3 * gx;
+	q3 += qa * gz + qb * gy - qc * gx;
+
+	// Normalise quaternion
+	recip_norm = inv_sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+	orient->x = q1 * recip_norm;
+	orient->y = q2 * recip_norm;
+	orient->z = q3 * recip_norm;
+	orient->w = q0 * recip_norm;
+}
+
 static float inv_sqrt(float x)
 {
 #if 1
@@ -132,31 +209,132 @@ CHIAKI_EXPORT void chiaki_orientation_tracker_init(ChiakiOrientationTracker *tra
 	chiaki_orientation_init(&tracker->orient);
 	tracker->timestamp = 0;
 	tracker->sample_index = 0;
+	tracker->filter = CHIAKI_ORIENTATION_FILTER_MADGWICK;
+	tracker->mahony_integral[0] = tracker->mahony_integral[1] = tracker->mahony_integral[2] = 0.0f;
+	tracker->bias_calibration = false;
+	tracker->gyro_bias_valid = false;
+	tracker->gyro_bias_x = tracker->gyro_bias_y = tracker->gyro_bias_z = 0.0f;
+	tracker->rest_accel_x = tracker->rest_accel_y = tracker->rest_accel_z = 0.0f;
+	tracker->rest_gyro_sum_x = tracker->rest_gyro_sum_y = tracker->rest_gyro_sum_z = 0.0f;
+	tracker->rest_gyro_sq_sum = 0.0f;
+	tracker->rest_samples = 0;
+	tracker->rest_time_us = 0;
+}
+
+CHIAKI_EXPORT void chiaki_orientation_tracker_set_filter(ChiakiOrientationTracker *tracker, ChiakiOrientationFilter filter)
+{
+	tracker->filter = filter;
+	tracker->mahony_integral[0] = tracker->mahony_integral[1] = tracker->mahony_integral[2] = 0.0f;
+}
+
+static void tracker_rest_reset(ChiakiOrientationTracker *tracker)
+{
+	tracker->rest_gyro_sum_x = tracker->rest_gyro_sum_y = tracker->rest_gyro_sum_z = 0.0f;
+	tracker->rest_gyro_sq_sum = 0.0f;
+	tracker->rest_samples = 0;
+	tracker->rest_time_us = 0;
+}
+
+/**
+ * Feed one raw sample into the rest detection and update the gyro bias after each period the device has been still for.
+ */
+static void tracker_calibrate_bias(ChiakiOrientationTracker *tracker,
+		float gx, float gy, float gz, float ax, float ay, float az, uint64_t delta_us)
+{
+	if(!tracker->rest_samples)
+	{
+		tracker->rest_accel_x = ax;
+		tracker->rest_accel_y = ay;
+		tracker->rest_accel_z = az;
+	}
+
+	// compared against the start of the period, so slow tilting can not creep through sample by sample
+	float dax = ax - tracker->rest_accel_x;
+	float day = ay - tracker->rest_accel_y;
+	float daz = az - tracker->rest_accel_z;
+	float accel_sq = tracker->rest_accel_x * tracker->rest_accel_x
+		+ tracker->rest_accel_y * tracker->rest_accel_y
+		+ tracker->rest_accel_z * tracker->rest_accel_z;
+	float gyro_sq = gx * gx + gy * gy + gz * gz;
+	bool rest = gyro_sq < REST_GYRO_MAX * REST_GYRO_MAX
+		&& dax * dax + day * day + daz * daz < REST_ACCEL_DELTA_MAX * REST_ACCEL_DELTA_MAX * accel_sq;
+	if(!rest)
+	{
+		tracker_rest_reset(tracker);
+		return;
+	}
+
+	tracker->rest_gyro_sum_x += gx;
+	tracker->rest_gyro_sum_y += gy;
+	tracker->rest_gyro_sum_z += gz;
+	tracker->rest_gyro_sq_sum += gyro_sq;
+	tracker->rest_samples++;
+	tracker->rest_time_us += delta_us;
+	if(tracker->rest_time_us < REST_TIME_MIN_US || tracker->rest_samples < REST_SAMPLES_MIN)
+		return;
+
+	float inv_samples = 1.0f / (float)tracker->rest_samples;
+	float mean_x = tracker->rest_gyro_sum_x * inv_samples;
+	float mean_y = tracker->rest_gyro_sum_y * inv_samples;
+	float mean_z = tracker->rest_gyro_sum_z * inv_samples;
+	float var = tracker->rest_gyro_sq_sum * inv_samples - (mean_x * mean_x + mean_y * mean_y + mean_z * mean_z);
+	tracker_rest_reset(tracker);
+	if(var > REST_GYRO_VAR_MAX)
+		return;
+
+	// a single period may still be off, e.g. when the device was turning very slowly and steadily
+	float gain = tracker->gyro_bias_valid ? BIAS_GAIN : 1.0f;
+	tracker->gyro_bias_x += gain * (mean_x - tracker->gyro_bias_x);
+	tracker->gyro_bias_y += gain * (mean_y - tracker->gyro_bias_y);
+	tracker->gyro_bias_z += gain * (mean_z - tracker->gyro_bias_z);
+	tracker->gyro_bias_valid = true;
 }
 
 CHIAKI_EXPORT void chiaki_orientation_tracker_update(ChiakiOrientationTracker *tracker,
 		float gx, float gy, float gz, float ax, float ay, float az, uint32_t timestamp_us)
 {
+	uint64_t delta_us = 0;
+	if(tracker->sample_index)
+	{
+		delta_us = timestamp_us;
+		if(delta_us < tracker->timestamp)
+			delta_us += (1ULL << 32);
+		delta_us -= tracker->timestamp;
+	}
+	tracker->timestamp = timestamp_us;
+	tracker->sample_index++;
+
+	if(tracker->bias_calibration && tracker->sample_index > 1)
+		tracker_calibrate_bias(tracker, gx, gy, gz, ax, ay, az, delta_us);
+	gx -= tracker->gyro_bias_x;
+	gy -= tracker->gyro_bias_y;
+	gz -= tracker->gyro_bias_z;
+
 	tracker->gyro_x = gx;
 	tracker->gyro_y = gy;
 	tracker->gyro_z = gz;
 	tracker->accel_x = ax;
 	tracker->accel_y = ay;
 	tracker->accel_z = az;
-	tracker->sample_index++;
-	if(tracker->sample_index <= 1)
-	{
-		tracker->timestamp = timestamp_us;
+	if(tracker->sample_index <= 1 || delta_us > TIME_STEP_MAX_US)
 		return;
+
+	bool warmup = tracker->sample_index < WARMUP_SAMPLES_COUNT;
+	float time_step_sec = (float)delta_us / 1000000.0f;
+	switch(tracker->filter)
+	{
+		case CHIAKI_ORIENTATION_FILTER_MAHONY:
+			chiaki_orientation_update_mahony(&tracker->orient, tracker->mahony_integral, gx, gy, gz, ax, ay, az,
+					warmup ? MAHONY_KP_WARMUP : MAHONY_KP_DEFAULT,
+					warmup ? 0.0f : MAHONY_KI_DEFAULT,
+					time_step_sec);
+			break;
+		default:
+			chiaki_orientation_update(&tracker->orient, gx, gy, gz, ax, ay, az,
+					warmup ? BETA_WARMUP : BETA_DEFAULT,
+					time_step_sec);
+			break;
 	}
-	uint64_t delta_us = timestamp_us;
-	if(delta_us < tracker->timestamp)
-		delta_us += (1ULL << 32);
-	delta_us -= tracker->timestamp;
-	tracker->timestamp = timestamp_us;
-	chiaki_orientation_update(&tracker->orient, gx, gy, gz, ax, ay, az,
-			tracker->sample_index < WARMUP_SAMPLES_COUNT ? BETA_WARMUP : BETA_DEFAULT,
-			(float)delta_us / 1000000.0f);
 }
 
 CHIAKI_EXPORT void chiaki_orientation_tracker_apply_to_controller_state(ChiakiOrientationTracker *tracker,
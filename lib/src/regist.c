@@ -219,7 +219,7 @@ static void *regist_thread_func(void *user)
 	bool canceled = false;
 	bool success = false;
 
-	ChiakiRPCrypt crypt;
+	ChiakiRPCrypt crypt = { 0 };
 	uint8_t ambassador[CHIAKI_RPCRYPT_KEY_SIZE];
 	ChiakiErrorCode err = chiaki_random_bytes_crypt(ambassador, sizeof(ambassador));
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -330,6 +330,7 @@ fail_socket:
 fail_addrinfos:
 	freeaddrinfo(addrinfos);
 fail:
+	chiaki_rpcrypt_fini(&crypt);
 	if(canceled)
 	{
 		CHIAKI_LOGI(regist->log, "Regist canceled");
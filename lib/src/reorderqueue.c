@@ -155,7 +155,8 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t
 	if(!entry->set)
 		return false;
 
-	*seq_num = seq_num_val;
+	if(seq_num)
+		*seq_num = seq_num_val;
 	*user = entry->user;
 	return true;
 }
@@ -170,6 +171,7 @@ CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t
 	if(!entry->set)
 		return;
 
+	entry->set = false;
 	if(queue->drop_cb)
 		queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
 
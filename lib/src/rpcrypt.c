@@ -8,6 +8,11 @@
 #else
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#define RPCRYPT_EVP_MAC
+#endif
 #endif
 
 #include <string.h>
@@ -1697,12 +1702,23 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_aeropause(ChiakiTarget target, size
 
 CHIAKI_EXPORT void chiaki_rpcrypt_init_auth(ChiakiRPCrypt *rpcrypt, ChiakiTarget target, const uint8_t *nonce, const uint8_t *morning)
 {
+	rpcrypt->ctx = NULL;
 	rpcrypt->target = target;
 	chiaki_rpcrypt_bright_ambassador(target, rpcrypt->bright, rpcrypt->ambassador, nonce, morning);
 }
 
+CHIAKI_EXPORT void chiaki_rpcrypt_init_clone(ChiakiRPCrypt *rpcrypt, const ChiakiRPCrypt *src)
+{
+	// the keyed contexts are created again on first use, they must never be shared
+	rpcrypt->ctx = NULL;
+	rpcrypt->target = src->target;
+	memcpy(rpcrypt->bright, src->bright, sizeof(rpcrypt->bright));
+	memcpy(rpcrypt->ambassador, src->ambassador, sizeof(rpcrypt->ambassador));
+}
+
 CHIAKI_EXPORT void chiaki_rpcrypt_init_regist_ps4_pre10(ChiakiRPCrypt *rpcrypt, const uint8_t *ambassador, uint32_t pin)
 {
+	rpcrypt->ctx = NULL;
 	rpcrypt->target = CHIAKI_TARGET_PS4_9; // representative, might not be the actual version
 	static const uint8_t regist_aes_key[CHIAKI_RPCRYPT_KEY_SIZE] =
 		{ 0x3f, 0x1c, 0xc4, 0xb6, 0xdc, 0xbb, 0x3e, 0xcc, 0x50, 0xba, 0xed, 0xef, 0x97, 0x34, 0xc7, 0xc9 };
@@ -1716,6 +1732,7 @@ CHIAKI_EXPORT void chiaki_rpcrypt_init_regist_ps4_pre10(ChiakiRPCrypt *rpcrypt,
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_init_regist(ChiakiRPCrypt *rpcrypt, ChiakiTarget target, const uint8_t *ambassador, size_t key_0_off, uint32_t pin)
 {
+	rpcrypt->ctx = NULL;
 	static const uint8_t ps4_keys_0[512] = {
 		0xbe, 0xce, 0x5d, 0xf0, 0xc1, 0x7d, 0xb5, 0xd0, 0xcb, 0x30,
 		0x13, 0x5d, 0xaa, 0x56, 0x23, 0xfb, 0xc4, 0xbc, 0xf1, 0x8f,
@@ -1865,96 +1882,217 @@ static const uint8_t *rpcrypt_hmac_key(ChiakiRPCrypt *rpcrypt)
 	}
 }
 
+/**
+ * Contexts that are keyed once and reused for every message
+ */
+struct chiaki_rpcrypt_ctx_t
+{
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_generate_iv(ChiakiRPCrypt *rpcrypt, uint8_t *iv, uint64_t counter)
+	mbedtls_md_context_t hmac;
+	mbedtls_aes_context aes; // cfb128 only uses the encryption key schedule, also for decryption
+#else
+#ifdef RPCRYPT_EVP_MAC
+	EVP_MAC *hmac_mac;
+	EVP_MAC_CTX *hmac;
+#else
+	HMAC_CTX *hmac;
+#endif
+	EVP_CIPHER_CTX *aes_enc;
+	EVP_CIPHER_CTX *aes_dec;
+#endif
+
+	/**
+	 * Direct-mapped by counter. The iv only depends on the counter, so both directions share it.
+	 */
+	uint8_t iv_cache[CHIAKI_RPCRYPT_IV_CACHE_SIZE][CHIAKI_RPCRYPT_KEY_SIZE];
+	uint64_t iv_cache_counter[CHIAKI_RPCRYPT_IV_CACHE_SIZE];
+	bool iv_cache_valid[CHIAKI_RPCRYPT_IV_CACHE_SIZE];
+};
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+static void rpcrypt_ctx_free(ChiakiRPCryptCtx *ctx)
 {
-	const uint8_t *hmac_key = rpcrypt_hmac_key(rpcrypt);
+	mbedtls_md_free(&ctx->hmac);
+	mbedtls_aes_free(&ctx->aes);
+	free(ctx);
+}
 
-	uint8_t buf[CHIAKI_RPCRYPT_KEY_SIZE + 8];
-	memcpy(buf, rpcrypt->ambassador, CHIAKI_RPCRYPT_KEY_SIZE);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 0] = (uint8_t)((counter >> 0x38) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 1] = (uint8_t)((counter >> 0x30) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 2] = (uint8_t)((counter >> 0x28) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 3] = (uint8_t)((counter >> 0x20) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 4] = (uint8_t)((counter >> 0x18) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 5] = (uint8_t)((counter >> 0x10) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 6] = (uint8_t)((counter >> 0x08) & 0xff);
-	buf[CHIAKI_RPCRYPT_KEY_SIZE + 7] = (uint8_t)((counter >> 0x00) & 0xff);
+static ChiakiRPCryptCtx *rpcrypt_ctx_new(ChiakiRPCrypt *rpcrypt)
+{
+	ChiakiRPCryptCtx *ctx = calloc(1, sizeof(ChiakiRPCryptCtx));
+	if(!ctx)
+		return NULL;
+	mbedtls_md_init(&ctx->hmac);
+	mbedtls_aes_init(&ctx->aes);
+	// https://tls.mbed.org/module-level-design-hashing
+	if(mbedtls_md_setup(&ctx->hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0
+		|| mbedtls_md_hmac_starts(&ctx->hmac, rpcrypt_hmac_key(rpcrypt), HMAC_KEY_SIZE) != 0
+		|| mbedtls_aes_setkey_enc(&ctx->aes, rpcrypt->bright, 128) != 0)
+	{
+		rpcrypt_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
 
-	uint8_t hmac[CHIAKI_RPCRYPT_KEY_SIZE];
-	unsigned int hmac_len = 0;
+static ChiakiErrorCode rpcrypt_hmac(ChiakiRPCryptCtx *ctx, const uint8_t *buf, size_t buf_size, uint8_t *iv)
+{
+	uint8_t hmac[32];
+	// reset restarts from the precomputed inner pad
+	if(mbedtls_md_hmac_reset(&ctx->hmac) != 0
+		|| mbedtls_md_hmac_update(&ctx->hmac, buf, buf_size) != 0
+		|| mbedtls_md_hmac_finish(&ctx->hmac, hmac) != 0)
+		return CHIAKI_ERR_UNKNOWN;
+	memcpy(iv, hmac, CHIAKI_RPCRYPT_KEY_SIZE);
+	return CHIAKI_ERR_SUCCESS;
+}
 
+static ChiakiErrorCode rpcrypt_aes_cfb(ChiakiRPCryptCtx *ctx, const uint8_t *iv_in, const uint8_t *in, uint8_t *out, size_t sz, bool encrypt)
+{
+	// https://github.com/ARMmbed/mbedtls/blob/development/programs/aes/aescrypt2.c
+	uint8_t iv[CHIAKI_RPCRYPT_KEY_SIZE];
+	memcpy(iv, iv_in, sizeof(iv));
+	size_t iv_off = 0;
+	if(mbedtls_aes_crypt_cfb128(&ctx->aes, encrypt ? MBEDTLS_AES_ENCRYPT : MBEDTLS_AES_DECRYPT, sz, &iv_off, iv, in, out) != 0)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	mbedtls_md_context_t ctx;
-	mbedtls_md_type_t type = MBEDTLS_MD_SHA256;
+#else
+#ifdef RPCRYPT_EVP_MAC
+static void rpcrypt_hmac_free(ChiakiRPCryptCtx *ctx)
+{
+	EVP_MAC_CTX_free(ctx->hmac);
+	EVP_MAC_free(ctx->hmac_mac);
+}
 
-	mbedtls_md_init(&ctx);
+static bool rpcrypt_hmac_init(ChiakiRPCryptCtx *ctx, const uint8_t *key)
+{
+	ctx->hmac_mac = EVP_MAC_fetch(NULL, OSSL_MAC_NAME_HMAC, NULL);
+	if(!ctx->hmac_mac)
+		return false;
+	ctx->hmac = EVP_MAC_CTX_new(ctx->hmac_mac);
+	if(!ctx->hmac)
+		return false;
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+		OSSL_PARAM_construct_end()
+	};
+	return EVP_MAC_init(ctx->hmac, key, HMAC_KEY_SIZE, params);
+}
 
-#define GOTO_ERROR(err) do { \
-	if((err) !=0){ \
-		goto error;} \
-	} while(0)
-	// https://tls.mbed.org/module-level-design-hashing
-	GOTO_ERROR(mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(type) , 1));
-	GOTO_ERROR(mbedtls_md_hmac_starts(&ctx, hmac_key, HMAC_KEY_SIZE));
-	GOTO_ERROR(mbedtls_md_hmac_update(&ctx, (const unsigned char *) buf, sizeof(buf)));
-	GOTO_ERROR(mbedtls_md_hmac_finish(&ctx, hmac));
-#undef GOTO_ERROR
+static ChiakiErrorCode rpcrypt_hmac(ChiakiRPCryptCtx *ctx, const uint8_t *buf, size_t buf_size, uint8_t *iv)
+{
+	uint8_t hmac[32];
+	size_t hmac_len = 0;
+	// only reset, the key stays
+	if(!EVP_MAC_init(ctx->hmac, NULL, 0, NULL)
+		|| !EVP_MAC_update(ctx->hmac, buf, buf_size)
+		|| !EVP_MAC_final(ctx->hmac, hmac, &hmac_len, sizeof(hmac)))
+		return CHIAKI_ERR_UNKNOWN;
+	if(hmac_len < CHIAKI_RPCRYPT_KEY_SIZE)
+		return CHIAKI_ERR_UNKNOWN;
 	memcpy(iv, hmac, CHIAKI_RPCRYPT_KEY_SIZE);
-	mbedtls_md_free(&ctx);
 	return CHIAKI_ERR_SUCCESS;
-error:
-	mbedtls_md_free(&ctx);
-	return CHIAKI_ERR_UNKNOWN;
+}
+#else
+static void rpcrypt_hmac_free(ChiakiRPCryptCtx *ctx)
+{
+	HMAC_CTX_free(ctx->hmac);
 }
 
-
-static ChiakiErrorCode chiaki_rpcrypt_crypt(ChiakiRPCrypt *rpcrypt, uint64_t counter, const uint8_t *in, uint8_t *out, size_t sz, bool encrypt)
+static bool rpcrypt_hmac_init(ChiakiRPCryptCtx *ctx, const uint8_t *key)
 {
+	ctx->hmac = HMAC_CTX_new();
+	return ctx->hmac && HMAC_Init_ex(ctx->hmac, key, HMAC_KEY_SIZE, EVP_sha256(), NULL);
+}
 
-#define GOTO_ERROR(err) do { \
-	if((err) !=0){ \
-		goto error;} \
-	} while(0)
+static ChiakiErrorCode rpcrypt_hmac(ChiakiRPCryptCtx *ctx, const uint8_t *buf, size_t buf_size, uint8_t *iv)
+{
+	uint8_t hmac[32];
+	unsigned int hmac_len = 0;
+	// without a key, the precomputed inner and outer pads are reused
+	if(!HMAC_Init_ex(ctx->hmac, NULL, 0, NULL, NULL)
+		|| !HMAC_Update(ctx->hmac, buf, buf_size)
+		|| !HMAC_Final(ctx->hmac, hmac, &hmac_len))
+		return CHIAKI_ERR_UNKNOWN;
+	if(hmac_len < CHIAKI_RPCRYPT_KEY_SIZE)
+		return CHIAKI_ERR_UNKNOWN;
+	memcpy(iv, hmac, CHIAKI_RPCRYPT_KEY_SIZE);
+	return CHIAKI_ERR_SUCCESS;
+}
+#endif
 
-	// https://github.com/ARMmbed/mbedtls/blob/development/programs/aes/aescrypt2.c
-	// build aes context
-	mbedtls_aes_context ctx;
-	mbedtls_aes_init(&ctx);
+static void rpcrypt_ctx_free(ChiakiRPCryptCtx *ctx)
+{
+	rpcrypt_hmac_free(ctx);
+	EVP_CIPHER_CTX_free(ctx->aes_enc);
+	EVP_CIPHER_CTX_free(ctx->aes_dec);
+	free(ctx);
+}
 
-	// initialization vector
-	uint8_t iv[CHIAKI_RPCRYPT_KEY_SIZE];
-	ChiakiErrorCode err = chiaki_rpcrypt_generate_iv(rpcrypt, iv, counter);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+static ChiakiRPCryptCtx *rpcrypt_ctx_new(ChiakiRPCrypt *rpcrypt)
+{
+	ChiakiRPCryptCtx *ctx = calloc(1, sizeof(ChiakiRPCryptCtx));
+	if(!ctx)
+		return NULL;
+	ctx->aes_enc = EVP_CIPHER_CTX_new();
+	ctx->aes_dec = EVP_CIPHER_CTX_new();
+	if(!rpcrypt_hmac_init(ctx, rpcrypt_hmac_key(rpcrypt))
+		|| !ctx->aes_enc || !ctx->aes_dec
+		|| !EVP_EncryptInit_ex(ctx->aes_enc, EVP_aes_128_cfb128(), NULL, rpcrypt->bright, NULL)
+		|| !EVP_DecryptInit_ex(ctx->aes_dec, EVP_aes_128_cfb128(), NULL, rpcrypt->bright, NULL)
+		|| !EVP_CIPHER_CTX_set_padding(ctx->aes_enc, 0)
+		|| !EVP_CIPHER_CTX_set_padding(ctx->aes_dec, 0))
+	{
+		rpcrypt_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
 
-	GOTO_ERROR(mbedtls_aes_setkey_enc(&ctx, rpcrypt->bright, 128));
-	size_t iv_off = 0;
+static ChiakiErrorCode rpcrypt_aes_cfb(ChiakiRPCryptCtx *ctx, const uint8_t *iv, const uint8_t *in, uint8_t *out, size_t sz, bool encrypt)
+{
+	// only set the iv, the key schedule stays
+	int outl;
 	if(encrypt)
 	{
-		GOTO_ERROR(mbedtls_aes_crypt_cfb128(&ctx, MBEDTLS_AES_ENCRYPT, sz, &iv_off, iv, in, out));
+		if(!EVP_EncryptInit_ex(ctx->aes_enc, NULL, NULL, NULL, iv)
+			|| !EVP_EncryptUpdate(ctx->aes_enc, out, &outl, in, (int)sz))
+			return CHIAKI_ERR_UNKNOWN;
 	}
 	else
 	{
-		// the aes_crypt_cfb128 does not seems to use the setkey_dec
-		// GOTO_ERROR(mbedtls_aes_setkey_dec(&ctx, rpcrypt->bright, 128));
-		GOTO_ERROR(mbedtls_aes_crypt_cfb128(&ctx, MBEDTLS_AES_DECRYPT, sz, &iv_off, iv, in, out));
+		if(!EVP_DecryptInit_ex(ctx->aes_dec, NULL, NULL, NULL, iv)
+			|| !EVP_DecryptUpdate(ctx->aes_dec, out, &outl, in, (int)sz))
+			return CHIAKI_ERR_UNKNOWN;
 	}
-
-#undef GOTO_ERROR
-	mbedtls_aes_free(&ctx);
-
+	if(outl != (int)sz)
+		return CHIAKI_ERR_UNKNOWN;
 	return CHIAKI_ERR_SUCCESS;
+}
+#endif
 
-error:
-	mbedtls_aes_free(&ctx);
-	return CHIAKI_ERR_UNKNOWN;
+static ChiakiErrorCode rpcrypt_ctx_get(ChiakiRPCrypt *rpcrypt, ChiakiRPCryptCtx **ctx)
+{
+	if(!rpcrypt->ctx)
+	{
+		rpcrypt->ctx = rpcrypt_ctx_new(rpcrypt);
+		if(!rpcrypt->ctx)
+			return CHIAKI_ERR_UNKNOWN;
+	}
+	*ctx = rpcrypt->ctx;
+	return CHIAKI_ERR_SUCCESS;
 }
 
-#else
-CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_generate_iv(ChiakiRPCrypt *rpcrypt, uint8_t *iv, uint64_t counter)
+static ChiakiErrorCode rpcrypt_iv(ChiakiRPCrypt *rpcrypt, ChiakiRPCryptCtx *ctx, uint64_t counter, uint8_t *iv)
 {
-	const uint8_t *hmac_key = rpcrypt_hmac_key(rpcrypt);
+	size_t slot = (size_t)(counter % CHIAKI_RPCRYPT_IV_CACHE_SIZE);
+	if(ctx->iv_cache_valid[slot] && ctx->iv_cache_counter[slot] == counter)
+	{
+		memcpy(iv, ctx->iv_cache[slot], CHIAKI_RPCRYPT_KEY_SIZE);
+		return CHIAKI_ERR_SUCCESS;
+	}
 
 	uint8_t buf[CHIAKI_RPCRYPT_KEY_SIZE + 8];
 	memcpy(buf, rpcrypt->ambassador, CHIAKI_RPCRYPT_KEY_SIZE);
@@ -1967,65 +2105,64 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_generate_iv(ChiakiRPCrypt *rpcrypt,
 	buf[CHIAKI_RPCRYPT_KEY_SIZE + 6] = (uint8_t)((counter >> 0x08) & 0xff);
 	buf[CHIAKI_RPCRYPT_KEY_SIZE + 7] = (uint8_t)((counter >> 0x00) & 0xff);
 
-	uint8_t hmac[32];
-	unsigned int hmac_len = 0;
-	if(!HMAC(EVP_sha256(), hmac_key, CHIAKI_RPCRYPT_KEY_SIZE, buf, sizeof(buf), hmac, &hmac_len))
-		return CHIAKI_ERR_UNKNOWN;
-
-	if(hmac_len < CHIAKI_RPCRYPT_KEY_SIZE)
-		return CHIAKI_ERR_UNKNOWN;
+	ChiakiErrorCode err = rpcrypt_hmac(ctx, buf, sizeof(buf), iv);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-	memcpy(iv, hmac, CHIAKI_RPCRYPT_KEY_SIZE);
+	memcpy(ctx->iv_cache[slot], iv, CHIAKI_RPCRYPT_KEY_SIZE);
+	ctx->iv_cache_counter[slot] = counter;
+	ctx->iv_cache_valid[slot] = true;
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode chiaki_rpcrypt_crypt(ChiakiRPCrypt *rpcrypt, uint64_t counter, const uint8_t *in, uint8_t *out, size_t sz, bool encrypt)
+CHIAKI_EXPORT void chiaki_rpcrypt_fini(ChiakiRPCrypt *rpcrypt)
 {
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-		return CHIAKI_ERR_UNKNOWN;
+	if(rpcrypt->ctx)
+		rpcrypt_ctx_free(rpcrypt->ctx);
+	rpcrypt->ctx = NULL;
+}
 
-	uint8_t iv[CHIAKI_RPCRYPT_KEY_SIZE];
-	ChiakiErrorCode err = chiaki_rpcrypt_generate_iv(rpcrypt, iv, counter);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_generate_iv(ChiakiRPCrypt *rpcrypt, uint8_t *iv, uint64_t counter)
+{
+	ChiakiRPCryptCtx *ctx;
+	ChiakiErrorCode err = rpcrypt_ctx_get(rpcrypt, &ctx);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
+	return rpcrypt_iv(rpcrypt, ctx, counter, iv);
+}
 
-#define FAIL(err) do { EVP_CIPHER_CTX_free(ctx); return (err); } while(0);
-
-	if(encrypt)
-	{
-		if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_cfb128(), NULL, rpcrypt->bright, iv))
-			FAIL(CHIAKI_ERR_UNKNOWN);
-	}
-	else
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_pregenerate_ivs(ChiakiRPCrypt *rpcrypt, uint64_t counter_first, size_t count)
+{
+	ChiakiRPCryptCtx *ctx;
+	ChiakiErrorCode err = rpcrypt_ctx_get(rpcrypt, &ctx);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	if(count > CHIAKI_RPCRYPT_IV_CACHE_SIZE)
+		count = CHIAKI_RPCRYPT_IV_CACHE_SIZE;
+	uint8_t iv[CHIAKI_RPCRYPT_KEY_SIZE];
+	for(size_t i=0; i<count; i++)
 	{
-		if(!EVP_DecryptInit_ex(ctx, EVP_aes_128_cfb128(), NULL, rpcrypt->bright, iv))
-			FAIL(CHIAKI_ERR_UNKNOWN);
+		err = rpcrypt_iv(rpcrypt, ctx, counter_first + i, iv);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 	}
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(!EVP_CIPHER_CTX_set_padding(ctx, 0))
-		FAIL(CHIAKI_ERR_UNKNOWN);
-
-	int outl;
-	if(encrypt)
-	{
-		if(!EVP_EncryptUpdate(ctx, out, &outl, in, (int)sz))
-			FAIL(CHIAKI_ERR_UNKNOWN);
-	}
-	else
-	{
-		if(!EVP_DecryptUpdate(ctx, out, &outl, in, (int)sz))
-			FAIL(CHIAKI_ERR_UNKNOWN);
-	}
+static ChiakiErrorCode chiaki_rpcrypt_crypt(ChiakiRPCrypt *rpcrypt, uint64_t counter, const uint8_t *in, uint8_t *out, size_t sz, bool encrypt)
+{
+	ChiakiRPCryptCtx *ctx;
+	ChiakiErrorCode err = rpcrypt_ctx_get(rpcrypt, &ctx);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-	if(outl != (int)sz)
-		FAIL(CHIAKI_ERR_UNKNOWN);
+	uint8_t iv[CHIAKI_RPCRYPT_KEY_SIZE];
+	err = rpcrypt_iv(rpcrypt, ctx, counter, iv);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-#undef FAIL
-	EVP_CIPHER_CTX_free(ctx);
-	return CHIAKI_ERR_SUCCESS;
+	return rpcrypt_aes_cfb(ctx, iv, in, out, sz, encrypt);
 }
-#endif
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rpcrypt_encrypt(ChiakiRPCrypt *rpcrypt, uint64_t counter, const uint8_t *in, uint8_t *out, size_t sz)
 {
@@ -33,6 +33,13 @@
 #define SENKUSHA_PING_COUNT_DEFAULT 10
 #define EXPECT_PONG_TIMEOUT_MS 1000
 
+// MTU candidates that are probed in parallel per round
+#define SENKUSHA_MTU_PROBES 8
+
+// ids of the Client MTU Commands starting and finishing the MTU out test, the console echoes the first one
+#define CLIENT_MTU_COMMAND_ID_START 1
+#define CLIENT_MTU_COMMAND_ID_FINISH 2
+
 // Assuming IPv4, sizeof(ip header) + sizeof(udp header)
 #define MTU_UDP_PACKET_ADD 0x1c
 
@@ -53,7 +60,7 @@ typedef enum {
 	STATE_EXPECT_CLIENT_MTU_COMMAND
 } SenkushaState;
 
-static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us);
+static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us, uint64_t *rtt_jitter_us);
 static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
 static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
 static void senkusha_takion_cb(ChiakiTakionEvent *event, void *user);
@@ -67,6 +74,7 @@ static ChiakiErrorCode senkusha_send_echo_command(ChiakiSenkusha *senkusha, bool
 static ChiakiErrorCode senkusha_send_mtu_command(ChiakiSenkusha *senkusha, tkproto_SenkushaMtuCommand *command);
 static ChiakiErrorCode senkusha_send_client_mtu_command(ChiakiSenkusha *senkusha, tkproto_SenkushaClientMtuCommand *command, bool wait_for_ack);
 static ChiakiErrorCode senkusha_send_data_wait_for_ack(ChiakiSenkusha *senkusha, uint8_t *buf, size_t buf_size);
+static void senkusha_probes_reset(ChiakiSenkusha *senkusha, size_t count);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, ChiakiSession *session)
 {
@@ -86,8 +94,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, Chi
 	senkusha->state_failed = false;
 	senkusha->should_stop = false;
 	senkusha->data_ack_seq_num_expected = 0;
-	senkusha->ping_tag = 0;
-	senkusha->pong_time_us = 0;
+	senkusha->ping_test_index = 0;
+	senkusha_probes_reset(senkusha, 0);
 
 	chiaki_key_state_init(&senkusha->takion.key_state);
 
@@ -111,7 +119,7 @@ static bool state_finished_cond_check(void *user)
 	return senkusha->state_finished || senkusha->should_stop;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, uint64_t *rtt_jitter_us)
 {
 	ChiakiSession *session = senkusha->session;
 	ChiakiErrorCode err;
@@ -127,7 +135,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	if(senkusha->should_stop)
 	{
 		err = CHIAKI_ERR_CANCELED;
-		goto quit;
+		QUIT(quit);
 	}
 
 	ChiakiTakionConnectInfo takion_info;
@@ -147,6 +155,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	takion_info.enable_crypt = false;
 	takion_info.protocol_version = 7;
+	takion_info.recv_timeout_ms = 0;
+	memset(&takion_info.socket_config, 0, sizeof(takion_info.socket_config));
+	takion_info.bitrate_kbps = 0;
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
@@ -238,7 +249,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	CHIAKI_LOGI(session->log, "Senkusha successfully received bang");
 
-	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
+	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us, rtt_jitter_us);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed");
@@ -278,8 +289,88 @@ quit:
 	return err;
 }
 
-static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_stop(ChiakiSenkusha *senkusha)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&senkusha->state_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	senkusha->should_stop = true;
+	ChiakiErrorCode unlock_err = chiaki_mutex_unlock(&senkusha->state_mutex);
+	err = chiaki_cond_signal(&senkusha->state_cond);
+	return err == CHIAKI_ERR_SUCCESS ? unlock_err : err;
+}
+
+static void senkusha_probes_reset(ChiakiSenkusha *senkusha, size_t count)
+{
+	assert(count <= CHIAKI_SENKUSHA_PROBES_MAX);
+	memset(senkusha->probes, 0, sizeof(senkusha->probes));
+	senkusha->probes_count = count;
+	senkusha->probes_received = 0;
+}
+
+static void senkusha_probe_received(ChiakiSenkusha *senkusha, ChiakiSenkushaProbe *probe, uint64_t time_us)
+{
+	if(probe->received)
+		return;
+	probe->received = true;
+	probe->recv_time_us = time_us;
+	senkusha->probes_received++;
+	if(senkusha->probes_received >= senkusha->probes_count)
+	{
+		senkusha->state_finished = true;
+		chiaki_cond_signal(&senkusha->state_cond);
+	}
+}
+
+/**
+ * Wait until all probes have been received or timeout_ms has passed.
+ * @return CHIAKI_ERR_CANCELED if stopped, otherwise CHIAKI_ERR_SUCCESS, even if not all probes were received
+ */
+static ChiakiErrorCode senkusha_probes_wait(ChiakiSenkusha *senkusha, uint64_t timeout_ms)
+{
+	ChiakiErrorCode err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
+	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
+	if(senkusha->should_stop)
+		return CHIAKI_ERR_CANCELED;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Send a ping for probe probe_index, buf_size is the full size of the packet to send.
+ */
+static ChiakiErrorCode senkusha_send_ping(ChiakiSenkusha *senkusha, uint8_t *buf, size_t buf_size, size_t probe_index)
+{
+	ChiakiSenkushaProbe *probe = &senkusha->probes[probe_index];
+
+	ChiakiTakionAVPacket av_packet = { 0 };
+	av_packet.codec = 0xff;
+	av_packet.is_video = false;
+	av_packet.frame_index = senkusha->ping_test_index;
+	av_packet.unit_index = (uint16_t)probe_index;
+	av_packet.units_in_frame_total = 0x800; // or 0
+
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v7_av_packet_format_header(buf, buf_size, &header_size, &av_packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
+		return err;
+	}
+	if(buf_size < header_size + 8)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	*((chiaki_unaligned_uint32_t *)(buf + header_size)) = 0;
+	*((chiaki_unaligned_uint32_t *)(buf + header_size + 4)) = htonl(probe->tag);
+
+	probe->send_time_us = chiaki_time_now_monotonic_us();
+	return chiaki_takion_send_raw(&senkusha->takion, buf, buf_size);
+}
+
+static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us, uint64_t *rtt_jitter_us)
 {
+	if(ping_count > CHIAKI_SENKUSHA_PROBES_MAX)
+		ping_count = CHIAKI_SENKUSHA_PROBES_MAX;
+
 	CHIAKI_LOGI(senkusha->log, "Senkusha Ping Test with count %u starting", (unsigned int)ping_count);
 
 	ChiakiErrorCode err = senkusha_send_echo_command(senkusha, true);
@@ -291,69 +382,48 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha enabled echo");
 
-	uint64_t rtt_us_acc = 0;
-	uint64_t pings_successful = 0;
+	// All pings are in flight at once, each one is identified by its unit index and tag
+	senkusha->state = STATE_EXPECT_PONG;
+	senkusha->state_finished = false;
+	senkusha->state_failed = false;
+	senkusha->ping_test_index = ping_test_index;
+	senkusha_probes_reset(senkusha, ping_count);
+
+	uint8_t data[0x224];
 	for(uint16_t ping_index=0; ping_index<ping_count; ping_index++)
 	{
-		CHIAKI_LOGI(senkusha->log, "Senkusha sending Ping %u of test index %u", (unsigned int)ping_index, (unsigned int)ping_test_index);
-
-		ChiakiTakionAVPacket av_packet = { 0 };
-		av_packet.codec = 0xff;
-		av_packet.is_video = false;
-		av_packet.frame_index = ping_test_index;
-		av_packet.unit_index = ping_index;
-		av_packet.units_in_frame_total = 0x800; // or 0
-
-		uint8_t data[0x224];
+		senkusha->probes[ping_index].tag = chiaki_random_32();
 		memset(data, 0, sizeof(data));
-
-		size_t header_size;
-		err = chiaki_takion_v7_av_packet_format_header(data, sizeof(data), &header_size, &av_packet);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
-			return err;
-		}
-
-		uint32_t tag = chiaki_random_32();
-		*((chiaki_unaligned_uint32_t *)(data + header_size + 4)) = htonl(tag);
-
-		senkusha->state = STATE_EXPECT_PONG;
-		senkusha->state_finished = false;
-		senkusha->state_failed = false;
-		senkusha->ping_test_index = ping_test_index;
-		senkusha->ping_index = ping_index;
-		senkusha->ping_tag = tag;
-
-		uint64_t time_start_us = chiaki_time_now_monotonic_us();
-
-		err = chiaki_takion_send_raw(&senkusha->takion, data, sizeof(data));
+		err = senkusha_send_ping(senkusha, data, sizeof(data), ping_index);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
 			CHIAKI_LOGE(senkusha->log, "Senkusha failed to send ping");
+			senkusha->state = STATE_IDLE;
 			return err;
 		}
+	}
 
-		err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, EXPECT_PONG_TIMEOUT_MS, state_finished_cond_check, senkusha);
-		assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
+	CHIAKI_LOGI(senkusha->log, "Senkusha sent %u Pings of test index %u", (unsigned int)ping_count, (unsigned int)ping_test_index);
 
-		if(!senkusha->state_finished)
-		{
-			if(err == CHIAKI_ERR_TIMEOUT)
-				CHIAKI_LOGE(senkusha->log, "Senkusha pong receive timeout");
-
-			if(senkusha->should_stop)
-				return CHIAKI_ERR_CANCELED;
-			else
-				CHIAKI_LOGE(senkusha->log, "Senkusha failed to receive pong");
+	err = senkusha_probes_wait(senkusha, EXPECT_PONG_TIMEOUT_MS);
+	senkusha->state = STATE_IDLE;
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
+	uint64_t rtt_us_acc = 0;
+	uint64_t pings_successful = 0;
+	for(size_t i=0; i<senkusha->probes_count; i++)
+	{
+		ChiakiSenkushaProbe *probe = &senkusha->probes[i];
+		if(!probe->received)
+		{
+			CHIAKI_LOGE(senkusha->log, "Senkusha pong %u receive timeout", (unsigned int)i);
 			continue;
 		}
-
-		uint64_t delta_us = senkusha->pong_time_us - time_start_us;
+		uint64_t delta_us = probe->recv_time_us - probe->send_time_us;
 		rtt_us_acc += delta_us;
 		pings_successful += 1;
-		CHIAKI_LOGI(senkusha->log, "Senkusha received Pong, RTT = %.3f ms", (float)delta_us * 0.001f);
+		CHIAKI_LOGI(senkusha->log, "Senkusha received Pong %u, RTT = %.3f ms", (unsigned int)i, (float)delta_us * 0.001f);
 	}
 
 	err = senkusha_send_echo_command(senkusha, false);
@@ -372,70 +442,127 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 	}
 
 	*rtt_us = rtt_us_acc / pings_successful;
-	CHIAKI_LOGI(senkusha->log, "Senkusha determined average RTT = %.3f ms", (float)(*rtt_us) * 0.001f);
+
+	uint64_t deviation_acc = 0;
+	for(size_t i=0; i<senkusha->probes_count; i++)
+	{
+		ChiakiSenkushaProbe *probe = &senkusha->probes[i];
+		if(!probe->received)
+			continue;
+		uint64_t delta_us = probe->recv_time_us - probe->send_time_us;
+		deviation_acc += delta_us > *rtt_us ? delta_us - *rtt_us : *rtt_us - delta_us;
+	}
+	*rtt_jitter_us = deviation_acc / pings_successful;
+
+	CHIAKI_LOGI(senkusha->log, "Senkusha determined average RTT = %.3f ms, jitter = %.3f ms",
+			(float)(*rtt_us) * 0.001f, (float)(*rtt_jitter_us) * 0.001f);
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Set up to SENKUSHA_MTU_PROBES MTU probes with values evenly spread in (lo, hi), always including hi - 1.
+ * Probes that have already been sent from earlier rounds are discarded.
+ */
+static void senkusha_mtu_probes_setup(ChiakiSenkusha *senkusha, uint32_t lo, uint32_t hi)
+{
+	uint32_t range = hi - 1 - lo;
+	size_t count = range < SENKUSHA_MTU_PROBES ? range : SENKUSHA_MTU_PROBES;
+	senkusha_probes_reset(senkusha, count);
+	for(size_t i=0; i<count; i++)
+		senkusha->probes[i].value = lo + (uint32_t)(((uint64_t)range * (i + 1)) / count);
+}
+
+/**
+ * Narrow down [*lo, *hi) after a round of MTU probes.
+ * lo becomes the largest received value, hi the smallest lost value above it.
+ */
+static void senkusha_mtu_probes_evaluate(ChiakiSenkusha *senkusha, uint32_t *lo, uint32_t *hi)
+{
+	for(size_t i=0; i<senkusha->probes_count; i++)
+	{
+		if(senkusha->probes[i].received && senkusha->probes[i].value > *lo)
+			*lo = senkusha->probes[i].value;
+	}
+	for(size_t i=0; i<senkusha->probes_count; i++)
+	{
+		uint32_t value = senkusha->probes[i].value;
+		if(!senkusha->probes[i].received && value > *lo && value < *hi)
+			*hi = value;
+	}
+}
+
+/**
+ * @return whether probe i has not been received yet, but its result still matters, i.e. no larger probe has been received
+ */
+static bool senkusha_mtu_probe_pending(ChiakiSenkusha *senkusha, size_t i)
+{
+	if(senkusha->probes[i].received)
+		return false;
+	for(size_t j=0; j<senkusha->probes_count; j++)
+	{
+		if(senkusha->probes[j].received && senkusha->probes[j].value > senkusha->probes[i].value)
+			return false;
+	}
+	return true;
+}
+
 static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
 {
 	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, retries %u, timeout %llu ms",
 			(unsigned int)min, (unsigned int)max, (unsigned int)retries, (unsigned long long)timeout_ms);
 
-	uint32_t cur = max;
 	uint32_t request_id = 0;
-	while((max - min) > 1)
+	uint32_t hi = max + 1; // smallest MTU known not to work
+	while((hi - min) > 1)
 	{
-		bool success = false;
+		senkusha->state = STATE_EXPECT_MTU;
+		senkusha->state_finished = false;
+		senkusha->state_failed = false;
+		senkusha_mtu_probes_setup(senkusha, min, hi);
+		for(size_t i=0; i<senkusha->probes_count; i++)
+			senkusha->probes[i].tag = ++request_id;
+
 		for(uint32_t attempt=0; attempt<retries; attempt++)
 		{
-			senkusha->state = STATE_EXPECT_MTU;
-			senkusha->state_finished = false;
-			senkusha->state_failed = false;
-			senkusha->mtu_id = ++request_id;
-
-			tkproto_SenkushaMtuCommand mtu_cmd = { 0 };
-			mtu_cmd.id = request_id;
-			mtu_cmd.mtu_req = cur;
-			mtu_cmd.num = 1;
-			ChiakiErrorCode err = senkusha_send_mtu_command(senkusha, &mtu_cmd);
-			if(err != CHIAKI_ERR_SUCCESS)
+			for(size_t i=0; i<senkusha->probes_count; i++)
 			{
-				CHIAKI_LOGE(senkusha->log, "Senkusha failed to send MTU command");
-				return err;
+				if(!senkusha_mtu_probe_pending(senkusha, i))
+					continue;
+				tkproto_SenkushaMtuCommand mtu_cmd = { 0 };
+				mtu_cmd.id = senkusha->probes[i].tag;
+				mtu_cmd.mtu_req = senkusha->probes[i].value;
+				mtu_cmd.num = 1;
+				ChiakiErrorCode err = senkusha_send_mtu_command(senkusha, &mtu_cmd);
+				if(err != CHIAKI_ERR_SUCCESS)
+				{
+					CHIAKI_LOGE(senkusha->log, "Senkusha failed to send MTU command");
+					senkusha->state = STATE_IDLE;
+					return err;
+				}
 			}
 
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU request %u (min %u, max %u), id %u, attempt %u",
-					(unsigned int)cur, (unsigned int)min, (unsigned int)max, (unsigned int)request_id, (unsigned int)attempt);
+			CHIAKI_LOGI(senkusha->log, "Senkusha MTU requests for %u candidates in (%u, %u), attempt %u",
+					(unsigned int)senkusha->probes_count, (unsigned int)min, (unsigned int)hi, (unsigned int)attempt);
 
-			err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
-			assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
-
-			if(!senkusha->state_finished)
+			ChiakiErrorCode err = senkusha_probes_wait(senkusha, timeout_ms);
+			if(err != CHIAKI_ERR_SUCCESS)
 			{
-				if(err == CHIAKI_ERR_TIMEOUT)
-				{
-					CHIAKI_LOGI(senkusha->log, "Senkusha MTU %u timeout", (unsigned int)cur);
-					continue;
-				}
-
-				if(senkusha->should_stop)
-					return CHIAKI_ERR_CANCELED;
-				else
-					CHIAKI_LOGE(senkusha->log, "Senkusha failed to receive MTU response");
+				senkusha->state = STATE_IDLE;
+				return err;
 			}
 
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU %u success", (unsigned int)cur);
-			success = true;
-			break;
+			bool pending = false;
+			for(size_t i=0; i<senkusha->probes_count; i++)
+				pending = pending || senkusha_mtu_probe_pending(senkusha, i);
+			if(!pending)
+				break;
 		}
 
-		if(success)
-			min = cur;
-		else
-			max = cur;
-		cur = min + (max - min) / 2;
+		senkusha_mtu_probes_evaluate(senkusha, &min, &hi);
+		CHIAKI_LOGI(senkusha->log, "Senkusha MTU in narrowed down to [%u, %u)", (unsigned int)min, (unsigned int)hi);
 	}
+	senkusha->state = STATE_IDLE;
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha determined inbound MTU %u", (unsigned int)min);
 	*mtu = min;
@@ -454,10 +581,9 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 	senkusha->state = STATE_EXPECT_CLIENT_MTU_COMMAND;
 	senkusha->state_finished = false;
 	senkusha->state_failed = false;
-	senkusha->mtu_id = 1;
 
 	tkproto_SenkushaClientMtuCommand client_mtu_cmd;
-	client_mtu_cmd.id = senkusha->mtu_id;
+	client_mtu_cmd.id = CLIENT_MTU_COMMAND_ID_START;
 	client_mtu_cmd.state = true;
 	client_mtu_cmd.mtu_req = mtu_in;
 	client_mtu_cmd.has_mtu_down = true;
@@ -501,91 +627,54 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 
 	err = CHIAKI_ERR_SUCCESS;
 
-	uint32_t cur = mtu_in;
-	while((max - min) > 1)
+	uint32_t hi = max + 1; // smallest MTU known not to work
+	while((hi - min) > 1)
 	{
-		bool success = false;
+		senkusha->state = STATE_EXPECT_PONG;
+		senkusha->state_finished = false;
+		senkusha->state_failed = false;
+		senkusha->ping_test_index = 0;
+		senkusha_mtu_probes_setup(senkusha, min, hi);
+		for(size_t i=0; i<senkusha->probes_count; i++)
+			senkusha->probes[i].tag = chiaki_random_32();
+
 		for(uint32_t attempt=0; attempt<retries; attempt++)
 		{
-			uint32_t tag = chiaki_random_32();
-
-			senkusha->state = STATE_EXPECT_PONG;
-			senkusha->state_finished = false;
-			senkusha->state_failed = false;
-			senkusha->ping_tag = tag;
-			senkusha->ping_test_index = 0;
-			senkusha->ping_index = (uint16_t)attempt;
-
-			ChiakiTakionAVPacket av_packet = { 0 };
-			av_packet.codec = 0xff;
-			av_packet.is_video = false;
-			av_packet.frame_index = senkusha->ping_test_index;
-			av_packet.unit_index = senkusha->ping_index;
-			av_packet.units_in_frame_total = 0x800;
-
-			size_t header_size;
-			err = chiaki_takion_v7_av_packet_format_header(packet_buf, packet_buf_size, &header_size, &av_packet);
-			if(err != CHIAKI_ERR_SUCCESS)
+			for(size_t i=0; i<senkusha->probes_count; i++)
 			{
-				CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
-				return err;
+				if(!senkusha_mtu_probe_pending(senkusha, i))
+					continue;
+				// a failed send, e.g. EMSGSIZE with don't fragment, is treated like a lost pong
+				if(senkusha_send_ping(senkusha, packet_buf, senkusha->probes[i].value - MTU_UDP_PACKET_ADD, i) != CHIAKI_ERR_SUCCESS)
+					CHIAKI_LOGI(senkusha->log, "Senkusha failed to send MTU %u ping", (unsigned int)senkusha->probes[i].value);
 			}
-			assert(header_size == MTU_AV_PACKET_ADD);
-
-			*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD)) = 0;
-			*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD + 4)) = htonl(tag);
 
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU %u out ping attempt %u", (unsigned int)cur, (unsigned int)attempt);
+			CHIAKI_LOGI(senkusha->log, "Senkusha MTU out pings for %u candidates in (%u, %u), attempt %u",
+					(unsigned int)senkusha->probes_count, (unsigned int)min, (unsigned int)hi, (unsigned int)attempt);
 
-			err = chiaki_takion_send_raw(&senkusha->takion, packet_buf, cur - MTU_UDP_PACKET_ADD);
+			err = senkusha_probes_wait(senkusha, timeout_ms);
 			if(err != CHIAKI_ERR_SUCCESS)
-			{
-				CHIAKI_LOGE(senkusha->log, "Senkusha failed to send ping");
-				err = CHIAKI_ERR_TIMEOUT;
-			}
-			else
-			{
-				err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
-			}
-
-			assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
-
-			if(!senkusha->state_finished)
-			{
-				if(err == CHIAKI_ERR_TIMEOUT)
-				{
-					CHIAKI_LOGI(senkusha->log, "Senkusha MTU pong %u timeout", (unsigned int)cur);
-					continue;
-				}
+				goto beach;
 
-				if(senkusha->should_stop)
-				{
-					err = CHIAKI_ERR_CANCELED;
-					goto beach;
-				}
-				else
-					CHIAKI_LOGE(senkusha->log, "Senkusha failed to receive MTU pong");
-			}
-
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU ping %u success", (unsigned int)cur);
-			success = true;
-			break;
+			bool pending = false;
+			for(size_t i=0; i<senkusha->probes_count; i++)
+				pending = pending || senkusha_mtu_probe_pending(senkusha, i);
+			if(!pending)
+				break;
 		}
 
-		if(success)
-			min = cur;
-		else
-			max = cur;
-		cur = min + (max - min) / 2;
+		senkusha_mtu_probes_evaluate(senkusha, &min, &hi);
+		CHIAKI_LOGI(senkusha->log, "Senkusha MTU out narrowed down to [%u, %u)", (unsigned int)min, (unsigned int)hi);
 	}
+	senkusha->state = STATE_IDLE;
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha determined outbound MTU %u", (unsigned int)min);
 	*mtu = min;
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha sending final Client MTU Command");
-	client_mtu_cmd.id = 2;
+	client_mtu_cmd.id = CLIENT_MTU_COMMAND_ID_FINISH;
 	client_mtu_cmd.state = false;
-	client_mtu_cmd.mtu_req = max;
+	client_mtu_cmd.mtu_req = hi > max ? max : hi;
 	client_mtu_cmd.has_mtu_down = true;
 	client_mtu_cmd.mtu_down = mtu_in;
 	err = senkusha_send_client_mtu_command(senkusha, &client_mtu_cmd, true);
@@ -593,6 +682,7 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 		CHIAKI_LOGE(senkusha->log, "Senkusha failed to send client MTU command");
 
 beach:
+	senkusha->state = STATE_IDLE;
 	free(packet_buf);
 	return err;
 }
@@ -674,7 +764,7 @@ static void senkusha_takion_data(ChiakiSenkusha *senkusha, ChiakiTakionMessageDa
 			|| !msg.has_senkusha_payload
 			|| msg.senkusha_payload.command != tkproto_SenkushaPayload_Command_CLIENT_MTU_COMMAND
 			|| !msg.senkusha_payload.has_client_mtu_command
-			|| msg.senkusha_payload.client_mtu_command.id != senkusha->mtu_id)
+			|| msg.senkusha_payload.client_mtu_command.id != CLIENT_MTU_COMMAND_ID_START)
 		{
 			// There might be another MTU_COMMAND from the server, which we ignore, but this is not an error.
 			if(msg.type != tkproto_TakionMessage_PayloadType_SENKUSHA
@@ -718,7 +808,7 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 	{
 		if(packet->is_video
 			|| packet->frame_index != senkusha->ping_test_index
-			|| packet->unit_index != senkusha->ping_index
+			|| packet->unit_index >= senkusha->probes_count
 			|| packet->data_size < 8)
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid Pong %u/%u, size: %#llx",
@@ -726,18 +816,15 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 			goto beach;
 		}
 
-		uint32_t tag = ntohl(*((uint32_t *)(packet->data + 4)));
-		if(tag != senkusha->ping_tag)
+		ChiakiSenkushaProbe *probe = &senkusha->probes[packet->unit_index];
+		uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)(packet->data + 4)));
+		if(tag != probe->tag)
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received Pong with invalid tag");
 			goto beach;
 		}
 
-		senkusha->pong_time_us = time_us;
-		senkusha->state_finished = true;
-		chiaki_mutex_unlock(&senkusha->state_mutex);
-		chiaki_cond_signal(&senkusha->state_cond);
-		return;
+		senkusha_probe_received(senkusha, probe, time_us);
 	}
 	else if(senkusha->state == STATE_EXPECT_MTU)
 	{
@@ -745,18 +832,27 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 		//chiaki_log_hexdump(senkusha->log, CHIAKI_LOG_DEBUG, packet->data, packet->data_size);
 		//CHIAKI_LOGD(senkusha->log, "packet index: %u, frame index: %u, unit index: %u, units in frame: %u", packet->packet_index, packet->frame_index, packet->unit_index, packet->units_in_frame_total);
 
-		if(!packet->is_video
-			|| packet->frame_index != senkusha->mtu_id)
+		ChiakiSenkushaProbe *probe = NULL;
+		if(packet->is_video)
+		{
+			for(size_t i=0; i<senkusha->probes_count; i++)
+			{
+				if(senkusha->probes[i].tag == packet->frame_index)
+				{
+					probe = &senkusha->probes[i];
+					break;
+				}
+			}
+		}
+
+		if(!probe)
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid MTU response %u, size: %#llx, is video: %d",
 					(unsigned int)packet->frame_index, (unsigned long long)packet->data_size, packet->is_video ? 1 : 0);
 			goto beach;
 		}
 
-		senkusha->state_finished = true;
-		chiaki_mutex_unlock(&senkusha->state_mutex);
-		chiaki_cond_signal(&senkusha->state_cond);
-		return;
+		senkusha_probe_received(senkusha, probe, time_us);
 	}
 
 beach:
@@ -6,6 +6,7 @@
 #include <chiaki/http.h>
 #include <chiaki/base64.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -32,6 +34,7 @@
 
 static void *session_thread_func(void *arg);
 static ChiakiErrorCode session_thread_request_session(ChiakiSession *session, ChiakiTarget *target_out);
+static void session_startup_hint_load_host_cache(ChiakiSession *session);
 
 const char *chiaki_rp_application_reason_string(uint32_t reason)
 {
@@ -230,6 +233,41 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
 	session->connect_info.enable_dualsense = connect_info->enable_dualsense;
+	session->connect_info.startup_mode = connect_info->startup_mode;
+	session->connect_info.startup_hint = connect_info->startup_hint;
+	session->connect_info.enable_resume = connect_info->enable_resume;
+	session->connect_info.socket_config = connect_info->socket_config;
+
+	if(connect_info->host_cache_path && connect_info->host_id)
+	{
+		if(strlen(connect_info->host_id) < sizeof(session->connect_info.host_id))
+		{
+			session->connect_info.host_cache_path = strdup(connect_info->host_cache_path);
+			if(!session->connect_info.host_cache_path)
+			{
+				chiaki_session_fini(session);
+				return CHIAKI_ERR_MEMORY;
+			}
+			strcpy(session->connect_info.host_id, connect_info->host_id);
+		}
+		else
+			CHIAKI_LOGW(session->log, "Host id for host cache is too long, not using host cache");
+	}
+
+	if(session->connect_info.startup_mode == CHIAKI_SESSION_STARTUP_MODE_FAST)
+	{
+		if(session->connect_info.host_cache_path && chiaki_target_is_unknown(session->connect_info.startup_hint.target))
+			session_startup_hint_load_host_cache(session);
+
+		ChiakiTarget hint_target = session->connect_info.startup_hint.target;
+		if(!chiaki_target_is_unknown(hint_target)
+			&& chiaki_target_is_ps5(hint_target) == session->connect_info.ps5
+			&& chiaki_rp_version_string(hint_target))
+		{
+			CHIAKI_LOGI(session->log, "Using RP-Version %s from startup hint", chiaki_rp_version_string(hint_target));
+			session->target = hint_target;
+		}
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 error_stop_pipe:
@@ -250,8 +288,10 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 		return;
 	free(session->login_pin);
 	free(session->quit_reason_str);
+	free(session->connect_info.host_cache_path);
 	chiaki_stream_connection_fini(&session->stream_connection);
 	chiaki_ctrl_fini(&session->ctrl);
+	chiaki_rpcrypt_fini(&session->rpcrypt);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
@@ -276,6 +316,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_stop(ChiakiSession *session)
 	chiaki_stop_pipe_stop(&session->stop_pipe);
 	chiaki_cond_signal(&session->state_cond);
 
+	if(session->senkusha)
+		chiaki_senkusha_stop(session->senkusha);
+
 	chiaki_stream_connection_stop(&session->stream_connection);
 
 	chiaki_mutex_unlock(&session->state_mutex);
@@ -324,6 +367,120 @@ void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event)
 	session->event_cb(event, session->event_cb_user);
 }
 
+CHIAKI_EXPORT void chiaki_session_get_startup_timings(ChiakiSession *session, ChiakiSessionStartupTimings *timings)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&session->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	*timings = session->startup_timings;
+	chiaki_mutex_unlock(&session->state_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_startup_hint(ChiakiSession *session, ChiakiSessionStartupHint *hint)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&session->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	hint->target = session->target;
+	hint->mtu_in = session->mtu_in;
+	hint->mtu_out = session->mtu_out;
+	hint->rtt_us = session->rtt_us;
+	// values taken over from the previous hint must keep aging, otherwise Senkusha would never run again
+	if(!session->network_measured)
+		hint->network_age_ms = UINT64_MAX;
+	else if(session->startup_timings.senkusha_skipped)
+		hint->network_age_ms = session->connect_info.startup_hint.network_age_ms + (chiaki_time_now_monotonic_ms() - session->startup_begin_ms);
+	else
+		hint->network_age_ms = 0;
+	chiaki_mutex_unlock(&session->state_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_delay_estimate(ChiakiSession *session, ChiakiDelayEstimate *estimate)
+{
+	chiaki_delay_estimator_get(&session->stream_connection.delay_estimator, estimate);
+}
+
+static void session_startup_hint_load_host_cache(ChiakiSession *session)
+{
+	ChiakiHostCacheEntry entry;
+	if(!chiaki_host_cache_get(session->connect_info.host_cache_path, session->connect_info.host_id, &entry, session->log))
+		return;
+
+	if(chiaki_target_is_unknown(entry.target)
+		|| chiaki_target_is_ps5(entry.target) != session->connect_info.ps5
+		|| !chiaki_rp_version_string(entry.target))
+	{
+		CHIAKI_LOGW(session->log, "Host cache entry does not match the host, invalidating it");
+		chiaki_host_cache_invalidate(session->connect_info.host_cache_path, session->connect_info.host_id, session->log);
+		return;
+	}
+
+	ChiakiSessionStartupHint *hint = &session->connect_info.startup_hint;
+	hint->target = entry.target;
+	hint->mtu_in = entry.mtu_in;
+	hint->mtu_out = entry.mtu_out;
+	hint->rtt_us = entry.rtt_us;
+	uint64_t now = (uint64_t)time(NULL);
+	// a clock that went backwards makes the values stale rather than infinitely fresh
+	hint->network_age_ms = now >= entry.network_time ? (now - entry.network_time) * 1000 : UINT64_MAX;
+	session->connect_info.target_from_host_cache = true;
+	CHIAKI_LOGI(session->log, "Loaded startup hint from host cache");
+}
+
+/**
+ * Called by the Stream Connection after streaminfo was received to persist the negotiated values in the host cache.
+ * Must be called without state_mutex locked.
+ */
+void chiaki_session_host_cache_update(ChiakiSession *session)
+{
+	if(!session->connect_info.host_cache_path)
+		return;
+
+	ChiakiSessionStartupHint hint;
+	chiaki_session_get_startup_hint(session, &hint);
+	// fallback values must not make the next sessions skip Senkusha
+	if(hint.network_age_ms == UINT64_MAX)
+	{
+		CHIAKI_LOGI(session->log, "Not updating host cache, network values were not measured");
+		return;
+	}
+
+	ChiakiHostCacheEntry entry = { 0 };
+	strcpy(entry.host_id, session->connect_info.host_id);
+	entry.target = hint.target;
+	entry.mtu_in = hint.mtu_in;
+	entry.mtu_out = hint.mtu_out;
+	entry.rtt_us = hint.rtt_us;
+	entry.time = (uint64_t)time(NULL);
+	uint64_t network_age_s = hint.network_age_ms / 1000;
+	entry.network_time = entry.time >= network_age_s ? entry.time - network_age_s : 0;
+	if(chiaki_host_cache_put(session->connect_info.host_cache_path, &entry, session->log) == CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGI(session->log, "Updated host cache");
+}
+
+/**
+ * Called by the Video Receiver when the first frame has been passed to the video sample callback.
+ * Must be called without state_mutex locked.
+ */
+void chiaki_session_startup_first_frame(ChiakiSession *session)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&session->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	ChiakiSessionStartupTimings *timings = &session->startup_timings;
+	if(timings->first_frame_ms)
+	{
+		chiaki_mutex_unlock(&session->state_mutex);
+		return;
+	}
+	timings->first_frame_ms = chiaki_time_now_monotonic_ms() - session->startup_begin_ms;
+	CHIAKI_LOGI(session->log, "Session startup took %llu ms until first frame: session request %llu ms, ctrl %llu ms, senkusha %llu ms%s, stream connection %llu ms",
+			(unsigned long long)timings->first_frame_ms,
+			(unsigned long long)timings->session_request_ms,
+			(unsigned long long)timings->ctrl_ms,
+			(unsigned long long)timings->senkusha_ms,
+			timings->senkusha_skipped ? " (skipped)" : (timings->senkusha_parallel ? " (parallel to ctrl)" : ""),
+			(unsigned long long)timings->stream_connection_ms);
+	chiaki_mutex_unlock(&session->state_mutex);
+}
+
 
 static bool session_check_state_pred(void *user)
 {
@@ -351,12 +508,83 @@ static bool session_check_state_pred_pin(void *user)
 
 #define ENABLE_SENKUSHA
 
+#define SENKUSHA_FALLBACK_MTU 1454
+#define SENKUSHA_FALLBACK_RTT_US 1000
+
+typedef struct session_senkusha_t
+{
+	ChiakiSession *session;
+	ChiakiSenkusha senkusha;
+	ChiakiErrorCode err;
+} SessionSenkusha;
+
+/**
+ * Run Senkusha and write the results to session.
+ * Must be called without state_mutex locked, senkusha must already be initialized.
+ */
+static ChiakiErrorCode session_run_senkusha(ChiakiSession *session, ChiakiSenkusha *senkusha)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&session->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	if(session->should_stop)
+	{
+		chiaki_mutex_unlock(&session->state_mutex);
+		return CHIAKI_ERR_CANCELED;
+	}
+	session->senkusha = senkusha;
+	chiaki_mutex_unlock(&session->state_mutex);
+
+	uint64_t begin_ms = chiaki_time_now_monotonic_ms();
+	uint32_t mtu_in = 0;
+	uint32_t mtu_out = 0;
+	uint64_t rtt_us = 0;
+	uint64_t rtt_jitter_us = 0;
+	err = chiaki_senkusha_run(senkusha, &mtu_in, &mtu_out, &rtt_us, &rtt_jitter_us);
+
+	ChiakiErrorCode mutex_err = chiaki_mutex_lock(&session->state_mutex);
+	assert(mutex_err == CHIAKI_ERR_SUCCESS);
+	session->senkusha = NULL;
+	session->startup_timings.senkusha_ms = chiaki_time_now_monotonic_ms() - begin_ms;
+	if(err == CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
+		session->mtu_in = mtu_in;
+		session->mtu_out = mtu_out;
+		session->rtt_us = rtt_us;
+		session->rtt_jitter_us = rtt_jitter_us;
+		session->network_measured = true;
+	}
+	else if(err != CHIAKI_ERR_CANCELED)
+	{
+		CHIAKI_LOGE(session->log, "Senkusha failed, but we still try to connect with fallback values");
+		session->mtu_in = SENKUSHA_FALLBACK_MTU;
+		session->mtu_out = SENKUSHA_FALLBACK_MTU;
+		session->rtt_us = SENKUSHA_FALLBACK_RTT_US;
+	}
+	chiaki_mutex_unlock(&session->state_mutex);
+	return err;
+}
+
+static void *session_senkusha_thread_func(void *arg)
+{
+	SessionSenkusha *senkusha = arg;
+	senkusha->err = session_run_senkusha(senkusha->session, &senkusha->senkusha);
+	return NULL;
+}
+
 static void *session_thread_func(void *arg)
 {
 	ChiakiSession *session = arg;
 
 	chiaki_mutex_lock(&session->state_mutex);
 
+	session->startup_begin_ms = chiaki_time_now_monotonic_ms();
+	memset(&session->startup_timings, 0, sizeof(session->startup_timings));
+	bool fast_startup = session->connect_info.startup_mode == CHIAKI_SESSION_STARTUP_MODE_FAST;
+	SessionSenkusha senkusha_parallel;
+	ChiakiThread senkusha_thread;
+	bool senkusha_thread_running = false;
+
 #define QUIT(quit_label) do { \
 	chiaki_mutex_unlock(&session->state_mutex); \
 	goto quit_label; } while(0)
@@ -375,6 +603,13 @@ static void *session_thread_func(void *arg)
 	ChiakiTarget server_target = CHIAKI_TARGET_PS4_UNKNOWN;
 	ChiakiErrorCode err = session_thread_request_session(session, &server_target);
 
+	if(err == CHIAKI_ERR_VERSION_MISMATCH && session->connect_info.target_from_host_cache)
+	{
+		CHIAKI_LOGI(session->log, "Host rejected RP-Version from host cache, invalidating cache entry");
+		chiaki_host_cache_invalidate(session->connect_info.host_cache_path, session->connect_info.host_id, session->log);
+		session->connect_info.target_from_host_cache = false;
+	}
+
 	if(err == CHIAKI_ERR_VERSION_MISMATCH && !chiaki_target_is_unknown(server_target))
 	{
 		CHIAKI_LOGI(session->log, "Attempting to re-request session with Server's RP-Version");
@@ -396,6 +631,7 @@ static void *session_thread_func(void *arg)
 	if(err != CHIAKI_ERR_SUCCESS)
 		QUIT(quit);
 
+	session->startup_timings.session_request_ms = chiaki_time_now_monotonic_ms() - session->startup_begin_ms;
 	CHIAKI_LOGI(session->log, "Session request successful");
 
 	chiaki_rpcrypt_init_auth(&session->rpcrypt, session->target, session->nonce, session->connect_info.morning);
@@ -405,10 +641,48 @@ static void *session_thread_func(void *arg)
 
 	CHIAKI_LOGI(session->log, "Starting ctrl");
 
+	uint64_t ctrl_begin_ms = chiaki_time_now_monotonic_ms();
 	err = chiaki_ctrl_start(&session->ctrl);
 	if(err != CHIAKI_ERR_SUCCESS)
 		QUIT(quit);
 
+#ifdef ENABLE_SENKUSHA
+	if(fast_startup)
+	{
+		ChiakiSessionStartupHint *hint = &session->connect_info.startup_hint;
+		if(chiaki_session_startup_hint_network_fresh(hint))
+		{
+			CHIAKI_LOGI(session->log, "Skipping Senkusha, using MTU in %u, MTU out %u and RTT %.3f ms from startup hint",
+					(unsigned int)hint->mtu_in, (unsigned int)hint->mtu_out, (float)hint->rtt_us * 0.001f);
+			session->mtu_in = hint->mtu_in;
+			session->mtu_out = hint->mtu_out;
+			session->rtt_us = hint->rtt_us;
+			session->network_measured = true;
+			session->startup_timings.senkusha_skipped = true;
+		}
+		else
+		{
+			CHIAKI_LOGI(session->log, "Starting Senkusha in parallel to Ctrl");
+			senkusha_parallel.session = session;
+			err = chiaki_senkusha_init(&senkusha_parallel.senkusha, session);
+			if(err != CHIAKI_ERR_SUCCESS)
+				QUIT(quit_ctrl);
+			err = chiaki_thread_create(&senkusha_thread, session_senkusha_thread_func, &senkusha_parallel);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGE(session->log, "Failed to start Senkusha thread, falling back to sequential Senkusha");
+				chiaki_senkusha_fini(&senkusha_parallel.senkusha);
+			}
+			else
+			{
+				chiaki_thread_set_name(&senkusha_thread, "Chiaki Senkusha");
+				senkusha_thread_running = true;
+				session->startup_timings.senkusha_parallel = true;
+			}
+		}
+	}
+#endif
+
 	chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, SESSION_EXPECT_TIMEOUT_MS, session_check_state_pred_ctrl_start, session);
 	CHECK_STOP(quit_ctrl);
 
@@ -463,27 +737,36 @@ ctrl_failed:
 		QUIT(quit_ctrl);
 	}
 
+	session->startup_timings.ctrl_ms = chiaki_time_now_monotonic_ms() - ctrl_begin_ms;
+
 #ifdef ENABLE_SENKUSHA
-	CHIAKI_LOGI(session->log, "Starting Senkusha");
+	if(senkusha_thread_running)
+	{
+		CHIAKI_LOGI(session->log, "Waiting for parallel Senkusha");
+		chiaki_mutex_unlock(&session->state_mutex);
+		chiaki_thread_join(&senkusha_thread, NULL);
+		chiaki_mutex_lock(&session->state_mutex);
+		senkusha_thread_running = false;
+		chiaki_senkusha_fini(&senkusha_parallel.senkusha);
+		if(senkusha_parallel.err == CHIAKI_ERR_CANCELED)
+			QUIT(quit_ctrl);
+	}
+	else if(!session->startup_timings.senkusha_skipped)
+	{
+		CHIAKI_LOGI(session->log, "Starting Senkusha");
 
-	ChiakiSenkusha senkusha;
-	err = chiaki_senkusha_init(&senkusha, session);
-	if(err != CHIAKI_ERR_SUCCESS)
-		QUIT(quit_ctrl);
+		ChiakiSenkusha senkusha;
+		err = chiaki_senkusha_init(&senkusha, session);
+		if(err != CHIAKI_ERR_SUCCESS)
+			QUIT(quit_ctrl);
 
-	err = chiaki_senkusha_run(&senkusha, &session->mtu_in, &session->mtu_out, &session->rtt_us);
-	chiaki_senkusha_fini(&senkusha);
+		chiaki_mutex_unlock(&session->state_mutex);
+		err = session_run_senkusha(session, &senkusha);
+		chiaki_mutex_lock(&session->state_mutex);
+		chiaki_senkusha_fini(&senkusha);
 
-	if(err == CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
-	else if(err == CHIAKI_ERR_CANCELED)
-		QUIT(quit_ctrl);
-	else
-	{
-		CHIAKI_LOGE(session->log, "Senkusha failed, but we still try to connect with fallback values");
-		session->mtu_in = 1454;
-		session->mtu_out = 1454;
-		session->rtt_us = 1000;
+		if(err == CHIAKI_ERR_CANCELED)
+			QUIT(quit_ctrl);
 	}
 #endif
 
@@ -528,6 +811,12 @@ ctrl_failed:
 	chiaki_ecdh_fini(&session->ecdh);
 
 quit_ctrl:
+	if(senkusha_thread_running)
+	{
+		chiaki_senkusha_stop(&senkusha_parallel.senkusha);
+		chiaki_thread_join(&senkusha_thread, NULL);
+		chiaki_senkusha_fini(&senkusha_parallel.senkusha);
+	}
 	chiaki_ctrl_stop(&session->ctrl);
 	chiaki_ctrl_join(&session->ctrl);
 	CHIAKI_LOGI(session->log, "Ctrl stopped");
@@ -1,7 +1,34 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/sock.h>
+#include <chiaki/log.h>
+#include <chiaki/time.h>
+
 #include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <time.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+#endif
+
+#if defined(__linux__) && defined(SO_TIMESTAMPNS)
+#define SOCK_TIMESTAMPS_NS
+#elif !defined(_WIN32) && !defined(__SWITCH__) && defined(SO_TIMESTAMP)
+#define SOCK_TIMESTAMPS_US
+#endif
+
+#if defined(__linux__) && !defined(UDP_GRO)
+#define UDP_GRO 104
+#endif
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_nonblock(chiaki_socket_t sock, bool nonblock)
 {
@@ -18,4 +45,191 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_nonblock(chiaki_socket_t sock, b
 		return CHIAKI_ERR_UNKNOWN;
 #endif
 	return CHIAKI_ERR_SUCCESS;
-}
\ No newline at end of file
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_configure(chiaki_socket_t sock, int family, const ChiakiSocketConfig *config,
+		uint32_t rcvbuf_size_default, ChiakiLog *log, ChiakiSocketFeatures *features)
+{
+	ChiakiSocketFeatures features_tmp;
+	if(!features)
+		features = &features_tmp;
+	memset(features, 0, sizeof(*features));
+
+	const int rcvbuf_val = (int)(config->rcvbuf_size ? config->rcvbuf_size : rcvbuf_size_default);
+	int r = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const void *)&rcvbuf_val, sizeof(rcvbuf_val));
+	if(r < 0)
+	{
+		CHIAKI_LOGE(log, "Failed to setsockopt SO_RCVBUF: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_NETWORK;
+	}
+	int rcvbuf_actual = 0;
+	socklen_t rcvbuf_actual_len = sizeof(rcvbuf_actual);
+	if(getsockopt(sock, SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf_actual, &rcvbuf_actual_len) == 0)
+	{
+		features->rcvbuf_size = (uint32_t)rcvbuf_actual;
+#ifdef __linux__
+		// Linux reports twice the requested size for its bookkeeping overhead
+		if(rcvbuf_actual / 2 < rcvbuf_val)
+			CHIAKI_LOGW(log, "Socket receive buffer is limited to %d bytes instead of %d, consider raising net.core.rmem_max",
+					rcvbuf_actual / 2, rcvbuf_val);
+#endif
+	}
+
+	if(config->busy_poll_us)
+	{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+		const int busy_poll_val = (int)config->busy_poll_us;
+		if(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (const void *)&busy_poll_val, sizeof(busy_poll_val)) < 0)
+			CHIAKI_LOGW(log, "Failed to setsockopt SO_BUSY_POLL: %s", strerror(errno));
+		else
+			CHIAKI_LOGI(log, "Socket busy polling for %u us", (unsigned int)config->busy_poll_us);
+#else
+		CHIAKI_LOGW(log, "Busy polling is not supported on this platform");
+#endif
+	}
+
+	if(config->dscp)
+	{
+		const int tos_val = (config->dscp & 0x3f) << 2; // ECN bits stay 0
+		if(family == AF_INET6)
+		{
+#ifdef IPV6_TCLASS
+			r = setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, (const void *)&tos_val, sizeof(tos_val));
+#else
+			r = -1;
+#endif
+		}
+		else
+			r = setsockopt(sock, IPPROTO_IP, IP_TOS, (const void *)&tos_val, sizeof(tos_val));
+		if(r < 0)
+			CHIAKI_LOGW(log, "Failed to set DSCP %u: " CHIAKI_SOCKET_ERROR_FMT, (unsigned int)config->dscp, CHIAKI_SOCKET_ERROR_VALUE);
+		else
+			CHIAKI_LOGI(log, "Socket marks outgoing packets with DSCP %u", (unsigned int)config->dscp);
+	}
+
+	if(config->timestamps)
+	{
+		const int one = 1;
+#if defined(SOCK_TIMESTAMPS_NS)
+		features->timestamps = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, (const void *)&one, sizeof(one)) == 0;
+#elif defined(SOCK_TIMESTAMPS_US)
+		features->timestamps = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, (const void *)&one, sizeof(one)) == 0;
+#else
+		(void)one;
+#endif
+		if(!features->timestamps)
+			CHIAKI_LOGW(log, "Kernel receive timestamps are not available, using the time of receiving instead");
+	}
+
+	if(config->gro)
+	{
+#ifdef __linux__
+		const int one = 1;
+		features->gro = setsockopt(sock, IPPROTO_UDP, UDP_GRO, (const void *)&one, sizeof(one)) == 0;
+		if(!features->gro)
+			CHIAKI_LOGW(log, "Failed to enable UDP GRO: %s", strerror(errno));
+#else
+		CHIAKI_LOGW(log, "UDP GRO is not supported on this platform");
+#endif
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT uint32_t chiaki_socket_rcvbuf_size_for_bitrate(uint32_t bitrate_kbps, uint32_t duration_ms, uint32_t min_size)
+{
+	uint64_t size = (uint64_t)bitrate_kbps * duration_ms / 8; // kbit/s * ms / 8 = bytes
+	if(size < min_size)
+		return min_size;
+	if(size > INT32_MAX)
+		return INT32_MAX;
+	return (uint32_t)size;
+}
+
+#if defined(SOCK_TIMESTAMPS_NS) || defined(SOCK_TIMESTAMPS_US)
+static uint64_t realtime_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+#endif
+
+CHIAKI_EXPORT int chiaki_socket_recv(chiaki_socket_t sock, uint8_t *buf, size_t buf_size, ChiakiSocketRecvInfo *info)
+{
+#ifdef _WIN32
+	int r = recv(sock, (char *)buf, (int)buf_size, 0);
+	if(info)
+	{
+		info->timestamp_us = chiaki_time_now_monotonic_us();
+		info->kernel_timestamp = false;
+		info->segment_size = 0;
+	}
+	return r;
+#else
+	if(!info)
+		return (int)recv(sock, buf, buf_size, 0);
+
+	struct iovec iov = { buf, buf_size };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t r = recvmsg(sock, &msg, 0);
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	info->timestamp_us = now_us;
+	info->kernel_timestamp = false;
+	info->segment_size = 0;
+	if(r < 0)
+		return (int)r;
+
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+#if defined(SOCK_TIMESTAMPS_NS) || defined(SOCK_TIMESTAMPS_US)
+		uint64_t kernel_us = 0;
+#if defined(SOCK_TIMESTAMPS_NS)
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			kernel_us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+		}
+#else
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP)
+		{
+			struct timeval tv;
+			memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+			kernel_us = (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+		}
+#endif
+		if(kernel_us)
+		{
+			// the kernel stamps on the realtime clock, so only the time since then can be transferred
+			uint64_t realtime_us = realtime_now_us();
+			uint64_t waited_us = realtime_us > kernel_us ? realtime_us - kernel_us : 0;
+			info->timestamp_us = waited_us < now_us ? now_us - waited_us : 0;
+			info->kernel_timestamp = true;
+			continue;
+		}
+#endif
+#ifdef __linux__
+		if(cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+		{
+			int segment_size;
+			memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+			if(segment_size > 0 && (size_t)segment_size < (size_t)r)
+				info->segment_size = (size_t)segment_size;
+		}
+#endif
+	}
+	return (int)r;
+#endif
+}
@@ -8,6 +8,7 @@
 #include <chiaki/base64.h>
 #include <chiaki/audio.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <assert.h>
@@ -42,6 +43,7 @@ typedef enum {
 } StreamConnectionState;
 
 void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
+void chiaki_session_host_cache_update(ChiakiSession *session);
 
 static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user);
 static void stream_connection_takion_data(ChiakiStreamConnection *stream_connection, ChiakiTakionMessageDataType data_type, uint8_t *buf, size_t buf_size);
@@ -84,19 +86,27 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	stream_connection->audio_receiver = NULL;
 	stream_connection->haptics_receiver = NULL;
 
-	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
+	err = chiaki_delay_estimator_init(&stream_connection->delay_estimator);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_packet_stats;
 
+	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_delay_estimator;
+
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
 	stream_connection->should_stop = false;
 	stream_connection->remote_disconnected = false;
 	stream_connection->remote_disconnect_reason = NULL;
+	stream_connection->takion_lost = false;
+	stream_connection->resume_count = 0;
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_delay_estimator:
+	chiaki_delay_estimator_fini(&stream_connection->delay_estimator);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -119,6 +129,7 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	if (stream_connection->congestion_control.thread.thread)
 		chiaki_congestion_control_stop(&stream_connection->congestion_control);
 
+	chiaki_delay_estimator_fini(&stream_connection->delay_estimator);
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
@@ -130,34 +141,52 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 static bool state_finished_cond_check(void *user)
 {
 	ChiakiStreamConnection *stream_connection = user;
-	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected;
+	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected
+		|| stream_connection->takion_lost;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection)
+static bool stream_connection_stop_cond_check(void *user)
 {
-	ChiakiSession *session = stream_connection->session;
-	ChiakiErrorCode err;
+	ChiakiStreamConnection *stream_connection = user;
+	return stream_connection->should_stop || stream_connection->remote_disconnected;
+}
 
-	ChiakiTakionConnectInfo takion_info;
-	takion_info.log = stream_connection->log;
-	takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
-	takion_info.sa = malloc(takion_info.sa_len);
-	if(!takion_info.sa)
-		return CHIAKI_ERR_MEMORY;
-	memcpy(takion_info.sa, session->connect_info.host_addrinfo_selected->ai_addr, takion_info.sa_len);
-	err = set_port(takion_info.sa, htons(STREAM_CONNECTION_PORT));
-	assert(err == CHIAKI_ERR_SUCCESS);
-	takion_info.ip_dontfrag = false;
+CHIAKI_EXPORT uint64_t chiaki_stream_connection_resume_timeout_ms(uint64_t lost_ms, uint64_t now_ms, uint64_t timeout_ms)
+{
+	uint64_t end_ms = lost_ms + CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS;
+	if(now_ms >= end_ms)
+		return 0;
+	return end_ms - now_ms < timeout_ms ? end_ms - now_ms : timeout_ms;
+}
 
-	takion_info.enable_crypt = true;
-	takion_info.enable_dualsense = session->connect_info.enable_dualsense;
-	takion_info.protocol_version = chiaki_target_is_ps5(session->target) ? 12 : 9;
+CHIAKI_EXPORT uint64_t chiaki_stream_connection_resume_retry_interval_ms(unsigned int attempt)
+{
+	uint64_t interval_ms = CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MS;
+	for(unsigned int i=1; i<attempt && interval_ms < CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MAX_MS; i++)
+		interval_ms *= 2;
+	return interval_ms < CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MAX_MS ? interval_ms : CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MAX_MS;
+}
 
-	takion_info.cb = stream_connection_takion_cb;
-	takion_info.cb_user = stream_connection;
+/**
+ * Timeout for one step of stream_connection_establish(), which must not run past the resume window when resuming.
+ */
+static uint64_t stream_connection_expect_timeout_ms(const uint64_t *resume_lost_ms)
+{
+	if(!resume_lost_ms)
+		return EXPECT_TIMEOUT_MS;
+	return chiaki_stream_connection_resume_timeout_ms(*resume_lost_ms, chiaki_time_now_monotonic_ms(), EXPECT_TIMEOUT_MS);
+}
 
-	err = chiaki_mutex_lock(&stream_connection->state_mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
+/**
+ * Connect Takion and go through the handshake until the stream is running.
+ * state_mutex must be locked, everything that was started is stopped again on failure.
+ *
+ * @param resume_lost_ms when the connection was lost if resuming, NULL otherwise
+ */
+static ChiakiErrorCode stream_connection_establish(ChiakiStreamConnection *stream_connection, ChiakiTakionConnectInfo *takion_info,
+		const uint64_t *resume_lost_ms)
+{
+	ChiakiSession *session = stream_connection->session;
 
 #define CHECK_STOP(quit_label) do { \
 	if(stream_connection->should_stop) \
@@ -165,39 +194,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto quit_label; \
 	} } while(0)
 
-	stream_connection->audio_receiver = chiaki_audio_receiver_new(session, &stream_connection->packet_stats);
-	if(!stream_connection->audio_receiver)
-	{
-		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Audio Receiver");
-		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	stream_connection->haptics_receiver = chiaki_audio_receiver_new(session, NULL);
-	if(!stream_connection->haptics_receiver)
-	{
-		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Haptics Receiver");
-		err = CHIAKI_ERR_UNKNOWN;
-		goto err_audio_receiver;
-	}
-
-	stream_connection->video_receiver = chiaki_video_receiver_new(session, &stream_connection->packet_stats);
-	if(!stream_connection->video_receiver)
-	{
-		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Video Receiver");
-		err = CHIAKI_ERR_UNKNOWN;
-		goto err_haptics_receiver;
-	}
-
 	stream_connection->state = STATE_TAKION_CONNECT;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
-	err = chiaki_takion_connect(&stream_connection->takion, &takion_info);
-	free(takion_info.sa);
+	stream_connection->takion_lost = false;
+	ChiakiErrorCode err = chiaki_takion_connect(&stream_connection->takion, takion_info);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection connect failed");
-		chiaki_mutex_unlock(&stream_connection->state_mutex);
-		goto err_video_receiver;
+		return err;
 	}
 
 	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats);
@@ -207,7 +212,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto close_takion;
 	}
 
-	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
+	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex,
+			stream_connection_expect_timeout_ms(resume_lost_ms), state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 	CHECK_STOP(close_takion);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -228,7 +234,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto disconnect;
 	}
 
-	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
+	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex,
+			stream_connection_expect_timeout_ms(resume_lost_ms), state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 	CHECK_STOP(disconnect);
 
@@ -247,7 +254,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	stream_connection->state = STATE_EXPECT_STREAMINFO;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
-	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, EXPECT_TIMEOUT_MS, state_finished_cond_check, stream_connection);
+	err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex,
+			stream_connection_expect_timeout_ms(resume_lost_ms), state_finished_cond_check, stream_connection);
 	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 	CHECK_STOP(disconnect);
 
@@ -279,10 +287,158 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
+	return CHIAKI_ERR_SUCCESS;
+
+disconnect:
+	CHIAKI_LOGI(session->log, "StreamConnection is disconnecting");
+	stream_connection_send_disconnect(stream_connection);
+
+err_congestion_control:
+	chiaki_congestion_control_stop(&stream_connection->congestion_control);
+
+close_takion:
+	chiaki_mutex_unlock(&stream_connection->state_mutex);
+	chiaki_takion_close(&stream_connection->takion);
+	CHIAKI_LOGI(session->log, "StreamConnection closed takion");
+	chiaki_mutex_lock(&stream_connection->state_mutex);
+	return err;
+
+#undef CHECK_STOP
+}
+
+/**
+ * Stop everything started by a successful stream_connection_establish()
+ * state_mutex must be locked.
+ */
+static void stream_connection_shutdown(ChiakiStreamConnection *stream_connection)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	stream_connection->feedback_sender_active = false;
+	chiaki_feedback_sender_fini(&stream_connection->feedback_sender);
+	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
+
+	CHIAKI_LOGI(stream_connection->log, "StreamConnection is disconnecting");
+	if(!stream_connection->takion_lost)
+		stream_connection_send_disconnect(stream_connection);
+
+	chiaki_congestion_control_stop(&stream_connection->congestion_control);
+
+	chiaki_mutex_unlock(&stream_connection->state_mutex);
+	chiaki_takion_close(&stream_connection->takion);
+	CHIAKI_LOGI(stream_connection->log, "StreamConnection closed takion");
+	chiaki_mutex_lock(&stream_connection->state_mutex);
+}
+
+/**
+ * Whether a lost connection may be resumed, i.e. resume is enabled, ctrl is still alive
+ * and nobody wants the stream to end.
+ * state_mutex must be locked.
+ */
+static bool stream_connection_resume_possible(ChiakiStreamConnection *stream_connection, uint64_t lost_ms)
+{
+	ChiakiSession *session = stream_connection->session;
+	if(!session->connect_info.enable_resume || stream_connection->should_stop || stream_connection->remote_disconnected)
+		return false;
+	if(!chiaki_stream_connection_resume_timeout_ms(lost_ms, chiaki_time_now_monotonic_ms(), UINT64_MAX))
+	{
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection could not resume within %u ms, giving up",
+				(unsigned int)CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS);
+		return false;
+	}
+
+	// session's state_mutex must never be locked while holding ours
+	chiaki_mutex_unlock(&stream_connection->state_mutex);
+	chiaki_mutex_lock(&session->state_mutex);
+	bool ctrl_alive = !session->ctrl_failed && !session->should_stop;
+	chiaki_mutex_unlock(&session->state_mutex);
+	chiaki_mutex_lock(&stream_connection->state_mutex);
+	if(!ctrl_alive)
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection can not resume because Ctrl is gone");
+	return ctrl_alive && !stream_connection->should_stop;
+}
+
+/**
+ * Drop the crypt of the lost connection, the keys of the session itself are reused for the new handshake.
+ */
+static void stream_connection_reset_crypt(ChiakiStreamConnection *stream_connection)
+{
+	chiaki_gkcrypt_free(stream_connection->gkcrypt_remote);
+	stream_connection->gkcrypt_remote = NULL;
+	chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
+	stream_connection->gkcrypt_local = NULL;
+	free(stream_connection->ecdh_secret);
+	stream_connection->ecdh_secret = NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection)
+{
+	ChiakiSession *session = stream_connection->session;
+	ChiakiErrorCode err;
+	uint64_t begin_ms = chiaki_time_now_monotonic_ms();
+
+	ChiakiTakionConnectInfo takion_info;
+	takion_info.log = stream_connection->log;
+	takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
+	takion_info.sa = malloc(takion_info.sa_len);
+	if(!takion_info.sa)
+		return CHIAKI_ERR_MEMORY;
+	memcpy(takion_info.sa, session->connect_info.host_addrinfo_selected->ai_addr, takion_info.sa_len);
+	err = set_port(takion_info.sa, htons(STREAM_CONNECTION_PORT));
+	assert(err == CHIAKI_ERR_SUCCESS);
+	takion_info.ip_dontfrag = false;
+
+	takion_info.enable_crypt = true;
+	takion_info.enable_dualsense = session->connect_info.enable_dualsense;
+	takion_info.protocol_version = chiaki_target_is_ps5(session->target) ? 12 : 9;
+	// without resume, a silent connection is only ended by the user
+	takion_info.recv_timeout_ms = session->connect_info.enable_resume ? CHIAKI_STREAM_CONNECTION_LOST_TIMEOUT_MS : 0;
+	takion_info.socket_config = session->connect_info.socket_config;
+	takion_info.bitrate_kbps = session->connect_info.video_profile.bitrate;
+
+	takion_info.cb = stream_connection_takion_cb;
+	takion_info.cb_user = stream_connection;
+
+	stream_connection->audio_receiver = chiaki_audio_receiver_new(session, &stream_connection->packet_stats);
+	if(!stream_connection->audio_receiver)
+	{
+		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Audio Receiver");
+		err = CHIAKI_ERR_UNKNOWN;
+		goto err_takion_info;
+	}
+
+	stream_connection->haptics_receiver = chiaki_audio_receiver_new(session, NULL);
+	if(!stream_connection->haptics_receiver)
+	{
+		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Haptics Receiver");
+		err = CHIAKI_ERR_UNKNOWN;
+		goto err_audio_receiver;
+	}
+
+	stream_connection->video_receiver = chiaki_video_receiver_new(session, &stream_connection->packet_stats);
+	if(!stream_connection->video_receiver)
+	{
+		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Video Receiver");
+		err = CHIAKI_ERR_UNKNOWN;
+		goto err_haptics_receiver;
+	}
+
+	chiaki_delay_estimator_reset(&stream_connection->delay_estimator, session->connect_info.video_profile.max_fps);
+
+	err = chiaki_mutex_lock(&stream_connection->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	err = stream_connection_establish(stream_connection, &takion_info, NULL);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto quit;
 
 	ChiakiEvent event = { 0 };
 	event.type = CHIAKI_EVENT_CONNECTED;
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
+	chiaki_mutex_lock(&session->state_mutex);
+	session->startup_timings.stream_connection_ms = chiaki_time_now_monotonic_ms() - begin_ms;
+	chiaki_mutex_unlock(&session->state_mutex);
+	chiaki_session_host_cache_update(session);
 	chiaki_session_send_event(session, &event);
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
@@ -290,28 +446,54 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	while(true)
 	{
 		err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, HEARTBEAT_INTERVAL_MS, state_finished_cond_check, stream_connection);
-		if(err != CHIAKI_ERR_TIMEOUT)
+		if(err == CHIAKI_ERR_TIMEOUT)
+		{
+			err = stream_connection_send_heartbeat(stream_connection);
+			if(err != CHIAKI_ERR_SUCCESS)
+				CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
+			else
+				CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
+			continue;
+		}
+
+		bool lost = stream_connection->takion_lost;
+		stream_connection_shutdown(stream_connection);
+		err = CHIAKI_ERR_SUCCESS;
+		if(!lost)
 			break;
 
-		err = stream_connection_send_heartbeat(stream_connection);
-		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
-		else
-			CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
+		// ctrl is independent of Takion, so as long as it is alive the console still knows this session
+		CHIAKI_LOGW(stream_connection->log, "StreamConnection lost Takion connection, trying to resume");
+		uint64_t lost_ms = chiaki_time_now_monotonic_ms();
+		unsigned int attempt = 0;
+		while(true)
+		{
+			if(!stream_connection_resume_possible(stream_connection, lost_ms))
+			{
+				err = CHIAKI_ERR_NETWORK;
+				goto quit;
+			}
+			stream_connection_reset_crypt(stream_connection);
+			chiaki_audio_receiver_reset(stream_connection->audio_receiver);
+			chiaki_audio_receiver_reset(stream_connection->haptics_receiver);
+			chiaki_video_receiver_resume(stream_connection->video_receiver);
+			// arrival times before the loss say nothing about the delay now
+			chiaki_delay_estimator_reset(&stream_connection->delay_estimator, stream_connection->session->connect_info.video_profile.max_fps);
+			err = stream_connection_establish(stream_connection, &takion_info, &lost_ms);
+			if(err == CHIAKI_ERR_SUCCESS)
+				break;
+			attempt++;
+			uint64_t retry_ms = chiaki_stream_connection_resume_timeout_ms(lost_ms, chiaki_time_now_monotonic_ms(),
+					chiaki_stream_connection_resume_retry_interval_ms(attempt));
+			chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex,
+					retry_ms, stream_connection_stop_cond_check, stream_connection);
+		}
+		stream_connection->resume_count++;
+		CHIAKI_LOGI(stream_connection->log, "StreamConnection resumed after %llu ms",
+				(unsigned long long)(chiaki_time_now_monotonic_ms() - lost_ms));
 	}
 
-	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	stream_connection->feedback_sender_active = false;
-	chiaki_feedback_sender_fini(&stream_connection->feedback_sender);
-	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
-
-	err = CHIAKI_ERR_SUCCESS;
-
-disconnect:
-	CHIAKI_LOGI(session->log, "StreamConnection is disconnecting");
-	stream_connection_send_disconnect(stream_connection);
-
+quit:
 	if(stream_connection->should_stop)
 	{
 		CHIAKI_LOGI(stream_connection->log, "StreamConnection was requested to stop");
@@ -322,17 +504,8 @@ disconnect:
 		CHIAKI_LOGI(stream_connection->log, "StreamConnection closing after Remote disconnected");
 		err = CHIAKI_ERR_DISCONNECTED;
 	}
-
-err_congestion_control:
-	chiaki_congestion_control_stop(&stream_connection->congestion_control);
-
-close_takion:
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
 
-	chiaki_takion_close(&stream_connection->takion);
-	CHIAKI_LOGI(session->log, "StreamConnection closed takion");
-
-err_video_receiver:
 	chiaki_video_receiver_free(stream_connection->video_receiver);
 	stream_connection->video_receiver = NULL;
 
@@ -344,6 +517,8 @@ err_audio_receiver:
 	chiaki_audio_receiver_free(stream_connection->audio_receiver);
 	stream_connection->audio_receiver = NULL;
 
+err_takion_info:
+	free(takion_info.sa);
 	return err;
 }
 
@@ -372,6 +547,11 @@ static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user)
 				stream_connection->state_failed = event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 				chiaki_cond_signal(&stream_connection->state_cond);
 			}
+			else if(stream_connection->state == STATE_IDLE && event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT)
+			{
+				stream_connection->takion_lost = true;
+				chiaki_cond_signal(&stream_connection->state_cond);
+			}
 			chiaki_mutex_unlock(&stream_connection->state_mutex);
 			break;
 		case CHIAKI_TAKION_EVENT_TYPE_DATA:
@@ -486,7 +666,21 @@ static void stream_connection_takion_data_handle_disconnect(ChiakiStreamConnecti
 	chiaki_cond_signal(&stream_connection->state_cond);
 }
 
-static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size)
+/**
+ * Peek the type of a TakionMessage without decoding it.
+ * type is the first field and is always serialized first, as a single byte varint for all known types.
+ *
+ * @return false if the message does not start like that and must be decoded fully
+ */
+static bool takion_message_peek_type(const uint8_t *buf, size_t buf_size, tkproto_TakionMessage_PayloadType *type)
+{
+	if(buf_size < 2 || buf[0] != ((tkproto_TakionMessage_type_tag << 3) | PB_WT_VARINT) || (buf[1] & 0x80))
+		return false;
+	*type = (tkproto_TakionMessage_PayloadType)buf[1];
+	return true;
+}
+
+static void stream_connection_takion_data_idle_decode(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size)
 {
 	tkproto_TakionMessage msg;
 	memset(&msg, 0, sizeof(msg));
@@ -500,9 +694,6 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 		return;
 	}
 
-	CHIAKI_LOGV(stream_connection->log, "StreamConnection received data with msg.type == %d", msg.type);
-	chiaki_log_hexdump(stream_connection->log, CHIAKI_LOG_VERBOSE, buf, buf_size);
-
 	switch (msg.type)
 	{
 	case tkproto_TakionMessage_PayloadType_DISCONNECT:
@@ -527,14 +718,48 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection received corrupt frame from %d to %d",
 			msg.corrupt_payload.start, msg.corrupt_payload.end);
 		break;
-	case tkproto_TakionMessage_PayloadType_STREAMINFOACK:
-		CHIAKI_LOGV(stream_connection->log, "StreamConnection received streaminfo ack");
-		break;
 	default:
 		break;
 	}
 }
 
+static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size)
+{
+	bool verbose = !stream_connection->log || (stream_connection->log->level_mask & CHIAKI_LOG_VERBOSE);
+	tkproto_TakionMessage_PayloadType type;
+	if(!takion_message_peek_type(buf, buf_size, &type))
+	{
+		stream_connection_takion_data_idle_decode(stream_connection, buf, buf_size);
+		return;
+	}
+
+	if(verbose)
+	{
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection received data with msg.type == %d", (int)type);
+		chiaki_log_hexdump(stream_connection->log, CHIAKI_LOG_VERBOSE, buf, buf_size);
+	}
+
+	// only the rare messages and those with a payload we actually look at are decoded
+	switch(type)
+	{
+		case tkproto_TakionMessage_PayloadType_CONNECTIONQUALITY:
+			if(verbose)
+				stream_connection_takion_data_idle_decode(stream_connection, buf, buf_size);
+			else
+				chiaki_stream_stats_reset(&stream_connection->video_receiver->frame_processor.stream_stats);
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+		case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
+			stream_connection_takion_data_idle_decode(stream_connection, buf, buf_size);
+			break;
+		case tkproto_TakionMessage_PayloadType_STREAMINFOACK:
+			CHIAKI_LOGV(stream_connection->log, "StreamConnection received streaminfo ack");
+			break;
+		default:
+			break;
+	}
+}
+
 static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stream_connection)
 {
 	ChiakiSession *session = stream_connection->session;
@@ -830,8 +1055,12 @@ static ChiakiErrorCode stream_connection_send_big(ChiakiStreamConnection *stream
 
 	uint8_t launch_spec_json_enc[LAUNCH_SPEC_JSON_BUF_SIZE];
 	memset(launch_spec_json_enc, 0, (size_t)launch_spec_json_size);
-	ChiakiErrorCode err = chiaki_rpcrypt_encrypt(&session->rpcrypt, 0, launch_spec_json_enc, launch_spec_json_enc,
+	// session->rpcrypt belongs to the ctrl thread, which keeps using it while this runs, e.g. when resuming
+	ChiakiRPCrypt rpcrypt;
+	chiaki_rpcrypt_init_clone(&rpcrypt, &session->rpcrypt);
+	ChiakiErrorCode err = chiaki_rpcrypt_encrypt(&rpcrypt, 0, launch_spec_json_enc, launch_spec_json_enc,
 			(size_t)launch_spec_json_size);
+	chiaki_rpcrypt_fini(&rpcrypt);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to encrypt LaunchSpec");
@@ -1023,20 +1252,9 @@ static void stream_connection_takion_av(ChiakiStreamConnection *stream_connectio
 
 static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *stream_connection)
 {
-	tkproto_TakionMessage msg = { 0 };
-	msg.type = tkproto_TakionMessage_PayloadType_HEARTBEAT;
-
-	uint8_t buf[8];
-
-	pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
-	bool pbr = pb_encode(&stream, tkproto_TakionMessage_fields, &msg);
-	if(!pbr)
-	{
-		CHIAKI_LOGE(stream_connection->log, "StreamConnection heartbeat protobuf encoding failed");
-		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 1, buf, stream.bytes_written, NULL);
+	// TakionMessage { type = HEARTBEAT }, constant so it is not encoded every time
+	uint8_t buf[] = { (tkproto_TakionMessage_type_tag << 3) | PB_WT_VARINT, tkproto_TakionMessage_PayloadType_HEARTBEAT };
+	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 1, buf, sizeof(buf), NULL);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
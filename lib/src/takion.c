@@ -5,6 +5,7 @@
 #include <chiaki/congestioncontrol.h>
 #include <chiaki/random.h>
 #include <chiaki/gkcrypt.h>
+#include <chiaki/time.h>
 
 #include <fcntl.h>
 #include <stdbool.h>
@@ -37,7 +38,19 @@
 #define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries
 #define TAKION_SEND_BUFFER_SIZE 16
 
-#define TAKION_POSTPONE_PACKETS_SIZE 32
+// AV packets are postponed until crypt is available, which can take this long after they started flowing
+#define TAKION_POSTPONE_DURATION_MS 500
+#define TAKION_POSTPONE_PACKETS_MIN 64
+#define TAKION_POSTPONE_PACKETS_MAX 0x1000
+
+// MACs of packets that arrived before crypt was available are checked in batches of this many
+#define TAKION_MAC_BATCH_SIZE 64
+
+// the receive buffer should hold this much data at the expected bitrate, to survive short stalls of the Takion thread
+#define TAKION_RCVBUF_DURATION_MS 200
+
+#define TAKION_RECV_SIZE 1500
+#define TAKION_RECV_GRO_SIZE 0x10000
 
 #define TAKION_MESSAGE_HEADER_SIZE 0x10
 
@@ -155,11 +168,28 @@ typedef struct chiaki_takion_postponed_packet_t
 {
 	uint8_t *buf;
 	size_t buf_size;
+	ChiakiSocketRecvInfo recv_info;
 } ChiakiTakionPostponedPacket;
 
+typedef struct takion_mac_check_t
+{
+	uint8_t *buf;
+	size_t buf_size;
+	uint64_t key_pos;
+	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE]; // as received
+	uint8_t key_pos_buf[sizeof(uint32_t)]; // zeroed in buf while calculating the mac for some packet types
+	bool prepared;
+	bool valid;
+} TakionMacCheck;
+
 static void *takion_thread_func(void *user);
 static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet_authentic(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
+static void takion_check_macs(ChiakiTakion *takion, TakionMacCheck *checks, size_t checks_count);
+static void takion_recheck_data_queue_macs(ChiakiTakion *takion);
+static void takion_flush_postponed_packets(ChiakiTakion *takion);
+static void takion_clear_postponed_packets(ChiakiTakion *takion);
 static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size);
@@ -167,11 +197,24 @@ static ChiakiErrorCode takion_parse_message(ChiakiTakion *takion, uint8_t *buf,
 static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size);
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
-static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms, ChiakiSocketRecvInfo *info);
+static ChiakiErrorCode takion_recv_streaming(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size);
+static ChiakiErrorCode takion_recv_gro(ChiakiTakion *takion, uint8_t *buf);
+static void takion_recv_stats_push(ChiakiTakionRecvStats *stats, const ChiakiSocketRecvInfo *info, uint64_t packets, uint64_t now_us);
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
 static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
 
+static size_t takion_postpone_packets_size(uint32_t bitrate_kbps)
+{
+	uint64_t size = (uint64_t)bitrate_kbps * TAKION_POSTPONE_DURATION_MS / 8 / TAKION_RECV_SIZE;
+	if(size < TAKION_POSTPONE_PACKETS_MIN)
+		return TAKION_POSTPONE_PACKETS_MIN;
+	if(size > TAKION_POSTPONE_PACKETS_MAX)
+		return TAKION_POSTPONE_PACKETS_MAX;
+	return (size_t)size;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info)
 {
 	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
@@ -216,7 +259,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	takion->postponed_packets = NULL;
 	takion->postponed_packets_size = 0;
 	takion->postponed_packets_count = 0;
+	takion->postponed_packets_size_initial = takion_postpone_packets_size(info->bitrate_kbps);
+	takion->postponed_packets_dropped = 0;
 	takion->enable_dualsense = info->enable_dualsense;
+	takion->recv_timeout_ms = info->recv_timeout_ms;
 
 	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
 
@@ -235,14 +281,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_pipe;
 	}
 
-	const int rcvbuf_val = takion->a_rwnd;
-	int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const void *)&rcvbuf_val, sizeof(rcvbuf_val));
-	if(r < 0)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: %s", strerror(errno));
-		ret = CHIAKI_ERR_NETWORK;
+	ChiakiSocketFeatures socket_features;
+	ret = chiaki_socket_configure(takion->sock, info->sa->sa_family, &info->socket_config,
+			chiaki_socket_rcvbuf_size_for_bitrate(info->bitrate_kbps, TAKION_RCVBUF_DURATION_MS, takion->a_rwnd),
+			takion->log, &socket_features);
+	if(ret != CHIAKI_ERR_SUCCESS)
 		goto error_sock;
-	}
+	CHIAKI_LOGI(takion->log, "Takion socket receive buffer is %u bytes%s%s", (unsigned int)socket_features.rcvbuf_size,
+			socket_features.timestamps ? ", kernel timestamps enabled" : "",
+			socket_features.gro ? ", GRO enabled" : "");
+	takion->recv_gro = socket_features.gro;
+	memset(&takion->recv_info, 0, sizeof(takion->recv_info));
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+
+	int r;
 
 	if(info->ip_dontfrag)
 	{
@@ -693,7 +745,7 @@ static ChiakiErrorCode takion_handshake(ChiakiTakion *takion, uint32_t *seq_num_
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
+static void takion_data_drop(ChiakiSeqNum32 seq_num, void *elem_user, void *cb_user)
 {
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
@@ -710,10 +762,10 @@ static void *takion_thread_func(void *user)
 	if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	if(chiaki_reorder_queue_init_32(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_reorder_queue32_init(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
+	chiaki_reorder_queue32_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
 	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
@@ -727,6 +779,14 @@ static void *takion_thread_func(void *user)
 		takion->cb(&event, takion->cb_user);
 	}
 
+	uint8_t *gro_buf = NULL;
+	if(takion->recv_gro)
+	{
+		gro_buf = malloc(TAKION_RECV_GRO_SIZE);
+		if(!gro_buf)
+			goto error_send_buffer;
+	}
+
 	bool crypt_available = takion->gkcrypt_remote ? true : false;
 
 	while(true)
@@ -734,52 +794,34 @@ static void *takion_thread_func(void *user)
 		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
 		{
 			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
-			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
-			}
-
+			takion_recheck_data_queue_macs(takion);
 		}
 
 		if(takion->postponed_packets && takion->gkcrypt_remote)
 		{
 			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+			takion_flush_postponed_packets(takion);
+		}
 
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
-
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
-			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
-			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
+		if(takion->recv_gro)
+		{
+			ChiakiErrorCode err = takion_recv_gro(takion, gro_buf);
+			if(err != CHIAKI_ERR_SUCCESS)
+				break;
+			continue;
 		}
 
-		size_t received_size = 1500;
+		size_t received_size = TAKION_RECV_SIZE;
 		uint8_t *buf = malloc(received_size); // TODO: no malloc?
 		if(!buf)
 			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
+		ChiakiErrorCode err = takion_recv_streaming(takion, buf, &received_size);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
 			free(buf);
 			break;
 		}
+		takion_recv_stats_push(&takion->recv_stats, &takion->recv_info, 1, chiaki_time_now_monotonic_us());
 		uint8_t *resized_buf = realloc(buf, received_size);
 		if(!resized_buf)
 		{
@@ -789,12 +831,21 @@ static void *takion_thread_func(void *user)
 		takion_handle_packet(takion, resized_buf, received_size);
 	}
 
+	ChiakiTakionRecvStats *recv_stats = &takion->recv_stats;
+	CHIAKI_LOGI(takion->log, "Takion received %llu packets, %llu with kernel timestamps, socket queueing delay avg %.3f ms, max %.3f ms, jitter %.3f ms",
+			(unsigned long long)recv_stats->packets, (unsigned long long)recv_stats->packets_kernel_timestamp,
+			(float)recv_stats->queue_delay_us_avg * 0.001f, (float)recv_stats->queue_delay_us_max * 0.001f,
+			(float)recv_stats->queue_jitter_us * 0.001f);
+	free(gro_buf);
+	takion_clear_postponed_packets(takion);
+
 	// chiaki_congestion_control_stop(&congestion_control);
 
+error_send_buffer:
 	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 
 error_reoder_queue:
-	chiaki_reorder_queue_fini(&takion->data_queue);
+	chiaki_reorder_queue32_fini(&takion->data_queue);
 
 beach:
 	if(takion->cb)
@@ -807,7 +858,7 @@ beach:
 	return NULL;
 }
 
-static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms, ChiakiSocketRecvInfo *info)
 {
 	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
@@ -818,7 +869,7 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 		return err;
 	}
 
-	int received_sz = recv(takion->sock, buf, *buf_size, 0);
+	int received_sz = chiaki_socket_recv(takion->sock, buf, *buf_size, info);
 	if(received_sz <= 0)
 	{
 		if(received_sz < 0)
@@ -831,6 +882,65 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * takion_recv() once the connection is established, into takion->recv_info
+ */
+static ChiakiErrorCode takion_recv_streaming(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size)
+{
+	ChiakiErrorCode err = takion_recv(takion, buf, buf_size, takion->recv_timeout_ms ? takion->recv_timeout_ms : UINT64_MAX, &takion->recv_info);
+	if(err == CHIAKI_ERR_TIMEOUT)
+		CHIAKI_LOGE(takion->log, "Takion received nothing for %llu ms, considering the connection lost",
+				(unsigned long long)takion->recv_timeout_ms);
+	return err;
+}
+
+/**
+ * Receive into buf of size TAKION_RECV_GRO_SIZE, which may get multiple datagrams merged by GRO, and handle each of them.
+ */
+static ChiakiErrorCode takion_recv_gro(ChiakiTakion *takion, uint8_t *buf)
+{
+	size_t received_size = TAKION_RECV_GRO_SIZE;
+	ChiakiErrorCode err = takion_recv_streaming(takion, buf, &received_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	size_t segment_size = takion->recv_info.segment_size ? takion->recv_info.segment_size : received_size;
+	takion_recv_stats_push(&takion->recv_stats, &takion->recv_info, (received_size + segment_size - 1) / segment_size,
+			chiaki_time_now_monotonic_us());
+	for(size_t offset = 0; offset < received_size; offset += segment_size)
+	{
+		size_t packet_size = received_size - offset < segment_size ? received_size - offset : segment_size;
+		// handled packets may be kept, e.g. in the reorder queue, so each one needs its own buffer
+		uint8_t *packet = malloc(packet_size);
+		if(!packet)
+			continue;
+		memcpy(packet, buf + offset, packet_size);
+		takion_handle_packet(takion, packet, packet_size);
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void takion_recv_stats_push(ChiakiTakionRecvStats *stats, const ChiakiSocketRecvInfo *info, uint64_t packets, uint64_t now_us)
+{
+	stats->packets += packets;
+	if(!info->kernel_timestamp)
+		return;
+	uint64_t delay_us = now_us > info->timestamp_us ? now_us - info->timestamp_us : 0;
+	if(!stats->packets_kernel_timestamp)
+		stats->queue_delay_us_avg = delay_us;
+	else
+	{
+		// gain of 1/16 like RFC 3550
+		stats->queue_delay_us_avg = (stats->queue_delay_us_avg * 15 + delay_us) / 16;
+		uint64_t delay_diff_us = delay_us > stats->queue_delay_us_prev ? delay_us - stats->queue_delay_us_prev : stats->queue_delay_us_prev - delay_us;
+		stats->queue_jitter_us = (stats->queue_jitter_us * 15 + delay_diff_us) / 16;
+	}
+	if(delay_us > stats->queue_delay_us_max)
+		stats->queue_delay_us_max = delay_us;
+	stats->queue_delay_us_prev = delay_us;
+	stats->packets_kernel_timestamp += packets;
+}
+
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
 {
 	if(!takion->gkcrypt_remote)
@@ -868,27 +978,187 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+/**
+ * Calculate the MACs of many received packets at once and compare them to the received ones.
+ * Like takion_handle_packet_mac(), the key state is committed for every authentic packet.
+ *
+ * @param checks buf and buf_size must be set, the rest is filled in
+ * @param checks_count at most TAKION_MAC_BATCH_SIZE
+ */
+static void takion_check_macs(ChiakiTakion *takion, TakionMacCheck *checks, size_t checks_count)
 {
-	if(!takion->postponed_packets)
+	assert(checks_count <= TAKION_MAC_BATCH_SIZE);
+	ChiakiGKCryptGMacJob jobs[TAKION_MAC_BATCH_SIZE];
+	size_t jobs_count = 0;
+
+	for(size_t i=0; i<checks_count; i++)
 	{
-		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
-		if(!takion->postponed_packets)
-			return;
-		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
-		takion->postponed_packets_count = 0;
+		TakionMacCheck *check = &checks[i];
+		check->prepared = false;
+		check->valid = false;
+		if(check->buf_size < 1)
+			continue;
+		TakionPacketType base_type = check->buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
+		int mac_offset = takion_packet_type_mac_offset(base_type);
+		int key_pos_offset = takion_packet_type_key_pos_offset(base_type);
+		if(mac_offset < 0 || key_pos_offset < 0
+			|| check->buf_size < mac_offset + CHIAKI_GKCRYPT_GMAC_SIZE || check->buf_size < key_pos_offset + sizeof(uint32_t))
+			continue;
+		if(chiaki_takion_packet_read_key_pos(takion, check->buf, check->buf_size, &check->key_pos) != CHIAKI_ERR_SUCCESS)
+			continue;
+
+		// same as chiaki_takion_packet_mac()
+		memcpy(check->mac, check->buf + mac_offset, CHIAKI_GKCRYPT_GMAC_SIZE);
+		memset(check->buf + mac_offset, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+		if(base_type == TAKION_PACKET_TYPE_CONTROL || base_type == TAKION_PACKET_TYPE_CONGESTION)
+		{
+			memcpy(check->key_pos_buf, check->buf + key_pos_offset, sizeof(uint32_t));
+			memset(check->buf + key_pos_offset, 0, sizeof(uint32_t));
+		}
+		check->prepared = true;
+
+		ChiakiGKCryptGMacJob *job = &jobs[jobs_count++];
+		job->key_pos = check->key_pos;
+		job->buf = check->buf;
+		job->buf_size = check->buf_size;
+		job->gmac_out = check->buf + mac_offset;
 	}
 
+	ChiakiErrorCode err = chiaki_gkcrypt_gmac_batch(takion->gkcrypt_remote, jobs, jobs_count);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "Takion failed to calculate macs for %llu received packets", (unsigned long long)jobs_count);
+
+	for(size_t i=0; i<checks_count; i++)
+	{
+		TakionMacCheck *check = &checks[i];
+		if(!check->prepared)
+			continue;
+		TakionPacketType base_type = check->buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
+		if(base_type == TAKION_PACKET_TYPE_CONTROL || base_type == TAKION_PACKET_TYPE_CONGESTION)
+			memcpy(check->buf + takion_packet_type_key_pos_offset(base_type), check->key_pos_buf, sizeof(uint32_t));
+		if(err != CHIAKI_ERR_SUCCESS)
+			continue;
+		check->valid = memcmp(check->buf + takion_packet_type_mac_offset(base_type), check->mac, CHIAKI_GKCRYPT_GMAC_SIZE) == 0;
+		if(check->valid)
+			chiaki_key_state_commit(&takion->key_state, check->key_pos);
+	}
+}
+
+static void takion_recheck_data_queue_macs(ChiakiTakion *takion)
+{
+	CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue32_count(&takion->data_queue));
+
+	// the whole queue fits into a single batch
+	TakionMacCheck checks[1 << TAKION_REORDER_QUEUE_SIZE_EXP];
+	size_t indices[1 << TAKION_REORDER_QUEUE_SIZE_EXP];
+	size_t checks_count = 0;
+	for(size_t i=0; i<chiaki_reorder_queue32_count(&takion->data_queue); i++)
+	{
+		void *elem;
+		bool peeked = chiaki_reorder_queue32_peek(&takion->data_queue, i, NULL, &elem);
+		if(!peeked)
+			continue;
+		TakionDataPacketEntry *packet = elem;
+		if(packet->packet_size == 0)
+			continue;
+		checks[checks_count].buf = packet->packet_buf;
+		checks[checks_count].buf_size = packet->packet_size;
+		indices[checks_count] = i;
+		checks_count++;
+	}
+
+	takion_check_macs(takion, checks, checks_count);
+	for(size_t i=0; i<checks_count; i++)
+	{
+		if(checks[i].valid)
+			continue;
+		CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+		chiaki_reorder_queue32_drop(&takion->data_queue, indices[i]);
+	}
+}
+
+static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+{
 	if(takion->postponed_packets_count >= takion->postponed_packets_size)
 	{
-		CHIAKI_LOGE(takion->log, "Should postpone a packet, but there is no space left");
-		return;
+		size_t size = takion->postponed_packets_size
+			? takion->postponed_packets_size * 2
+			: takion->postponed_packets_size_initial;
+		if(size > TAKION_POSTPONE_PACKETS_MAX)
+			size = TAKION_POSTPONE_PACKETS_MAX;
+		ChiakiTakionPostponedPacket *packets = NULL;
+		if(size > takion->postponed_packets_size)
+			packets = realloc(takion->postponed_packets, size * sizeof(ChiakiTakionPostponedPacket));
+		if(!packets)
+		{
+			if(!takion->postponed_packets_dropped)
+				CHIAKI_LOGE(takion->log, "Should postpone a packet, but there is no space left");
+			takion->postponed_packets_dropped++;
+			free(buf);
+			return;
+		}
+		if(takion->postponed_packets_size)
+			CHIAKI_LOGW(takion->log, "Takion postponed more packets than expected, growing to %llu", (unsigned long long)size);
+		takion->postponed_packets = packets;
+		takion->postponed_packets_size = size;
 	}
 
-	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
+	CHIAKI_LOGV(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
 	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[takion->postponed_packets_count++];
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	packet->recv_info = takion->recv_info;
+}
+
+static void takion_flush_postponed_packets(ChiakiTakion *takion)
+{
+	CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+	if(takion->postponed_packets_dropped)
+		CHIAKI_LOGW(takion->log, "Takion dropped %llu packet(s) that could not be postponed anymore",
+				(unsigned long long)takion->postponed_packets_dropped);
+
+	TakionMacCheck checks[TAKION_MAC_BATCH_SIZE];
+	for(size_t i=0; i<takion->postponed_packets_count; i+=TAKION_MAC_BATCH_SIZE)
+	{
+		size_t checks_count = takion->postponed_packets_count - i;
+		if(checks_count > TAKION_MAC_BATCH_SIZE)
+			checks_count = TAKION_MAC_BATCH_SIZE;
+		for(size_t j=0; j<checks_count; j++)
+		{
+			checks[j].buf = takion->postponed_packets[i+j].buf;
+			checks[j].buf_size = takion->postponed_packets[i+j].buf_size;
+		}
+		takion_check_macs(takion, checks, checks_count);
+		for(size_t j=0; j<checks_count; j++)
+		{
+			ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i+j];
+			if(!checks[j].valid)
+			{
+				CHIAKI_LOGE(takion->log, "Takion postponed packet MAC mismatch for packet type %#x with key_pos %#llx",
+						packet->buf[0] & TAKION_PACKET_BASE_TYPE_MASK, (unsigned long long)checks[j].key_pos);
+				free(packet->buf);
+				continue;
+			}
+			takion->recv_info = packet->recv_info;
+			takion_handle_packet_authentic(takion, packet->buf[0] & TAKION_PACKET_BASE_TYPE_MASK, packet->buf, packet->buf_size);
+		}
+	}
+
+	free(takion->postponed_packets);
+	takion->postponed_packets = NULL;
+	takion->postponed_packets_size = 0;
+	takion->postponed_packets_count = 0;
+	takion->postponed_packets_dropped = 0;
+}
+
+static void takion_clear_postponed_packets(ChiakiTakion *takion)
+{
+	for(size_t i=0; i<takion->postponed_packets_count; i++)
+		free(takion->postponed_packets[i].buf);
+	free(takion->postponed_packets);
+	takion->postponed_packets = NULL;
+	takion->postponed_packets_size = 0;
+	takion->postponed_packets_count = 0;
 }
 
 /**
@@ -905,6 +1175,15 @@ static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_
 		return;
 	}
 
+	takion_handle_packet_authentic(takion, base_type, buf, buf_size);
+}
+
+/**
+ * Handle a packet whose MAC has already been checked.
+ * @param buf ownership of this buf is taken.
+ */
+static void takion_handle_packet_authentic(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+{
 	switch(base_type)
 	{
 		case TAKION_PACKET_TYPE_CONTROL:
@@ -958,55 +1237,59 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	}
 }
 
+static void takion_handle_data_entry(ChiakiTakion *takion, TakionDataPacketEntry *entry)
+{
+	if(entry->payload_size < 9)
+		goto beach;
+
+	uint16_t zero_a = *((chiaki_unaligned_uint16_t *)(entry->payload + 6));
+	uint8_t data_type = entry->payload[8]; // & 0xf
+
+	if(zero_a != 0)
+		CHIAKI_LOGW(takion->log, "Takion received data with unexpected nonzero %#x at buf+6", zero_a);
+
+	if(data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF
+			&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_RUMBLE
+			&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_TRIGGER_EFFECTS
+			&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_9)
+	{
+		CHIAKI_LOGW(takion->log, "Takion received data with unexpected data type %#x", data_type);
+		chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, entry->packet_buf, entry->packet_size);
+	}
+	else if(takion->cb)
+	{
+		ChiakiTakionEvent event = { 0 };
+		event.type = CHIAKI_TAKION_EVENT_TYPE_DATA;
+		event.data.data_type = (ChiakiTakionMessageDataType)data_type;
+		event.data.buf = entry->payload + 9;
+		event.data.buf_size = (size_t)(entry->payload_size - 9);
+		takion->cb(&event, takion->cb_user);
+	}
+
+beach:
+	free(entry->packet_buf);
+	free(entry);
+}
+
 static void takion_flush_data_queue(ChiakiTakion *takion)
 {
-	uint64_t seq_num = 0;
+	void *entries[1 << TAKION_REORDER_QUEUE_SIZE_EXP];
+	ChiakiSeqNum32 seq_num_first;
+	ChiakiSeqNum32 seq_num_last = 0;
 	bool ack = false;
 	while(true)
 	{
-		TakionDataPacketEntry *entry;
-		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&entry);
-		if(!pulled)
+		size_t count = chiaki_reorder_queue32_pull_bulk(&takion->data_queue, entries, sizeof(entries) / sizeof(entries[0]), &seq_num_first);
+		if(!count)
 			break;
 		ack = true;
-
-		if(entry->payload_size < 9)
-		{
-			free(entry->packet_buf);
-			free(entry);
-			continue;
-		}
-
-		uint16_t zero_a = *((chiaki_unaligned_uint16_t *)(entry->payload + 6));
-		uint8_t data_type = entry->payload[8]; // & 0xf
-
-		if(zero_a != 0)
-			CHIAKI_LOGW(takion->log, "Takion received data with unexpected nonzero %#x at buf+6", zero_a);
-
-		if(data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF
-				&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_RUMBLE
-				&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_TRIGGER_EFFECTS
-				&& data_type != CHIAKI_TAKION_MESSAGE_DATA_TYPE_9)
-		{
-			CHIAKI_LOGW(takion->log, "Takion received data with unexpected data type %#x", data_type);
-			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, entry->packet_buf, entry->packet_size);
-		}
-		else if(takion->cb)
-		{
-			ChiakiTakionEvent event = { 0 };
-			event.type = CHIAKI_TAKION_EVENT_TYPE_DATA;
-			event.data.data_type = (ChiakiTakionMessageDataType)data_type;
-			event.data.buf = entry->payload + 9;
-			event.data.buf_size = (size_t)(entry->payload_size - 9);
-			takion->cb(&event, takion->cb_user);
-		}
-
-		free(entry->packet_buf);
-		free(entry);
+		seq_num_last = seq_num_first + (ChiakiSeqNum32)(count - 1);
+		for(size_t i=0; i<count; i++)
+			takion_handle_data_entry(takion, entries[i]);
 	}
 
 	if(ack)
-		chiaki_takion_send_message_data_ack(takion, (uint32_t)seq_num);
+		chiaki_takion_send_message_data_ack(takion, seq_num_last);
 }
 
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
@@ -1032,7 +1315,7 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	entry->channel = ntohs(*((chiaki_unaligned_uint16_t *)(payload + 4)));
 	ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0)));
 
-	chiaki_reorder_queue_push(&takion->data_queue, seq_num, entry);
+	chiaki_reorder_queue32_push(&takion->data_queue, seq_num, entry);
 	takion_flush_data_queue(takion);
 }
 
@@ -1157,7 +1440,7 @@ static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, Takion
 {
 	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE + 0x10 + TAKION_COOKIE_SIZE];
 	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
+	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS, NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -1204,7 +1487,7 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 {
 	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE];
 	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
+	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS, NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -1253,6 +1536,8 @@ static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uin
 			CHIAKI_LOGE(takion->log, "Takion received AV packet that was too small");
 		return;
 	}
+	packet.recv_timestamp_us = takion->recv_info.timestamp_us;
+	packet.recv_timestamp_kernel = takion->recv_info.kernel_timestamp;
 
 	if(takion->cb)
 	{
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/videodecodequeue.h>
+#include <chiaki/videorecovery.h>
+
+#include "atomic.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+typedef struct video_decode_slot_t
+{
+	ChiakiFrameBuffer *frame;
+	int32_t frames_lost;
+	ChiakiSeqNum16 frame_index;
+	bool header;
+	bool keyframe;
+} VideoDecodeSlot;
+
+struct chiaki_video_decode_queue_ring_t
+{
+	VideoDecodeSlot slots[CHIAKI_VIDEO_DECODE_QUEUE_SIZE];
+	ChiakiAtomicSize write_pos;
+	ChiakiAtomicSize read_pos;
+
+	/**
+	 * Set by the producer on overflow, every frame before this position that is neither a keyframe nor a header is discarded
+	 */
+	ChiakiAtomicSize discard_before;
+
+	ChiakiAtomicBool consumer_waiting;
+	ChiakiAtomicI32 failed_frame; // -1 if none
+
+	ChiakiAtomicU64 frames_pushed;
+	ChiakiAtomicU64 frames_decoded;
+	ChiakiAtomicU64 frames_dropped;
+	ChiakiAtomicU64 overflows;
+};
+
+static void *video_decode_queue_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_decode_queue_init(ChiakiVideoDecodeQueue *queue, ChiakiLog *log, ChiakiCodec codec,
+		ChiakiVideoDecodeQueueCallback cb, void *cb_user)
+{
+	queue->log = log;
+	queue->codec = codec;
+	queue->cb = cb;
+	queue->cb_user = cb_user;
+	queue->should_stop = false;
+	queue->waiting_for_keyframe = false;
+	queue->keyframe_wait_count = 0;
+	queue->frames_lost = 0;
+
+	struct chiaki_video_decode_queue_ring_t *ring = calloc(1, sizeof(struct chiaki_video_decode_queue_ring_t));
+	if(!ring)
+		return CHIAKI_ERR_MEMORY;
+	chiaki_atomic_size_init(&ring->write_pos, 0);
+	chiaki_atomic_size_init(&ring->read_pos, 0);
+	chiaki_atomic_size_init(&ring->discard_before, 0);
+	chiaki_atomic_bool_init(&ring->consumer_waiting, false);
+	chiaki_atomic_i32_init(&ring->failed_frame, -1);
+	chiaki_atomic_u64_init(&ring->frames_pushed, 0);
+	chiaki_atomic_u64_init(&ring->frames_decoded, 0);
+	chiaki_atomic_u64_init(&ring->frames_dropped, 0);
+	chiaki_atomic_u64_init(&ring->overflows, 0);
+	queue->ring = ring;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&queue->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_ring;
+
+	err = chiaki_cond_init(&queue->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&queue->thread, video_decode_queue_thread_func, queue);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	chiaki_thread_set_name(&queue->thread, "Video Decode");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&queue->cond);
+error_mutex:
+	chiaki_mutex_fini(&queue->mutex);
+error_ring:
+	free(ring);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_video_decode_queue_fini(ChiakiVideoDecodeQueue *queue)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&queue->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	queue->should_stop = true;
+	chiaki_cond_signal(&queue->cond);
+	chiaki_mutex_unlock(&queue->mutex);
+
+	chiaki_thread_join(&queue->thread, NULL);
+	chiaki_cond_fini(&queue->cond);
+	chiaki_mutex_fini(&queue->mutex);
+	for(size_t i=0; i<CHIAKI_VIDEO_DECODE_QUEUE_SIZE; i++)
+		chiaki_frame_buffer_unref(queue->ring->slots[i].frame);
+	free(queue->ring);
+}
+
+static bool video_decode_queue_drop(ChiakiVideoDecodeQueue *queue)
+{
+	queue->frames_lost++;
+	chiaki_atomic_u64_fetch_add(&queue->ring->frames_dropped, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+	return false;
+}
+
+CHIAKI_EXPORT bool chiaki_video_decode_queue_push(ChiakiVideoDecodeQueue *queue, ChiakiFrameBuffer *frame,
+		int32_t frames_lost, ChiakiSeqNum16 frame_index, bool header)
+{
+	struct chiaki_video_decode_queue_ring_t *ring = queue->ring;
+	chiaki_atomic_u64_fetch_add(&ring->frames_pushed, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+	queue->frames_lost += frames_lost;
+	bool keyframe = chiaki_video_frame_is_keyframe(queue->codec,
+			chiaki_frame_buffer_data(frame), chiaki_frame_buffer_size(frame));
+
+	// headers are still needed by the keyframe that ends the wait, but do not end it themselves
+	if(queue->waiting_for_keyframe && !header)
+	{
+		if(!keyframe && queue->keyframe_wait_count < CHIAKI_VIDEO_DECODE_QUEUE_KEYFRAME_WAIT_MAX)
+		{
+			queue->keyframe_wait_count++;
+			return video_decode_queue_drop(queue);
+		}
+		if(keyframe)
+			CHIAKI_LOGI(queue->log, "Video Decode Queue resuming at keyframe after dropping %u frames", queue->keyframe_wait_count);
+		else
+			CHIAKI_LOGW(queue->log, "Video Decode Queue got no keyframe after %u frames, resuming anyway", queue->keyframe_wait_count);
+		queue->waiting_for_keyframe = false;
+	}
+
+	size_t write_pos = chiaki_atomic_size_load(&ring->write_pos, CHIAKI_MEMORY_ORDER_RELAXED);
+	size_t queued = write_pos - chiaki_atomic_size_load(&ring->read_pos, CHIAKI_MEMORY_ORDER_ACQUIRE);
+	if(!keyframe && !header && queued >= CHIAKI_VIDEO_DECODE_QUEUE_DEPTH_MAX)
+	{
+		CHIAKI_LOGW(queue->log, "Video Decode Queue overflow with %zu frames queued, skipping to next keyframe", queued);
+		chiaki_atomic_u64_fetch_add(&ring->overflows, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+		chiaki_atomic_size_store(&ring->discard_before, write_pos, CHIAKI_MEMORY_ORDER_RELEASE);
+		queue->waiting_for_keyframe = true;
+		queue->keyframe_wait_count = 0;
+		return video_decode_queue_drop(queue);
+	}
+	if(queued >= CHIAKI_VIDEO_DECODE_QUEUE_SIZE)
+	{
+		CHIAKI_LOGE(queue->log, "Video Decode Queue has no space left even for keyframes");
+		chiaki_atomic_size_store(&ring->discard_before, write_pos, CHIAKI_MEMORY_ORDER_RELEASE);
+		queue->waiting_for_keyframe = true;
+		queue->keyframe_wait_count = 0;
+		return video_decode_queue_drop(queue);
+	}
+
+	// the consumer has released the slot's previous frame before advancing read_pos
+	VideoDecodeSlot *slot = &ring->slots[write_pos & (CHIAKI_VIDEO_DECODE_QUEUE_SIZE - 1)];
+	assert(!slot->frame);
+	slot->frame = chiaki_frame_buffer_ref(frame);
+	slot->frames_lost = queue->frames_lost;
+	slot->frame_index = frame_index;
+	slot->header = header;
+	slot->keyframe = keyframe;
+	queue->frames_lost = 0;
+
+	// seq_cst pairs with the consumer setting consumer_waiting and checking write_pos afterwards,
+	// so either it sees the new frame or we see it waiting
+	chiaki_atomic_size_store(&ring->write_pos, write_pos + 1, CHIAKI_MEMORY_ORDER_SEQ_CST);
+	if(chiaki_atomic_bool_load(&ring->consumer_waiting, CHIAKI_MEMORY_ORDER_SEQ_CST))
+	{
+		chiaki_mutex_lock(&queue->mutex);
+		chiaki_cond_signal(&queue->cond);
+		chiaki_mutex_unlock(&queue->mutex);
+	}
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_video_decode_queue_take_failed(ChiakiVideoDecodeQueue *queue, ChiakiSeqNum16 *frame_index)
+{
+	int32_t failed = chiaki_atomic_i32_exchange(&queue->ring->failed_frame, -1, CHIAKI_MEMORY_ORDER_RELAXED);
+	if(failed < 0)
+		return false;
+	*frame_index = (ChiakiSeqNum16)failed;
+	return true;
+}
+
+CHIAKI_EXPORT void chiaki_video_decode_queue_resume(ChiakiVideoDecodeQueue *queue)
+{
+	queue->waiting_for_keyframe = false;
+}
+
+CHIAKI_EXPORT void chiaki_video_decode_queue_get_stats(ChiakiVideoDecodeQueue *queue, ChiakiVideoDecodeQueueStats *stats)
+{
+	struct chiaki_video_decode_queue_ring_t *ring = queue->ring;
+	stats->frames_pushed = chiaki_atomic_u64_load(&ring->frames_pushed, CHIAKI_MEMORY_ORDER_RELAXED);
+	stats->frames_decoded = chiaki_atomic_u64_load(&ring->frames_decoded, CHIAKI_MEMORY_ORDER_RELAXED);
+	stats->frames_dropped = chiaki_atomic_u64_load(&ring->frames_dropped, CHIAKI_MEMORY_ORDER_RELAXED);
+	stats->overflows = chiaki_atomic_u64_load(&ring->overflows, CHIAKI_MEMORY_ORDER_RELAXED);
+}
+
+static void video_decode_queue_set_failed(struct chiaki_video_decode_queue_ring_t *ring, ChiakiSeqNum16 frame_index)
+{
+	// keep the first one until it is taken
+	int32_t none = -1;
+	chiaki_atomic_i32_compare_exchange(&ring->failed_frame, &none, frame_index, CHIAKI_MEMORY_ORDER_RELAXED);
+}
+
+static void video_decode_queue_drain(ChiakiVideoDecodeQueue *queue, int32_t *discarded)
+{
+	struct chiaki_video_decode_queue_ring_t *ring = queue->ring;
+	while(true)
+	{
+		size_t read_pos = chiaki_atomic_size_load(&ring->read_pos, CHIAKI_MEMORY_ORDER_RELAXED);
+		if(read_pos == chiaki_atomic_size_load(&ring->write_pos, CHIAKI_MEMORY_ORDER_ACQUIRE))
+			break;
+		VideoDecodeSlot *slot = &ring->slots[read_pos & (CHIAKI_VIDEO_DECODE_QUEUE_SIZE - 1)];
+		if(!slot->keyframe && !slot->header && read_pos < chiaki_atomic_size_load(&ring->discard_before, CHIAKI_MEMORY_ORDER_ACQUIRE))
+		{
+			chiaki_atomic_u64_fetch_add(&ring->frames_dropped, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+			video_decode_queue_set_failed(ring, slot->frame_index);
+			(*discarded)++;
+		}
+		else
+		{
+			bool succ = queue->cb(slot->frame, slot->frames_lost + *discarded, queue->cb_user);
+			*discarded = 0;
+			chiaki_atomic_u64_fetch_add(&ring->frames_decoded, 1, CHIAKI_MEMORY_ORDER_RELAXED);
+			if(!succ && !slot->header)
+				video_decode_queue_set_failed(ring, slot->frame_index);
+		}
+		chiaki_frame_buffer_unref(slot->frame);
+		slot->frame = NULL;
+		chiaki_atomic_size_store(&ring->read_pos, read_pos + 1, CHIAKI_MEMORY_ORDER_RELEASE);
+	}
+}
+
+static void *video_decode_queue_thread_func(void *user)
+{
+	ChiakiVideoDecodeQueue *queue = user;
+	struct chiaki_video_decode_queue_ring_t *ring = queue->ring;
+	int32_t discarded = 0;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&queue->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	while(!queue->should_stop)
+	{
+		chiaki_mutex_unlock(&queue->mutex);
+		video_decode_queue_drain(queue, &discarded);
+		err = chiaki_mutex_lock(&queue->mutex);
+		assert(err == CHIAKI_ERR_SUCCESS);
+
+		chiaki_atomic_bool_store(&ring->consumer_waiting, true, CHIAKI_MEMORY_ORDER_SEQ_CST);
+		if(!queue->should_stop && chiaki_atomic_size_load(&ring->write_pos, CHIAKI_MEMORY_ORDER_SEQ_CST) == chiaki_atomic_size_load(&ring->read_pos, CHIAKI_MEMORY_ORDER_RELAXED))
+			chiaki_cond_wait(&queue->cond, &queue->mutex);
+		chiaki_atomic_bool_store(&ring->consumer_waiting, false, CHIAKI_MEMORY_ORDER_SEQ_CST);
+	}
+	chiaki_mutex_unlock(&queue->mutex);
+
+	return NULL;
+}
+
+CHIAKI_EXPORT bool chiaki_video_frame_is_keyframe(ChiakiCodec codec, const uint8_t *buf, size_t buf_size)
+{
+	ChiakiVideoFrameInfo info;
+	chiaki_video_frame_info_parse(codec, buf, buf_size, &info);
+	return info.valid && info.keyframe;
+}
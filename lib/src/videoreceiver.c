@@ -2,10 +2,15 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
+void chiaki_session_startup_first_frame(ChiakiSession *session);
+
 static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+static void chiaki_video_receiver_request_recovery(ChiakiVideoReceiver *video_receiver, uint64_t now_us);
+static bool chiaki_video_receiver_decode_cb(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user);
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
@@ -17,32 +22,62 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 
 	video_receiver->frame_index_cur = -1;
 	video_receiver->frame_index_prev = -1;
-	video_receiver->frame_index_prev_complete = 0;
 
 	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
 	video_receiver->packet_stats = packet_stats;
 
-	video_receiver->old_frame = NULL;
-	video_receiver->old_frame_size = 0;
-	video_receiver->old_frame_allocd = 0;
+	chiaki_video_recovery_init(&video_receiver->recovery, video_receiver->log);
+	chiaki_video_recovery_set_rtt(&video_receiver->recovery, session->rtt_us);
 
 	video_receiver->frames_lost = 0;
+	video_receiver->resumed = false;
+	video_receiver->first_frame_flushed = false;
+
+	ChiakiErrorCode err = chiaki_video_decode_queue_init(&video_receiver->decode_queue, video_receiver->log,
+			session->connect_info.video_profile.codec, chiaki_video_receiver_decode_cb, video_receiver);
+	video_receiver->decode_queue_enabled = err == CHIAKI_ERR_SUCCESS;
+	if(!video_receiver->decode_queue_enabled)
+		CHIAKI_LOGE(video_receiver->log, "Video Receiver failed to start decode thread, decoding on the receive thread instead");
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
+	if(video_receiver->decode_queue_enabled)
+	{
+		ChiakiVideoDecodeQueueStats stats;
+		chiaki_video_decode_queue_get_stats(&video_receiver->decode_queue, &stats);
+		CHIAKI_LOGI(video_receiver->log, "Video Decode Queue decoded %llu of %llu frames, dropped %llu in %llu overflows",
+				(unsigned long long)stats.frames_decoded, (unsigned long long)stats.frames_pushed,
+				(unsigned long long)stats.frames_dropped, (unsigned long long)stats.overflows);
+		chiaki_video_decode_queue_fini(&video_receiver->decode_queue);
+	}
+	ChiakiVideoRecoveryStats *recovery_stats = &video_receiver->recovery.stats;
+	CHIAKI_LOGI(video_receiver->log, "Video Recovery handled %llu losses (%llu non-reference), withheld %llu frames, "
+			"recovered %llu times by keyframe, %llu by reference invalidation, %llu timeouts, broken for %llu ms total, %llu ms max",
+			(unsigned long long)recovery_stats->losses, (unsigned long long)recovery_stats->losses_non_reference,
+			(unsigned long long)recovery_stats->frames_withheld,
+			(unsigned long long)recovery_stats->recoveries_keyframe, (unsigned long long)recovery_stats->recoveries_invalidation,
+			(unsigned long long)recovery_stats->timeouts,
+			(unsigned long long)(recovery_stats->broken_us_total / 1000), (unsigned long long)(recovery_stats->broken_us_max / 1000));
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
 		free(video_receiver->profiles[i].header);
 	chiaki_frame_processor_fini(&video_receiver->frame_processor);
-	free(video_receiver->old_frame);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count)
 {
 	if(video_receiver->profiles_count > 0)
 	{
-		CHIAKI_LOGE(video_receiver->log, "Video Receiver profiles already set");
-		return;
+		if(!video_receiver->resumed)
+		{
+			CHIAKI_LOGE(video_receiver->log, "Video Receiver profiles already set");
+			return;
+		}
+		// the new connection sends its own headers, which are passed to the decoder again on the first packet
+		for(size_t i=0; i<video_receiver->profiles_count; i++)
+			free(video_receiver->profiles[i].header);
+		video_receiver->profiles_count = 0;
+		video_receiver->profile_cur = -1;
 	}
 
 	memcpy(video_receiver->profiles, profiles, profiles_count * sizeof(ChiakiVideoProfile));
@@ -68,6 +103,9 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 		return;
 	}
 
+	chiaki_delay_estimator_push_packet(&video_receiver->session->stream_connection.delay_estimator,
+			frame_index, packet->recv_timestamp_us, packet->recv_timestamp_kernel);
+
 	// check adaptive stream index
 	if(video_receiver->profile_cur < 0 || video_receiver->profile_cur != packet->adaptive_stream_index)
 	{
@@ -82,10 +120,21 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
-			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, 0, video_receiver->session->video_sample_cb_user);
-
-		video_receiver->old_frame_size = 0;
+		ChiakiVideoFrameInfo header_info;
+		chiaki_video_frame_info_parse(video_receiver->session->connect_info.video_profile.codec,
+				profile->header, profile->header_sz, &header_info);
+		chiaki_video_recovery_header(&video_receiver->recovery, &header_info);
+		ChiakiFrameBuffer *header = chiaki_frame_buffer_new_copy(profile->header, profile->header_sz);
+		if(header)
+		{
+			if(video_receiver->decode_queue_enabled)
+				chiaki_video_decode_queue_push(&video_receiver->decode_queue, header, 0, frame_index, true);
+			else
+				chiaki_video_receiver_decode_cb(header, 0, video_receiver);
+			chiaki_frame_buffer_unref(header);
+		}
+		else
+			CHIAKI_LOGE(video_receiver->log, "Video Receiver failed to alloc header buffer");
 	}
 
 	// next frame?
@@ -99,14 +148,30 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
 			chiaki_video_receiver_flush_frame(video_receiver);
 
-		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+
+		// frames the decoder failed on break the references just like lost ones
+		ChiakiSeqNum16 failed_frame_index;
+		if(video_receiver->decode_queue_enabled
+			&& chiaki_video_decode_queue_take_failed(&video_receiver->decode_queue, &failed_frame_index))
+			chiaki_video_recovery_frames_lost(&video_receiver->recovery, failed_frame_index, failed_frame_index, NULL, now_us);
+
+		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev + 1);
+		if(video_receiver->resumed)
+		{
+			// whatever the console sent while disconnected is gone, which should make it send a keyframe
+			CHIAKI_LOGI(video_receiver->log, "Video Receiver resuming at frame %d", (int)frame_index);
+			chiaki_video_recovery_frames_lost(&video_receiver->recovery, frame_index - 1, frame_index - 1, NULL, now_us);
+			video_receiver->resumed = false;
+		}
+		else if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
 			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
 		{
-			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
-			video_receiver->frames_lost = frame_index - next_frame_expected;
+			CHIAKI_LOGW(video_receiver->log, "Detected missing frame(s) from %d to %d", next_frame_expected, (int)frame_index - 1);
+			chiaki_video_recovery_frames_lost(&video_receiver->recovery, next_frame_expected, frame_index - 1, NULL, now_us);
+			video_receiver->frames_lost += (ChiakiSeqNum16)(frame_index - next_frame_expected);
 		}
+		chiaki_video_receiver_request_recovery(video_receiver, now_us);
 
 		video_receiver->frame_index_cur = frame_index;
 		chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
@@ -123,61 +188,94 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 	}
 }
 
-#define FLUSH_CORRUPT_FRAMES
+CHIAKI_EXPORT void chiaki_video_receiver_resume(ChiakiVideoReceiver *video_receiver)
+{
+	// a partially received frame is dropped by the next chiaki_frame_processor_alloc_frame()
+	video_receiver->frame_index_cur = -1;
+	video_receiver->frame_index_prev = -1;
+	video_receiver->resumed = true;
+}
 
 static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
 {
-	uint8_t *frame;
-	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	ChiakiFrameBuffer *frame = NULL;
+	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush_ref(&video_receiver->frame_processor, &frame);
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)video_receiver->frame_index_cur;
+	ChiakiCodec codec = video_receiver->session->connect_info.video_profile.codec;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
 
+	ChiakiVideoFrameInfo info;
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
-#ifndef FLUSH_CORRUPT_FRAMES
-		|| flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED
-#endif
-		)
+		|| flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
 	{
-		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index);
+		// whatever did arrive may still tell that nothing depends on this frame
+		if(frame)
+			chiaki_video_frame_info_parse(codec, chiaki_frame_buffer_data(frame), chiaki_frame_buffer_size(frame), &info);
+		chiaki_video_recovery_frames_lost(&video_receiver->recovery, frame_index, frame_index, frame ? &info : NULL, now_us);
+		chiaki_frame_buffer_unref(frame);
+		video_receiver->frames_lost++;
+		chiaki_video_receiver_request_recovery(video_receiver, now_us);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
-	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
-
-	if(video_receiver->session->connect_info.video_profile.codec > CHIAKI_CODEC_H264)
+	chiaki_video_frame_info_parse(codec, chiaki_frame_buffer_data(frame), chiaki_frame_buffer_size(frame), &info);
+	bool recovering = video_receiver->recovery.broken;
+	if(!chiaki_video_recovery_frame_decodable(&video_receiver->recovery, frame_index, &info, now_us))
 	{
-		if(succ)
-		{
-			if(video_receiver->old_frame_allocd < frame_size)
-			{
-				free(video_receiver->old_frame);
-				video_receiver->old_frame_allocd = frame_size * 2;
-				video_receiver->old_frame = malloc(video_receiver->old_frame_allocd);
-			}
-			video_receiver->old_frame_size = frame_size;
-			memcpy(video_receiver->old_frame, frame, frame_size);
-		}
-		else if(video_receiver->old_frame_size)
-		{
-			frame = video_receiver->old_frame;
-			frame_size = video_receiver->old_frame_size;
-		}
+		chiaki_frame_buffer_unref(frame);
+		video_receiver->frames_lost++;
+		chiaki_video_receiver_request_recovery(video_receiver, now_us);
+		return CHIAKI_ERR_SUCCESS;
 	}
+	// the queue would otherwise still wait for a keyframe if the loss came from an overflow
+	if(recovering && video_receiver->decode_queue_enabled)
+		chiaki_video_decode_queue_resume(&video_receiver->decode_queue);
 
-	if(video_receiver->session->video_sample_cb)
+	bool succ;
+	if(video_receiver->decode_queue_enabled)
+		succ = chiaki_video_decode_queue_push(&video_receiver->decode_queue, frame,
+				video_receiver->frames_lost, frame_index, false);
+	else
+		succ = chiaki_video_receiver_decode_cb(frame, video_receiver->frames_lost, video_receiver);
+	chiaki_frame_buffer_unref(frame);
+	video_receiver->frames_lost = 0;
+	if(!succ)
 	{
-		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->frames_lost, video_receiver->session->video_sample_cb_user);
-		video_receiver->frames_lost = 0;
-		if(!cb_succ)
-		{
-			succ = false;
-			CHIAKI_LOGW(video_receiver->log, "Video callback did not process frame successfully.");
-		}
+		// dropped by the decode queue or rejected by the decoder, later frames can not reference it either
+		chiaki_video_recovery_frames_lost(&video_receiver->recovery, frame_index, frame_index, NULL, now_us);
+		chiaki_video_receiver_request_recovery(video_receiver, now_us);
 	}
 
-	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	if(succ)
-		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
+static void chiaki_video_receiver_request_recovery(ChiakiVideoReceiver *video_receiver, uint64_t now_us)
+{
+	ChiakiSeqNum16 first, last;
+	if(chiaki_video_recovery_poll_request(&video_receiver->recovery, now_us, &first, &last))
+		stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, first, last);
+}
 
-	return CHIAKI_ERR_SUCCESS;
+static bool chiaki_video_receiver_decode_cb(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user)
+{
+	ChiakiVideoReceiver *video_receiver = user;
+	ChiakiSession *session = video_receiver->session;
+	bool succ;
+	if(session->video_frame_cb)
+		succ = session->video_frame_cb(frame, frames_lost, session->video_frame_cb_user);
+	else if(session->video_sample_cb)
+		succ = session->video_sample_cb(chiaki_frame_buffer_data(frame), chiaki_frame_buffer_size(frame),
+				frames_lost, session->video_sample_cb_user);
+	else
+		return true;
+	if(!succ)
+		CHIAKI_LOGW(video_receiver->log, "Video callback did not process frame successfully.");
+	else if(!video_receiver->first_frame_flushed)
+	{
+		video_receiver->first_frame_flushed = true;
+		chiaki_session_startup_first_frame(session);
+	}
+	return succ;
 }
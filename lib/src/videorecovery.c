@@ -0,0 +1,270 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/videorecovery.h>
+
+#include <string.h>
+
+// only the beginning of a frame is searched for the first slice
+#define NAL_SCAN_MAX 256
+
+#define SEI_PAYLOAD_TYPE_RECOVERY_POINT 6
+
+/**
+ * Parse the first SEI message of a NAL unit, starting after the NAL unit header
+ *
+ * @return true if it is a recovery point, whose recovery_frame_cnt is written to cnt
+ */
+static bool sei_recovery_point(const uint8_t *buf, size_t buf_size, unsigned int *cnt)
+{
+	// payload type and size are each coded as a run of 0xff bytes and a final byte
+	size_t pos = 0;
+	unsigned int type = 0;
+	while(pos < buf_size && buf[pos] == 0xff)
+		type += buf[pos++];
+	if(pos >= buf_size)
+		return false;
+	type += buf[pos++];
+	if(type != SEI_PAYLOAD_TYPE_RECOVERY_POINT)
+		return false;
+	while(pos < buf_size && buf[pos] == 0xff)
+		pos++;
+	if(pos >= buf_size)
+		return false;
+	pos++;
+
+	// recovery_frame_cnt is the first field of the payload, coded as ue(v)
+	uint64_t bits = 0;
+	size_t bytes = 0;
+	unsigned int zeros = 0;
+	for(; pos < buf_size && bytes < sizeof(bits); pos++)
+	{
+		if(zeros >= 2 && buf[pos] == 3) // emulation prevention
+		{
+			zeros = 0;
+			continue;
+		}
+		zeros = buf[pos] ? 0 : zeros + 1;
+		bits = (bits << 8) | buf[pos];
+		bytes++;
+	}
+	if(!bytes)
+		return false;
+	bits <<= 8 * (sizeof(bits) - bytes);
+	unsigned int leading_zeros = 0;
+	while(leading_zeros < 32 && !(bits & (0x8000000000000000ull >> leading_zeros)))
+		leading_zeros++;
+	if(2 * leading_zeros + 1 > 8 * bytes)
+		return false;
+	*cnt = (unsigned int)((bits >> (63 - 2 * leading_zeros)) & ((1ull << (leading_zeros + 1)) - 1)) - 1;
+	return true;
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_info_parse(ChiakiCodec codec, const uint8_t *buf, size_t buf_size, ChiakiVideoFrameInfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->max_temporal_id = -1;
+	bool h265 = chiaki_codec_is_h265(codec);
+	size_t scan_size = buf_size < NAL_SCAN_MAX ? buf_size : NAL_SCAN_MAX;
+	for(size_t i=0; i + 3 < scan_size; i++)
+	{
+		if(buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 1)
+			continue;
+		uint8_t nal_header = buf[i+3];
+		if(h265)
+		{
+			// the header is 2 bytes
+			if(i + 4 >= scan_size)
+				break;
+			unsigned int type = (nal_header >> 1) & 0x3f;
+			unsigned int temporal_id_plus1 = buf[i+4] & 7;
+			if(type < 32) // slice
+			{
+				info->valid = true;
+				info->temporal_id = temporal_id_plus1 ? temporal_id_plus1 - 1 : 0;
+				// IRAP: BLA, IDR, CRA
+				info->keyframe = (type >= 16 && type <= 23) || (info->recovery_point && !info->recovery_frame_cnt);
+				// sub-layer non-reference pictures have even types up to RSV_VCL_N14,
+				// pictures of higher sub-layers may still reference them
+				info->sub_layer_non_reference = type <= 14 && !(type & 1);
+				info->reference = true;
+				return;
+			}
+			if(type == 33 && i + 5 < scan_size) // SPS
+				info->max_temporal_id = (buf[i+5] >> 1) & 7; // sps_max_sub_layers_minus1
+			else if(type == 39 && i + 5 < scan_size // prefix SEI
+				&& sei_recovery_point(buf + i + 5, scan_size - i - 5, &info->recovery_frame_cnt))
+				info->recovery_point = true;
+		}
+		else
+		{
+			unsigned int type = nal_header & 0x1f;
+			if(type >= 1 && type <= 5) // slice
+			{
+				info->valid = true;
+				info->keyframe = type == 5 || (info->recovery_point && !info->recovery_frame_cnt); // IDR
+				info->reference = (nal_header >> 5) & 3; // nal_ref_idc
+				return;
+			}
+			if(type == 6 && i + 4 < scan_size // SEI
+				&& sei_recovery_point(buf + i + 4, scan_size - i - 4, &info->recovery_frame_cnt))
+				info->recovery_point = true;
+		}
+		i += 3;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_video_recovery_init(ChiakiVideoRecovery *recovery, ChiakiLog *log)
+{
+	memset(recovery, 0, sizeof(*recovery));
+	recovery->log = log;
+	recovery->rtt_us = CHIAKI_VIDEO_RECOVERY_RTT_DEFAULT_US;
+	recovery->max_temporal_id = -1;
+}
+
+CHIAKI_EXPORT void chiaki_video_recovery_set_rtt(ChiakiVideoRecovery *recovery, uint64_t rtt_us)
+{
+	recovery->rtt_us = rtt_us ? rtt_us : CHIAKI_VIDEO_RECOVERY_RTT_DEFAULT_US;
+}
+
+CHIAKI_EXPORT void chiaki_video_recovery_header(ChiakiVideoRecovery *recovery, const ChiakiVideoFrameInfo *info)
+{
+	if(info->max_temporal_id >= 0)
+		recovery->max_temporal_id = info->max_temporal_id;
+}
+
+static bool video_recovery_frame_referenced(ChiakiVideoRecovery *recovery, const ChiakiVideoFrameInfo *info)
+{
+	if(!info->valid)
+		return true;
+	if(!info->reference)
+		return false;
+	// pictures of higher sub-layers may reference it, so only the highest one is safe to skip
+	return !info->sub_layer_non_reference
+		|| recovery->max_temporal_id < 0 || info->temporal_id < recovery->max_temporal_id;
+}
+
+CHIAKI_EXPORT void chiaki_video_recovery_frames_lost(ChiakiVideoRecovery *recovery, ChiakiSeqNum16 first, ChiakiSeqNum16 last,
+		const ChiakiVideoFrameInfo *info, uint64_t now_us)
+{
+	if(info)
+		chiaki_video_recovery_header(recovery, info);
+	if(info && !video_recovery_frame_referenced(recovery, info) && first == last)
+	{
+		// nothing depends on this frame, so it can simply be skipped
+		recovery->stats.losses_non_reference++;
+		return;
+	}
+
+	// the frames up to the end of a recovery point are needed to reach it
+	recovery->recovery_point_pending = false;
+	recovery->request_due = true;
+	if(recovery->broken)
+	{
+		if(chiaki_seq_num_16_gt(last, recovery->lost_last))
+			recovery->lost_last = last;
+		return;
+	}
+
+	CHIAKI_LOGI(recovery->log, "Video Recovery lost reference in frames %d to %d, withholding frames until recovered",
+			(int)first, (int)last);
+	recovery->broken = true;
+	recovery->lost_first = first;
+	recovery->lost_last = last;
+	recovery->broken_since_us = now_us;
+	recovery->request_sent = false;
+	recovery->stats.losses++;
+}
+
+static void video_recovery_recovered(ChiakiVideoRecovery *recovery, ChiakiSeqNum16 frame_index, const char *how, uint64_t now_us)
+{
+	uint64_t broken_us = now_us - recovery->broken_since_us;
+	recovery->stats.broken_us_total += broken_us;
+	if(broken_us > recovery->stats.broken_us_max)
+		recovery->stats.broken_us_max = broken_us;
+	CHIAKI_LOGI(recovery->log, "Video Recovery resuming at frame %d after %llu ms by %s",
+			(int)frame_index, (unsigned long long)(broken_us / 1000), how);
+	recovery->broken = false;
+	recovery->request_due = false;
+	recovery->request_sent = false;
+	recovery->recovery_point_pending = false;
+}
+
+CHIAKI_EXPORT bool chiaki_video_recovery_frame_decodable(ChiakiVideoRecovery *recovery, ChiakiSeqNum16 frame_index,
+		const ChiakiVideoFrameInfo *info, uint64_t now_us)
+{
+	chiaki_video_recovery_header(recovery, info);
+	if(!recovery->broken)
+		return true;
+
+	if(info->valid && info->keyframe)
+	{
+		recovery->stats.recoveries_keyframe++;
+		video_recovery_recovered(recovery, frame_index, "keyframe", now_us);
+		return true;
+	}
+
+	if(recovery->recovery_point_pending)
+	{
+		if(!chiaki_seq_num_16_lt(frame_index, recovery->recovery_point_end))
+		{
+			recovery->stats.recoveries_keyframe++;
+			video_recovery_recovered(recovery, frame_index, "recovery point", now_us);
+		}
+		return true;
+	}
+
+	if(info->valid && info->recovery_point)
+	{
+		// decoding has to start here, but the output is only correct after recovery_frame_cnt more frames
+		CHIAKI_LOGI(recovery->log, "Video Recovery got recovery point at frame %d, correct output in %u frames",
+				(int)frame_index, info->recovery_frame_cnt);
+		recovery->recovery_point_pending = true;
+		recovery->recovery_point_end = (ChiakiSeqNum16)(frame_index + info->recovery_frame_cnt);
+		return true;
+	}
+
+	// the console has received the report by now, so this frame can only reference intact ones
+	if(recovery->request_sent && !recovery->request_due
+		&& now_us - recovery->request_us >= recovery->rtt_us + CHIAKI_VIDEO_RECOVERY_RESUME_MARGIN_US)
+	{
+		recovery->stats.recoveries_invalidation++;
+		video_recovery_recovered(recovery, frame_index, "reference invalidation", now_us);
+		return true;
+	}
+
+	if(now_us - recovery->broken_since_us >= CHIAKI_VIDEO_RECOVERY_TIMEOUT_US)
+	{
+		CHIAKI_LOGW(recovery->log, "Video Recovery got no decodable frame in time, decoding anyway");
+		recovery->stats.timeouts++;
+		video_recovery_recovered(recovery, frame_index, "timeout", now_us);
+		return true;
+	}
+
+	// withheld frames are lost for the console too, they must not be referenced either
+	if(video_recovery_frame_referenced(recovery, info))
+	{
+		if(chiaki_seq_num_16_gt(frame_index, recovery->lost_last))
+			recovery->lost_last = frame_index;
+	}
+	recovery->stats.frames_withheld++;
+	return false;
+}
+
+CHIAKI_EXPORT bool chiaki_video_recovery_poll_request(ChiakiVideoRecovery *recovery, uint64_t now_us,
+		ChiakiSeqNum16 *first, ChiakiSeqNum16 *last)
+{
+	// a recovery point is already underway, unless something was lost since
+	if(!recovery->broken || (recovery->recovery_point_pending && !recovery->request_due))
+		return false;
+	// repeat the request if it got lost or was ignored
+	if(!recovery->request_due
+		&& (recovery->request_sent && now_us - recovery->request_us < 2 * recovery->rtt_us + CHIAKI_VIDEO_RECOVERY_RESUME_MARGIN_US))
+		return false;
+	recovery->request_due = false;
+	recovery->request_sent = true;
+	recovery->request_us = now_us;
+	recovery->stats.requests++;
+	*first = recovery->lost_first;
+	*last = recovery->lost_last;
+	return true;
+}
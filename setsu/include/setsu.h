@@ -4,6 +4,7 @@
 #define _SETSU_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -93,6 +94,16 @@ typedef void (*SetsuEventCb)(SetsuEvent *event, void *user);
 Setsu *setsu_new();
 void setsu_free(Setsu *setsu);
 void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user);
+
+/* Block until a connected device or the udev monitor has new data
+ * or setsu_wakeup() is called, at most timeout_ms, forever if negative.
+ * Call setsu_poll() afterwards to handle the data.
+ * Returns true if anything woke the call up before the timeout. */
+bool setsu_wait(Setsu *setsu, int timeout_ms);
+
+/* Make a setsu_wait() that is blocking in another thread return immediately.
+ * Safe to call from any thread. */
+void setsu_wakeup(Setsu *setsu);
 SetsuDevice *setsu_connect(Setsu *setsu, const char *path, SetsuDeviceType type);
 void setsu_disconnect(Setsu *setsu, SetsuDevice *dev);
 const char *setsu_device_get_path(SetsuDevice *dev);
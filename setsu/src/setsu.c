@@ -12,6 +12,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <math.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <stdio.h>
 
@@ -25,6 +27,8 @@
 
 #define DEG2RAD (2.0f * M_PI / 360.0f)
 
+#define WAIT_EVENTS_MAX 16
+
 typedef struct setsu_avail_device_t
 {
 	struct setsu_avail_device_t *next;
@@ -86,6 +90,8 @@ struct setsu_t
 	struct udev_monitor *udev_mon;
 	SetsuAvailDevice *avail_dev;
 	SetsuDevice *dev;
+	int epoll_fd;
+	int wakeup_fd;
 };
 
 bool get_dev_ids(const char *path, uint32_t *vendor_id, uint32_t *model_id);
@@ -110,11 +116,34 @@ Setsu *setsu_new()
 		return NULL;
 	}
 
+	setsu->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(setsu->epoll_fd == -1)
+	{
+		udev_unref(setsu->udev);
+		free(setsu);
+		return NULL;
+	}
+
+	setsu->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(setsu->wakeup_fd == -1)
+	{
+		close(setsu->epoll_fd);
+		udev_unref(setsu->udev);
+		free(setsu);
+		return NULL;
+	}
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(setsu->epoll_fd, EPOLL_CTL_ADD, setsu->wakeup_fd, &ev);
+
 	setsu->udev_mon = udev_monitor_new_from_netlink(setsu->udev, "udev");
 	if(setsu->udev_mon)
 	{
 		udev_monitor_filter_add_match_subsystem_devtype(setsu->udev_mon, "input", NULL);
 		udev_monitor_enable_receiving(setsu->udev_mon);
+		ev.data.ptr = setsu->udev_mon;
+		epoll_ctl(setsu->epoll_fd, EPOLL_CTL_ADD, udev_monitor_get_fd(setsu->udev_mon), &ev);
 	}
 	else
 		SETSU_LOG("Failed to create udev monitor\n");
@@ -133,6 +162,8 @@ void setsu_free(Setsu *setsu)
 	if(setsu->udev_mon)
 		udev_monitor_unref(setsu->udev_mon);
 	udev_unref(setsu->udev);
+	close(setsu->wakeup_fd);
+	close(setsu->epoll_fd);
 	while(setsu->avail_dev)
 	{
 		SetsuAvailDevice *adev = setsu->avail_dev;
@@ -360,6 +391,15 @@ SetsuDevice *setsu_connect(Setsu *setsu, const char *path, SetsuDeviceType type)
 			break;
 	}
 
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+	if(epoll_ctl(setsu->epoll_fd, EPOLL_CTL_ADD, dev->fd, &ev) < 0)
+	{
+		SETSU_LOG("Failed to add %s to epoll\n", dev->path);
+		goto error;
+	}
+
 	dev->next = setsu->dev;
 	setsu->dev = dev;
 	return dev;
@@ -388,6 +428,7 @@ void setsu_disconnect(Setsu *setsu, SetsuDevice *dev)
 			}
 		}
 	}
+	epoll_ctl(setsu->epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
 	libevdev_free(dev->evdev);
 	close(dev->fd);
 	free(dev->path);
@@ -479,6 +520,34 @@ void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user)
 		poll_device(setsu, dev, cb, user);
 }
 
+bool setsu_wait(Setsu *setsu, int timeout_ms)
+{
+	struct epoll_event events[WAIT_EVENTS_MAX];
+	int r = epoll_wait(setsu->epoll_fd, events, WAIT_EVENTS_MAX, timeout_ms);
+	if(r < 0)
+	{
+		if(errno != EINTR)
+			perror("setsu_wait");
+		return false;
+	}
+	for(int i=0; i<r; i++)
+	{
+		if(events[i].data.ptr)
+			continue;
+		uint64_t v;
+		if(read(setsu->wakeup_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+			perror("setsu_wait");
+	}
+	return r > 0;
+}
+
+void setsu_wakeup(Setsu *setsu)
+{
+	uint64_t v = 1;
+	if(write(setsu->wakeup_fd, &v, sizeof(v)) < 0)
+		perror("setsu_wakeup");
+}
+
 static void poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user)
 {
 	bool sync = false;
@@ -8,6 +8,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct sdeck_t SDeck;
 //typedef struct freq_t FreqFinder;
@@ -102,10 +103,19 @@ typedef void (*SDeckEventCb)(SDeckEvent *event, void *user);
 SDeck *sdeck_new();
 void sdeck_free(SDeck *sdeck);
 void sdeck_read(SDeck *sdeck, SDeckEventCb cb, void *user);
+// Wait up to timeout_ms (forever if negative) for a report, then handle the most recent one.
+// Returns the number of reports read, 0 on timeout, -1 on error.
+int sdeck_read_wait(SDeck *sdeck, SDeckEventCb cb, void *user, int timeout_ms);
 int sdeck_haptic(SDeck *sdeck, uint8_t position, double frequency, uint32_t interval, const uint16_t repeat);
 int sdeck_haptic_ratio(SDeck *sdeck, uint8_t position, double frequency, uint32_t interval, double ratio, const uint16_t repeat);
 int send_haptic(SDeck* sdeck, uint8_t position, uint16_t period_high, uint16_t period_low, uint16_t repeat_count);
 int sdeck_haptic_init(SDeck * sdeck, int samples);
+// Start playing haptics audio pushed with sdeck_haptic_stream_push() on a dedicated thread,
+// analyzing window_samples samples at a time (at 3 kHz) per trackpad.
+int sdeck_haptic_stream_start(SDeck *sdeck, int window_samples);
+void sdeck_haptic_stream_stop(SDeck *sdeck);
+// Queue little endian int16 stereo samples at 3 kHz, left channel first. Safe to call from any thread.
+int sdeck_haptic_stream_push(SDeck *sdeck, const uint8_t *buf, size_t buf_size);
 int play_pcm_haptic(SDeck *sdeck, uint8_t position, int16_t *buf, const int32_t num_elements, const int sampling_rate);
 
 #ifdef __cplusplus
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sdeck.h>
 #include <stdio.h>
 #include <wchar.h>
@@ -7,6 +8,9 @@
 #include <hidapi.h>
 #include <math.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <fftw3.h>
 #define ENABLE_LOG
 
@@ -32,6 +36,9 @@
 #define STEAM_DECK_HAPTIC_INTENSITY 0.38f
 #define STEAM_DECK_CUTOFF_FREQ 250.0f
 #define STEAM_DECK_HAPTIC_SAMPLING_FREQ 3000.0f
+// haptics stream buffers this many analysis windows, older audio is dropped to bound latency
+#define STEAM_DECK_HAPTIC_STREAM_WINDOWS_MAX 2
+#define STEAM_DECK_HAPTIC_RING_WINDOWS 4
 
 typedef struct freq_t
 {
@@ -39,6 +46,8 @@ typedef struct freq_t
 	fftw_plan fft;
 	double *hann, *butterworth, *pcm_data;
 	fftw_complex *freq_data;
+	// low pass filter history (x[n-1], x[n-2], y[n-1], y[n-2]) per trackpad, carried across windows
+	double lpf_state[2][4];
 } FreqFinder;
 
 struct sdeck_t
@@ -48,6 +57,17 @@ struct sdeck_t
 	SDeckMotion prev_motion;
 	bool motion_dirty;
 	FreqFinder *freqfinder;
+
+	// haptics stream, see sdeck_haptic_stream_start()
+	bool haptic_thread_running;
+	pthread_t haptic_thread;
+	pthread_mutex_t haptic_mutex;
+	pthread_cond_t haptic_cond;
+	bool haptic_stop;
+	int16_t *haptic_ring[2]; // left, right
+	size_t haptic_ring_size;
+	size_t haptic_ring_read, haptic_ring_write; // absolute sample counts
+	int16_t *haptic_window[2];
 };
 
 hid_device *is_steam_deck();
@@ -56,8 +76,8 @@ void calc_powers(fftw_complex *data, int N);
 void max_power_freq(const int N, const double sampling_rate, double *frequency, double *freq_power, fftw_complex *power);
 void generate_event(SDeck *sdeck, SDeckEventType type, SDeckEventCb cb, void *user);
 double * butterworth_init();
-void lpf_apply(double * pcm_data, double * butterworth, int N);
 FreqFinder *freqfinder_new(int samples);
+void haptic_free(FreqFinder *freqfinder);
 
 SDeck *sdeck_new()
 {
@@ -87,6 +107,12 @@ SDeck *sdeck_new()
 
 int sdeck_haptic_init(SDeck *sdeck, int samples)
 {
+	if (sdeck->freqfinder)
+	{
+		if (sdeck->freqfinder->N == samples)
+			return 0;
+		haptic_free(sdeck->freqfinder);
+	}
 	sdeck->freqfinder = freqfinder_new(samples);
 	if (!sdeck->freqfinder)
 		return -1;
@@ -101,7 +127,9 @@ FreqFinder *freqfinder_new(int samples)
 	freqfinder->butterworth = butterworth_init();
 	freqfinder->pcm_data = fftw_malloc(2 * samples * sizeof(double));
 	freqfinder->freq_data = fftw_malloc((samples + 1) * sizeof(fftw_complex));
+	// planned once, every analysis window reuses it
 	freqfinder->fft = fftw_plan_dft_r2c_1d(2 * samples, freqfinder->pcm_data, freqfinder->freq_data, FFTW_MEASURE);
+	memset(freqfinder->lpf_state, 0, sizeof(freqfinder->lpf_state));
 	return freqfinder;
 }
 
@@ -122,6 +150,7 @@ void sdeck_free(SDeck *sdeck)
 {
 	if (!sdeck)
 		return;
+	sdeck_haptic_stream_stop(sdeck);
 	hid_close(sdeck->hiddev);
 	hid_exit();
 	if (sdeck->freqfinder)
@@ -234,17 +263,27 @@ double *butterworth_init()
 	return butterworth;
 }
 
-void lpf_apply(double *buf, double * butterworth, int buf_count)
+// convert pcm to double and low pass it in one pass, continuing the filter from the previous window of the same trackpad
+static void lpf_stream(FreqFinder *freqfinder, int channel, const int16_t *buf, int buf_count)
 {
-	double holder_buffer[buf_count];
-	holder_buffer[0] = buf[0];
-	holder_buffer[1] = buf[1];
-	for (int i = 2; i < buf_count; i++)
-		holder_buffer[i] = butterworth[0] * buf[i] + butterworth[1] * buf[i - 1] + butterworth[2] * buf[i - 2] + butterworth[3] * holder_buffer[i - 1] + butterworth[4] * holder_buffer[i - 2];
-	for (int i = 2; i < buf_count; i++)
+	const double *b = freqfinder->butterworth;
+	double *state = freqfinder->lpf_state[channel];
+	double x1 = state[0], x2 = state[1], y1 = state[2], y2 = state[3];
+	double *out = freqfinder->pcm_data;
+	for (int i = 0; i < buf_count; i++)
 	{
-		buf[i] = holder_buffer[i];
+		double x = buf[i];
+		double y = b[0] * x + b[1] * x1 + b[2] * x2 + b[3] * y1 + b[4] * y2;
+		x2 = x1;
+		x1 = x;
+		y2 = y1;
+		y1 = y;
+		out[i] = y;
 	}
+	state[0] = x1;
+	state[1] = x2;
+	state[2] = y1;
+	state[3] = y2;
 }
 
 void hann_apply(double *data, double *han, int N) // apply hann window to data
@@ -308,7 +347,6 @@ void calc_freqs(FreqFinder *freqfinder, const int sampling_rate, double *freq, d
 {
 	int N = freqfinder->N;
 	int complexN = freqfinder->N + 1;
-	lpf_apply(freqfinder->pcm_data, freqfinder->butterworth, N);
 	hann_apply(freqfinder->pcm_data, freqfinder->hann, N);
 	zero_pad(freqfinder->pcm_data, N);
 	fftw_execute(freqfinder->fft);
@@ -316,17 +354,14 @@ void calc_freqs(FreqFinder *freqfinder, const int sampling_rate, double *freq, d
 	max_power_freq(complexN, sampling_rate, freq, freq_power, freqfinder->freq_data);
 }
 
-int get_data(FreqFinder *freqfinder, int16_t *buf, const int num_elements)
+int get_data(FreqFinder *freqfinder, int channel, int16_t *buf, const int num_elements)
 {
 	if (freqfinder->N != num_elements)
 	{
 		SDECK_LOG("\nBuffer size mismatch...initialized buffer is not right size!\n");
 		return -1;
 	}
-	for (int i = 0; i < num_elements; i++)
-	{
-		freqfinder->pcm_data[i] = buf[i];
-	}
+	lpf_stream(freqfinder, channel, buf, num_elements);
 	return 0;
 }
 
@@ -374,7 +409,7 @@ int play_pcm_haptic(SDeck *sdeck, uint8_t position, int16_t *buf, const int num_
 	int repeat = 0;
 	int32_t playtime = 0;
 	double freq = 0, avg = 0, ratio = 0, freq_power = 0;
-	if (get_data(sdeck->freqfinder, buf, num_elements))
+	if (get_data(sdeck->freqfinder, position & 1, buf, num_elements))
 		return -1;
 	// interval in microseconds
 	interval = 1000000 * ((double)num_elements / (double)sampling_rate);
@@ -394,6 +429,175 @@ int play_pcm_haptic(SDeck *sdeck, uint8_t position, int16_t *buf, const int num_
 	return 2;
 }
 
+static void timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+static void *haptic_stream_thread(void *user)
+{
+	SDeck *sdeck = user;
+	const int N = sdeck->freqfinder->N;
+	const uint64_t window_ns = (uint64_t)N * 1000000000 / (uint64_t)STEAM_DECK_HAPTIC_SAMPLING_FREQ;
+	const uint8_t positions[2] = { TRACKPAD_LEFT, TRACKPAD_RIGHT };
+	bool skip[2] = { false, false };
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&sdeck->haptic_mutex);
+	while (!sdeck->haptic_stop)
+	{
+		// wake up once per analysis window on an absolute schedule, so the windows don't drift against the source
+		timespec_add_ns(&next, window_ns);
+		while (!sdeck->haptic_stop && pthread_cond_timedwait(&sdeck->haptic_cond, &sdeck->haptic_mutex, &next) != ETIMEDOUT);
+		if (sdeck->haptic_stop)
+			break;
+
+		size_t available = sdeck->haptic_ring_write - sdeck->haptic_ring_read;
+		size_t latency_max = (size_t)N * STEAM_DECK_HAPTIC_STREAM_WINDOWS_MAX;
+		if (available > latency_max)
+		{
+			sdeck->haptic_ring_read += available - latency_max;
+			available = latency_max;
+		}
+		size_t take = available < (size_t)N ? available : (size_t)N;
+		for (int c = 0; c < 2; c++)
+		{
+			for (size_t i = 0; i < take; i++)
+				sdeck->haptic_window[c][i] = sdeck->haptic_ring[c][(sdeck->haptic_ring_read + i) % sdeck->haptic_ring_size];
+			memset(sdeck->haptic_window[c] + take, 0, (N - take) * sizeof(int16_t));
+		}
+		sdeck->haptic_ring_read += take;
+		pthread_mutex_unlock(&sdeck->haptic_mutex);
+
+		for (int c = 0; c < 2; c++)
+		{
+			// a haptic that took 2 windows to play covers the next window too
+			if (!take || skip[c])
+			{
+				skip[c] = false;
+				continue;
+			}
+			int intervals = play_pcm_haptic(sdeck, positions[c], sdeck->haptic_window[c], N, STEAM_DECK_HAPTIC_SAMPLING_FREQ);
+			if (intervals < 0)
+				SDECK_LOG("Failed to submit haptics audio to Steam Deck\n");
+			else if (intervals == 2)
+				skip[c] = true;
+		}
+
+		// after a stall, continue from now instead of catching up with a burst of windows
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec + 1)
+			next = now;
+
+		pthread_mutex_lock(&sdeck->haptic_mutex);
+	}
+	pthread_mutex_unlock(&sdeck->haptic_mutex);
+	return NULL;
+}
+
+int sdeck_haptic_stream_start(SDeck *sdeck, int window_samples)
+{
+	if (sdeck->haptic_thread_running)
+		return 0;
+	if (sdeck_haptic_init(sdeck, window_samples) < 0)
+		return -1;
+
+	sdeck->haptic_ring_size = (size_t)window_samples * STEAM_DECK_HAPTIC_RING_WINDOWS;
+	sdeck->haptic_ring_read = sdeck->haptic_ring_write = 0;
+	sdeck->haptic_stop = false;
+	for (int c = 0; c < 2; c++)
+	{
+		sdeck->haptic_ring[c] = calloc(sdeck->haptic_ring_size, sizeof(int16_t));
+		sdeck->haptic_window[c] = calloc(window_samples, sizeof(int16_t));
+	}
+	if (!sdeck->haptic_ring[0] || !sdeck->haptic_ring[1] || !sdeck->haptic_window[0] || !sdeck->haptic_window[1])
+		goto error_buffers;
+
+	if (pthread_mutex_init(&sdeck->haptic_mutex, NULL))
+		goto error_buffers;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	int res = pthread_cond_init(&sdeck->haptic_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (res)
+		goto error_mutex;
+	if (pthread_create(&sdeck->haptic_thread, NULL, haptic_stream_thread, sdeck))
+		goto error_cond;
+#ifdef __GLIBC__
+	pthread_setname_np(sdeck->haptic_thread, "SDeck Haptics");
+#endif
+	sdeck->haptic_thread_running = true;
+	return 0;
+
+error_cond:
+	pthread_cond_destroy(&sdeck->haptic_cond);
+error_mutex:
+	pthread_mutex_destroy(&sdeck->haptic_mutex);
+error_buffers:
+	for (int c = 0; c < 2; c++)
+	{
+		free(sdeck->haptic_ring[c]);
+		sdeck->haptic_ring[c] = NULL;
+		free(sdeck->haptic_window[c]);
+		sdeck->haptic_window[c] = NULL;
+	}
+	SDECK_LOG("Failed to start Steam Deck haptics stream\n");
+	return -1;
+}
+
+void sdeck_haptic_stream_stop(SDeck *sdeck)
+{
+	if (!sdeck->haptic_thread_running)
+		return;
+	pthread_mutex_lock(&sdeck->haptic_mutex);
+	sdeck->haptic_stop = true;
+	pthread_cond_signal(&sdeck->haptic_cond);
+	pthread_mutex_unlock(&sdeck->haptic_mutex);
+	pthread_join(sdeck->haptic_thread, NULL);
+	sdeck->haptic_thread_running = false;
+
+	pthread_cond_destroy(&sdeck->haptic_cond);
+	pthread_mutex_destroy(&sdeck->haptic_mutex);
+	for (int c = 0; c < 2; c++)
+	{
+		free(sdeck->haptic_ring[c]);
+		sdeck->haptic_ring[c] = NULL;
+		free(sdeck->haptic_window[c]);
+		sdeck->haptic_window[c] = NULL;
+	}
+}
+
+int sdeck_haptic_stream_push(SDeck *sdeck, const uint8_t *buf, size_t buf_size)
+{
+	if (!sdeck->haptic_thread_running)
+		return -1;
+	size_t frames = buf_size / (2 * sizeof(int16_t));
+	if (frames > sdeck->haptic_ring_size)
+	{
+		buf += (frames - sdeck->haptic_ring_size) * 2 * sizeof(int16_t);
+		frames = sdeck->haptic_ring_size;
+	}
+	pthread_mutex_lock(&sdeck->haptic_mutex);
+	// keep the newest audio if the consumer fell behind
+	size_t used = sdeck->haptic_ring_write - sdeck->haptic_ring_read;
+	if (used + frames > sdeck->haptic_ring_size)
+		sdeck->haptic_ring_read += used + frames - sdeck->haptic_ring_size;
+	for (size_t i = 0; i < frames; i++)
+	{
+		size_t pos = (sdeck->haptic_ring_write + i) % sdeck->haptic_ring_size;
+		memcpy(&sdeck->haptic_ring[0][pos], buf + i * 4, sizeof(int16_t));
+		memcpy(&sdeck->haptic_ring[1][pos], buf + i * 4 + sizeof(int16_t), sizeof(int16_t));
+	}
+	sdeck->haptic_ring_write += frames;
+	pthread_mutex_unlock(&sdeck->haptic_mutex);
+	return 0;
+}
+
 int send_haptic(SDeck *sdeck, uint8_t position, uint16_t period_high, uint16_t period_low, uint16_t repeat_count)
 {
 	hid_device *handle = sdeck->hiddev;
@@ -499,66 +703,73 @@ void movemult_accel(float *accel, float mult)
 	*accel = *accel * mult;
 }
 
-void sdeck_read(SDeck *sdeck, SDeckEventCb cb, void *user)
+// apply filters to a report and send events
+// apply fuzz filter to accel and orient to remove noise
+// apply deadzone filter to gyro to reduce jitter when still
+static void process_controls(SDeck *sdeck, SDControls *sdc, SDeckEventCb cb, void *user)
+{
+	float accel_x = sdc->accel_x;
+	float accel_y = sdc->accel_y;
+	float accel_z = sdc->accel_z;
+	movemult_accel(&accel_x, ACCEL_MOVESPEED_MULT);
+	movemult_accel(&accel_y, ACCEL_MOVESPEED_MULT);
+	movemult_accel(&accel_z, ACCEL_MOVESPEED_MULT);
+	fuzz(accel_x, &sdeck->prev_motion.accel_x, STEAM_DECK_ACCEL_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	fuzz(accel_y, &sdeck->prev_motion.accel_y, STEAM_DECK_ACCEL_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	fuzz(accel_z, &sdeck->prev_motion.accel_z, STEAM_DECK_ACCEL_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	fuzz(sdc->orient_w, &sdeck->prev_motion.orient_w, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	fuzz(sdc->orient_x, &sdeck->prev_motion.orient_x, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	fuzz(sdc->orient_y, &sdeck->prev_motion.orient_y, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	fuzz(sdc->orient_z, &sdeck->prev_motion.orient_z, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
+	deadzone(sdc->gyro_x, &sdeck->prev_motion.gyro_x, STEAM_DECK_GYRO_DEADZONE, &sdeck->motion_dirty);
+	deadzone(sdc->gyro_y, &sdeck->prev_motion.gyro_y, STEAM_DECK_GYRO_DEADZONE, &sdeck->motion_dirty);
+	deadzone(sdc->gyro_z, &sdeck->prev_motion.gyro_z, STEAM_DECK_GYRO_DEADZONE, &sdeck->motion_dirty);
+	// send events for data we want to send (currently just motion data)
+	generate_event(sdeck, SDECK_EVENT_MOTION, cb, user);
+}
+
+// read until no more data to read in buffer or error, keeping only most recent data (minimize updates for stream performance)
+// the first read waits up to timeout_ms, all further ones return immediately
+static int read_latest(SDeck *sdeck, SDControls *sdc, int timeout_ms)
 {
-	int res = 0;
 	hid_device *handle = sdeck->hiddev;
 	unsigned char buf[64];
-	SDControls sdc;
-	memset(buf, 0, sizeof(buf));
-	memset(&sdc, 0, sizeof(SDControls));
-	bool data_to_read = false;
-
-	if (!handle)
-	{
-		SDECK_LOG("Steam Deck not found\n");
-		return;
-	}
-	// Set the hid_read() function to be non-blocking (returns immediately with values or 0).
-	hid_set_nonblocking(handle, 1);
-	// read until no more data to read in buffer or error, keeping only most recent data (minimize updates for stream performance)
+	int count = 0;
 	while (true)
 	{
-		res = hid_read(handle, buf, (sizeof(buf)));
+		int res = hid_read_timeout(handle, buf, sizeof(buf), count ? 0 : timeout_ms);
 		if (res < 0)
 		{
 			SDECK_LOG("Unable to read(): %ls\n", hid_error(handle));
-			break;
+			return count ? count : -1;
 		}
 		// if res == 0 => no more data to read
 		if (res == 0)
-			break;
-		if (res > 0)
-		{
-			memcpy(&sdc, buf, sizeof(buf));
-			data_to_read = true;
-			continue;
-		}
+			return count;
+		memcpy(sdc, buf, sizeof(buf));
+		count++;
 	}
-	// if data to read, read and apply filters
-	// apply fuzz filter to accel and orient to remove noise
-	// apply deadzone filter to gyro to reduce jitter when still
-	if (data_to_read)
+}
+
+void sdeck_read(SDeck *sdeck, SDeckEventCb cb, void *user)
+{
+	sdeck_read_wait(sdeck, cb, user, 0);
+}
+
+int sdeck_read_wait(SDeck *sdeck, SDeckEventCb cb, void *user, int timeout_ms)
+{
+	SDControls sdc;
+	memset(&sdc, 0, sizeof(SDControls));
+
+	if (!sdeck->hiddev)
 	{
-		float accel_x = sdc.accel_x;
-		float accel_y = sdc.accel_y;
-		float accel_z = sdc.accel_z;
-		movemult_accel(&accel_x, ACCEL_MOVESPEED_MULT);
-		movemult_accel(&accel_y, ACCEL_MOVESPEED_MULT);
-		movemult_accel(&accel_z, ACCEL_MOVESPEED_MULT);
-		fuzz(accel_x, &sdeck->prev_motion.accel_x, STEAM_DECK_ACCEL_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		fuzz(accel_y, &sdeck->prev_motion.accel_y, STEAM_DECK_ACCEL_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		fuzz(accel_z, &sdeck->prev_motion.accel_z, STEAM_DECK_ACCEL_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		fuzz(sdc.orient_w, &sdeck->prev_motion.orient_w, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		fuzz(sdc.orient_x, &sdeck->prev_motion.orient_x, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		fuzz(sdc.orient_y, &sdeck->prev_motion.orient_y, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		fuzz(sdc.orient_z, &sdeck->prev_motion.orient_z, STEAM_DECK_ORIENT_FUZZ, FUZZ_FILTER_PREV_WEIGHT, FUZZ_FILTER_PREV_WEIGHT2x, &sdeck->motion_dirty);
-		deadzone(sdc.gyro_x, &sdeck->prev_motion.gyro_x, STEAM_DECK_GYRO_DEADZONE, &sdeck->motion_dirty);
-		deadzone(sdc.gyro_y, &sdeck->prev_motion.gyro_y, STEAM_DECK_GYRO_DEADZONE, &sdeck->motion_dirty);
-		deadzone(sdc.gyro_z, &sdeck->prev_motion.gyro_z, STEAM_DECK_GYRO_DEADZONE, &sdeck->motion_dirty);
-		// send events for data we want to send (currently just motion data)
-		generate_event(sdeck, SDECK_EVENT_MOTION, cb, user);
+		SDECK_LOG("Steam Deck not found\n");
+		return -1;
 	}
+	int count = read_latest(sdeck, &sdc, timeout_ms);
+	if (count > 0)
+		process_controls(sdeck, &sdc, cb, user);
+	return count;
 }
 
 void generate_event(SDeck *sdeck, SDeckEventType type, SDeckEventCb cb, void *user)
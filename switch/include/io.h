@@ -50,6 +50,7 @@ extern "C"
 #include "exception.h"
 
 #define PLANES_COUNT 3
+#define PBO_RING_SIZE 3
 #define SDL_JOYSTICK_COUNT 2
 
 class IO
@@ -81,7 +82,16 @@ class IO
 		GLuint vao;
 		GLuint vbo;
 		GLuint tex[PLANES_COUNT];
-		GLuint pbo[PLANES_COUNT];
+		int tex_width = 0;
+		int tex_height = 0;
+		bool tex_immutable = false;
+		// all planes of a frame go into one pbo, cycled so uploading never waits for the previous draws
+		GLuint pbo[PBO_RING_SIZE] = {0};
+		GLsizeiptr pbo_size[PBO_RING_SIZE] = {0};
+		uint8_t *pbo_mapped[PBO_RING_SIZE] = {0};
+		GLsync pbo_fence[PBO_RING_SIZE] = {0};
+		unsigned int pbo_cur = 0;
+		bool pbo_persistent = false;
 		GLuint vert;
 		GLuint frag;
 		GLuint prog;
@@ -89,6 +99,9 @@ class IO
 		bool InitOpenGl();
 		bool InitOpenGlTextures();
 		bool InitOpenGlShader();
+		void AllocateOpenGlTextures(int width, int height);
+		uint8_t *AcquireOpenGlPBO(GLsizeiptr size);
+		void FreeOpenGlPBOs();
 		void OpenGlDraw();
 #ifdef DEBUG_OPENGL
 		void CheckGLError(const char *func, const char *file, int line);
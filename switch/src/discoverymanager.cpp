@@ -13,16 +13,16 @@
 #include <discoverymanager.h>
 
 #define PING_MS 500
+#define PING_MS_MAX 4000
 #define HOSTS_MAX 16
 #define DROP_PINGS 3
 
-static void Discovery(ChiakiDiscoveryHost *discovered_hosts, size_t hosts_count, void *user)
+static void Discovery(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *discovered_host, void *user)
 {
+	if(event == CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED)
+		return;
 	DiscoveryManager *dm = (DiscoveryManager *)user;
-	for(size_t i = 0; i < hosts_count; i++)
-	{
-		dm->DiscoveryCB(discovered_hosts + i);
-	}
+	dm->DiscoveryCB(discovered_host);
 }
 
 DiscoveryManager::DiscoveryManager()
@@ -47,12 +47,13 @@ void DiscoveryManager::SetService(bool enable)
 
 	if(enable)
 	{
-		ChiakiDiscoveryServiceOptions options;
+		ChiakiDiscoveryServiceOptions options = {};
 		options.ping_ms = PING_MS;
+		options.ping_ms_max = PING_MS_MAX;
 		options.hosts_max = HOSTS_MAX;
 		options.host_drop_pings = DROP_PINGS;
-		options.cb = Discovery;
-		options.cb_user = this;
+		options.host_cb = Discovery;
+		options.host_cb_user = this;
 
 		sockaddr_in addr = {};
 		addr.sin_family = AF_INET;
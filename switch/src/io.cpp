@@ -336,6 +336,8 @@ bool IO::FreeVideo()
 		avcodec_free_context(&this->codec_context);
 	}
 
+	FreeOpenGlPBOs();
+
 	return ret;
 }
 
@@ -740,7 +742,16 @@ bool IO::InitOpenGlTextures()
 	CHIAKI_LOGV(this->log, "loading OpenGL textrures");
 
 	D(glGenTextures(PLANES_COUNT, this->tex));
-	D(glGenBuffers(PLANES_COUNT, this->pbo));
+	D(glGenBuffers(PBO_RING_SIZE, this->pbo));
+#ifdef GL_TEXTURE_IMMUTABLE_FORMAT
+	this->tex_immutable = glTexStorage2D != nullptr;
+#endif
+#ifdef GL_MAP_PERSISTENT_BIT
+	this->pbo_persistent = glBufferStorage != nullptr;
+#endif
+	CHIAKI_LOGI(this->log, "OpenGL textures %s, pbos %s",
+		this->tex_immutable ? "immutable" : "mutable",
+		this->pbo_persistent ? "persistently mapped" : "mapped per frame");
 	uint8_t uv_default[] = {0x7f, 0x7f};
 	for(int i = 0; i < PLANES_COUNT; i++)
 	{
@@ -832,6 +843,126 @@ bool IO::InitOpenGlShader()
 	return true;
 }
 
+void IO::AllocateOpenGlTextures(int width, int height)
+{
+	CHIAKI_LOGI(this->log, "Allocating OpenGL textures for %dx%d", width, height);
+	for(int i = 0; i < PLANES_COUNT; i++)
+	{
+		// Y full size, U and V half size
+		int plane_width = i > 0 ? width / 2 : width;
+		int plane_height = i > 0 ? height / 2 : height;
+#ifdef GL_TEXTURE_IMMUTABLE_FORMAT
+		if(this->tex_immutable)
+		{
+			// immutable storage can not be resized, so replace the whole texture
+			D(glDeleteTextures(1, &this->tex[i]));
+			D(glGenTextures(1, &this->tex[i]));
+			D(glBindTexture(GL_TEXTURE_2D, this->tex[i]));
+			D(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+			D(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+			D(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+			D(glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+			D(glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, plane_width, plane_height));
+			continue;
+		}
+#endif
+		D(glBindTexture(GL_TEXTURE_2D, this->tex[i]));
+		D(glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, plane_width, plane_height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr));
+	}
+	this->tex_width = width;
+	this->tex_height = height;
+}
+
+uint8_t *IO::AcquireOpenGlPBO(GLsizeiptr size)
+{
+	unsigned int i = this->pbo_cur;
+	if(this->pbo_fence[i])
+	{
+		// the gpu is normally done with it since two frames, so this only blocks if it hangs
+		GLenum r;
+		D(r = glClientWaitSync(this->pbo_fence[i], GL_SYNC_FLUSH_COMMANDS_BIT, 100000000));
+		if(r == GL_TIMEOUT_EXPIRED || r == GL_WAIT_FAILED)
+			CHIAKI_LOGW(this->log, "Timed out waiting for PBO %u", i);
+		D(glDeleteSync(this->pbo_fence[i]));
+		this->pbo_fence[i] = nullptr;
+	}
+
+	D(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[i]));
+	if(this->pbo_size[i] < size)
+	{
+		if(this->pbo_mapped[i])
+		{
+			D(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+			this->pbo_mapped[i] = nullptr;
+		}
+		// the buffer may have immutable storage from glBufferStorage, even if that has been given up since,
+		// so growing always requires a new buffer object
+		D(glDeleteBuffers(1, &this->pbo[i]));
+		D(glGenBuffers(1, &this->pbo[i]));
+		D(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[i]));
+#ifdef GL_MAP_PERSISTENT_BIT
+		if(this->pbo_persistent)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			D(glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags));
+			D(this->pbo_mapped[i] = reinterpret_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags)));
+			if(this->pbo_mapped[i])
+			{
+				this->pbo_size[i] = size;
+				return this->pbo_mapped[i];
+			}
+			CHIAKI_LOGW(this->log, "Failed to persistently map PBO %u with size %ld, falling back to mapping every frame", i, (long)size);
+			this->pbo_persistent = false;
+			D(glDeleteBuffers(1, &this->pbo[i]));
+			D(glGenBuffers(1, &this->pbo[i]));
+			D(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[i]));
+		}
+#endif
+		D(glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW));
+		this->pbo_size[i] = size;
+	}
+
+	if(this->pbo_mapped[i])
+		return this->pbo_mapped[i];
+
+	uint8_t *buf;
+	// the fence guarantees the gpu is done with this buffer, so there is no need to orphan or synchronize
+	D(buf = reinterpret_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT)));
+	if(!buf)
+	{
+		GLint data;
+		D(glGetBufferParameteriv(GL_PIXEL_UNPACK_BUFFER, GL_BUFFER_SIZE, &data));
+		CHIAKI_LOGE(this->log, "Failed to map PBO %u with size %ld, GL_BUFFER_SIZE %d", i, (long)size, data);
+	}
+	return buf;
+}
+
+void IO::FreeOpenGlPBOs()
+{
+	// never initialized, so there might not even be a context
+	if(!this->pbo[0])
+		return;
+	for(int i = 0; i < PBO_RING_SIZE; i++)
+	{
+		if(this->pbo_fence[i])
+		{
+			D(glDeleteSync(this->pbo_fence[i]));
+			this->pbo_fence[i] = nullptr;
+		}
+		if(this->pbo_mapped[i])
+		{
+			D(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[i]));
+			D(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+			this->pbo_mapped[i] = nullptr;
+		}
+		D(glDeleteBuffers(1, &this->pbo[i]));
+		this->pbo[i] = 0;
+		this->pbo_size[i] = 0;
+	}
+	D(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+	this->pbo_cur = 0;
+}
+
 inline void IO::SetOpenGlYUVPixels(AVFrame *frame)
 {
 	D(glUseProgram(this->prog));
@@ -844,46 +975,55 @@ inline void IO::SetOpenGlYUVPixels(AVFrame *frame)
 	};
 
 	this->mtx.lock();
+	if(!frame->data[0])
+	{
+		// nothing decoded yet
+		this->mtx.unlock();
+		return;
+	}
+
+	if(frame->width != this->tex_width || frame->height != this->tex_height)
+		AllocateOpenGlTextures(frame->width, frame->height);
+
+	// keep the decoder's line size, so every plane is a single copy
+	GLintptr offsets[PLANES_COUNT];
+	size_t copy_sizes[PLANES_COUNT];
+	GLsizeiptr size = 0;
 	for(int i = 0; i < PLANES_COUNT; i++)
 	{
 		int width = frame->width / planes[i][0];
 		int height = frame->height / planes[i][1];
-		int size = width * height * planes[i][2];
-		uint8_t *buf;
-
-		D(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[i]));
-		D(glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW));
-		D(buf = reinterpret_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT)));
-		if(!buf)
-		{
-			GLint data;
-			D(glGetBufferParameteriv(GL_PIXEL_UNPACK_BUFFER, GL_BUFFER_SIZE, &data));
-			CHIAKI_LOGE(this->log, "AVOpenGLFrame failed to map PBO");
-			CHIAKI_LOGE(this->log, "Info buf == %p. size %d frame %d * %d, divs %d, %d, pbo %d GL_BUFFER_SIZE %x",
-				buf, size, frame->width, frame->height, planes[i][0], planes[i][1], pbo[i], data);
-			continue;
-		}
+		offsets[i] = size;
+		copy_sizes[i] = (size_t)frame->linesize[i] * (height - 1) + width * planes[i][2];
+		size += (copy_sizes[i] + 63) & ~(size_t)63;
+	}
 
-		if(frame->linesize[i] == width)
-		{
-			// Y
-			memcpy(buf, frame->data[i], size);
-		}
-		else
-		{
-			// UV
-			for(int l = 0; l < height; l++)
-				memcpy(buf + width * l * planes[i][2],
-					frame->data[i] + frame->linesize[i] * l,
-					width * planes[i][2]);
-		}
+	uint8_t *buf = AcquireOpenGlPBO(size);
+	if(!buf)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		this->mtx.unlock();
+		return;
+	}
+	for(int i = 0; i < PLANES_COUNT; i++)
+		memcpy(buf + offsets[i], frame->data[i], copy_sizes[i]);
+	if(!this->pbo_mapped[this->pbo_cur])
 		D(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+
+	D(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+	for(int i = 0; i < PLANES_COUNT; i++)
+	{
+		D(glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->linesize[i] / planes[i][2]));
 		D(glBindTexture(GL_TEXTURE_2D, tex[i]));
-		D(glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr));
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		D(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame->width / planes[i][0], frame->height / planes[i][1],
+			GL_RED, GL_UNSIGNED_BYTE, reinterpret_cast<const void *>(offsets[i])));
 	}
 	this->mtx.unlock();
-	glFinish();
+	D(glPixelStorei(GL_UNPACK_ROW_LENGTH, 0));
+
+	D(this->pbo_fence[this->pbo_cur] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+	this->pbo_cur = (this->pbo_cur + 1) % PBO_RING_SIZE;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 inline void IO::OpenGlDraw()
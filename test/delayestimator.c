@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/delayestimator.h>
+
+#define FPS 60
+#define FRAME_INTERVAL_US (1000000 / FPS)
+#define UNITS_PER_FRAME 4
+#define UNIT_SPACING_US 500
+
+/**
+ * Push frames starting at frame_index, each arriving extra_delay_us later than the nominal interval
+ */
+static uint64_t push_frames(ChiakiDelayEstimator *estimator, ChiakiSeqNum16 frame_index, size_t count, uint64_t t, int64_t extra_delay_us)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		for(size_t j=0; j<UNITS_PER_FRAME; j++)
+			chiaki_delay_estimator_push_packet(estimator, (ChiakiSeqNum16)(frame_index + i), t + j * UNIT_SPACING_US, true);
+		t += FRAME_INTERVAL_US + extra_delay_us;
+	}
+	return t;
+}
+
+static MunitResult test_constant(const MunitParameter params[], void *user)
+{
+	ChiakiDelayEstimator estimator;
+	munit_assert_int(chiaki_delay_estimator_init(&estimator), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_delay_estimator_reset(&estimator, FPS);
+
+	ChiakiDelayEstimate estimate;
+	chiaki_delay_estimator_get(&estimator, &estimate);
+	munit_assert_uint64(estimate.frames, ==, 0);
+
+	// wraps the frame index
+	push_frames(&estimator, 0xfff0, 60, 1000000, 0);
+	chiaki_delay_estimator_get(&estimator, &estimate);
+	munit_assert_uint64(estimate.frames, ==, 59); // the last one is not complete yet
+	munit_assert(estimate.kernel_timestamps);
+	munit_assert_double_equal(estimate.frame_spread_ms, (UNITS_PER_FRAME - 1) * UNIT_SPACING_US / 1000.0, 3);
+	munit_assert_double_equal(estimate.frame_interval_ms, FRAME_INTERVAL_US / 1000.0, 3);
+	munit_assert_double_equal(estimate.gradient_ms, 0.0, 3);
+	munit_assert_double_equal(estimate.queue_delay_ms, 0.0, 3);
+	munit_assert_double_equal(estimate.trend, 0.0, 3);
+
+	chiaki_delay_estimator_fini(&estimator);
+	return MUNIT_OK;
+}
+
+static MunitResult test_growing(const MunitParameter params[], void *user)
+{
+	ChiakiDelayEstimator estimator;
+	munit_assert_int(chiaki_delay_estimator_init(&estimator), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_delay_estimator_reset(&estimator, FPS);
+
+	uint64_t t = push_frames(&estimator, 0, 30, 1000000, 0);
+	t = push_frames(&estimator, 30, 30, t, 1000);
+	ChiakiDelayEstimate estimate;
+	chiaki_delay_estimator_get(&estimator, &estimate);
+	munit_assert_double(estimate.gradient_ms, >, 0.5);
+	munit_assert_double(estimate.queue_delay_ms, >, 20.0);
+	munit_assert_double(estimate.trend, >, 0.01);
+
+	// draining again
+	push_frames(&estimator, 60, 30, t, -1000);
+	chiaki_delay_estimator_get(&estimator, &estimate);
+	munit_assert_double(estimate.gradient_ms, <, -0.5);
+	munit_assert_double(estimate.trend, <, -0.01);
+
+	chiaki_delay_estimator_fini(&estimator);
+	return MUNIT_OK;
+}
+
+static MunitResult test_gap(const MunitParameter params[], void *user)
+{
+	ChiakiDelayEstimator estimator;
+	munit_assert_int(chiaki_delay_estimator_init(&estimator), ==, CHIAKI_ERR_SUCCESS);
+	chiaki_delay_estimator_reset(&estimator, FPS);
+
+	uint64_t t = push_frames(&estimator, 0, 10, 1000000, 0);
+	// late unit of an older frame is ignored
+	chiaki_delay_estimator_push_packet(&estimator, 3, t, false);
+	// a pause of the stream must not count as delay
+	t = push_frames(&estimator, 10, 10, t + 2 * CHIAKI_DELAY_ESTIMATOR_GAP_MAX_US, 0);
+	ChiakiDelayEstimate estimate;
+	chiaki_delay_estimator_get(&estimator, &estimate);
+	munit_assert_double_equal(estimate.queue_delay_ms, 0.0, 3);
+	munit_assert_double_equal(estimate.trend, 0.0, 3);
+
+	chiaki_delay_estimator_push_packet(&estimator, 20, t, false);
+	chiaki_delay_estimator_push_packet(&estimator, 21, t + FRAME_INTERVAL_US, false);
+	chiaki_delay_estimator_get(&estimator, &estimate);
+	munit_assert(!estimate.kernel_timestamps);
+
+	chiaki_delay_estimator_fini(&estimator);
+	return MUNIT_OK;
+}
+
+MunitTest tests_delay_estimator[] = {
+	{
+		"/constant",
+		test_constant,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/growing",
+		test_growing,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gap",
+		test_gap,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
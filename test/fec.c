@@ -67,6 +67,41 @@ static MunitResult test_fec(const MunitParameter params[], void *test_user)
 	return test_fec_case(&fec_test_cases[test_case_id]);
 }
 
+static MunitResult test_fec_encoder(const MunitParameter params[], void *test_user)
+{
+	// same layout as the mic packets: 1 source unit and 2 coding units
+	const size_t unit_size = 40;
+	uint8_t frame_buffer[3 * 40];
+	uint8_t frame_buffer_ref[3 * 40];
+
+	ChiakiFecEncoder encoder;
+	ChiakiErrorCode err = chiaki_fec_encoder_init(&encoder, 1, 2);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(int round=0; round<3; round++)
+	{
+		munit_rand_memory(unit_size, frame_buffer);
+		memset(frame_buffer + unit_size, 0x42, 2 * unit_size);
+		memcpy(frame_buffer_ref, frame_buffer, sizeof(frame_buffer));
+
+		chiaki_fec_encoder_encode(&encoder, frame_buffer, unit_size);
+		err = chiaki_fec_encode(frame_buffer_ref, unit_size, unit_size, 1, 2);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(frame_buffer), frame_buffer, frame_buffer_ref);
+
+		// source unit must be recoverable from either coding unit
+		const unsigned int erasures[] = { 0, 1 + round % 2 };
+		memset(frame_buffer, 0x42, unit_size);
+		memset(frame_buffer + erasures[1] * unit_size, 0x42, unit_size);
+		err = chiaki_fec_decode(frame_buffer, unit_size, unit_size, 1, 2, erasures, 2);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(unit_size, frame_buffer, frame_buffer_ref);
+	}
+
+	chiaki_fec_encoder_fini(&encoder);
+	return MUNIT_OK;
+}
+
 MunitTest tests_fec[] = {
 	{
 		"/fec",
@@ -76,5 +111,13 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/encoder",
+		test_fec_encoder,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/framebuffer.h>
+#include <chiaki/frameprocessor.h>
+#include <chiaki/video.h>
+
+#include "test_log.h"
+
+#include <string.h>
+
+static MunitResult test_pool(const MunitParameter params[], void *user)
+{
+	ChiakiFrameBufferPool *pool = chiaki_frame_buffer_pool_new();
+	munit_assert_not_null(pool);
+
+	ChiakiFrameBuffer *a = chiaki_frame_buffer_pool_get(pool, 100);
+	munit_assert_not_null(a);
+	munit_assert_size(chiaki_frame_buffer_capacity(a), >=, 100);
+	munit_assert_size(chiaki_frame_buffer_size(a), ==, 0);
+	munit_assert(!chiaki_frame_buffer_is_shared(a));
+
+	memset(chiaki_frame_buffer_data(a), 0x42, 100);
+	chiaki_frame_buffer_set_size(a, 10);
+	for(size_t i=0; i<CHIAKI_VIDEO_BUFFER_PADDING_SIZE; i++)
+		munit_assert_uint8(chiaki_frame_buffer_data(a)[10 + i], ==, 0);
+
+	munit_assert_ptr_equal(chiaki_frame_buffer_ref(a), a);
+	munit_assert(chiaki_frame_buffer_is_shared(a));
+	chiaki_frame_buffer_unref(a);
+	munit_assert(!chiaki_frame_buffer_is_shared(a));
+
+	// released buffers are reused, growing them if necessary
+	uint8_t *data = chiaki_frame_buffer_data(a);
+	chiaki_frame_buffer_unref(a);
+	ChiakiFrameBuffer *b = chiaki_frame_buffer_pool_get(pool, 50);
+	munit_assert_ptr_equal(b, a);
+	munit_assert_ptr_equal(chiaki_frame_buffer_data(b), data);
+	chiaki_frame_buffer_unref(b);
+	b = chiaki_frame_buffer_pool_get(pool, 1000);
+	munit_assert_ptr_equal(b, a);
+	munit_assert_size(chiaki_frame_buffer_capacity(b), >=, 1000);
+
+	// b outlives the pool
+	chiaki_frame_buffer_pool_free(pool);
+	memset(chiaki_frame_buffer_data(b), 0x42, 1000);
+	chiaki_frame_buffer_unref(b);
+	return MUNIT_OK;
+}
+
+static void put_frame(ChiakiFrameProcessor *frame_processor, ChiakiSeqNum16 frame_index, uint8_t *unit, size_t unit_size)
+{
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.frame_index = frame_index;
+	packet.units_in_frame_total = 1;
+	packet.units_in_frame_fec = 0;
+	packet.unit_index = 0;
+	packet.data = unit;
+	packet.data_size = unit_size;
+	munit_assert_int(chiaki_frame_processor_alloc_frame(frame_processor, &packet), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_frame_processor_put_unit(frame_processor, &packet), ==, CHIAKI_ERR_SUCCESS);
+}
+
+static MunitResult test_frame_processor_ref(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	// the first 2 bytes of a unit are padding info, which is stripped
+	uint8_t unit_a[] = { 0, 0, 'a', 'b', 'c' };
+	put_frame(&frame_processor, 0, unit_a, sizeof(unit_a));
+	ChiakiFrameBuffer *frame_a;
+	munit_assert_int(chiaki_frame_processor_flush_ref(&frame_processor, &frame_a), ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+	munit_assert_size(chiaki_frame_buffer_size(frame_a), ==, 3);
+	munit_assert_memory_equal(3, chiaki_frame_buffer_data(frame_a), "abc");
+
+	// late units of a flushed frame must not touch the buffer anymore
+	chiaki_frame_processor_put_unit(&frame_processor, &(ChiakiTakionAVPacket){ .unit_index = 1, .data = unit_a, .data_size = 1 });
+
+	// the next frame goes to another buffer while the previous one is referenced
+	uint8_t unit_b[] = { 0, 0, 'x', 'y', 'z', 'w' };
+	put_frame(&frame_processor, 1, unit_b, sizeof(unit_b));
+	ChiakiFrameBuffer *frame_b;
+	munit_assert_int(chiaki_frame_processor_flush_ref(&frame_processor, &frame_b), ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS);
+	munit_assert_ptr_not_equal(frame_a, frame_b);
+	munit_assert_memory_equal(3, chiaki_frame_buffer_data(frame_a), "abc");
+	munit_assert_size(chiaki_frame_buffer_size(frame_b), ==, 4);
+	munit_assert_memory_equal(4, chiaki_frame_buffer_data(frame_b), "xyzw");
+
+	// a frame may stay referenced after the frame processor is gone
+	chiaki_frame_buffer_unref(frame_b);
+	chiaki_frame_processor_fini(&frame_processor);
+	munit_assert_memory_equal(3, chiaki_frame_buffer_data(frame_a), "abc");
+	chiaki_frame_buffer_unref(frame_a);
+	return MUNIT_OK;
+}
+
+MunitTest tests_frame_buffer[] = {
+	{
+		"/pool",
+		test_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/frame_processor_ref",
+		test_frame_processor_ref,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -379,6 +379,60 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 	return MUNIT_OK;
 }
 
+static MunitResult test_gmac_batch(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+	static const uint8_t crypt_index = 3;
+	// unordered, across several key periods and with some in periods before the current one
+	static const uint64_t key_pos[] = { 0x6b1de0, 0x6b1de1, 0x10, 0x6b0000, 0x6c0000, 0x6b1de0 - 0x100, 0xafc8, 0xafc9, 0x6c0010 };
+	#define BATCH_COUNT (sizeof(key_pos) / sizeof(key_pos[0]))
+
+	uint8_t data[BATCH_COUNT][0x40];
+	for(size_t i=0; i<BATCH_COUNT; i++)
+		for(size_t j=0; j<sizeof(data[i]); j++)
+			data[i][j] = (uint8_t)(i * 0x40 + j);
+
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt;
+	chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+
+	uint8_t gmac_expected[BATCH_COUNT][CHIAKI_GKCRYPT_GMAC_SIZE];
+	for(size_t i=0; i<BATCH_COUNT; i++)
+	{
+		ChiakiErrorCode err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos[i], data[i], sizeof(data[i]), gmac_expected[i]);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return MUNIT_ERROR;
+	}
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+	uint8_t gmac[BATCH_COUNT][CHIAKI_GKCRYPT_GMAC_SIZE];
+	ChiakiGKCryptGMacJob jobs[BATCH_COUNT];
+	for(size_t i=0; i<BATCH_COUNT; i++)
+	{
+		jobs[i].key_pos = key_pos[i];
+		jobs[i].buf = data[i];
+		jobs[i].buf_size = sizeof(data[i]);
+		jobs[i].gmac_out = gmac[i];
+	}
+	ChiakiErrorCode err = chiaki_gkcrypt_gmac_batch(&gkcrypt, jobs, BATCH_COUNT);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+
+	for(size_t i=0; i<BATCH_COUNT; i++)
+		munit_assert_memory_equal(CHIAKI_GKCRYPT_GMAC_SIZE, gmac[i], gmac_expected[i]);
+	for(size_t i=1; i<BATCH_COUNT; i++)
+		munit_assert_uint64(jobs[i-1].key_pos, <=, jobs[i].key_pos);
+	munit_assert_uint64(gkcrypt.key_gmac_index_current, ==, (0x6c0010 - 1) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS);
+	#undef BATCH_COUNT
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
+
 
 MunitTest tests_gkcrypt[] = {
 	{
@@ -437,5 +491,13 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/gmac_batch",
+		test_gmac_batch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/hostcache.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "test_log.h"
+
+#define TEST_CACHE_PATH "chiaki_unit_host.cache"
+
+static ChiakiHostCacheEntry test_entry(const char *host_id, uint64_t time)
+{
+	ChiakiHostCacheEntry entry = { 0 };
+	strcpy(entry.host_id, host_id);
+	entry.target = CHIAKI_TARGET_PS5_1;
+	entry.mtu_in = 1454;
+	entry.mtu_out = 1454;
+	entry.rtt_us = 4242;
+	entry.network_time = time - 10;
+	entry.time = time;
+	return entry;
+}
+
+static void assert_entry_equal(const ChiakiHostCacheEntry *a, const ChiakiHostCacheEntry *b)
+{
+	munit_assert_string_equal(a->host_id, b->host_id);
+	munit_assert_int(a->target, ==, b->target);
+	munit_assert_uint32(a->mtu_in, ==, b->mtu_in);
+	munit_assert_uint32(a->mtu_out, ==, b->mtu_out);
+	munit_assert_uint64(a->rtt_us, ==, b->rtt_us);
+	munit_assert_uint64(a->network_time, ==, b->network_time);
+	munit_assert_uint64(a->time, ==, b->time);
+}
+
+static MunitResult test_put_get(const MunitParameter params[], void *user)
+{
+	remove(TEST_CACHE_PATH);
+	ChiakiHostCacheEntry entry;
+	munit_assert(!chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+
+	ChiakiHostCacheEntry a = test_entry("abc", 1000);
+	ChiakiHostCacheEntry b = test_entry("def", 2000);
+	b.target = CHIAKI_TARGET_PS4_10;
+	b.mtu_out = 1300;
+	munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &a, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &b, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+	assert_entry_equal(&entry, &a);
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "def", &entry, get_test_log()));
+	assert_entry_equal(&entry, &b);
+
+	// replace
+	a.rtt_us = 1337;
+	munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &a, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+	munit_assert_uint64(entry.rtt_us, ==, 1337);
+
+	munit_assert_int(chiaki_host_cache_invalidate(TEST_CACHE_PATH, "abc", get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(!chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "def", &entry, get_test_log()));
+
+	remove(TEST_CACHE_PATH);
+	return MUNIT_OK;
+}
+
+static MunitResult test_evict(const MunitParameter params[], void *user)
+{
+	remove(TEST_CACHE_PATH);
+	char host_id[CHIAKI_HOST_CACHE_HOST_ID_SIZE];
+	for(unsigned int i = 0; i < CHIAKI_HOST_CACHE_ENTRIES_MAX; i++)
+	{
+		snprintf(host_id, sizeof(host_id), "host%u", i);
+		// host0 is the least recently written one
+		ChiakiHostCacheEntry entry = test_entry(host_id, i == 0 ? 100 : 1000 + i);
+		munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &entry, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	ChiakiHostCacheEntry entry = test_entry("new", 5000);
+	munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &entry, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "new", &entry, get_test_log()));
+	munit_assert(!chiaki_host_cache_get(TEST_CACHE_PATH, "host0", &entry, get_test_log()));
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "host1", &entry, get_test_log()));
+
+	remove(TEST_CACHE_PATH);
+	return MUNIT_OK;
+}
+
+static MunitResult test_version_mismatch(const MunitParameter params[], void *user)
+{
+	FILE *f = fopen(TEST_CACHE_PATH, "w");
+	munit_assert_not_null(f);
+	fprintf(f, "chiaki-host-cache %u\nabc 1000100 1454 1454 4242 990 1000\n", (unsigned int)CHIAKI_HOST_CACHE_VERSION + 1);
+	fclose(f);
+
+	ChiakiHostCacheEntry entry;
+	munit_assert(!chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+
+	// writing replaces the outdated file
+	entry = test_entry("def", 1000);
+	munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &entry, get_test_log()), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "def", &entry, get_test_log()));
+	munit_assert(!chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+
+	remove(TEST_CACHE_PATH);
+	return MUNIT_OK;
+}
+
+static MunitResult test_corrupt(const MunitParameter params[], void *user)
+{
+	FILE *f = fopen(TEST_CACHE_PATH, "w");
+	munit_assert_not_null(f);
+	fprintf(f, "chiaki-host-cache %u\nabc 1000100 garbage\ndef 1000100 1454 1454 4242 990 1000\n", (unsigned int)CHIAKI_HOST_CACHE_VERSION);
+	fclose(f);
+
+	ChiakiHostCacheEntry entry;
+	munit_assert(!chiaki_host_cache_get(TEST_CACHE_PATH, "abc", &entry, get_test_log()));
+	munit_assert(chiaki_host_cache_get(TEST_CACHE_PATH, "def", &entry, get_test_log()));
+	munit_assert_int(entry.target, ==, CHIAKI_TARGET_PS5_1);
+	munit_assert_uint64(entry.network_time, ==, 990);
+
+	// ids with whitespace would break the format
+	entry = test_entry("a b", 1000);
+	munit_assert_int(chiaki_host_cache_put(TEST_CACHE_PATH, &entry, get_test_log()), ==, CHIAKI_ERR_INVALID_DATA);
+
+	remove(TEST_CACHE_PATH);
+	return MUNIT_OK;
+}
+
+MunitTest tests_host_cache[] = {
+	{
+		"/put_get",
+		test_put_get,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/evict",
+		test_evict,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/version_mismatch",
+		test_version_mismatch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/corrupt",
+		test_corrupt,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -11,6 +11,13 @@ extern MunitTest tests_gkcrypt[];
 extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
 extern MunitTest tests_regist[];
+extern MunitTest tests_host_cache[];
+extern MunitTest tests_orientation[];
+extern MunitTest tests_video_decode_queue[];
+extern MunitTest tests_frame_buffer[];
+extern MunitTest tests_video_recovery[];
+extern MunitTest tests_delay_estimator[];
+extern MunitTest tests_stream_connection[];
 
 static MunitSuite suites[] = {
 	{
@@ -76,6 +83,55 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/host_cache",
+		tests_host_cache,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/orientation",
+		tests_orientation,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_decode_queue",
+		tests_video_decode_queue,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/frame_buffer",
+		tests_frame_buffer,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_recovery",
+		tests_video_recovery,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/delay_estimator",
+		tests_delay_estimator,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/stream_connection",
+		tests_stream_connection,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
 };
 
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/orientation.h>
+
+#include <math.h>
+
+#define SAMPLE_INTERVAL_US 1000
+
+static void feed(ChiakiOrientationTracker *tracker, uint32_t *timestamp, size_t count,
+		float gx, float gy, float gz, float ax, float ay, float az)
+{
+	for(size_t i = 0; i < count; i++)
+	{
+		chiaki_orientation_tracker_update(tracker, gx, gy, gz, ax, ay, az, *timestamp);
+		*timestamp += SAMPLE_INTERVAL_US;
+	}
+}
+
+static float orient_angle(const ChiakiOrientation *a, const ChiakiOrientation *b)
+{
+	float dot = fabsf(a->x * b->x + a->y * b->y + a->z * b->z + a->w * b->w);
+	if(dot > 1.0f)
+		dot = 1.0f;
+	return 2.0f * acosf(dot);
+}
+
+static MunitResult test_bias_calibration(const MunitParameter params[], void *user)
+{
+	ChiakiOrientationTracker tracker;
+	chiaki_orientation_tracker_init(&tracker);
+	munit_assert(!tracker.bias_calibration);
+	tracker.bias_calibration = true;
+	uint32_t timestamp = 0xffff0000; // also covers the wrap-around
+	feed(&tracker, &timestamp, 2000, 0.02f, -0.01f, 0.03f, 0.0f, 1.0f, 0.0f);
+	munit_assert_double_equal(tracker.gyro_bias_x, 0.02, 4);
+	munit_assert_double_equal(tracker.gyro_bias_y, -0.01, 4);
+	munit_assert_double_equal(tracker.gyro_bias_z, 0.03, 4);
+	munit_assert_double_equal(tracker.gyro_x, 0.0, 4);
+
+	// motion must not touch the bias
+	feed(&tracker, &timestamp, 100, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+	munit_assert_double_equal(tracker.gyro_bias_x, 0.02, 4);
+	munit_assert_double_equal(tracker.gyro_x, 0.98, 4);
+	munit_assert_uint64(tracker.rest_samples, ==, 0);
+
+	// later periods are only blended in
+	feed(&tracker, &timestamp, 1100, 0.04f, -0.01f, 0.03f, 0.0f, 1.0f, 0.0f);
+	munit_assert_float(tracker.gyro_bias_x, >, 0.0201f);
+	munit_assert_float(tracker.gyro_bias_x, <, 0.0399f);
+	return MUNIT_OK;
+}
+
+static MunitResult test_bias_calibration_motion(const MunitParameter params[], void *user)
+{
+	ChiakiOrientationTracker tracker;
+	chiaki_orientation_tracker_init(&tracker);
+	tracker.bias_calibration = true;
+	uint32_t timestamp = 0;
+
+	// slow tilt, each sample is close to the previous one, but not to the start
+	for(size_t i = 0; i < 2000; i++)
+	{
+		float angle = (float)i * 0.0002f;
+		chiaki_orientation_tracker_update(&tracker, 0.02f, 0.0f, 0.0f, 0.0f, cosf(angle), sinf(angle), timestamp);
+		timestamp += SAMPLE_INTERVAL_US;
+	}
+	munit_assert(!tracker.gyro_bias_valid);
+
+	// gyro jittering within the magnitude limit
+	for(size_t i = 0; i < 2000; i++)
+	{
+		float g = (i & 1) ? 0.05f : -0.05f;
+		chiaki_orientation_tracker_update(&tracker, g, -g, 0.0f, 0.0f, 1.0f, 0.0f, timestamp);
+		timestamp += SAMPLE_INTERVAL_US;
+	}
+	munit_assert(!tracker.gyro_bias_valid);
+	munit_assert_double_equal(tracker.gyro_bias_x, 0.0, 4);
+	return MUNIT_OK;
+}
+
+static MunitResult test_bias_drift(const MunitParameter params[], void *user)
+{
+	ChiakiOrientationFilter filters[] = { CHIAKI_ORIENTATION_FILTER_MADGWICK, CHIAKI_ORIENTATION_FILTER_MAHONY };
+	for(size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++)
+	{
+		ChiakiOrientationTracker calibrated, uncalibrated;
+		chiaki_orientation_tracker_init(&calibrated);
+		chiaki_orientation_tracker_init(&uncalibrated);
+		chiaki_orientation_tracker_set_filter(&calibrated, filters[i]);
+		chiaki_orientation_tracker_set_filter(&uncalibrated, filters[i]);
+		calibrated.bias_calibration = true;
+
+		// lying still with a yaw bias, which the accelerometer can not correct
+		uint32_t ts_calibrated = 0, ts_uncalibrated = 0;
+		feed(&calibrated, &ts_calibrated, 10000, 0.0f, 0.05f, 0.0f, 0.0f, 1.0f, 0.0f);
+		feed(&uncalibrated, &ts_uncalibrated, 10000, 0.0f, 0.05f, 0.0f, 0.0f, 1.0f, 0.0f);
+
+		ChiakiOrientation start;
+		chiaki_orientation_init(&start);
+		float drift_calibrated = orient_angle(&start, &calibrated.orient);
+		float drift_uncalibrated = orient_angle(&start, &uncalibrated.orient);
+		munit_assert_float(drift_uncalibrated, >, 0.4f);
+		munit_assert_float(drift_calibrated, <, 0.1f);
+	}
+	return MUNIT_OK;
+}
+
+static MunitResult test_gravity_convergence(const MunitParameter params[], void *user)
+{
+	ChiakiOrientationFilter filters[] = { CHIAKI_ORIENTATION_FILTER_MADGWICK, CHIAKI_ORIENTATION_FILTER_MAHONY };
+	for(size_t i = 0; i < sizeof(filters) / sizeof(filters[0]); i++)
+	{
+		ChiakiOrientationTracker tracker;
+		chiaki_orientation_tracker_init(&tracker);
+		chiaki_orientation_tracker_set_filter(&tracker, filters[i]);
+		uint32_t timestamp = 0;
+		feed(&tracker, &timestamp, 20000, 0.0f, 0.0f, 0.0f, 0.0f, 0.6f, 0.8f);
+
+		// gravity in the device frame as estimated by the filter must match the accelerometer
+		float q0 = tracker.orient.w, q1 = tracker.orient.x, q2 = tracker.orient.y, q3 = tracker.orient.z;
+		float vx = 2.0f * (q1 * q3 - q0 * q2);
+		float vy = 2.0f * (q0 * q1 + q2 * q3);
+		float vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+		munit_assert_double_equal(vx, 0.0, 2);
+		munit_assert_double_equal(vy, 0.6, 2);
+		munit_assert_double_equal(vz, 0.8, 2);
+	}
+	return MUNIT_OK;
+}
+
+static MunitResult test_time_step_gap(const MunitParameter params[], void *user)
+{
+	ChiakiOrientationTracker tracker;
+	chiaki_orientation_tracker_init(&tracker);
+	uint32_t timestamp = 0;
+	feed(&tracker, &timestamp, 100, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f);
+	ChiakiOrientation before = tracker.orient;
+
+	// a sample after a long gap must not be integrated over the whole gap
+	timestamp += 5000000;
+	chiaki_orientation_tracker_update(&tracker, 0.0f, 3.0f, 0.0f, 0.0f, 1.0f, 0.0f, timestamp);
+	munit_assert_float(orient_angle(&before, &tracker.orient), <, 0.001f);
+	return MUNIT_OK;
+}
+
+MunitTest tests_orientation[] = {
+	{
+		"/bias_calibration",
+		test_bias_calibration,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/bias_calibration_motion",
+		test_bias_calibration_motion,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/bias_drift",
+		test_bias_drift,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gravity_convergence",
+		test_gravity_convergence,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/time_step_gap",
+		test_time_step_gap,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
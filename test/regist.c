@@ -57,6 +57,7 @@ static MunitResult test_request_payload_ps4_pre10(const MunitParameter params[],
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	munit_assert_size(payload_size, ==, sizeof(expected));
 	munit_assert_memory_equal(sizeof(expected), payload, expected);
+	chiaki_rpcrypt_fini(&rpcrypt);
 	return MUNIT_OK;
 }
 
@@ -172,6 +172,142 @@ static MunitResult test_reorder_queue_16(const MunitParameter params[], void *te
 }
 
 
+typedef struct drop_log_t
+{
+	uint64_t seq_num[64];
+	size_t count;
+} DropLog;
+
+static void drop_log_generic(uint64_t seq_num, void *elem_user, void *cb_user)
+{
+	DropLog *log = cb_user;
+	munit_assert_size(log->count, <, 64);
+	munit_assert_uint64((uint64_t)(size_t)elem_user, ==, seq_num);
+	log->seq_num[log->count++] = seq_num;
+}
+
+static void drop_log_16(ChiakiSeqNum16 seq_num, void *elem_user, void *cb_user)
+{
+	drop_log_generic(seq_num, elem_user, cb_user);
+}
+
+static MunitResult test_reorder_queue_specialized(const MunitParameter params[], void *test_user)
+{
+	// both queues must behave exactly the same, including around the wrap of the sequence numbers
+	ChiakiReorderQueue generic;
+	ChiakiReorderQueue16 specialized;
+	munit_assert_int(chiaki_reorder_queue_init_16(&generic, 3, 0xffe0), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_reorder_queue16_init(&specialized, 3, 0xffe0), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(chiaki_reorder_queue16_size(&specialized), ==, 8);
+	DropLog drop_generic = { 0 };
+	DropLog drop_specialized = { 0 };
+	chiaki_reorder_queue_set_drop_cb(&generic, drop_log_generic, &drop_generic);
+	chiaki_reorder_queue16_set_drop_cb(&specialized, drop_log_16, &drop_specialized);
+
+	ChiakiSeqNum16 next = 0xffe0;
+	for(int i=0; i<2000; i++)
+	{
+		if(i == 1000)
+		{
+			chiaki_reorder_queue_set_drop_strategy(&generic, CHIAKI_REORDER_QUEUE_DROP_STRATEGY_BEGIN);
+			chiaki_reorder_queue16_set_drop_strategy(&specialized, CHIAKI_REORDER_QUEUE_DROP_STRATEGY_BEGIN);
+		}
+
+		uint32_t op = munit_rand_int_range(0, 9);
+		if(op < 5)
+		{
+			ChiakiSeqNum16 seq_num = (ChiakiSeqNum16)(next + munit_rand_int_range(-4, 10));
+			chiaki_reorder_queue_push(&generic, seq_num, (void *)(size_t)seq_num);
+			chiaki_reorder_queue16_push(&specialized, seq_num, (void *)(size_t)seq_num);
+			if(op == 0)
+				next = (ChiakiSeqNum16)(next + 3);
+		}
+		else if(op < 8)
+		{
+			uint64_t seq_num_generic = 0;
+			ChiakiSeqNum16 seq_num_specialized = 0;
+			void *elem_generic = NULL;
+			void *elem_specialized = NULL;
+			bool pulled = chiaki_reorder_queue_pull(&generic, &seq_num_generic, &elem_generic);
+			munit_assert(pulled == chiaki_reorder_queue16_pull(&specialized, &seq_num_specialized, &elem_specialized));
+			if(pulled)
+			{
+				munit_assert_uint64(seq_num_generic, ==, seq_num_specialized);
+				munit_assert_ptr_equal(elem_generic, elem_specialized);
+				next = (ChiakiSeqNum16)(seq_num_specialized + 1);
+			}
+		}
+		else
+		{
+			uint64_t index = munit_rand_int_range(0, 7);
+			chiaki_reorder_queue_drop(&generic, index);
+			chiaki_reorder_queue16_drop(&specialized, index);
+		}
+
+		munit_assert_uint64(chiaki_reorder_queue_count(&generic), ==, chiaki_reorder_queue16_count(&specialized));
+		for(size_t j=0; j<chiaki_reorder_queue16_count(&specialized); j++)
+		{
+			void *elem_generic = NULL;
+			void *elem_specialized = NULL;
+			bool peeked = chiaki_reorder_queue_peek(&generic, j, NULL, &elem_generic);
+			munit_assert(peeked == chiaki_reorder_queue16_peek(&specialized, j, NULL, &elem_specialized));
+			munit_assert_ptr_equal(elem_generic, elem_specialized);
+		}
+		munit_assert_size(drop_generic.count, ==, drop_specialized.count);
+		munit_assert_memory_equal(drop_generic.count * sizeof(uint64_t), drop_generic.seq_num, drop_specialized.seq_num);
+		drop_generic.count = drop_specialized.count = 0;
+	}
+
+	chiaki_reorder_queue_fini(&generic);
+	chiaki_reorder_queue16_fini(&specialized);
+	munit_assert_size(drop_generic.count, ==, drop_specialized.count);
+	return MUNIT_OK;
+}
+
+static MunitResult test_reorder_queue_pull_bulk(const MunitParameter params[], void *test_user)
+{
+	ChiakiReorderQueue32 queue;
+	munit_assert_int(chiaki_reorder_queue32_init(&queue, 7, 0xfffffff0), ==, CHIAKI_ERR_SUCCESS);
+
+	void *elems[128];
+	ChiakiSeqNum32 seq_num_first = 0;
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 128, &seq_num_first), ==, 0);
+
+	// a run across the end of the ring and the sequence number wrap, with a gap after it
+	for(ChiakiSeqNum32 i=0; i<100; i++)
+	{
+		if(i != 80)
+			chiaki_reorder_queue32_push(&queue, 0xfffffff0 + i, (void *)(size_t)(i + 1));
+	}
+	munit_assert_size(chiaki_reorder_queue32_count(&queue), ==, 100);
+
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 10, &seq_num_first), ==, 10);
+	munit_assert_uint32(seq_num_first, ==, 0xfffffff0);
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 128, &seq_num_first), ==, 70);
+	munit_assert_uint32(seq_num_first, ==, 0xfffffffa);
+	for(size_t i=0; i<70; i++)
+		munit_assert_size((size_t)elems[i], ==, i + 11);
+	munit_assert_size(chiaki_reorder_queue32_count(&queue), ==, 20);
+
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 128, &seq_num_first), ==, 0);
+	chiaki_reorder_queue32_push(&queue, 0xfffffff0 + 80, (void *)81);
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 128, NULL), ==, 20);
+	munit_assert_size((size_t)elems[19], ==, 100);
+	munit_assert_size(chiaki_reorder_queue32_count(&queue), ==, 0);
+
+	// dropped elements leave a gap
+	chiaki_reorder_queue32_push(&queue, 84, (void *)1);
+	chiaki_reorder_queue32_push(&queue, 85, (void *)2);
+	chiaki_reorder_queue32_push(&queue, 86, (void *)3);
+	chiaki_reorder_queue32_drop(&queue, 1);
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 128, &seq_num_first), ==, 1);
+	munit_assert_uint32(seq_num_first, ==, 84);
+	munit_assert_size(chiaki_reorder_queue32_pull_bulk(&queue, elems, 128, &seq_num_first), ==, 0);
+
+	chiaki_reorder_queue32_fini(&queue);
+	return MUNIT_OK;
+}
+
 MunitTest tests_reorder_queue[] = {
 	{
 		"/reorder_queue_16",
@@ -181,5 +317,21 @@ MunitTest tests_reorder_queue[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/specialized",
+		test_reorder_queue_specialized,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/pull_bulk",
+		test_reorder_queue_pull_bulk,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+// Compares the generic ChiakiReorderQueue with the specialized ChiakiReorderQueue32
+// on a stream with local reordering, like Takion's data queue sees it.
+
+#include <chiaki/reorderqueue.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define QUEUE_SIZE_EXP 4
+#define ELEMS_COUNT (1 << 22)
+#define ROUNDS 5
+
+static ChiakiSeqNum32 *seq_nums_create(size_t count, ChiakiSeqNum32 start)
+{
+	ChiakiSeqNum32 *seq_nums = malloc(count * sizeof(ChiakiSeqNum32));
+	if(!seq_nums)
+		return NULL;
+	for(size_t i=0; i<count; i++)
+		seq_nums[i] = start + (ChiakiSeqNum32)i;
+	// swap neighbours within a small window, so elements arrive out of order but never overflow the queue
+	srand(1337);
+	for(size_t i=0; i+4<count; i+=4)
+	{
+		size_t j = i + (size_t)(rand() % 4);
+		ChiakiSeqNum32 tmp = seq_nums[i];
+		seq_nums[i] = seq_nums[j];
+		seq_nums[j] = tmp;
+	}
+	return seq_nums;
+}
+
+static uint64_t bench_generic(const ChiakiSeqNum32 *seq_nums, size_t count, uint64_t *sum)
+{
+	ChiakiReorderQueue queue;
+	if(chiaki_reorder_queue_init_32(&queue, QUEUE_SIZE_EXP, seq_nums[0] & ~3u) != CHIAKI_ERR_SUCCESS)
+		return 0;
+	uint64_t start = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<count; i++)
+	{
+		chiaki_reorder_queue_push(&queue, seq_nums[i], (void *)(size_t)seq_nums[i]);
+		uint64_t seq_num;
+		void *elem;
+		while(chiaki_reorder_queue_pull(&queue, &seq_num, &elem))
+			*sum += (size_t)elem;
+	}
+	uint64_t dur = chiaki_time_now_monotonic_us() - start;
+	chiaki_reorder_queue_fini(&queue);
+	return dur;
+}
+
+static uint64_t bench_specialized(const ChiakiSeqNum32 *seq_nums, size_t count, uint64_t *sum)
+{
+	ChiakiReorderQueue32 queue;
+	if(chiaki_reorder_queue32_init(&queue, QUEUE_SIZE_EXP, seq_nums[0] & ~3u) != CHIAKI_ERR_SUCCESS)
+		return 0;
+	uint64_t start = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<count; i++)
+	{
+		chiaki_reorder_queue32_push(&queue, seq_nums[i], (void *)(size_t)seq_nums[i]);
+		void *elem;
+		while(chiaki_reorder_queue32_pull(&queue, NULL, &elem))
+			*sum += (size_t)elem;
+	}
+	uint64_t dur = chiaki_time_now_monotonic_us() - start;
+	chiaki_reorder_queue32_fini(&queue);
+	return dur;
+}
+
+static uint64_t bench_specialized_bulk(const ChiakiSeqNum32 *seq_nums, size_t count, uint64_t *sum)
+{
+	ChiakiReorderQueue32 queue;
+	if(chiaki_reorder_queue32_init(&queue, QUEUE_SIZE_EXP, seq_nums[0] & ~3u) != CHIAKI_ERR_SUCCESS)
+		return 0;
+	void *elems[1 << QUEUE_SIZE_EXP];
+	uint64_t start = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<count; i++)
+	{
+		chiaki_reorder_queue32_push(&queue, seq_nums[i], (void *)(size_t)seq_nums[i]);
+		size_t pulled = chiaki_reorder_queue32_pull_bulk(&queue, elems, sizeof(elems) / sizeof(elems[0]), NULL);
+		for(size_t j=0; j<pulled; j++)
+			*sum += (size_t)elems[j];
+	}
+	uint64_t dur = chiaki_time_now_monotonic_us() - start;
+	chiaki_reorder_queue32_fini(&queue);
+	return dur;
+}
+
+typedef uint64_t (*BenchFunc)(const ChiakiSeqNum32 *seq_nums, size_t count, uint64_t *sum);
+
+static void bench_run(const char *name, BenchFunc func, const ChiakiSeqNum32 *seq_nums, size_t count)
+{
+	uint64_t best = UINT64_MAX;
+	uint64_t sum = 0;
+	for(int i=0; i<ROUNDS; i++)
+	{
+		uint64_t dur = func(seq_nums, count, &sum);
+		if(dur < best)
+			best = dur;
+	}
+	printf("%-20s %8.2f ns/elem (checksum %llx)\n", name, (double)best * 1000.0 / (double)count, (unsigned long long)(sum / ROUNDS));
+}
+
+int main(int argc, char *argv[])
+{
+	// start right before the wrap of the sequence numbers
+	ChiakiSeqNum32 *seq_nums = seq_nums_create(ELEMS_COUNT, 0xffffff00);
+	if(!seq_nums)
+		return 1;
+	bench_run("generic", bench_generic, seq_nums, ELEMS_COUNT);
+	bench_run("specialized", bench_specialized, seq_nums, ELEMS_COUNT);
+	bench_run("specialized bulk", bench_specialized_bulk, seq_nums, ELEMS_COUNT);
+	free(seq_nums);
+	return 0;
+}
@@ -72,6 +72,7 @@ static MunitResult test_iv_ps4_pre10(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 	munit_assert_memory_equal(CHIAKI_RPCRYPT_KEY_SIZE, iv, iv_b_expected);
 
+	chiaki_rpcrypt_fini(&rpcrypt);
 	return MUNIT_OK;
 }
 
@@ -92,6 +93,7 @@ static MunitResult test_iv_regist_ps4(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 	munit_assert_memory_equal(CHIAKI_RPCRYPT_KEY_SIZE, iv, iv_expected);
 
+	chiaki_rpcrypt_fini(&rpcrypt);
 	return MUNIT_OK;
 }
 
@@ -112,6 +114,7 @@ static MunitResult test_iv_regist_ps5(const MunitParameter params[], void *user)
 		return MUNIT_ERROR;
 	munit_assert_memory_equal(CHIAKI_RPCRYPT_KEY_SIZE, iv, iv_expected);
 
+	chiaki_rpcrypt_fini(&rpcrypt);
 	return MUNIT_OK;
 }
 
@@ -186,6 +189,7 @@ static MunitResult test_encrypt_ps4_pre10(const MunitParameter params[], void *u
 		return MUNIT_ERROR;
 	munit_assert_memory_equal(sizeof(buf_d), buf_d, cipher_expected_d);
 
+	chiaki_rpcrypt_fini(&rpcrypt);
 	return MUNIT_OK;
 }
 
@@ -230,10 +234,59 @@ static MunitResult test_decrypt_ps4_pre10(const MunitParameter params[], void *u
 		return MUNIT_ERROR;
 	munit_assert_memory_equal(sizeof(buf_d), buf_d, expected_d);
 
+	chiaki_rpcrypt_fini(&rpcrypt);
 	return MUNIT_OK;
 }
 
 
+static MunitResult test_iv_cache(const MunitParameter params[], void *user)
+{
+	static const uint8_t nonce[] = { 0x43, 0x9, 0x67, 0xae, 0x36, 0x4b, 0x1c, 0x45, 0x26, 0x62, 0x37, 0x7a, 0xbf, 0x3f, 0xe9, 0x39 };
+	static const uint8_t morning[] = { 0xd2, 0x78, 0x9f, 0x51, 0x85, 0xa7, 0x99, 0xa2, 0x44, 0x52, 0x77, 0x9c, 0x2b, 0x83, 0xcf, 0x7 };
+
+	ChiakiRPCrypt cached;
+	chiaki_rpcrypt_init_auth(&cached, CHIAKI_TARGET_PS5_1, nonce, morning);
+	munit_assert_int(chiaki_rpcrypt_pregenerate_ivs(&cached, 30, 8), ==, CHIAKI_ERR_SUCCESS);
+
+	// cached and colliding ivs must be the same as freshly generated ones
+	static const uint64_t counters[] = { 30, 31, 37, 38, 30 + CHIAKI_RPCRYPT_IV_CACHE_SIZE, 30, 0x0102030405060708 };
+	for(size_t i=0; i<sizeof(counters) / sizeof(counters[0]); i++)
+	{
+		ChiakiRPCrypt fresh;
+		chiaki_rpcrypt_init_auth(&fresh, CHIAKI_TARGET_PS5_1, nonce, morning);
+		uint8_t iv_fresh[CHIAKI_RPCRYPT_KEY_SIZE];
+		uint8_t iv_cached[CHIAKI_RPCRYPT_KEY_SIZE];
+		munit_assert_int(chiaki_rpcrypt_generate_iv(&fresh, iv_fresh, counters[i]), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_int(chiaki_rpcrypt_generate_iv(&cached, iv_cached, counters[i]), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(CHIAKI_RPCRYPT_KEY_SIZE, iv_cached, iv_fresh);
+		chiaki_rpcrypt_fini(&fresh);
+	}
+
+	// the reused cipher contexts must not carry any state from one message to the next
+	uint8_t plain[37];
+	for(size_t i=0; i<sizeof(plain); i++)
+		plain[i] = (uint8_t)(i * 7);
+	uint8_t buf[sizeof(plain)];
+	for(uint64_t counter=0; counter<4; counter++)
+	{
+		munit_assert_int(chiaki_rpcrypt_encrypt(&cached, counter, plain, buf, sizeof(buf) - counter), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_int(chiaki_rpcrypt_decrypt(&cached, counter, buf, buf, sizeof(buf) - counter), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(buf) - counter, buf, plain);
+	}
+
+	// a clone has the same keys, but its own contexts
+	ChiakiRPCrypt clone;
+	chiaki_rpcrypt_init_clone(&clone, &cached);
+	munit_assert_int(chiaki_rpcrypt_encrypt(&cached, 5, plain, buf, sizeof(buf)), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_rpcrypt_decrypt(&clone, 5, buf, buf, sizeof(buf)), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_memory_equal(sizeof(buf), buf, plain);
+	munit_assert_ptr_not_equal(clone.ctx, cached.ctx);
+	chiaki_rpcrypt_fini(&clone);
+
+	chiaki_rpcrypt_fini(&cached);
+	return MUNIT_OK;
+}
+
 MunitTest tests_rpcrypt[] = {
 	{
 		"/bright_ambassador_ps4_pre10",
@@ -307,5 +360,13 @@ MunitTest tests_rpcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/iv_cache",
+		test_iv_cache,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/streamconnection.h>
+
+#define LOST_MS 100000
+
+static MunitResult test_resume_timeout(const MunitParameter params[], void *user)
+{
+	// plenty of time left, the timeout itself applies
+	munit_assert_uint64(chiaki_stream_connection_resume_timeout_ms(LOST_MS, LOST_MS, 5000), ==, 5000);
+	munit_assert_uint64(chiaki_stream_connection_resume_timeout_ms(LOST_MS, LOST_MS + 1000, 5000), ==, 5000);
+
+	// a connect or handshake step must not run past the end of the window
+	munit_assert_uint64(chiaki_stream_connection_resume_timeout_ms(LOST_MS,
+				LOST_MS + CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS - 1200, 5000), ==, 1200);
+	munit_assert_uint64(chiaki_stream_connection_resume_timeout_ms(LOST_MS,
+				LOST_MS + CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS - 1, UINT64_MAX), ==, 1);
+
+	// over
+	munit_assert_uint64(chiaki_stream_connection_resume_timeout_ms(LOST_MS,
+				LOST_MS + CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS, 5000), ==, 0);
+	munit_assert_uint64(chiaki_stream_connection_resume_timeout_ms(LOST_MS,
+				LOST_MS + CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS + 5000, UINT64_MAX), ==, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_resume_retry_interval(const MunitParameter params[], void *user)
+{
+	munit_assert_uint64(chiaki_stream_connection_resume_retry_interval_ms(1), ==, CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MS);
+	munit_assert_uint64(chiaki_stream_connection_resume_retry_interval_ms(2), ==, 2 * CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MS);
+	munit_assert_uint64(chiaki_stream_connection_resume_retry_interval_ms(3), ==, 4 * CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MS);
+
+	uint64_t prev = 0;
+	for(unsigned int attempt = 1; attempt < 100; attempt++)
+	{
+		uint64_t interval = chiaki_stream_connection_resume_retry_interval_ms(attempt);
+		munit_assert_uint64(interval, >=, prev);
+		munit_assert_uint64(interval, <=, CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MAX_MS);
+		prev = interval;
+	}
+	munit_assert_uint64(prev, ==, CHIAKI_STREAM_CONNECTION_RESUME_RETRY_INTERVAL_MAX_MS);
+
+	// the attempts fit into the window, the last wait is cut off by it
+	uint64_t now = LOST_MS;
+	unsigned int attempt = 0;
+	while(true)
+	{
+		attempt++;
+		uint64_t wait = chiaki_stream_connection_resume_timeout_ms(LOST_MS, now,
+				chiaki_stream_connection_resume_retry_interval_ms(attempt));
+		if(!wait)
+			break;
+		now += wait;
+	}
+	munit_assert_uint64(now, ==, LOST_MS + CHIAKI_STREAM_CONNECTION_RESUME_WINDOW_MS);
+	munit_assert_uint(attempt, >, 3);
+	return MUNIT_OK;
+}
+
+MunitTest tests_stream_connection[] = {
+	{
+		"/resume_timeout",
+		test_resume_timeout,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/resume_retry_interval",
+		test_resume_retry_interval,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
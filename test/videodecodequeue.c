@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videodecodequeue.h>
+
+#include "test_log.h"
+
+
+static const uint8_t h264_idr[] = { 0, 0, 0, 1, 0x67, 0x42, 0, 0, 0, 1, 0x68, 0xce, 0, 0, 0, 1, 0x65, 0x88, 0x84 };
+static const uint8_t h264_p[] = { 0, 0, 0, 1, 0x09, 0xf0, 0, 0, 0, 1, 0x41, 0x9a, 0x02 };
+static const uint8_t h265_idr[] = { 0, 0, 0, 1, 0x40, 0x01, 0x0c, 0, 0, 0, 1, 0x26, 0x01, 0xaf };
+static const uint8_t h265_p[] = { 0, 0, 0, 1, 0x02, 0x01, 0xd0 };
+
+static MunitResult test_keyframe(const MunitParameter params[], void *user)
+{
+	munit_assert(chiaki_video_frame_is_keyframe(CHIAKI_CODEC_H264, h264_idr, sizeof(h264_idr)));
+	munit_assert(!chiaki_video_frame_is_keyframe(CHIAKI_CODEC_H264, h264_p, sizeof(h264_p)));
+	munit_assert(chiaki_video_frame_is_keyframe(CHIAKI_CODEC_H265, h265_idr, sizeof(h265_idr)));
+	munit_assert(!chiaki_video_frame_is_keyframe(CHIAKI_CODEC_H265, h265_p, sizeof(h265_p)));
+	munit_assert(!chiaki_video_frame_is_keyframe(CHIAKI_CODEC_H264, h264_idr, 4));
+	return MUNIT_OK;
+}
+
+#define DECODED_MAX 16
+
+typedef struct decode_log_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool blocked; // the callback waits while this is true
+	bool entered;
+	size_t count;
+	uint8_t first_byte[DECODED_MAX];
+	int32_t frames_lost[DECODED_MAX];
+} DecodeLog;
+
+static bool decode_cb(ChiakiFrameBuffer *frame, int32_t frames_lost, void *user)
+{
+	DecodeLog *log = user;
+	uint8_t *buf = chiaki_frame_buffer_data(frame);
+	size_t buf_size = chiaki_frame_buffer_size(frame);
+	chiaki_mutex_lock(&log->mutex);
+	log->entered = true;
+	chiaki_cond_broadcast(&log->cond);
+	while(log->blocked)
+		chiaki_cond_wait(&log->cond, &log->mutex);
+	if(log->count < DECODED_MAX)
+	{
+		// the byte after the first start code identifies the test frame
+		log->first_byte[log->count] = buf_size > 5 ? buf[5] : 0;
+		log->frames_lost[log->count] = frames_lost;
+	}
+	log->count++;
+	chiaki_cond_broadcast(&log->cond);
+	chiaki_mutex_unlock(&log->mutex);
+	return true;
+}
+
+static bool decoded_pred(void *user)
+{
+	DecodeLog *log = user;
+	return log->count >= 3;
+}
+
+static MunitResult test_overflow(const MunitParameter params[], void *user)
+{
+	DecodeLog log = { 0 };
+	chiaki_mutex_init(&log.mutex, false);
+	chiaki_cond_init(&log.cond);
+	log.blocked = true;
+
+	ChiakiVideoDecodeQueue queue;
+	ChiakiErrorCode err = chiaki_video_decode_queue_init(&queue, get_test_log(), CHIAKI_CODEC_H264, decode_cb, &log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiFrameBuffer *idr = chiaki_frame_buffer_new_copy(h264_idr, sizeof(h264_idr));
+	munit_assert_not_null(idr);
+	ChiakiFrameBuffer *p = chiaki_frame_buffer_new_copy(h264_p, sizeof(h264_p));
+	munit_assert_not_null(p);
+
+	// the first keyframe blocks the decoder
+	chiaki_frame_buffer_data(idr)[5] = 1;
+	munit_assert(chiaki_video_decode_queue_push(&queue, idr, 0, 0, false));
+	chiaki_frame_buffer_unref(idr);
+	chiaki_mutex_lock(&log.mutex);
+	while(!log.entered)
+		chiaki_cond_wait(&log.cond, &log.mutex);
+	chiaki_mutex_unlock(&log.mutex);
+
+	// the frame being decoded still counts as queued
+	for(ChiakiSeqNum16 i=1; i<CHIAKI_VIDEO_DECODE_QUEUE_DEPTH_MAX; i++)
+		munit_assert(chiaki_video_decode_queue_push(&queue, p, 0, i, false));
+	munit_assert(chiaki_frame_buffer_is_shared(p));
+
+	// overflow, everything is dropped until the next keyframe
+	munit_assert(!chiaki_video_decode_queue_push(&queue, p, 0, 5, false));
+	munit_assert(!chiaki_video_decode_queue_push(&queue, p, 1, 6, false));
+
+	// a header is queued, but does not end the wait for the keyframe
+	ChiakiFrameBuffer *header = chiaki_frame_buffer_new_copy(h264_idr, 10);
+	munit_assert_not_null(header);
+	chiaki_frame_buffer_data(header)[5] = 2;
+	munit_assert(chiaki_video_decode_queue_push(&queue, header, 0, 0, true));
+	chiaki_frame_buffer_unref(header);
+	munit_assert(!chiaki_video_decode_queue_push(&queue, p, 0, 7, false));
+
+	idr = chiaki_frame_buffer_new_copy(h264_idr, sizeof(h264_idr));
+	munit_assert_not_null(idr);
+	chiaki_frame_buffer_data(idr)[5] = 3;
+	munit_assert(chiaki_video_decode_queue_push(&queue, idr, 0, 8, false));
+	chiaki_frame_buffer_unref(idr);
+
+	chiaki_mutex_lock(&log.mutex);
+	log.blocked = false;
+	chiaki_cond_broadcast(&log.cond);
+	chiaki_cond_wait_pred(&log.cond, &log.mutex, decoded_pred, &log);
+	chiaki_mutex_unlock(&log.mutex);
+
+	chiaki_video_decode_queue_fini(&queue);
+
+	// all references held by the queue were released
+	munit_assert(!chiaki_frame_buffer_is_shared(p));
+	chiaki_frame_buffer_unref(p);
+
+	// the queued non-keyframes were discarded
+	munit_assert_size(log.count, ==, 3);
+	munit_assert_uint8(log.first_byte[0], ==, 1);
+	munit_assert_uint8(log.first_byte[1], ==, 2);
+	munit_assert_uint8(log.first_byte[2], ==, 3);
+	// discarded from the queue, 2 dropped on push, 1 lost before
+	munit_assert_int32(log.frames_lost[1], ==, CHIAKI_VIDEO_DECODE_QUEUE_DEPTH_MAX - 1 + 2 + 1);
+	// dropped while waiting after the header
+	munit_assert_int32(log.frames_lost[2], ==, 1);
+
+	chiaki_cond_fini(&log.cond);
+	chiaki_mutex_fini(&log.mutex);
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_decode_queue[] = {
+	{
+		"/keyframe",
+		test_keyframe,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/overflow",
+		test_overflow,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
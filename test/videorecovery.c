@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/videorecovery.h>
+
+#include "test_log.h"
+
+#define RTT_US 30000
+
+static const uint8_t h264_idr[] = { 0, 0, 0, 1, 0x67, 0x42, 0, 0, 0, 1, 0x68, 0xce, 0, 0, 0, 1, 0x65, 0x88, 0x84 };
+static const uint8_t h264_p[] = { 0, 0, 0, 1, 0x09, 0xf0, 0, 0, 0, 1, 0x41, 0x9a, 0x02 };
+static const uint8_t h264_b[] = { 0, 0, 0, 1, 0x01, 0x9e, 0x02 };
+static const uint8_t h264_recovery_point[] = { 0, 0, 0, 1, 0x06, 0x06, 0x01, 0xc4, 0x80, 0, 0, 0, 1, 0x41, 0x9a, 0x02 };
+static const uint8_t h265_idr[] = { 0, 0, 0, 1, 0x40, 0x01, 0x0c, 0, 0, 0, 1, 0x26, 0x01, 0xaf };
+static const uint8_t h265_p[] = { 0, 0, 0, 1, 0x02, 0x01, 0xd0 };
+static const uint8_t h264_recovery_point_cnt[] = { 0, 0, 0, 1, 0x06, 0x06, 0x01, 0x64, 0x80, 0, 0, 0, 1, 0x41, 0x9a, 0x02 };
+static const uint8_t h265_p_non_ref[] = { 0, 0, 0, 1, 0x00, 0x01, 0xd0 };
+static const uint8_t h265_p_non_ref_tid1[] = { 0, 0, 0, 1, 0x00, 0x02, 0xd0 };
+static const uint8_t h265_header[] = { 0, 0, 0, 1, 0x40, 0x01, 0x0c, 0x01, 0, 0, 0, 1, 0x42, 0x01, 0x01, 0x01 };
+static const uint8_t h265_header_sub_layers[] = { 0, 0, 0, 1, 0x40, 0x01, 0x0c, 0x11, 0, 0, 0, 1, 0x42, 0x01, 0x03, 0x01 };
+
+static ChiakiVideoFrameInfo frame_info(ChiakiCodec codec, const uint8_t *buf, size_t buf_size)
+{
+	ChiakiVideoFrameInfo info;
+	chiaki_video_frame_info_parse(codec, buf, buf_size, &info);
+	return info;
+}
+
+static MunitResult test_frame_info(const MunitParameter params[], void *user)
+{
+	ChiakiVideoFrameInfo info = frame_info(CHIAKI_CODEC_H264, h264_idr, sizeof(h264_idr));
+	munit_assert(info.valid && info.keyframe && info.reference);
+	info = frame_info(CHIAKI_CODEC_H264, h264_p, sizeof(h264_p));
+	munit_assert(info.valid && !info.keyframe && info.reference);
+	info = frame_info(CHIAKI_CODEC_H264, h264_b, sizeof(h264_b));
+	munit_assert(info.valid && !info.keyframe && !info.reference);
+	info = frame_info(CHIAKI_CODEC_H264, h264_recovery_point, sizeof(h264_recovery_point));
+	munit_assert(info.valid && info.keyframe && info.reference && info.recovery_point);
+	munit_assert_uint(info.recovery_frame_cnt, ==, 0);
+	info = frame_info(CHIAKI_CODEC_H264, h264_recovery_point_cnt, sizeof(h264_recovery_point_cnt));
+	munit_assert(info.valid && !info.keyframe && info.recovery_point);
+	munit_assert_uint(info.recovery_frame_cnt, ==, 2);
+	info = frame_info(CHIAKI_CODEC_H265, h265_idr, sizeof(h265_idr));
+	munit_assert(info.valid && info.keyframe && info.reference);
+	info = frame_info(CHIAKI_CODEC_H265, h265_p, sizeof(h265_p));
+	munit_assert(info.valid && !info.keyframe && info.reference);
+	munit_assert(!info.sub_layer_non_reference);
+	info = frame_info(CHIAKI_CODEC_H265, h265_p_non_ref, sizeof(h265_p_non_ref));
+	munit_assert(info.valid && !info.keyframe && info.sub_layer_non_reference);
+	munit_assert_uint8(info.temporal_id, ==, 0);
+	info = frame_info(CHIAKI_CODEC_H265, h265_p_non_ref_tid1, sizeof(h265_p_non_ref_tid1));
+	munit_assert(info.valid && info.sub_layer_non_reference);
+	munit_assert_uint8(info.temporal_id, ==, 1);
+	info = frame_info(CHIAKI_CODEC_H265, h265_header, sizeof(h265_header));
+	munit_assert(!info.valid);
+	munit_assert_int(info.max_temporal_id, ==, 0);
+	info = frame_info(CHIAKI_CODEC_H265, h265_header_sub_layers, sizeof(h265_header_sub_layers));
+	munit_assert_int(info.max_temporal_id, ==, 1);
+	info = frame_info(CHIAKI_CODEC_H265, h265_p, sizeof(h265_p));
+	munit_assert_int(info.max_temporal_id, ==, -1);
+	info = frame_info(CHIAKI_CODEC_H264, h264_idr, 8);
+	munit_assert(!info.valid);
+	return MUNIT_OK;
+}
+
+static MunitResult test_keyframe(const MunitParameter params[], void *user)
+{
+	ChiakiVideoRecovery recovery;
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	chiaki_video_recovery_set_rtt(&recovery, RTT_US);
+	ChiakiVideoFrameInfo p = frame_info(CHIAKI_CODEC_H264, h264_p, sizeof(h264_p));
+	ChiakiVideoFrameInfo idr = frame_info(CHIAKI_CODEC_H264, h264_idr, sizeof(h264_idr));
+	uint64_t now = 1000000;
+
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 9, &p, now));
+	ChiakiSeqNum16 first, last;
+	munit_assert(!chiaki_video_recovery_poll_request(&recovery, now, &first, &last));
+
+	chiaki_video_recovery_frames_lost(&recovery, 10, 11, NULL, now);
+	munit_assert(chiaki_video_recovery_poll_request(&recovery, now, &first, &last));
+	munit_assert_uint16(first, ==, 10);
+	munit_assert_uint16(last, ==, 11);
+	munit_assert(!chiaki_video_recovery_poll_request(&recovery, now + 1000, &first, &last));
+
+	// frames referencing the lost ones are withheld until the keyframe
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 12, &p, now + 1000));
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 13, &p, now + 2000));
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 14, &idr, now + 3000));
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 15, &p, now + 4000));
+
+	munit_assert_uint64(recovery.stats.losses, ==, 1);
+	munit_assert_uint64(recovery.stats.frames_withheld, ==, 2);
+	munit_assert_uint64(recovery.stats.recoveries_keyframe, ==, 1);
+	munit_assert_uint64(recovery.stats.requests, ==, 1);
+	munit_assert_uint64(recovery.stats.broken_us_max, ==, 3000);
+	return MUNIT_OK;
+}
+
+static MunitResult test_invalidation(const MunitParameter params[], void *user)
+{
+	ChiakiVideoRecovery recovery;
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	chiaki_video_recovery_set_rtt(&recovery, RTT_US);
+	ChiakiVideoFrameInfo p = frame_info(CHIAKI_CODEC_H265, h265_p, sizeof(h265_p));
+	uint64_t now = 1000000;
+
+	chiaki_video_recovery_frames_lost(&recovery, 100, 100, &p, now);
+	ChiakiSeqNum16 first, last;
+	munit_assert(chiaki_video_recovery_poll_request(&recovery, now, &first, &last));
+
+	// still encoded before the console got the report
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 101, &p, now + 16000));
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 102, &p, now + 32000));
+
+	// encoded after the report, without references to anything lost
+	uint64_t resume = now + RTT_US + CHIAKI_VIDEO_RECOVERY_RESUME_MARGIN_US;
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 103, &p, resume));
+	munit_assert_uint64(recovery.stats.recoveries_invalidation, ==, 1);
+	munit_assert(!chiaki_video_recovery_poll_request(&recovery, resume, &first, &last));
+	return MUNIT_OK;
+}
+
+static MunitResult test_non_reference(const MunitParameter params[], void *user)
+{
+	ChiakiVideoRecovery recovery;
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	ChiakiVideoFrameInfo header = frame_info(CHIAKI_CODEC_H265, h265_header, sizeof(h265_header));
+	ChiakiVideoFrameInfo b = frame_info(CHIAKI_CODEC_H265, h265_p_non_ref, sizeof(h265_p_non_ref));
+	ChiakiVideoFrameInfo p = frame_info(CHIAKI_CODEC_H265, h265_p, sizeof(h265_p));
+
+	chiaki_video_recovery_header(&recovery, &header);
+	chiaki_video_recovery_frames_lost(&recovery, 5, 5, &b, 0);
+	ChiakiSeqNum16 first, last;
+	munit_assert(!chiaki_video_recovery_poll_request(&recovery, 0, &first, &last));
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 6, &p, 0));
+	munit_assert_uint64(recovery.stats.losses, ==, 0);
+	munit_assert_uint64(recovery.stats.losses_non_reference, ==, 1);
+	return MUNIT_OK;
+}
+
+static MunitResult test_temporal_layers(const MunitParameter params[], void *user)
+{
+	ChiakiVideoRecovery recovery;
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	ChiakiVideoFrameInfo header = frame_info(CHIAKI_CODEC_H265, h265_header_sub_layers, sizeof(h265_header_sub_layers));
+	ChiakiVideoFrameInfo b0 = frame_info(CHIAKI_CODEC_H265, h265_p_non_ref, sizeof(h265_p_non_ref));
+	ChiakiVideoFrameInfo b1 = frame_info(CHIAKI_CODEC_H265, h265_p_non_ref_tid1, sizeof(h265_p_non_ref_tid1));
+
+	// without knowing the sub-layers, anything might depend on it
+	chiaki_video_recovery_frames_lost(&recovery, 5, 5, &b1, 0);
+	munit_assert(recovery.broken);
+	munit_assert_uint64(recovery.stats.losses, ==, 1);
+
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	chiaki_video_recovery_header(&recovery, &header);
+	// the highest sub-layer is never referenced
+	chiaki_video_recovery_frames_lost(&recovery, 5, 5, &b1, 0);
+	munit_assert(!recovery.broken);
+	munit_assert_uint64(recovery.stats.losses_non_reference, ==, 1);
+	// but sub-layer 1 may reference sub-layer 0
+	chiaki_video_recovery_frames_lost(&recovery, 6, 6, &b0, 0);
+	munit_assert(recovery.broken);
+	munit_assert_uint64(recovery.stats.losses, ==, 1);
+	return MUNIT_OK;
+}
+
+static MunitResult test_recovery_point(const MunitParameter params[], void *user)
+{
+	ChiakiVideoRecovery recovery;
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	chiaki_video_recovery_set_rtt(&recovery, RTT_US);
+	ChiakiVideoFrameInfo p = frame_info(CHIAKI_CODEC_H264, h264_p, sizeof(h264_p));
+	ChiakiVideoFrameInfo rp = frame_info(CHIAKI_CODEC_H264, h264_recovery_point_cnt, sizeof(h264_recovery_point_cnt));
+	uint64_t now = 1000000;
+
+	chiaki_video_recovery_frames_lost(&recovery, 10, 10, NULL, now);
+	ChiakiSeqNum16 first, last;
+	munit_assert(chiaki_video_recovery_poll_request(&recovery, now, &first, &last));
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 11, &p, now + 1000));
+
+	// decoded from the recovery point on, but only recovered 2 frames later
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 12, &rp, now + 2000));
+	munit_assert(recovery.broken);
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 13, &p, now + 3000));
+	munit_assert(recovery.broken);
+	munit_assert(!chiaki_video_recovery_poll_request(&recovery, now + 1000000, &first, &last));
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 14, &p, now + 4000));
+	munit_assert(!recovery.broken);
+	munit_assert_uint64(recovery.stats.recoveries_keyframe, ==, 1);
+
+	// a loss before the end of the recovery point breaks it
+	chiaki_video_recovery_frames_lost(&recovery, 15, 15, NULL, now + 5000);
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 16, &rp, now + 6000));
+	chiaki_video_recovery_frames_lost(&recovery, 17, 17, NULL, now + 7000);
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 18, &p, now + 8000));
+	munit_assert(recovery.broken);
+	return MUNIT_OK;
+}
+
+static MunitResult test_repeat_timeout(const MunitParameter params[], void *user)
+{
+	ChiakiVideoRecovery recovery;
+	chiaki_video_recovery_init(&recovery, get_test_log());
+	chiaki_video_recovery_set_rtt(&recovery, RTT_US);
+	ChiakiVideoFrameInfo p = frame_info(CHIAKI_CODEC_H264, h264_p, sizeof(h264_p));
+	uint64_t now = 0;
+
+	chiaki_video_recovery_frames_lost(&recovery, 0xfffe, 0xfffe, NULL, now);
+	ChiakiSeqNum16 first, last;
+	munit_assert(chiaki_video_recovery_poll_request(&recovery, now, &first, &last));
+
+	// another loss while recovering is reported right away and delays resuming
+	chiaki_video_recovery_frames_lost(&recovery, 0xffff, 1, NULL, now + 10000);
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 2, &p, now + 10000));
+	munit_assert(chiaki_video_recovery_poll_request(&recovery, now + 10000, &first, &last));
+	munit_assert_uint16(first, ==, 0xfffe);
+	munit_assert_uint16(last, ==, 2);
+
+	// no effect, so the request is repeated including everything withheld since
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 3, &p, now + 20000));
+	uint64_t repeat = now + 10000 + 2 * RTT_US + CHIAKI_VIDEO_RECOVERY_RESUME_MARGIN_US;
+	munit_assert(chiaki_video_recovery_poll_request(&recovery, repeat, &first, &last));
+	munit_assert_uint16(last, ==, 3);
+	munit_assert_uint64(recovery.stats.requests, ==, 3);
+	munit_assert_uint64(recovery.stats.losses, ==, 1);
+
+	// never freeze forever
+	recovery.request_due = true;
+	munit_assert(!chiaki_video_recovery_frame_decodable(&recovery, 4, &p, CHIAKI_VIDEO_RECOVERY_TIMEOUT_US - 1));
+	munit_assert(chiaki_video_recovery_frame_decodable(&recovery, 5, &p, CHIAKI_VIDEO_RECOVERY_TIMEOUT_US));
+	munit_assert_uint64(recovery.stats.timeouts, ==, 1);
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_recovery[] = {
+	{
+		"/frame_info",
+		test_frame_info,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/keyframe",
+		test_keyframe,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/invalidation",
+		test_invalidation,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/non_reference",
+		test_non_reference,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/temporal_layers",
+		test_temporal_layers,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/recovery_point",
+		test_recovery_point,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/repeat_timeout",
+		test_repeat_timeout,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};